@@ -18,6 +18,12 @@
 #include "qemu-queue.h"
 #include "qemu_socket.h"
 
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+
+#define AIO_EPOLL_MAX_EVENTS 128
+#endif
+
 struct AioHandler
 {
     GPollFD pfd;
@@ -42,6 +48,200 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
+#ifdef CONFIG_EPOLL
+static void aio_epoll_disable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    /* Let the GSource poll each descriptor instead */
+    g_source_remove_poll(&ctx->source, &ctx->epoll_pfd);
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+    }
+
+    close(ctx->epollfd);
+    ctx->epollfd = -1;
+    ctx->epoll_nevents = 0;
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event = {
+        .events = (node->pfd.events & G_IO_IN ? EPOLLIN : 0) |
+                  (node->pfd.events & G_IO_OUT ? EPOLLOUT : 0),
+        .data.ptr = node,
+    };
+    int ret;
+
+    ret = epoll_ctl(ctx->epollfd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                    node->pfd.fd, &event);
+    if (ret < 0 && errno == ENOENT) {
+        /* Closed and reused without removing the handler first */
+        ret = epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event);
+    }
+    if (ret < 0) {
+        /* For example a regular file, which epoll does not support */
+        aio_epoll_disable(ctx);
+    }
+}
+
+static void aio_epoll_remove(AioContext *ctx, AioHandler *node)
+{
+    struct epoll_event event;
+    int i;
+
+    epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, &event);
+
+    /* The node may be freed before the GSource dispatches its events */
+    for (i = 0; i < ctx->epoll_nevents; i++) {
+        if (ctx->epoll_events[i].data.ptr == node) {
+            ctx->epoll_events[i].data.ptr = NULL;
+        }
+    }
+}
+
+/* Fetches the ready descriptors, unless the last ones were not dispatched */
+static void aio_epoll_wait(AioContext *ctx, int timeout)
+{
+    int ret;
+
+    if (ctx->epoll_nevents) {
+        return;
+    }
+
+    ret = epoll_wait(ctx->epollfd, ctx->epoll_events, AIO_EPOLL_MAX_EVENTS,
+                     timeout);
+    ctx->epoll_nevents = MAX(ret, 0);
+}
+
+static bool aio_epoll_dispatch(AioContext *ctx)
+{
+    struct epoll_event events[AIO_EPOLL_MAX_EVENTS];
+    AioHandler *node, *tmp;
+    bool progress = false;
+    int i, n, revents;
+
+    /* Handlers may call aio_poll recursively, take the events first */
+    n = ctx->epoll_nevents;
+    memcpy(events, ctx->epoll_events, n * sizeof(events[0]));
+    ctx->epoll_nevents = 0;
+
+    ctx->walking_handlers++;
+
+    for (i = 0; i < n; i++) {
+        node = events[i].data.ptr;
+        if (!node || node->deleted) {
+            continue;
+        }
+
+        revents = (events[i].events & EPOLLIN ? G_IO_IN : 0) |
+                  (events[i].events & EPOLLOUT ? G_IO_OUT : 0) |
+                  (events[i].events & EPOLLHUP ? G_IO_HUP : 0) |
+                  (events[i].events & EPOLLERR ? G_IO_ERR : 0);
+        revents &= node->pfd.events | G_IO_ERR;
+
+        /* See comment in aio_pending.  */
+        if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR) && node->io_read) {
+            node->io_read(node->opaque);
+            progress = true;
+        }
+        if (!node->deleted && revents & (G_IO_OUT | G_IO_ERR) &&
+            node->io_write) {
+            node->io_write(node->opaque);
+            progress = true;
+        }
+    }
+
+    ctx->walking_handlers--;
+
+    if (!ctx->walking_handlers && ctx->deleted_handlers) {
+        QLIST_FOREACH_SAFE(node, &ctx->aio_handlers, node, tmp) {
+            if (node->deleted) {
+                QLIST_REMOVE(node, node);
+                g_free(node);
+            }
+        }
+        ctx->deleted_handlers = 0;
+    }
+
+    return progress;
+}
+
+/*
+ * With epoll, only the descriptors that are ready are looked at.  The
+ * io_flush callbacks still decide whether to wait at all, but the handlers
+ * that have no requests pending stay in the epoll set.  They are dispatched
+ * if their descriptor becomes ready, which handlers need to cope with
+ * anyway.
+ */
+static bool aio_epoll_poll(AioContext *ctx, bool blocking, bool progress)
+{
+    AioHandler *node;
+    bool busy;
+
+    /* Dispatch what the GSource found ready */
+    if (aio_epoll_dispatch(ctx)) {
+        progress = true;
+    }
+
+    if (progress && !blocking) {
+        return true;
+    }
+
+    ctx->walking_handlers++;
+
+    busy = false;
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_flush &&
+            node->io_flush(node->opaque) != 0) {
+            busy = true;
+            break;
+        }
+    }
+
+    ctx->walking_handlers--;
+
+    /* No AIO operations?  Get us out of here */
+    if (!busy) {
+        return progress;
+    }
+
+    aio_epoll_wait(ctx, blocking ? -1 : 0);
+    if (aio_epoll_dispatch(ctx)) {
+        progress = true;
+    }
+
+    return progress;
+}
+#endif
+
+void aio_context_setup(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL
+    ctx->epollfd = qemu_epoll_create();
+    if (ctx->epollfd < 0) {
+        return;
+    }
+
+    ctx->epoll_events = g_new(struct epoll_event, AIO_EPOLL_MAX_EVENTS);
+    ctx->epoll_pfd.fd = ctx->epollfd;
+    ctx->epoll_pfd.events = G_IO_IN;
+    g_source_add_poll(&ctx->source, &ctx->epoll_pfd);
+#endif
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+    }
+    g_free(ctx->epoll_events);
+#endif
+}
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -56,12 +256,22 @@ void aio_set_fd_handler(AioContext *ctx,
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
         if (node) {
-            g_source_remove_poll(&ctx->source, &node->pfd);
+#ifdef CONFIG_EPOLL
+            if (ctx->epollfd >= 0) {
+                aio_epoll_remove(ctx, node);
+            } else
+#endif
+            {
+                g_source_remove_poll(&ctx->source, &node->pfd);
+            }
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
                 node->deleted = 1;
                 node->pfd.revents = 0;
+#ifdef CONFIG_EPOLL
+                ctx->deleted_handlers++;
+#endif
             } else {
                 /* Otherwise, delete it for real.  We can't just mark it as
                  * deleted because deleted nodes are only cleaned up after
@@ -72,13 +282,20 @@ void aio_set_fd_handler(AioContext *ctx,
             }
         }
     } else {
-        if (node == NULL) {
+        bool is_new = (node == NULL);
+
+        if (is_new) {
             /* Alloc and insert if it's not already there */
             node = g_malloc0(sizeof(AioHandler));
             node->pfd.fd = fd;
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
-            g_source_add_poll(&ctx->source, &node->pfd);
+#ifdef CONFIG_EPOLL
+            if (ctx->epollfd < 0)
+#endif
+            {
+                g_source_add_poll(&ctx->source, &node->pfd);
+            }
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -88,6 +305,12 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP : 0);
         node->pfd.events |= (io_write ? G_IO_OUT : 0);
+
+#ifdef CONFIG_EPOLL
+        if (ctx->epollfd >= 0) {
+            aio_epoll_update(ctx, node, is_new);
+        }
+#endif
     }
 
     aio_notify(ctx);
@@ -107,6 +330,16 @@ bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
 
+#ifdef CONFIG_EPOLL
+    if (ctx->epollfd >= 0) {
+        if (ctx->epoll_pfd.revents & G_IO_IN) {
+            ctx->epoll_pfd.revents = 0;
+            aio_epoll_wait(ctx, 0);
+        }
+        return ctx->epoll_nevents > 0;
+    }
+#endif
+
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         int revents;
 
@@ -150,6 +383,12 @@ bool aio_poll(AioContext *ctx, bool blocking)
         progress = true;
     }
 
+#ifdef CONFIG_EPOLL
+    if (ctx->epollfd >= 0) {
+        return aio_epoll_poll(ctx, blocking, progress);
+    }
+#endif
+
     /*
      * Then dispatch any pending callbacks from the GSource.
      *
@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor.h"
 #include "sysemu.h"
@@ -39,6 +40,8 @@
 #include "hw/pci.h"
 #include "hw/audiodev.h"
 #include "kvm.h"
+#include "hw/xen.h"
+#include "qemu-barrier.h"
 #include "migration.h"
 #include "net.h"
 #include "gdbstub.h"
@@ -46,6 +49,7 @@
 #include "exec-memory.h"
 #include "hw/pcspk.h"
 #include "qemu/page_cache.h"
+#include "qemu_socket.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "cpu-all.h"
@@ -113,26 +117,8 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
-
-#ifdef __ALTIVEC__
-#include <altivec.h>
-#define VECTYPE        vector unsigned char
-#define SPLAT(p)       vec_splat(vec_ld(0, p), 0)
-#define ALL_EQ(v1, v2) vec_all_eq(v1, v2)
-/* altivec.h may redefine the bool macro as vector type.
- * Reset it to POSIX semantics. */
-#undef bool
-#define bool _Bool
-#elif defined __SSE2__
-#include <emmintrin.h>
-#define VECTYPE        __m128i
-#define SPLAT(p)       _mm_set1_epi8(*(p))
-#define ALL_EQ(v1, v2) (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
-#else
-#define VECTYPE        unsigned long
-#define SPLAT(p)       (*(p) * (~0UL / 255))
-#define ALL_EQ(v1, v2) ((v1) == (v2))
-#endif
+#define RAM_SAVE_FLAG_ZLIB     0x80
+#define RAM_SAVE_FLAG_MULTIFD  0x100
 
 
 static struct defconfig_file {
@@ -166,17 +152,7 @@ int qemu_read_default_config_files(bool userconfig)
 
 static int is_dup_page(uint8_t *page)
 {
-    VECTYPE *p = (VECTYPE *)page;
-    VECTYPE val = SPLAT(page);
-    int i;
-
-    for (i = 0; i < TARGET_PAGE_SIZE / sizeof(VECTYPE); i++) {
-        if (!ALL_EQ(val, p[i])) {
-            return 0;
-        }
-    }
-
-    return 1;
+    return buffer_is_dup(page, TARGET_PAGE_SIZE);
 }
 
 /* struct contains XBZRLE cache and a static page
@@ -200,9 +176,15 @@ static struct {
 
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
+    int64_t ret;
+
     if (XBZRLE.cache != NULL) {
-        return cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
+        /* the migration thread uses the cache with the ramlist lock held */
+        qemu_mutex_lock_ramlist();
+        ret = cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
             TARGET_PAGE_SIZE;
+        qemu_mutex_unlock_ramlist();
+        return ret;
     }
     return pow2floor(new_size);
 }
@@ -215,7 +197,15 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_hit;
     uint64_t xbzrle_overflows;
+    uint64_t xbzrle_sync_cache_miss;
+    uint64_t xbzrle_sync_cache_hit;
+    double xbzrle_cache_hit_rate;
+    uint64_t compress_bytes;
+    uint64_t compress_pages;
+    uint64_t compress_busy;
+    uint64_t postcopy_requests;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -260,40 +250,73 @@ uint64_t xbzrle_mig_pages_cache_miss(void)
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+double xbzrle_mig_cache_hit_rate(void)
+{
+    return acct_info.xbzrle_cache_hit_rate;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
 }
 
-static void save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
-        int cont, int flag)
+uint64_t compress_mig_bytes_transferred(void)
 {
-        qemu_put_be64(f, offset | cont | flag);
-        if (!cont) {
-                qemu_put_byte(f, strlen(block->idstr));
-                qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                strlen(block->idstr));
-        }
+    return acct_info.compress_bytes;
+}
+
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
 
+uint64_t compress_mig_busy(void)
+{
+    return acct_info.compress_busy;
+}
+
+/* Block of the last page header put on the wire.  Pages are not always
+ * written in the order ram_save_block() finds them (compressed pages are
+ * emitted when their worker completes), so RAM_SAVE_FLAG_CONTINUE must be
+ * decided against what the destination has actually seen. */
+static RAMBlock *last_sent_block;
+
+static void save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                           int flag)
+{
+    if (block == last_sent_block) {
+        qemu_put_be64(f, offset | RAM_SAVE_FLAG_CONTINUE | flag);
+    } else {
+        qemu_put_be64(f, offset | flag);
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr,
+                        strlen(block->idstr));
+        last_sent_block = block;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
 
 static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
                             ram_addr_t current_addr, RAMBlock *block,
-                            ram_addr_t offset, int cont, bool last_stage)
+                            ram_addr_t offset, bool last_stage)
 {
     int encoded_len = 0, bytes_sent = -1;
     uint8_t *prev_cached_page;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr)) {
         if (!last_stage) {
-            cache_insert(XBZRLE.cache, current_addr,
-                         g_memdup(current_data, TARGET_PAGE_SIZE));
+            cache_insert(XBZRLE.cache, current_addr, current_data);
         }
         acct_info.xbzrle_cache_miss++;
         return -1;
     }
+    acct_info.xbzrle_cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -321,7 +344,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
     }
 
     /* Send XBZRLE based compressed page */
-    save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_XBZRLE);
+    save_block_hdr(f, block, offset, RAM_SAVE_FLAG_XBZRLE);
     qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
     qemu_put_be16(f, encoded_len);
     qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
@@ -332,11 +355,823 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
     return bytes_sent;
 }
 
+/* Multithreaded page compression
+ *
+ * ram_save_block() hands each page that is neither a dup page nor sent by
+ * XBZRLE to an idle worker, which deflates a private copy of it.  The
+ * compressed result is put on the wire the next time that worker is picked,
+ * or when flush_compressed_data() drains all workers before RAM_SAVE_FLAG_EOS.
+ * The destination mirrors this with a pool of inflating workers that write
+ * straight into guest RAM and are drained when the section ends.
+ */
+
+#define COMPRESS_BUF_SIZE (TARGET_PAGE_SIZE + TARGET_PAGE_SIZE / 1000 + 64)
+
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;
+    bool quit;
+    /* protected by comp_done_lock */
+    bool done;
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t page[TARGET_PAGE_SIZE];
+    uint8_t buf[COMPRESS_BUF_SIZE];
+    uLongf len;
+} CompressParam;
+
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;
+    bool quit;
+    /* protected by decomp_done_lock */
+    bool done;
+    void *des;
+    uint8_t buf[COMPRESS_BUF_SIZE];
+    uLong len;
+} DecompressParam;
+
+static CompressParam *comp_param;
+static int comp_thread_count;
+static int comp_level;
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+
+static DecompressParam *decomp_param;
+static int decomp_thread_count;
+static bool decomp_error;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        param->len = sizeof(param->buf);
+        if (compress2(param->buf, &param->len, param->page,
+                      TARGET_PAGE_SIZE, comp_level) != Z_OK) {
+            /* sent uncompressed by flush_compressed_page() */
+            param->len = 0;
+        }
+
+        qemu_mutex_lock(&comp_done_lock);
+        param->done = true;
+        qemu_cond_signal(&comp_done_cond);
+        qemu_mutex_unlock(&comp_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void compress_threads_save_setup(void)
+{
+    int i;
+
+    comp_thread_count = migrate_compress_threads();
+    comp_level = migrate_compress_level();
+    comp_param = g_new0(CompressParam, comp_thread_count);
+    qemu_mutex_init(&comp_done_lock);
+    qemu_cond_init(&comp_done_cond);
+    for (i = 0; i < comp_thread_count; i++) {
+        comp_param[i].done = true;
+        qemu_mutex_init(&comp_param[i].mutex);
+        qemu_cond_init(&comp_param[i].cond);
+        qemu_thread_create(&comp_param[i].thread, do_data_compress,
+                           &comp_param[i], QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void compress_threads_save_cleanup(void)
+{
+    int i;
+
+    if (!comp_param) {
+        return;
+    }
+    for (i = 0; i < comp_thread_count; i++) {
+        qemu_mutex_lock(&comp_param[i].mutex);
+        comp_param[i].quit = true;
+        qemu_cond_signal(&comp_param[i].cond);
+        qemu_mutex_unlock(&comp_param[i].mutex);
+        qemu_thread_join(&comp_param[i].thread);
+        qemu_mutex_destroy(&comp_param[i].mutex);
+        qemu_cond_destroy(&comp_param[i].cond);
+    }
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+    g_free(comp_param);
+    comp_param = NULL;
+}
+
+/* Put the result of a finished worker on the wire.  Must be called with
+ * param->done set, i.e. while the worker is idle. */
+static int flush_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    int bytes_sent;
+
+    if (!param->block) {
+        return 0;
+    }
+
+    if (param->len == 0 || param->len >= TARGET_PAGE_SIZE) {
+        /* incompressible, fall back to a normal page */
+        save_block_hdr(f, param->block, param->offset, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, param->page, TARGET_PAGE_SIZE);
+        bytes_sent = TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    } else {
+        save_block_hdr(f, param->block, param->offset, RAM_SAVE_FLAG_ZLIB);
+        qemu_put_be32(f, param->len);
+        qemu_put_buffer(f, param->buf, param->len);
+        bytes_sent = param->len + 4;
+        acct_info.compress_pages++;
+        acct_info.compress_bytes += bytes_sent;
+    }
+    param->block = NULL;
+
+    return bytes_sent;
+}
+
+static int flush_compressed_data(QEMUFile *f)
+{
+    int i, bytes_sent = 0;
+
+    if (!comp_param) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&comp_done_lock);
+    for (i = 0; i < comp_thread_count; i++) {
+        while (!comp_param[i].done) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    for (i = 0; i < comp_thread_count; i++) {
+        bytes_sent += flush_compressed_page(f, &comp_param[i]);
+    }
+    return bytes_sent;
+}
+
+/* Queue a page for compression.  Returns the number of bytes put on the
+ * wire for the page that the chosen worker had finished before, if any. */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset, uint8_t *p)
+{
+    CompressParam *param = NULL;
+    int i, bytes_sent;
+
+    qemu_mutex_lock(&comp_done_lock);
+    while (!param) {
+        for (i = 0; i < comp_thread_count; i++) {
+            if (comp_param[i].done) {
+                param = &comp_param[i];
+                param->done = false;
+                break;
+            }
+        }
+        if (!param) {
+            acct_info.compress_busy++;
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    bytes_sent = flush_compressed_page(f, param);
+
+    param->block = block;
+    param->offset = offset;
+    memcpy(param->page, p, TARGET_PAGE_SIZE);
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return bytes_sent;
+}
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    uLongf pagesize;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        pagesize = TARGET_PAGE_SIZE;
+        if (uncompress(param->des, &pagesize, param->buf,
+                       param->len) != Z_OK ||
+            pagesize != TARGET_PAGE_SIZE) {
+            decomp_error = true;
+        }
+
+        qemu_mutex_lock(&decomp_done_lock);
+        param->done = true;
+        qemu_cond_signal(&decomp_done_cond);
+        qemu_mutex_unlock(&decomp_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void decompress_threads_load_setup(void)
+{
+    int i;
+
+    decomp_thread_count = migrate_decompress_threads();
+    decomp_param = g_new0(DecompressParam, decomp_thread_count);
+    decomp_error = false;
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    for (i = 0; i < decomp_thread_count; i++) {
+        decomp_param[i].done = true;
+        qemu_mutex_init(&decomp_param[i].mutex);
+        qemu_cond_init(&decomp_param[i].cond);
+        qemu_thread_create(&decomp_param[i].thread, do_data_decompress,
+                           &decomp_param[i], QEMU_THREAD_JOINABLE);
+    }
+}
+
+void ram_decompress_threads_cleanup(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+    for (i = 0; i < decomp_thread_count; i++) {
+        qemu_mutex_lock(&decomp_param[i].mutex);
+        decomp_param[i].quit = true;
+        qemu_cond_signal(&decomp_param[i].cond);
+        qemu_mutex_unlock(&decomp_param[i].mutex);
+        qemu_thread_join(&decomp_param[i].thread);
+        qemu_mutex_destroy(&decomp_param[i].mutex);
+        qemu_cond_destroy(&decomp_param[i].cond);
+    }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
+    g_free(decomp_param);
+    decomp_param = NULL;
+}
+
+static int wait_for_decompress_done(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    for (i = 0; i < decomp_thread_count; i++) {
+        while (!decomp_param[i].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    return decomp_error ? -EINVAL : 0;
+}
+
+static int load_compressed_page(QEMUFile *f, void *host)
+{
+    DecompressParam *param = NULL;
+    uint32_t len;
+    int i;
+
+    len = qemu_get_be32(f);
+    if (len == 0 || len > COMPRESS_BUF_SIZE) {
+        fprintf(stderr, "Failed to load compressed page - len %u invalid!\n",
+                len);
+        return -EINVAL;
+    }
+
+    if (!decomp_param) {
+        decompress_threads_load_setup();
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    while (!param) {
+        for (i = 0; i < decomp_thread_count; i++) {
+            if (decomp_param[i].done) {
+                param = &decomp_param[i];
+                param->done = false;
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    qemu_get_buffer(f, param->buf, len);
+    param->des = host;
+    param->len = len;
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return 0;
+}
+
+static RAMBlock *ram_find_block(const char *idstr)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(idstr, block->idstr, sizeof(block->idstr))) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/***********************************************************/
+/* multifd */
+
+/*
+ * With the multifd capability, normal pages are sent over several extra
+ * connections in batches of up to MULTIFD_PAGES pages of the same RAMBlock,
+ * one sender thread per connection.  Everything else still goes through
+ * the main stream, which at the end of every iteration also carries a sync
+ * record.  A page is sent at most once between two syncs, so the destination
+ * only needs all channels to catch up with the main stream at each sync.
+ *
+ * Channel stream: be32 MULTIFD_MAGIC, be32 channel id, then for each batch
+ * be32 page count, byte idstr length, idstr, be64 offset for each page and
+ * the pages themselves.  A zero page count is a sync marker.
+ */
+
+#define MULTIFD_MAGIC 0x4d554c54 /* "MULT" */
+#define MULTIFD_PAGES 64
+
+typedef struct MultiFDPages {
+    RAMBlock *block;
+    int num;
+    ram_addr_t offset[MULTIFD_PAGES];
+} MultiFDPages;
+
+typedef struct MultiFDSendParam {
+    QemuThread thread;
+    QEMUFile *file;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;
+    bool sync;
+    bool quit;
+    /* protected by multifd_done_lock */
+    bool done;
+    MultiFDPages pages;
+} MultiFDSendParam;
+
+typedef struct MultiFDRecvParam {
+    QemuThread thread;
+    QEMUFile *file;
+    int fd;
+    QemuSemaphore sem_sync;
+    QemuSemaphore sem_go;
+    bool quit;
+} MultiFDRecvParam;
+
+static MultiFDSendParam *multifd_send_param;
+static int multifd_send_count;
+/* batch being filled by the migration thread */
+static MultiFDPages multifd_pages;
+static QemuMutex multifd_done_lock;
+static QemuCond multifd_done_cond;
+
+static MultiFDRecvParam *multifd_recv_param;
+static int multifd_recv_count;
+static bool multifd_recv_error;
+
+static void multifd_send_pages(QEMUFile *f, MultiFDPages *pages)
+{
+    RAMBlock *block = pages->block;
+    uint8_t *host = memory_region_get_ram_ptr(block->mr);
+    int i;
+
+    qemu_put_be32(f, pages->num);
+    qemu_put_byte(f, strlen(block->idstr));
+    qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_be64(f, pages->offset[i]);
+    }
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_buffer_no_copy(f, host + pages->offset[i], TARGET_PAGE_SIZE);
+    }
+}
+
+static void *do_multifd_send(void *opaque)
+{
+    MultiFDSendParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        if (param->pages.num) {
+            multifd_send_pages(param->file, &param->pages);
+            param->pages.num = 0;
+        }
+        if (param->sync) {
+            qemu_put_be32(param->file, 0);
+            param->sync = false;
+        }
+        qemu_fflush(param->file);
+
+        qemu_mutex_lock(&multifd_done_lock);
+        param->done = true;
+        qemu_cond_signal(&multifd_done_cond);
+        qemu_mutex_unlock(&multifd_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void multifd_save_setup(void)
+{
+    int i, n = migrate_multifd_channels();
+
+    multifd_send_param = g_new0(MultiFDSendParam, n);
+    multifd_send_count = 0;
+    multifd_pages.num = 0;
+    qemu_mutex_init(&multifd_done_lock);
+    qemu_cond_init(&multifd_done_cond);
+
+    for (i = 0; i < n; i++) {
+        MultiFDSendParam *param = &multifd_send_param[i];
+        Error *local_err = NULL;
+        int fd;
+
+        fd = migrate_open_channel(&local_err);
+        if (fd < 0) {
+            /* go on with the channels we have, if any */
+            fprintf(stderr, "multifd: cannot open channel %d: %s\n", i,
+                    error_get_pretty(local_err));
+            error_free(local_err);
+            break;
+        }
+
+        param->file = qemu_fopen_socket(fd, "wb");
+        qemu_put_be32(param->file, MULTIFD_MAGIC);
+        qemu_put_be32(param->file, i);
+        qemu_fflush(param->file);
+
+        param->done = true;
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_multifd_send, param,
+                           QEMU_THREAD_JOINABLE);
+        multifd_send_count++;
+    }
+}
+
+static void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_param) {
+        return;
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendParam *param = &multifd_send_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+        qemu_mutex_destroy(&param->mutex);
+        qemu_cond_destroy(&param->cond);
+        qemu_fclose(param->file);
+    }
+    qemu_mutex_destroy(&multifd_done_lock);
+    qemu_cond_destroy(&multifd_done_cond);
+    g_free(multifd_send_param);
+    multifd_send_param = NULL;
+    multifd_send_count = 0;
+}
+
+/* Wait until @param, or any channel if @param is NULL, is idle and
+ * claim it. */
+static MultiFDSendParam *multifd_claim_channel(MultiFDSendParam *param)
+{
+    int i;
+
+    qemu_mutex_lock(&multifd_done_lock);
+    while (true) {
+        if (param) {
+            if (param->done) {
+                break;
+            }
+        } else {
+            for (i = 0; i < multifd_send_count; i++) {
+                if (multifd_send_param[i].done) {
+                    param = &multifd_send_param[i];
+                    break;
+                }
+            }
+            if (param) {
+                break;
+            }
+        }
+        qemu_cond_wait(&multifd_done_cond, &multifd_done_lock);
+    }
+    param->done = false;
+    qemu_mutex_unlock(&multifd_done_lock);
+
+    return param;
+}
+
+static void multifd_start_channel(MultiFDSendParam *param, bool sync)
+{
+    if (sync) {
+        param->sync = true;
+    } else {
+        param->pages = multifd_pages;
+        multifd_pages.num = 0;
+    }
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+}
+
+/* Queue a normal page on the channels.  The bytes are accounted against
+ * the rate limit of the main stream. */
+static int multifd_queue_page(QEMUFile *f, RAMBlock *block,
+                              ram_addr_t offset)
+{
+    if (multifd_pages.num == MULTIFD_PAGES ||
+        (multifd_pages.num && multifd_pages.block != block)) {
+        multifd_start_channel(multifd_claim_channel(NULL), false);
+    }
+    multifd_pages.block = block;
+    multifd_pages.offset[multifd_pages.num++] = offset;
+
+    qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+    acct_info.norm_pages++;
+    return TARGET_PAGE_SIZE;
+}
+
+/* Send out the pending batch and a sync marker on every channel, then the
+ * sync record on the main stream. */
+static void multifd_flush(QEMUFile *f)
+{
+    int i, ret;
+
+    if (!multifd_send_count) {
+        return;
+    }
+
+    if (multifd_pages.num) {
+        multifd_start_channel(multifd_claim_channel(NULL), false);
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        multifd_start_channel(multifd_claim_channel(&multifd_send_param[i]),
+                              true);
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendParam *param;
+
+        param = multifd_claim_channel(&multifd_send_param[i]);
+        ret = qemu_file_get_error(param->file);
+        if (ret) {
+            qemu_file_set_error(f, ret);
+        }
+        qemu_mutex_lock(&multifd_done_lock);
+        param->done = true;
+        qemu_mutex_unlock(&multifd_done_lock);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD);
+    qemu_put_be32(f, 0);
+}
+
+static int multifd_recv_pages(QEMUFile *f, uint32_t num)
+{
+    ram_addr_t offset[MULTIFD_PAGES];
+    RAMBlock *block;
+    uint8_t *host;
+    char id[256];
+    uint8_t len;
+    int i;
+
+    if (num > MULTIFD_PAGES) {
+        return -EINVAL;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    block = ram_find_block(id);
+    if (!block) {
+        fprintf(stderr, "multifd: can't find block %s!\n", id);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < num; i++) {
+        offset[i] = qemu_get_be64(f);
+        if (offset[i] >= block->length || (offset[i] & ~TARGET_PAGE_MASK)) {
+            fprintf(stderr, "multifd: bad offset " RAM_ADDR_FMT
+                    " in block %s\n", offset[i], id);
+            return -EINVAL;
+        }
+    }
+
+    host = memory_region_get_ram_ptr(block->mr);
+    for (i = 0; i < num; i++) {
+        qemu_get_buffer(f, host + offset[i], TARGET_PAGE_SIZE);
+    }
+    return qemu_file_get_error(f);
+}
+
+static void *do_multifd_recv(void *opaque)
+{
+    MultiFDRecvParam *param = opaque;
+    uint32_t num;
+
+    while (true) {
+        num = qemu_get_be32(param->file);
+        if (qemu_file_get_error(param->file)) {
+            break;
+        }
+        if (num == 0) {
+            qemu_sem_post(&param->sem_sync);
+            qemu_sem_wait(&param->sem_go);
+            if (param->quit) {
+                return NULL;
+            }
+            continue;
+        }
+        if (multifd_recv_pages(param->file, num) < 0) {
+            break;
+        }
+    }
+
+    /* keep answering syncs, so that ram_load notices the error */
+    if (!param->quit) {
+        multifd_recv_error = true;
+    }
+    while (true) {
+        qemu_sem_post(&param->sem_sync);
+        qemu_sem_wait(&param->sem_go);
+        if (param->quit) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int multifd_load_setup(uint32_t n)
+{
+    int i;
+
+    if (multifd_recv_param || n == 0 || n > 256) {
+        return -EINVAL;
+    }
+
+    multifd_recv_param = g_new0(MultiFDRecvParam, n);
+    multifd_recv_count = n;
+    multifd_recv_error = false;
+
+    for (i = 0; i < n; i++) {
+        MultiFDRecvParam *param;
+        QEMUFile *file;
+        uint32_t magic, id;
+        int fd;
+
+        fd = migration_incoming_accept_channel();
+        if (fd < 0) {
+            fprintf(stderr, "multifd: cannot accept channel\n");
+            return -EIO;
+        }
+        socket_set_block(fd);
+        file = qemu_fopen_socket(fd, "rb");
+
+        magic = qemu_get_be32(file);
+        id = qemu_get_be32(file);
+        if (qemu_file_get_error(file) || magic != MULTIFD_MAGIC ||
+            id >= n || multifd_recv_param[id].file) {
+            fprintf(stderr, "multifd: bad channel header\n");
+            qemu_fclose(file);
+            return -EINVAL;
+        }
+
+        param = &multifd_recv_param[id];
+        param->file = file;
+        param->fd = fd;
+        qemu_sem_init(&param->sem_sync, 0);
+        qemu_sem_init(&param->sem_go, 0);
+        qemu_thread_create(&param->thread, do_multifd_recv, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+    return 0;
+}
+
+/* Wait until every channel has reached the sync marker matching the
+ * one just read from the main stream. */
+static int multifd_recv_sync(void)
+{
+    int i, ret;
+
+    if (!multifd_recv_param) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < multifd_recv_count; i++) {
+        if (multifd_recv_param[i].file) {
+            qemu_sem_wait(&multifd_recv_param[i].sem_sync);
+        }
+    }
+    ret = multifd_recv_error ? -EIO : 0;
+    for (i = 0; i < multifd_recv_count; i++) {
+        if (multifd_recv_param[i].file) {
+            qemu_sem_post(&multifd_recv_param[i].sem_go);
+        }
+    }
+    return ret;
+}
+
+void ram_multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_param) {
+        return;
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        MultiFDRecvParam *param = &multifd_recv_param[i];
+
+        if (!param->file) {
+            continue;
+        }
+        param->quit = true;
+        /* wake up the thread if it is blocked reading */
+        shutdown(param->fd, SHUT_RDWR);
+        qemu_sem_post(&param->sem_go);
+        qemu_thread_join(&param->thread);
+        qemu_sem_destroy(&param->sem_sync);
+        qemu_sem_destroy(&param->sem_go);
+        qemu_fclose(param->file);
+    }
+    g_free(multifd_recv_param);
+    multifd_recv_param = NULL;
+    multifd_recv_count = 0;
+}
+
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
+static uint64_t bitmap_sync_count;
+/* auto-converge: dirty pages left after the previous sync */
+static uint64_t last_sync_dirty_pages;
+static int dirty_rate_high_cnt;
+static QemuMutex page_request_lock;
+static bool page_request_lock_initialized;
+/* Set once the source switched to post-copy: pages are then sent whole */
+static bool ram_postcopy_active;
 
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
@@ -355,24 +1190,36 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
-                                              ram_addr_t offset)
-{
-    bool ret;
-    int nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
-
-    ret = test_and_set_bit(nr, migration_bitmap);
+#define MIG_THROTTLE_PCT_INITIAL   20
+#define MIG_THROTTLE_PCT_INCREMENT 10
 
-    if (!ret) {
-        migration_dirty_pages++;
+/* Throttle the guest harder whenever two passes in a row over RAM left at
+ * least as many dirty pages as the one before.  The migration thread
+ * applies the new percentage. */
+static void migration_check_convergence(MigrationState *s)
+{
+    if (bitmap_sync_count > 2 &&
+        migration_dirty_pages >= last_sync_dirty_pages) {
+        if (++dirty_rate_high_cnt >= 2) {
+            dirty_rate_high_cnt = 0;
+            if (!s->throttle_percentage) {
+                s->throttle_percentage = MIG_THROTTLE_PCT_INITIAL;
+            } else {
+                s->throttle_percentage =
+                    MIN(s->throttle_percentage + MIG_THROTTLE_PCT_INCREMENT,
+                        99);
+            }
+            DPRINTF("throttling guest to %d%%\n", s->throttle_percentage);
+        }
+    } else {
+        dirty_rate_high_cnt = 0;
     }
-    return ret;
+    last_sync_dirty_pages = migration_dirty_pages;
 }
 
 static void migration_bitmap_sync(void)
 {
     RAMBlock *block;
-    ram_addr_t addr;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     static int64_t start_time;
@@ -384,22 +1231,39 @@ static void migration_bitmap_sync(void)
     }
 
     trace_migration_bitmap_sync_start();
+    bitmap_sync_count++;
     memory_global_sync_dirty_bitmap(get_system_memory());
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (memory_region_test_and_clear_dirty(block->mr,
-                                                   addr, TARGET_PAGE_SIZE,
-                                                   DIRTY_MEMORY_MIGRATION)) {
-                migration_bitmap_set_dirty(block->mr, addr);
-            }
+    if (XBZRLE.cache) {
+        uint64_t hits = acct_info.xbzrle_cache_hit -
+                        acct_info.xbzrle_sync_cache_hit;
+        uint64_t misses = acct_info.xbzrle_cache_miss -
+                          acct_info.xbzrle_sync_cache_miss;
+
+        if (hits + misses) {
+            acct_info.xbzrle_cache_hit_rate = (double)hits / (hits + misses);
         }
+        acct_info.xbzrle_sync_cache_hit = acct_info.xbzrle_cache_hit;
+        acct_info.xbzrle_sync_cache_miss = acct_info.xbzrle_cache_miss;
+        cache_age(XBZRLE.cache);
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        migration_dirty_pages +=
+            memory_region_test_and_clear_dirty_bitmap(block->mr,
+                                                      0, block->length,
+                                                      DIRTY_MEMORY_MIGRATION,
+                                                      migration_bitmap);
     }
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_get_clock_ms(rt_clock);
 
+    if (migrate_auto_converge() && !ram_postcopy_active) {
+        migration_check_convergence(s);
+    }
+
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
         s->dirty_pages_rate = num_dirty_pages_period * 1000
@@ -409,6 +1273,61 @@ static void migration_bitmap_sync(void)
     }
 }
 
+/*
+ * ram_save_page: Writes one page of memory to the stream f
+ *
+ * Returns:  0: if the page hasn't changed
+ *           n: the amount of bytes written in other case
+ */
+
+static int ram_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                         bool last_stage)
+{
+    int bytes_sent = -1;
+    ram_addr_t current_addr;
+    uint8_t *p;
+
+    p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    if (is_dup_page(p)) {
+        acct_info.dup_pages++;
+        save_block_hdr(f, block, offset, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        bytes_sent = 1;
+    } else if (migrate_use_xbzrle() && !ram_postcopy_active) {
+        current_addr = block->offset + offset;
+        bytes_sent = save_xbzrle_page(f, p, current_addr, block,
+                                      offset, last_stage);
+        if (!last_stage) {
+            /* send the copy in the cache, so that what the destination
+             * gets matches what the next delta will be encoded against */
+            uint8_t *cached = get_cached_data(XBZRLE.cache, current_addr);
+            if (cached) {
+                p = cached;
+            }
+        }
+    }
+
+    /* not sent yet, and threads are available to compress it */
+    if (bytes_sent == -1 && comp_param) {
+        bytes_sent = compress_page_with_multi_thread(f, block, offset, p);
+    }
+
+    if (bytes_sent == -1 && multifd_send_count) {
+        bytes_sent = multifd_queue_page(f, block, offset);
+    }
+
+    /* either we didn't send yet (we may have had XBZRLE overflow) */
+    if (bytes_sent == -1) {
+        save_block_hdr(f, block, offset, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_no_copy(f, p, TARGET_PAGE_SIZE);
+        bytes_sent = TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+
+    return bytes_sent;
+}
+
 /*
  * ram_save_block: Writes a page of memory to the stream f
  *
@@ -424,7 +1343,6 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     bool complete_round = false;
     int bytes_sent = -1;
     MemoryRegion *mr;
-    ram_addr_t current_addr;
 
     if (!block)
         block = QTAILQ_FIRST(&ram_list.blocks);
@@ -434,6 +1352,7 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
         offset = migration_bitmap_find_and_reset_dirty(mr, offset);
         if (complete_round && block == last_block &&
             offset >= last_offset) {
+            bytes_sent = -1;
             break;
         }
         if (offset >= block->length) {
@@ -444,32 +1363,7 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
                 complete_round = true;
             }
         } else {
-            uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
-
-            p = memory_region_get_ram_ptr(mr) + offset;
-
-            if (is_dup_page(p)) {
-                acct_info.dup_pages++;
-                save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, *p);
-                bytes_sent = 1;
-            } else if (migrate_use_xbzrle()) {
-                current_addr = block->offset + offset;
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    p = get_cached_data(XBZRLE.cache, current_addr);
-                }
-            }
-
-            /* either we didn't send yet (we may have had XBZRLE overflow) */
-            if (bytes_sent == -1) {
-                save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer_no_copy(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
-                acct_info.norm_pages++;
-            }
+            bytes_sent = ram_save_page(f, block, offset, last_stage);
 
             /* if page is unmodified, continue to the next */
             if (bytes_sent != 0) {
@@ -515,6 +1409,10 @@ static void migration_end(void)
 {
     memory_global_dirty_log_stop();
 
+    compress_threads_save_cleanup();
+    multifd_save_cleanup();
+    ram_postcopy_active = false;
+
     if (migrate_use_xbzrle()) {
         cache_fini(XBZRLE.cache);
         g_free(XBZRLE.cache);
@@ -533,6 +1431,7 @@ static void ram_migration_cancel(void *opaque)
 static void reset_ram_globals(void)
 {
     last_block = NULL;
+    last_sent_block = NULL;
     last_offset = 0;
     last_version = ram_list.version;
 }
@@ -547,6 +1446,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_bitmap = bitmap_new(ram_pages);
     bitmap_set(migration_bitmap, 1, ram_pages);
     migration_dirty_pages = ram_pages;
+    bitmap_sync_count = 0;
+    last_sync_dirty_pages = 0;
+    dirty_rate_high_cnt = 0;
 
     if (migrate_use_xbzrle()) {
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
@@ -558,7 +1460,18 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         }
         XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
         XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
-        acct_clear();
+    }
+    acct_clear();
+
+    if (migrate_use_compress()) {
+        compress_threads_save_setup();
+    }
+    if (migrate_use_multifd()) {
+        multifd_save_setup();
+    }
+    if (migrate_use_postcopy() && !page_request_lock_initialized) {
+        qemu_mutex_init(&page_request_lock);
+        page_request_lock_initialized = true;
     }
 
     qemu_mutex_lock_ramlist();
@@ -576,6 +1489,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_be64(f, block->length);
     }
 
+    if (multifd_send_count) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD);
+        qemu_put_be32(f, multifd_send_count);
+    }
+
     qemu_mutex_unlock_ramlist();
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
@@ -621,6 +1539,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         i++;
     }
+    bytes_transferred += flush_compressed_data(f);
+    multifd_flush(f);
 
     qemu_mutex_unlock_ramlist();
 
@@ -651,6 +1571,10 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
         bytes_transferred += bytes_sent;
     }
+    bytes_transferred += flush_compressed_data(f);
+    compress_threads_save_cleanup();
+    multifd_flush(f);
+    multifd_save_cleanup();
     memory_global_dirty_log_stop();
 
     qemu_mutex_unlock_ramlist();
@@ -679,6 +1603,217 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
     return remaining_size;
 }
 
+/***********************************************************/
+/* post-copy */
+
+/*
+ * Once the source switches to post-copy, the guest runs on the destination
+ * and every page that was still dirty is missing there.  The source sends
+ * the list of missing pages, then streams them in the background and serves
+ * page requests that the destination sends on the return path whenever the
+ * guest (or a device) touches one of them.
+ *
+ * On the destination, missing memory is made inaccessible in chunks of
+ * POSTCOPY_CHUNK_PAGES pages and a SIGSEGV handler stands in for the kernel
+ * user fault support: the faulting thread queues a request for its chunk and
+ * sleeps until the listening thread has received every missing page of the
+ * chunk and made it accessible again.  Pages are written behind the
+ * protection through /proc/self/mem, so nobody can observe a partial page.
+ * Protecting whole chunks keeps the number of distinct mappings bounded.
+ * This only works when guest memory is accessed through QEMU's own
+ * mappings, i.e. with TCG and anonymous memory.
+ */
+
+#define POSTCOPY_CHUNK_PAGES 512
+
+typedef struct RAMPageRequest {
+    char idstr[256];
+    ram_addr_t offset;
+    ram_addr_t npages;
+    QSIMPLEQ_ENTRY(RAMPageRequest) next;
+} RAMPageRequest;
+
+static QSIMPLEQ_HEAD(, RAMPageRequest) page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(page_requests);
+
+uint64_t postcopy_mig_requests(void)
+{
+    return acct_info.postcopy_requests;
+}
+
+uint64_t ram_dirty_sync_count(void)
+{
+    return bitmap_sync_count;
+}
+
+/* Called from the return path thread */
+void ram_save_queue_pages(const char *idstr, uint64_t offset,
+                          uint32_t npages)
+{
+    RAMPageRequest *req = g_malloc0(sizeof(*req));
+
+    pstrcpy(req->idstr, sizeof(req->idstr), idstr);
+    req->offset = offset;
+    req->npages = npages;
+
+    qemu_mutex_lock(&page_request_lock);
+    QSIMPLEQ_INSERT_TAIL(&page_requests, req, next);
+    qemu_mutex_unlock(&page_request_lock);
+}
+
+/* Send the pages the destination is waiting for, ahead of the background
+ * stream.  Pages that were sent already are skipped. */
+static int ram_save_page_requests(QEMUFile *f)
+{
+    RAMPageRequest *req;
+    int bytes_sent = 0;
+
+    while (true) {
+        RAMBlock *block;
+        ram_addr_t offset, end;
+
+        qemu_mutex_lock(&page_request_lock);
+        req = QSIMPLEQ_FIRST(&page_requests);
+        if (req) {
+            QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+        }
+        qemu_mutex_unlock(&page_request_lock);
+        if (!req) {
+            break;
+        }
+
+        acct_info.postcopy_requests++;
+        block = ram_find_block(req->idstr);
+        if (!block) {
+            fprintf(stderr, "postcopy: request for unknown block %s\n",
+                    req->idstr);
+            g_free(req);
+            return -EINVAL;
+        }
+
+        end = MIN(block->length,
+                  req->offset + (req->npages << TARGET_PAGE_BITS));
+        for (offset = req->offset; offset < end;
+             offset += TARGET_PAGE_SIZE) {
+            long nr = (block->offset + offset) >> TARGET_PAGE_BITS;
+
+            if (test_and_clear_bit(nr, migration_bitmap)) {
+                migration_dirty_pages--;
+                bytes_sent += ram_save_page(f, block, offset, true);
+            }
+        }
+        g_free(req);
+    }
+
+    if (bytes_sent) {
+        qemu_fflush(f);
+    }
+    return bytes_sent;
+}
+
+static int ram_save_postcopy_begin(QEMUFile *f, void *opaque)
+{
+    RAMBlock *block;
+
+    qemu_mutex_lock_ramlist();
+
+    /* ram_save_iterate flushed the compression threads already */
+    compress_threads_save_cleanup();
+    migration_bitmap_sync();
+    ram_postcopy_active = true;
+    last_sent_block = NULL;
+
+    /* list of missing pages, as runs per block */
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long base = block->offset >> TARGET_PAGE_BITS;
+        unsigned long end = base + (block->length >> TARGET_PAGE_BITS);
+        unsigned long first, last;
+
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+
+        first = find_next_bit(migration_bitmap, end, base);
+        while (first < end) {
+            last = find_next_zero_bit(migration_bitmap, end, first);
+            qemu_put_be64(f, first - base);
+            qemu_put_be64(f, last - first);
+            first = find_next_bit(migration_bitmap, end, last);
+        }
+        qemu_put_be64(f, 0);
+        qemu_put_be64(f, 0);
+    }
+    qemu_put_byte(f, 0);
+
+    qemu_mutex_unlock_ramlist();
+
+    return 0;
+}
+
+/*
+ * Returns 1 once every missing page has been sent, 0 if there is more to
+ * send, negative on error.
+ */
+int ram_save_postcopy_iterate(QEMUFile *f)
+{
+    int ret = 0;
+    int i = 0;
+    int64_t t0;
+
+    qemu_mutex_lock_ramlist();
+
+    t0 = qemu_get_clock_ns(rt_clock);
+    while (!qemu_file_rate_limit(f)) {
+        int bytes_sent;
+
+        bytes_sent = ram_save_page_requests(f);
+        if (bytes_sent < 0) {
+            ret = bytes_sent;
+            break;
+        }
+        bytes_transferred += bytes_sent;
+
+        bytes_sent = ram_save_block(f, true);
+        if (bytes_sent < 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            ret = 1;
+            break;
+        }
+        bytes_transferred += bytes_sent;
+
+        if ((i & 63) == 0) {
+            uint64_t t1 = (qemu_get_clock_ns(rt_clock) - t0) / 1000000;
+            if (t1 > MAX_WAIT) {
+                break;
+            }
+        }
+        i++;
+    }
+
+    qemu_mutex_unlock_ramlist();
+    qemu_fflush(f);
+
+    if (ret == 0) {
+        ret = qemu_file_get_error(f);
+    }
+    return ret;
+}
+
+void ram_save_postcopy_complete(void)
+{
+    RAMPageRequest *req;
+
+    memory_global_dirty_log_stop();
+    ram_postcopy_active = false;
+
+    g_free(migration_bitmap);
+    migration_bitmap = NULL;
+
+    while ((req = QSIMPLEQ_FIRST(&page_requests)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+        g_free(req);
+    }
+}
+
 static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
 {
     int ret, rc = 0;
@@ -750,6 +1885,378 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+#ifdef CONFIG_POSIX
+typedef struct PostcopyBlock {
+    RAMBlock *block;
+    uint8_t *host;
+    ram_addr_t length;
+    unsigned long *missing;
+    uint32_t *chunk_missing;
+    /* 0: present, 1: missing, 2: missing and requested */
+    int *chunk_state;
+} PostcopyBlock;
+
+static struct {
+    PostcopyBlock *blocks;
+    int nb_blocks;
+    QEMUFile *file;
+    QEMUFile *return_path;
+    int proc_mem;
+    int fault_pipe[2];
+    QemuThread fault_thread;
+    QemuThread listen_thread;
+    struct sigaction old_sigsegv;
+    int incoming;
+} postcopy;
+
+static PostcopyBlock *postcopy_find_host(uint8_t *addr)
+{
+    int i;
+
+    for (i = 0; i < postcopy.nb_blocks; i++) {
+        PostcopyBlock *pb = &postcopy.blocks[i];
+        if (addr >= pb->host && addr < pb->host + pb->length) {
+            return pb;
+        }
+    }
+    return NULL;
+}
+
+static void postcopy_sigsegv(int sig, siginfo_t *info, void *ctx)
+{
+    uint8_t *addr = info->si_addr;
+    PostcopyBlock *pb = postcopy_find_host(addr);
+    struct timespec ts = { 0, 100000 };
+    unsigned long chunk;
+    int *state;
+
+    if (!pb) {
+        /* not ours, let the previous handler deal with it */
+        sigaction(SIGSEGV, &postcopy.old_sigsegv, NULL);
+        return;
+    }
+
+    chunk = ((addr - pb->host) >> TARGET_PAGE_BITS) / POSTCOPY_CHUNK_PAGES;
+    state = &pb->chunk_state[chunk];
+    if (g_atomic_int_compare_and_exchange(state, 1, 2)) {
+        struct { PostcopyBlock *pb; unsigned long chunk; } req = { pb, chunk };
+        ssize_t len;
+
+        do {
+            len = write(postcopy.fault_pipe[1], &req, sizeof(req));
+        } while (len < 0 && errno == EINTR);
+    }
+
+    /* retried on return, by which time the chunk is accessible */
+    while (g_atomic_int_get(state) != 0) {
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void *postcopy_fault_thread(void *opaque)
+{
+    struct { PostcopyBlock *pb; unsigned long chunk; } req;
+    ssize_t len;
+
+    while (true) {
+        const char *idstr;
+
+        len = read(postcopy.fault_pipe[0], &req, sizeof(req));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len != sizeof(req)) {
+            break;
+        }
+
+        idstr = req.pb->block->idstr;
+        qemu_put_byte(postcopy.return_path, strlen(idstr));
+        qemu_put_buffer(postcopy.return_path, (uint8_t *)idstr,
+                        strlen(idstr));
+        qemu_put_be64(postcopy.return_path,
+                      (ram_addr_t)req.chunk * POSTCOPY_CHUNK_PAGES
+                      << TARGET_PAGE_BITS);
+        qemu_put_be32(postcopy.return_path, POSTCOPY_CHUNK_PAGES);
+        qemu_fflush(postcopy.return_path);
+    }
+    return NULL;
+}
+
+static int postcopy_place_page(ram_addr_t addr, int flags, const void *buf)
+{
+    PostcopyBlock *pb;
+    uint8_t *host;
+    unsigned long page, chunk;
+
+    host = host_from_stream_offset(postcopy.file, addr, flags);
+    pb = host ? postcopy_find_host(host) : NULL;
+    if (!pb) {
+        return -EINVAL;
+    }
+
+    page = (host - pb->host) >> TARGET_PAGE_BITS;
+    if (!test_and_clear_bit(page, pb->missing)) {
+        /* sent twice, once on request and once in the background */
+        return 0;
+    }
+
+    if (pwrite(postcopy.proc_mem, buf, TARGET_PAGE_SIZE,
+               (uintptr_t)host) != TARGET_PAGE_SIZE) {
+        return -errno;
+    }
+
+    chunk = page / POSTCOPY_CHUNK_PAGES;
+    if (--pb->chunk_missing[chunk] == 0) {
+        ram_addr_t start = (ram_addr_t)chunk * POSTCOPY_CHUNK_PAGES
+                           << TARGET_PAGE_BITS;
+
+        if (mprotect(pb->host + start,
+                     MIN(pb->length - start,
+                         POSTCOPY_CHUNK_PAGES << TARGET_PAGE_BITS),
+                     PROT_READ | PROT_WRITE) < 0) {
+            return -errno;
+        }
+        smp_wmb();
+        g_atomic_int_set(&pb->chunk_state[chunk], 0);
+    }
+    return 0;
+}
+
+static void *postcopy_listen_thread(void *opaque)
+{
+    QEMUFile *f = postcopy.file;
+    uint8_t *buf = g_malloc(TARGET_PAGE_SIZE);
+    ram_addr_t addr;
+    int flags, ret = 0;
+    int i;
+
+    do {
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            uint8_t ch = qemu_get_byte(f);
+            memset(buf, ch, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+        } else if (!(flags & RAM_SAVE_FLAG_EOS)) {
+            ret = -EINVAL;
+        }
+        if (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
+            ret = postcopy_place_page(addr, flags, buf);
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+        if (ret) {
+            /* the guest is already running here and the source has
+             * stopped, there is nothing left to fall back to */
+            fprintf(stderr, "postcopy: failed to receive RAM: %s\n",
+                    strerror(-ret));
+            exit(1);
+        }
+    } while (!(flags & RAM_SAVE_FLAG_EOS));
+
+    for (i = 0; i < postcopy.nb_blocks; i++) {
+        if (!bitmap_empty(postcopy.blocks[i].missing,
+                          postcopy.blocks[i].length >> TARGET_PAGE_BITS)) {
+            fprintf(stderr, "postcopy: pages of %s never arrived\n",
+                    postcopy.blocks[i].block->idstr);
+            exit(1);
+        }
+    }
+
+    g_atomic_int_set(&postcopy.incoming, 0);
+    sigaction(SIGSEGV, &postcopy.old_sigsegv, NULL);
+    close(postcopy.fault_pipe[1]);
+    qemu_thread_join(&postcopy.fault_thread);
+    close(postcopy.fault_pipe[0]);
+    qemu_fclose(postcopy.return_path);
+    qemu_fclose(f);
+    close(postcopy.proc_mem);
+
+    /* chunk_state is left allocated: a thread that faulted just before
+     * the handler was restored may still be polling it */
+    for (i = 0; i < postcopy.nb_blocks; i++) {
+        g_free(postcopy.blocks[i].missing);
+        g_free(postcopy.blocks[i].chunk_missing);
+    }
+    g_free(buf);
+
+    DPRINTF("postcopy: all pages received\n");
+    return NULL;
+}
+
+static int ram_load_postcopy_begin(QEMUFile *f, void *opaque)
+{
+    struct sigaction act;
+    RAMBlock *block;
+    int i;
+
+    if (kvm_enabled() || xen_enabled() || mem_path) {
+        fprintf(stderr, "postcopy: only supported with TCG and "
+                "anonymous guest memory\n");
+        return -ENOTSUP;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        postcopy.nb_blocks++;
+    }
+    postcopy.blocks = g_new0(PostcopyBlock, postcopy.nb_blocks);
+    i = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        PostcopyBlock *pb = &postcopy.blocks[i++];
+        unsigned long pages = block->length >> TARGET_PAGE_BITS;
+        unsigned long chunks = DIV_ROUND_UP(pages, POSTCOPY_CHUNK_PAGES);
+
+        pb->block = block;
+        pb->host = memory_region_get_ram_ptr(block->mr);
+        pb->length = block->length;
+        pb->missing = bitmap_new(pages);
+        pb->chunk_missing = g_new0(uint32_t, chunks);
+        pb->chunk_state = g_new0(int, chunks);
+    }
+
+    /* list of missing pages */
+    while (true) {
+        PostcopyBlock *pb = NULL;
+        char id[256];
+        uint8_t len;
+
+        len = qemu_get_byte(f);
+        if (!len) {
+            break;
+        }
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        for (i = 0; i < postcopy.nb_blocks; i++) {
+            if (!strncmp(id, postcopy.blocks[i].block->idstr, sizeof(id))) {
+                pb = &postcopy.blocks[i];
+            }
+        }
+        if (!pb) {
+            fprintf(stderr, "postcopy: unknown ramblock \"%s\"\n", id);
+            return -EINVAL;
+        }
+
+        while (true) {
+            uint64_t start = qemu_get_be64(f);
+            uint64_t npages = qemu_get_be64(f);
+            uint64_t page;
+
+            if (!npages) {
+                break;
+            }
+            if (start + npages > pb->length >> TARGET_PAGE_BITS) {
+                return -EINVAL;
+            }
+            bitmap_set(pb->missing, start, npages);
+            for (page = start; page < start + npages; page++) {
+                pb->chunk_missing[page / POSTCOPY_CHUNK_PAGES]++;
+            }
+        }
+    }
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+
+    postcopy.return_path = qemu_file_get_return_path(f);
+    if (!postcopy.return_path) {
+        fprintf(stderr, "postcopy: no return path to the source\n");
+        return -EINVAL;
+    }
+    postcopy.proc_mem = open("/proc/self/mem", O_RDWR);
+    if (postcopy.proc_mem < 0) {
+        perror("postcopy: cannot open /proc/self/mem");
+        qemu_fclose(postcopy.return_path);
+        return -errno;
+    }
+    if (qemu_pipe(postcopy.fault_pipe) < 0) {
+        close(postcopy.proc_mem);
+        qemu_fclose(postcopy.return_path);
+        return -errno;
+    }
+    postcopy.file = f;
+
+    /* the listen thread reads outside of the coroutine that loaded the
+     * device state, so it needs the socket in blocking mode */
+    socket_set_block(qemu_get_fd(f));
+
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = postcopy_sigsegv;
+    act.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &act, &postcopy.old_sigsegv);
+
+    for (i = 0; i < postcopy.nb_blocks; i++) {
+        PostcopyBlock *pb = &postcopy.blocks[i];
+        unsigned long pages = pb->length >> TARGET_PAGE_BITS;
+        unsigned long chunks = DIV_ROUND_UP(pages, POSTCOPY_CHUNK_PAGES);
+        unsigned long chunk, first;
+
+        /* coalesce missing chunks to keep the number of mappings down */
+        for (chunk = 0; chunk < chunks; chunk = first) {
+            ram_addr_t start, end;
+
+            while (chunk < chunks && !pb->chunk_missing[chunk]) {
+                chunk++;
+            }
+            for (first = chunk; first < chunks && pb->chunk_missing[first];
+                 first++) {
+                pb->chunk_state[first] = 1;
+            }
+            if (chunk == first) {
+                break;
+            }
+            start = (ram_addr_t)chunk * POSTCOPY_CHUNK_PAGES
+                    << TARGET_PAGE_BITS;
+            end = MIN(pb->length, (ram_addr_t)first * POSTCOPY_CHUNK_PAGES
+                                  << TARGET_PAGE_BITS);
+            mprotect(pb->host + start, end - start, PROT_NONE);
+        }
+    }
+    g_atomic_int_set(&postcopy.incoming, 1);
+
+    qemu_thread_create(&postcopy.fault_thread, postcopy_fault_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&postcopy.listen_thread, postcopy_listen_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+    return 0;
+}
+#endif
+
+/* The kernel does not raise SIGSEGV when a system call accesses a page that
+ * is still protected, the call fails with EFAULT instead.  Touch the pages
+ * before guest memory is handed to disk or network I/O, so that missing
+ * chunks are fetched by postcopy_sigsegv() first. */
+void ram_postcopy_fault_in(void *host, size_t len)
+{
+#ifdef CONFIG_POSIX
+    uint8_t *addr = host;
+    uint8_t *end = addr + len;
+    PostcopyBlock *pb;
+    unsigned long chunk;
+
+    if (!g_atomic_int_get(&postcopy.incoming)) {
+        return;
+    }
+
+    while (addr < end) {
+        pb = postcopy_find_host(addr);
+        if (!pb) {
+            addr = (uint8_t *)(((uintptr_t)addr | ~TARGET_PAGE_MASK) + 1);
+            continue;
+        }
+        chunk = ((addr - pb->host) >> TARGET_PAGE_BITS) / POSTCOPY_CHUNK_PAGES;
+        if (g_atomic_int_get(&pb->chunk_state[chunk])) {
+            (void)*(volatile uint8_t *)addr;
+        }
+        addr = pb->host + ((ram_addr_t)(chunk + 1) * POSTCOPY_CHUNK_PAGES
+                           << TARGET_PAGE_BITS);
+    }
+#endif
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
@@ -846,6 +2353,25 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_ZLIB) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            if (load_compressed_page(f, host) < 0) {
+                ret = -EINVAL;
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_MULTIFD) {
+            /* channel count at setup, then zero for every sync */
+            uint32_t channels = qemu_get_be32(f);
+
+            ret = channels ? multifd_load_setup(channels)
+                           : multifd_recv_sync();
+            if (ret < 0) {
+                goto done;
+            }
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -855,6 +2381,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    if (wait_for_decompress_done() < 0 && !ret) {
+        ret = -EINVAL;
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -867,6 +2396,10 @@ SaveVMHandlers savevm_ram_handlers = {
     .save_live_pending = ram_save_pending,
     .load_state = ram_load,
     .cancel = ram_migration_cancel,
+    .save_postcopy_begin = ram_save_postcopy_begin,
+#ifdef CONFIG_POSIX
+    .load_postcopy_begin = ram_load_postcopy_begin,
+#endif
 };
 
 #ifdef HAS_AUDIO
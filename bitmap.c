@@ -11,6 +11,7 @@
 
 #include "bitops.h"
 #include "bitmap.h"
+#include "host-utils.h"
 
 /*
  * bitmaps provide an array of bits, implemented using an an
@@ -254,3 +255,79 @@ int slow_bitmap_intersects(const unsigned long *bitmap1,
     }
     return 0;
 }
+
+/*
+ * Gather bit @shift of each of the eight bytes in @bytes (in memory
+ * order) into the low eight bits of the result.
+ */
+static inline unsigned long bytemap_gather8(uint64_t bytes, int shift)
+{
+    bytes = (le64_to_cpu(bytes) >> shift) & 0x0101010101010101ULL;
+    return (bytes * 0x0102040810204080ULL) >> 56;
+}
+
+static inline int bytemap_sync_one(unsigned long *dst, uint8_t *bytemap,
+                                   long i, uint8_t flag)
+{
+    if (!(bytemap[i] & flag)) {
+        return 0;
+    }
+    bytemap[i] &= ~flag;
+    return !test_and_set_bit(i, dst);
+}
+
+/**
+ * bitmap_sync_bytemap - move a flag from a byte-per-entry map to a bitmap
+ * @dst: The bitmap to update
+ * @bytemap: The byte map, indexed like @dst
+ * @start: The first entry to look at
+ * @nr: The number of entries to look at
+ * @flag: The single bit to test and clear in each byte
+ *
+ * Clears @flag in every byte of @bytemap between @start and @start + @nr,
+ * and sets the matching bit of @dst for every byte that had it.  Works on
+ * a word of @dst, i.e. BITS_PER_LONG bytes, at a time, so clean areas cost
+ * one load per eight entries.  Returns the number of bits that were not
+ * already set in @dst.
+ */
+long bitmap_sync_bytemap(unsigned long *dst, uint8_t *bytemap,
+                         long start, long nr, uint8_t flag)
+{
+    const uint64_t mask = flag * 0x0101010101010101ULL;
+    const int shift = ctz32(flag);
+    long end = start + nr;
+    long count = 0;
+    long i = start;
+
+    /* single entries up to the first word boundary, and at the end */
+    for (; i < end && (i % BITS_PER_LONG); i++) {
+        count += bytemap_sync_one(dst, bytemap, i, flag);
+    }
+
+    for (; i + BITS_PER_LONG <= end; i += BITS_PER_LONG) {
+        unsigned long bits = 0;
+        unsigned long *word;
+        int j;
+
+        for (j = 0; j < BITS_PER_LONG; j += 8) {
+            uint64_t bytes;
+
+            memcpy(&bytes, bytemap + i + j, 8);
+            if (bytes & mask) {
+                bits |= bytemap_gather8(bytes, shift) << j;
+                bytes &= ~mask;
+                memcpy(bytemap + i + j, &bytes, 8);
+            }
+        }
+        if (bits) {
+            word = dst + BIT_WORD(i);
+            count += ctpop64(bits & ~*word);
+            *word |= bits;
+        }
+    }
+
+    for (; i < end; i++) {
+        count += bytemap_sync_one(dst, bytemap, i, flag);
+    }
+    return count;
+}
@@ -218,5 +218,7 @@ unsigned long bitmap_find_next_zero_area(unsigned long *map,
 					 unsigned long start,
 					 unsigned int nr,
 					 unsigned long align_mask);
+long bitmap_sync_bytemap(unsigned long *dst, uint8_t *bytemap,
+                         long start, long nr, uint8_t flag);
 
 #endif /* BITMAP_H */
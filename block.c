@@ -34,6 +34,9 @@
 #include "qemu-coroutine.h"
 #include "qmp-commands.h"
 #include "qemu-timer.h"
+#include "bitmap.h"
+#include "host-utils.h"
+#include "block/throttle-groups.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -85,13 +88,10 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
 static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors);
+static void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
+                           int nr_sectors);
+static void bdrv_release_all_dirty_bitmaps(BlockDriverState *bs);
 
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-        double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, int64_t *wait);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -126,76 +126,76 @@ int is_windows_drive(const char *filename)
 #endif
 
 /* throttling disk I/O limits */
-void bdrv_io_limits_disable(BlockDriverState *bs)
-{
-    bs->io_limits_enabled = false;
 
-    while (qemu_co_queue_next(&bs->throttled_reqs));
+/* Lets all queued requests go without waiting for the limits */
+static bool bdrv_start_throttled_reqs(BlockDriverState *bs)
+{
+    bool restarted = false;
+    int i;
 
-    if (bs->block_timer) {
-        qemu_del_timer(bs->block_timer);
-        qemu_free_timer(bs->block_timer);
-        bs->block_timer = NULL;
+    for (i = 0; i < 2; i++) {
+        while (qemu_co_queue_next(&bs->throttled_reqs[i])) {
+            restarted = true;
+        }
     }
-
-    bs->slice_start = 0;
-    bs->slice_end   = 0;
-    bs->slice_time  = 0;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
+    return restarted;
 }
 
-static void bdrv_block_timer(void *opaque)
+void bdrv_io_limits_disable(BlockDriverState *bs)
 {
-    BlockDriverState *bs = opaque;
-
-    qemu_co_queue_next(&bs->throttled_reqs);
+    bs->io_limits_enabled = false;
+    bdrv_start_throttled_reqs(bs);
+    throttle_group_unregister_bs(bs);
 }
 
-void bdrv_io_limits_enable(BlockDriverState *bs)
+/* Throttles @bs with the limits of @group, which is created if needed */
+void bdrv_io_limits_enable(BlockDriverState *bs, const char *group)
 {
-    qemu_co_queue_init(&bs->throttled_reqs);
-    bs->block_timer = qemu_new_timer_ns(vm_clock, bdrv_block_timer, bs);
-    bs->slice_time  = 5 * BLOCK_IO_SLICE_TIME;
-    bs->slice_start = qemu_get_clock_ns(vm_clock);
-    bs->slice_end   = bs->slice_start + bs->slice_time;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
+    assert(!bs->io_limits_enabled);
+    throttle_group_register_bs(bs, group);
     bs->io_limits_enabled = true;
 }
 
-bool bdrv_io_limits_enabled(BlockDriverState *bs)
+/* Moves @bs to another throttle group */
+void bdrv_io_limits_update_group(BlockDriverState *bs, const char *group)
 {
-    BlockIOLimit *io_limits = &bs->io_limits;
-    return io_limits->bps[BLOCK_IO_LIMIT_READ]
-         || io_limits->bps[BLOCK_IO_LIMIT_WRITE]
-         || io_limits->bps[BLOCK_IO_LIMIT_TOTAL]
-         || io_limits->iops[BLOCK_IO_LIMIT_READ]
-         || io_limits->iops[BLOCK_IO_LIMIT_WRITE]
-         || io_limits->iops[BLOCK_IO_LIMIT_TOTAL];
+    if (!strcmp(throttle_group_get_name(bs), group)) {
+        return;
+    }
+
+    bdrv_io_limits_disable(bs);
+    bdrv_io_limits_enable(bs, group);
 }
 
-static void bdrv_io_limits_intercept(BlockDriverState *bs,
-                                     bool is_write, int nb_sectors)
+const char *bdrv_io_limits_group(BlockDriverState *bs)
 {
-    int64_t wait_time = -1;
+    return throttle_group_get_name(bs);
+}
 
-    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
-        qemu_co_queue_wait(&bs->throttled_reqs);
-    }
+/* Sets the limits of the throttle group of @bs */
+void bdrv_set_io_limits(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    int i;
 
-    /* In fact, we hope to keep each request's timing, in FIFO mode. The next
-     * throttled requests will not be dequeued until the current request is
-     * allowed to be serviced. So if the current request still exceeds the
-     * limits, it will be inserted to the head. All requests followed it will
-     * be still in throttled_reqs queue.
-     */
+    throttle_group_config(bs, cfg);
 
-    while (bdrv_exceed_io_limits(bs, nb_sectors, is_write, &wait_time)) {
-        qemu_mod_timer(bs->block_timer,
-                       wait_time + qemu_get_clock_ns(vm_clock));
-        qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
+    /* Let the first queued requests go; the ones that follow them are
+     * checked against the new limits */
+    for (i = 0; i < 2; i++) {
+        qemu_co_queue_next(&bs->throttled_reqs[i]);
     }
+}
+
+void bdrv_get_io_limits(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    throttle_group_get_config(bs, cfg);
+}
 
-    qemu_co_queue_next(&bs->throttled_reqs);
+static void bdrv_io_limits_intercept(BlockDriverState *bs,
+                                     bool is_write, int nb_sectors)
+{
+    throttle_group_co_io_limits_intercept(bs, nb_sectors << BDRV_SECTOR_BITS,
+                                          is_write);
 }
 
 /* check if the path starts with "<protocol>:" */
@@ -311,9 +311,14 @@ BlockDriverState *bdrv_new(const char *device_name)
     pstrcpy(bs->device_name, sizeof(bs->device_name), device_name);
     if (device_name[0] != '\0') {
         QTAILQ_INSERT_TAIL(&bdrv_states, bs, list);
+        bdrv_set_latency_histogram(bs, BLOCK_LATENCY_HISTOGRAM_START,
+                                   BLOCK_LATENCY_HISTOGRAM_FACTOR,
+                                   BLOCK_LATENCY_HISTOGRAM_COUNT);
     }
     bdrv_iostatus_disable(bs);
     notifier_list_init(&bs->close_notifiers);
+    notifier_with_return_list_init(&bs->before_write_notifiers);
+    QLIST_INIT(&bs->dirty_bitmaps);
 
     return bs;
 }
@@ -323,6 +328,12 @@ void bdrv_add_close_notifier(BlockDriverState *bs, Notifier *notify)
     notifier_list_add(&bs->close_notifiers, notify);
 }
 
+void bdrv_add_before_write_notifier(BlockDriverState *bs,
+                                    NotifierWithReturn *notifier)
+{
+    notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
+}
+
 BlockDriver *bdrv_find_format(const char *format_name)
 {
     BlockDriver *drv1;
@@ -879,11 +890,6 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
         bdrv_dev_change_media_cb(bs, true);
     }
 
-    /* throttling disk I/O limits */
-    if (bs->io_limits_enabled) {
-        bdrv_io_limits_enable(bs);
-    }
-
     return 0;
 
 unlink_and_fail:
@@ -1143,6 +1149,7 @@ void bdrv_close(BlockDriverState *bs)
             bs->backing_hd = NULL;
         }
         bs->drv->bdrv_close(bs);
+        bdrv_release_all_dirty_bitmaps(bs);
         g_free(bs->opaque);
 #ifdef _WIN32
         if (bs->is_temporary) {
@@ -1207,8 +1214,7 @@ void bdrv_drain_all(void)
          * a busy wait.
          */
         QTAILQ_FOREACH(bs, &bdrv_states, list) {
-            if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
-                qemu_co_queue_restart_all(&bs->throttled_reqs);
+            if (bdrv_start_throttled_reqs(bs)) {
                 busy = true;
             }
         }
@@ -1217,7 +1223,8 @@ void bdrv_drain_all(void)
     /* If requests are still pending there is a bug somewhere */
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
         assert(QLIST_EMPTY(&bs->tracked_requests));
-        assert(qemu_co_queue_empty(&bs->throttled_reqs));
+        assert(qemu_co_queue_empty(&bs->throttled_reqs[0]));
+        assert(qemu_co_queue_empty(&bs->throttled_reqs[1]));
     }
 }
 
@@ -1253,14 +1260,16 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
-    /* i/o timing parameters */
-    bs_dest->slice_time         = bs_src->slice_time;
-    bs_dest->slice_start        = bs_src->slice_start;
-    bs_dest->slice_end          = bs_src->slice_end;
-    bs_dest->io_limits          = bs_src->io_limits;
-    bs_dest->io_base            = bs_src->io_base;
-    bs_dest->throttled_reqs     = bs_src->throttled_reqs;
-    bs_dest->block_timer        = bs_src->block_timer;
+    /* i/o throttling; the group and its round-robin list keep pointing
+     * at the same address, because the fields are moved back to it */
+    bs_dest->throttle_group     = bs_src->throttle_group;
+    bs_dest->round_robin        = bs_src->round_robin;
+    memcpy(bs_dest->throttled_reqs, bs_src->throttled_reqs,
+           sizeof(bs_dest->throttled_reqs));
+    memcpy(bs_dest->pending_reqs, bs_src->pending_reqs,
+           sizeof(bs_dest->pending_reqs));
+    memcpy(bs_dest->throttle_timers, bs_src->throttle_timers,
+           sizeof(bs_dest->throttle_timers));
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
 
     /* r/w error */
@@ -1271,9 +1280,13 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->iostatus_enabled   = bs_src->iostatus_enabled;
     bs_dest->iostatus           = bs_src->iostatus;
 
-    /* dirty bitmap */
-    bs_dest->dirty_count        = bs_src->dirty_count;
-    bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+    /* latency histograms, configured for the device */
+    memcpy(bs_dest->latency_histogram, bs_src->latency_histogram,
+           sizeof(bs_dest->latency_histogram));
+
+    /* dirty bitmaps; bdrv_swap() moves the list head back to the same
+     * address that it started from, so the first element stays valid */
+    bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
 
     /* job */
     bs_dest->in_use             = bs_src->in_use;
@@ -1303,12 +1316,17 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
 
     /* bs_new must be anonymous and shouldn't have anything fancy enabled */
     assert(bs_new->device_name[0] == '\0');
-    assert(bs_new->dirty_bitmap == NULL);
+    assert(QLIST_EMPTY(&bs_new->dirty_bitmaps));
     assert(bs_new->job == NULL);
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
+
+    /* the lists are not moved along with the fields, so the notifiers would
+     * end up pointing at the wrong BlockDriverState */
+    assert(QLIST_EMPTY(&bs_new->before_write_notifiers.notifiers));
+    assert(QLIST_EMPTY(&bs_old->before_write_notifiers.notifiers));
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1327,7 +1345,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->job == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     bdrv_rebind(bs_new);
     bdrv_rebind(bs_old);
@@ -1360,6 +1378,8 @@ void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
 
 void bdrv_delete(BlockDriverState *bs)
 {
+    int i;
+
     assert(!bs->dev);
     assert(!bs->job);
     assert(!bs->in_use);
@@ -1369,6 +1389,10 @@ void bdrv_delete(BlockDriverState *bs)
 
     bdrv_close(bs);
 
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        block_latency_histogram_clear(&bs->latency_histogram[i]);
+    }
+
     assert(bs != bs_snapshots);
     g_free(bs);
 }
@@ -1615,15 +1639,21 @@ int bdrv_commit_all(void)
     return 0;
 }
 
-struct BdrvTrackedRequest {
-    BlockDriverState *bs;
-    int64_t sector_num;
-    int nb_sectors;
-    bool is_write;
-    QLIST_ENTRY(BdrvTrackedRequest) list;
-    Coroutine *co; /* owner, used for deadlock detection */
-    CoQueue wait_queue; /* coroutines blocked on this request */
-};
+/*
+ * Accounts the time since the number of requests in flight last changed;
+ * called right before it changes.
+ */
+static void bdrv_update_in_flight_time(BlockDriverState *bs)
+{
+    int64_t now = get_clock();
+    int64_t delta = now - bs->in_flight_changed_ns;
+
+    if (bs->in_flight) {
+        bs->busy_time_ns += delta;
+        bs->queue_depth_time_ns += delta * bs->in_flight;
+    }
+    bs->in_flight_changed_ns = now;
+}
 
 /**
  * Remove an active request from the tracked requests list
@@ -1632,6 +1662,11 @@ struct BdrvTrackedRequest {
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
+    BlockDriverState *bs = req->bs;
+
+    bdrv_update_in_flight_time(bs);
+    bs->in_flight--;
+
     QLIST_REMOVE(req, list);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
@@ -1655,6 +1690,9 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     qemu_co_queue_init(&req->wait_queue);
 
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+
+    bdrv_update_in_flight_time(bs);
+    bs->in_flight++;
 }
 
 /**
@@ -2021,36 +2059,6 @@ int bdrv_read_unthrottled(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
-#define BITS_PER_LONG  (sizeof(unsigned long) * 8)
-
-static void set_dirty_bitmap(BlockDriverState *bs, int64_t sector_num,
-                             int nb_sectors, int dirty)
-{
-    int64_t start, end;
-    unsigned long val, idx, bit;
-
-    start = sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK;
-    end = (sector_num + nb_sectors - 1) / BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    for (; start <= end; start++) {
-        idx = start / BITS_PER_LONG;
-        bit = start % BITS_PER_LONG;
-        val = bs->dirty_bitmap[idx];
-        if (dirty) {
-            if (!(val & (1UL << bit))) {
-                bs->dirty_count++;
-                val |= 1UL << bit;
-            }
-        } else {
-            if (val & (1UL << bit)) {
-                bs->dirty_count--;
-                val &= ~(1UL << bit);
-            }
-        }
-        bs->dirty_bitmap[idx] = val;
-    }
-}
-
 /* Return < 0 if error. Important errors are:
   -EIO         generic I/O error (may happen for all errors)
   -ENOMEDIUM   No media inserted.
@@ -2389,7 +2397,11 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 
     tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
 
-    if (flags & BDRV_REQ_ZERO_WRITE) {
+    ret = notifier_with_return_list_notify(&bs->before_write_notifiers, &req);
+
+    if (ret < 0) {
+        /* Do nothing, write notifier decided to fail this request */
+    } else if (flags & BDRV_REQ_ZERO_WRITE) {
         ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors);
     } else {
         ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
@@ -2399,9 +2411,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         ret = bdrv_co_flush(bs);
     }
 
-    if (bs->dirty_bitmap) {
-        bdrv_set_dirty(bs, sector_num, nb_sectors);
-    }
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
@@ -2500,12 +2510,11 @@ void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr)
     *nb_sectors_ptr = length;
 }
 
-/* throttling disk io limits */
-void bdrv_set_io_limits(BlockDriverState *bs,
-                        BlockIOLimit *io_limits)
+void bdrv_set_l2_cache_size(BlockDriverState *bs, uint64_t cache_size,
+                            uint64_t entry_size)
 {
-    bs->io_limits = *io_limits;
-    bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
+    bs->l2_cache_size = cache_size;
+    bs->l2_cache_entry_size = entry_size;
 }
 
 void bdrv_set_on_error(BlockDriverState *bs, BlockdevOnError on_read_error,
@@ -2698,6 +2707,7 @@ int bdrv_has_zero_init(BlockDriverState *bs)
 
 typedef struct BdrvCoIsAllocatedData {
     BlockDriverState *bs;
+    BlockDriverState *base;
     int64_t sector_num;
     int nb_sectors;
     int *pnum;
@@ -2828,6 +2838,43 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
     return 0;
 }
 
+/* Coroutine wrapper for bdrv_is_allocated_above() */
+static void coroutine_fn bdrv_is_allocated_above_co_entry(void *opaque)
+{
+    BdrvCoIsAllocatedData *data = opaque;
+
+    data->ret = bdrv_co_is_allocated_above(data->bs, data->base,
+                                           data->sector_num,
+                                           data->nb_sectors, data->pnum);
+    data->done = true;
+}
+
+/*
+ * Synchronous wrapper around bdrv_co_is_allocated_above().
+ *
+ * See bdrv_co_is_allocated_above() for details.
+ */
+int bdrv_is_allocated_above(BlockDriverState *top, BlockDriverState *base,
+                            int64_t sector_num, int nb_sectors, int *pnum)
+{
+    Coroutine *co;
+    BdrvCoIsAllocatedData data = {
+        .bs = top,
+        .base = base,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .pnum = pnum,
+        .done = false,
+    };
+
+    co = qemu_coroutine_create(bdrv_is_allocated_above_co_entry);
+    qemu_coroutine_enter(co, &data);
+    while (!data.done) {
+        qemu_aio_wait();
+    }
+    return data.ret;
+}
+
 BlockInfo *bdrv_query_info(BlockDriverState *bs)
 {
     BlockInfo *info = g_malloc0(sizeof(*info));
@@ -2846,11 +2893,9 @@ BlockInfo *bdrv_query_info(BlockDriverState *bs)
         info->io_status = bs->iostatus;
     }
 
-    if (bs->dirty_bitmap) {
-        info->has_dirty = true;
-        info->dirty = g_malloc0(sizeof(*info->dirty));
-        info->dirty->count = bdrv_get_dirty_count(bs) *
-            BDRV_SECTORS_PER_DIRTY_CHUNK * BDRV_SECTOR_SIZE;
+    if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        info->has_dirty_bitmaps = true;
+        info->dirty_bitmaps = bdrv_query_dirty_bitmaps(bs);
     }
 
     if (bs->drv) {
@@ -2870,18 +2915,33 @@ BlockInfo *bdrv_query_info(BlockDriverState *bs)
         info->inserted->backing_file_depth = bdrv_get_backing_file_depth(bs);
 
         if (bs->io_limits_enabled) {
-            info->inserted->bps =
-                           bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
-            info->inserted->bps_rd =
-                           bs->io_limits.bps[BLOCK_IO_LIMIT_READ];
-            info->inserted->bps_wr =
-                           bs->io_limits.bps[BLOCK_IO_LIMIT_WRITE];
-            info->inserted->iops =
-                           bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
-            info->inserted->iops_rd =
-                           bs->io_limits.iops[BLOCK_IO_LIMIT_READ];
-            info->inserted->iops_wr =
-                           bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE];
+            ThrottleConfig cfg;
+            LeakyBucket *b = cfg.buckets;
+
+            bdrv_get_io_limits(bs, &cfg);
+            info->inserted->bps     = b[THROTTLE_BPS_TOTAL].avg;
+            info->inserted->bps_rd  = b[THROTTLE_BPS_READ].avg;
+            info->inserted->bps_wr  = b[THROTTLE_BPS_WRITE].avg;
+            info->inserted->iops    = b[THROTTLE_OPS_TOTAL].avg;
+            info->inserted->iops_rd = b[THROTTLE_OPS_READ].avg;
+            info->inserted->iops_wr = b[THROTTLE_OPS_WRITE].avg;
+
+            info->inserted->has_bps_max     = !!b[THROTTLE_BPS_TOTAL].max;
+            info->inserted->bps_max         = b[THROTTLE_BPS_TOTAL].max;
+            info->inserted->has_bps_rd_max  = !!b[THROTTLE_BPS_READ].max;
+            info->inserted->bps_rd_max      = b[THROTTLE_BPS_READ].max;
+            info->inserted->has_bps_wr_max  = !!b[THROTTLE_BPS_WRITE].max;
+            info->inserted->bps_wr_max      = b[THROTTLE_BPS_WRITE].max;
+            info->inserted->has_iops_max    = !!b[THROTTLE_OPS_TOTAL].max;
+            info->inserted->iops_max        = b[THROTTLE_OPS_TOTAL].max;
+            info->inserted->has_iops_rd_max = !!b[THROTTLE_OPS_READ].max;
+            info->inserted->iops_rd_max     = b[THROTTLE_OPS_READ].max;
+            info->inserted->has_iops_wr_max = !!b[THROTTLE_OPS_WRITE].max;
+            info->inserted->iops_wr_max     = b[THROTTLE_OPS_WRITE].max;
+            info->inserted->has_iops_size   = !!cfg.op_size;
+            info->inserted->iops_size       = cfg.op_size;
+            info->inserted->has_group       = true;
+            info->inserted->group = g_strdup(bdrv_io_limits_group(bs));
         }
     }
     return info;
@@ -2903,9 +2963,34 @@ BlockInfoList *qmp_query_block(Error **errp)
     return head;
 }
 
-BlockStats *bdrv_query_stats(const BlockDriverState *bs)
+static BlockLatencyBinList *
+bdrv_latency_histogram_info(BlockLatencyHistogram *hist)
+{
+    BlockLatencyBinList *head = NULL, **p_next = &head;
+    int i;
+
+    for (i = 0; i < hist->nbins; i++) {
+        BlockLatencyBinList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        if (i < hist->nbins - 1) {
+            entry->value->has_limit_ns = true;
+            entry->value->limit_ns = hist->boundaries[i];
+        }
+        entry->value->count = hist->bins[i];
+
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    return head;
+}
+
+BlockStats *bdrv_query_stats(BlockDriverState *bs)
 {
+    BlockDriverInfo bdi;
     BlockStats *s;
+    int64_t now;
 
     s = g_malloc0(sizeof(*s));
 
@@ -2925,6 +3010,38 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
 
+    now = get_clock();
+    s->stats->in_flight = bs->in_flight;
+    s->stats->busy_time_ns = bs->busy_time_ns;
+    s->stats->queue_depth_time_ns = bs->queue_depth_time_ns;
+    if (bs->in_flight) {
+        s->stats->busy_time_ns += now - bs->in_flight_changed_ns;
+        s->stats->queue_depth_time_ns +=
+            (now - bs->in_flight_changed_ns) * bs->in_flight;
+    } else if (bs->in_flight_changed_ns) {
+        /* the last request completed when the number last changed */
+        s->stats->has_idle_time_ns = true;
+        s->stats->idle_time_ns = now - bs->in_flight_changed_ns;
+    }
+
+    s->stats->rd_latency_histogram =
+        bdrv_latency_histogram_info(&bs->latency_histogram[BDRV_ACCT_READ]);
+    s->stats->has_rd_latency_histogram = !!s->stats->rd_latency_histogram;
+    s->stats->wr_latency_histogram =
+        bdrv_latency_histogram_info(&bs->latency_histogram[BDRV_ACCT_WRITE]);
+    s->stats->has_wr_latency_histogram = !!s->stats->wr_latency_histogram;
+    s->stats->flush_latency_histogram =
+        bdrv_latency_histogram_info(&bs->latency_histogram[BDRV_ACCT_FLUSH]);
+    s->stats->has_flush_latency_histogram =
+        !!s->stats->flush_latency_histogram;
+
+    if (bdrv_get_info(bs, &bdi) == 0 && bdi.has_l2_cache_stats) {
+        s->stats->has_l2_cache_hits = true;
+        s->stats->l2_cache_hits = bdi.l2_cache_hits;
+        s->stats->has_l2_cache_misses = true;
+        s->stats->l2_cache_misses = bdi.l2_cache_misses;
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file);
@@ -2965,10 +3082,48 @@ void bdrv_get_backing_filename(BlockDriverState *bs,
     pstrcpy(filename, filename_size, bs->backing_file);
 }
 
+typedef struct WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+} WriteCompressedCo;
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    WriteCompressedCo *wco = opaque;
+
+    wco->ret = bdrv_co_write_compressed(wco->bs, wco->sector_num, wco->buf,
+                                        wco->nb_sectors);
+}
+
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    Coroutine *co;
+    WriteCompressedCo wco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .buf = buf,
+        .nb_sectors = nb_sectors,
+        .ret = NOT_DONE,
+    };
+
+    if (drv && drv->bdrv_co_write_compressed) {
+        if (qemu_in_coroutine()) {
+            bdrv_write_compressed_co_entry(&wco);
+        } else {
+            co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+            qemu_coroutine_enter(co, &wco);
+            while (wco.ret == NOT_DONE) {
+                qemu_aio_wait();
+            }
+        }
+        return wco.ret;
+    }
+
     if (!drv)
         return -ENOMEDIUM;
     if (!drv->bdrv_write_compressed)
@@ -2976,11 +3131,40 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
-    assert(!bs->dirty_bitmap);
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
 
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
+/*
+ * Writes one cluster of compressed data, or aligns the end of the image
+ * when nb_sectors is 0.  Drivers that implement this in a coroutine allow
+ * several clusters to be compressed at the same time.
+ */
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          const uint8_t *buf, int nb_sectors)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_co_write_compressed && !drv->bdrv_write_compressed) {
+        return -ENOTSUP;
+    }
+    if (bdrv_check_request(bs, sector_num, nb_sectors)) {
+        return -EIO;
+    }
+
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
+
+    if (!drv->bdrv_co_write_compressed) {
+        return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    }
+    return drv->bdrv_co_write_compressed(bs, sector_num, buf, nb_sectors);
+}
+
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BlockDriver *drv = bs->drv;
@@ -3030,6 +3214,33 @@ void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event)
 
 }
 
+/*
+ * Batch the requests issued until the matching bdrv_io_unplug(), so that
+ * drivers that support it can submit them with a single system call.
+ * Plugging nests.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 /**************************************************************/
 /* handling of snapshots */
 
@@ -3524,171 +3735,6 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->aiocb_info->cancel(acb);
 }
 
-/* block I/O throttling */
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-                 bool is_write, double elapsed_time, uint64_t *wait)
-{
-    uint64_t bps_limit = 0;
-    double   bytes_limit, bytes_base, bytes_res;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bps_limit = bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.bps[is_write]) {
-        bps_limit = bs->io_limits.bps[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    bytes_limit = bps_limit * slice_time;
-    bytes_base  = bs->nr_bytes[is_write] - bs->io_base.bytes[is_write];
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bytes_base += bs->nr_bytes[!is_write] - bs->io_base.bytes[!is_write];
-    }
-
-    /* bytes_base: the bytes of data which have been read/written; and
-     *             it is obtained from the history statistic info.
-     * bytes_res: the remaining bytes of data which need to be read/written.
-     * (bytes_base + bytes_res) / bps_limit: used to calcuate
-     *             the total time for completing reading/writting all data.
-     */
-    bytes_res   = (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
-
-    if (bytes_base + bytes_res <= bytes_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (bytes_base + bytes_res) / bps_limit - elapsed_time;
-
-    /* When the I/O rate at runtime exceeds the limits,
-     * bs->slice_end need to be extended in order that the current statistic
-     * info can be kept until the timer fire, so it is increased and tuned
-     * based on the result of experiment.
-     */
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
-}
-
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-                             double elapsed_time, uint64_t *wait)
-{
-    uint64_t iops_limit = 0;
-    double   ios_limit, ios_base;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        iops_limit = bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.iops[is_write]) {
-        iops_limit = bs->io_limits.iops[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    ios_limit  = iops_limit * slice_time;
-    ios_base   = bs->nr_ops[is_write] - bs->io_base.ios[is_write];
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        ios_base += bs->nr_ops[!is_write] - bs->io_base.ios[!is_write];
-    }
-
-    if (ios_base + 1 <= ios_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (ios_base + 1) / iops_limit;
-    if (wait_time > elapsed_time) {
-        wait_time = wait_time - elapsed_time;
-    } else {
-        wait_time = 0;
-    }
-
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
-}
-
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-                           bool is_write, int64_t *wait)
-{
-    int64_t  now, max_wait;
-    uint64_t bps_wait = 0, iops_wait = 0;
-    double   elapsed_time;
-    int      bps_ret, iops_ret;
-
-    now = qemu_get_clock_ns(vm_clock);
-    if ((bs->slice_start < now)
-        && (bs->slice_end > now)) {
-        bs->slice_end = now + bs->slice_time;
-    } else {
-        bs->slice_time  =  5 * BLOCK_IO_SLICE_TIME;
-        bs->slice_start = now;
-        bs->slice_end   = now + bs->slice_time;
-
-        bs->io_base.bytes[is_write]  = bs->nr_bytes[is_write];
-        bs->io_base.bytes[!is_write] = bs->nr_bytes[!is_write];
-
-        bs->io_base.ios[is_write]    = bs->nr_ops[is_write];
-        bs->io_base.ios[!is_write]   = bs->nr_ops[!is_write];
-    }
-
-    elapsed_time  = now - bs->slice_start;
-    elapsed_time  /= (NANOSECONDS_PER_SECOND);
-
-    bps_ret  = bdrv_exceed_bps_limits(bs, nb_sectors,
-                                      is_write, elapsed_time, &bps_wait);
-    iops_ret = bdrv_exceed_iops_limits(bs, is_write,
-                                      elapsed_time, &iops_wait);
-    if (bps_ret || iops_ret) {
-        max_wait = bps_wait > iops_wait ? bps_wait : iops_wait;
-        if (wait) {
-            *wait = max_wait;
-        }
-
-        now = qemu_get_clock_ns(vm_clock);
-        if (bs->slice_end < now + max_wait) {
-            bs->slice_end = now + max_wait;
-        }
-
-        return true;
-    }
-
-    if (wait) {
-        *wait = 0;
-    }
-
-    return false;
-}
-
 /**************************************************************/
 /* async block device emulation */
 
@@ -4063,6 +4109,22 @@ void bdrv_invalidate_cache_all(void)
     }
 }
 
+void bdrv_inactivate(BlockDriverState *bs)
+{
+    if (bs->drv && bs->drv->bdrv_inactivate) {
+        bs->drv->bdrv_inactivate(bs);
+    }
+}
+
+void bdrv_inactivate_all(void)
+{
+    BlockDriverState *bs;
+
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        bdrv_inactivate(bs);
+    }
+}
+
 void bdrv_clear_incoming_migration_all(void)
 {
     BlockDriverState *bs;
@@ -4110,7 +4172,12 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
         return -EIO;
     } else if (bs->read_only) {
         return -EROFS;
-    } else if (bs->drv->bdrv_co_discard) {
+    }
+
+    /* Discarded sectors may read differently afterwards */
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
+
+    if (bs->drv->bdrv_co_discard) {
         return bs->drv->bdrv_co_discard(bs, sector_num, nb_sectors);
     } else if (bs->drv->bdrv_aio_discard) {
         BlockDriverAIOCB *acb;
@@ -4249,90 +4316,394 @@ void *qemu_blockalign(BlockDriverState *bs, size_t size)
     return qemu_memalign((bs && bs->buffer_alignment) ? bs->buffer_alignment : 512, size);
 }
 
-void bdrv_set_dirty_tracking(BlockDriverState *bs, int enable)
+struct BdrvDirtyBitmap {
+    unsigned long *bitmap;
+    int64_t size;           /* number of chunks */
+    int64_t count;          /* number of dirty chunks */
+    int granularity;        /* sectors per chunk */
+    char *name;             /* NULL for anonymous bitmaps */
+    bool persistent;        /* saved in the image file on close */
+    bool frozen;            /* contents handed over to a block job */
+    QLIST_ENTRY(BdrvDirtyBitmap) list;
+};
+
+static BdrvDirtyBitmap *dirty_bitmap_new(int64_t total_sectors,
+                                         int granularity)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    assert(granularity >= BDRV_SECTOR_SIZE &&
+           (granularity & (granularity - 1)) == 0);
+
+    bitmap = g_new0(BdrvDirtyBitmap, 1);
+    bitmap->granularity = granularity >> BDRV_SECTOR_BITS;
+    bitmap->size = DIV_ROUND_UP(total_sectors, bitmap->granularity);
+    bitmap->bitmap = g_new0(unsigned long, BITS_TO_LONGS(bitmap->size));
+    return bitmap;
+}
+
+/* The padding bits after the last chunk must be clear */
+static int64_t dirty_bitmap_count(BdrvDirtyBitmap *bitmap)
 {
-    int64_t bitmap_size;
+    int64_t i, count = 0;
 
-    bs->dirty_count = 0;
-    if (enable) {
-        if (!bs->dirty_bitmap) {
-            bitmap_size = (bdrv_getlength(bs) >> BDRV_SECTOR_BITS) +
-                    BDRV_SECTORS_PER_DIRTY_CHUNK * BITS_PER_LONG - 1;
-            bitmap_size /= BDRV_SECTORS_PER_DIRTY_CHUNK * BITS_PER_LONG;
+    for (i = 0; i < BITS_TO_LONGS(bitmap->size); i++) {
+        count += ctpop64(bitmap->bitmap[i]);
+    }
+    return count;
+}
+
+static void dirty_bitmap_free(BdrvDirtyBitmap *bitmap)
+{
+    g_free(bitmap->bitmap);
+    g_free(bitmap->name);
+    g_free(bitmap);
+}
 
-            bs->dirty_bitmap = g_new0(unsigned long, bitmap_size);
+/*
+ * Creates a dirty bitmap with one bit per @granularity bytes, which must be
+ * a power of two and a multiple of the sector size.  From now on, all writes
+ * to @bs mark the bitmap dirty.  Named bitmaps can be looked up with
+ * bdrv_find_dirty_bitmap(); @name may be NULL for a bitmap that is private
+ * to its creator.
+ */
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          int granularity, const char *name,
+                                          Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    int64_t total_sectors;
+
+    if (name) {
+        if (!*name || strlen(name) > BDRV_DIRTY_BITMAP_MAX_NAME_SIZE) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "name",
+                      "a non-empty string of at most 1023 characters");
+            return NULL;
         }
-    } else {
-        if (bs->dirty_bitmap) {
-            g_free(bs->dirty_bitmap);
-            bs->dirty_bitmap = NULL;
+        if (bdrv_find_dirty_bitmap(bs, name)) {
+            error_setg(errp, "Bitmap already exists: %s", name);
+            return NULL;
+        }
+    }
+
+    total_sectors = bdrv_getlength(bs);
+    if (total_sectors < 0) {
+        error_set(errp, QERR_IO_ERROR);
+        return NULL;
+    }
+    total_sectors >>= BDRV_SECTOR_BITS;
+
+    bitmap = dirty_bitmap_new(total_sectors, granularity);
+    bitmap->name = g_strdup(name);
+    QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+    return bitmap;
+}
+
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    BdrvDirtyBitmap *bm;
+
+    QLIST_FOREACH(bm, &bs->dirty_bitmaps, list) {
+        if (bm == bitmap) {
+            QLIST_REMOVE(bitmap, list);
+            dirty_bitmap_free(bitmap);
+            return;
+        }
+    }
+    abort();
+}
+
+static void bdrv_release_all_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap, *next;
+
+    QLIST_FOREACH_SAFE(bitmap, &bs->dirty_bitmaps, list, next) {
+        assert(!bitmap->frozen);
+        QLIST_REMOVE(bitmap, list);
+        dirty_bitmap_free(bitmap);
+    }
+}
+
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (bitmap->name && !strcmp(bitmap->name, name)) {
+            return bitmap;
         }
     }
+    return NULL;
+}
+
+/* Iterates over the bitmaps of @bs; pass NULL to get the first one */
+BdrvDirtyBitmap *bdrv_next_dirty_bitmap(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    return bitmap ? QLIST_NEXT(bitmap, list) : QLIST_FIRST(&bs->dirty_bitmaps);
+}
+
+const char *bdrv_dirty_bitmap_name(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+/* Returns the granularity of @bitmap in bytes */
+int bdrv_dirty_bitmap_granularity(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->granularity << BDRV_SECTOR_BITS;
+}
+
+bool bdrv_dirty_bitmap_is_persistent(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+bool bdrv_dirty_bitmap_is_frozen(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->frozen;
+}
+
+/*
+ * Asks the format driver to save @bitmap in the image file when @bs is
+ * closed, and to load it back when the image is opened again.
+ */
+void bdrv_dirty_bitmap_set_persistent(BlockDriverState *bs,
+                                      BdrvDirtyBitmap *bitmap,
+                                      bool persistent, Error **errp)
+{
+    if (persistent && !bitmap->name) {
+        error_set(errp, QERR_INVALID_PARAMETER, "persistent");
+        return;
+    }
+    if (persistent && (!bs->drv || !bs->drv->bdrv_can_store_dirty_bitmaps ||
+                       !bs->drv->bdrv_can_store_dirty_bitmaps(bs))) {
+        error_set(errp, QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
+                  bs->drv ? bs->drv->format_name : "",
+                  bs->device_name, "persistent dirty bitmaps");
+        return;
+    }
+    bitmap->persistent = persistent;
 }
 
-int bdrv_get_dirty(BlockDriverState *bs, int64_t sector)
+BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
 {
-    int64_t chunk = sector / (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK;
+    BdrvDirtyBitmap *bitmap;
+    BlockDirtyInfoList *list = NULL;
+    BlockDirtyInfoList **plist = &list;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        BlockDirtyInfo *info = g_malloc0(sizeof(BlockDirtyInfo));
+        BlockDirtyInfoList *entry = g_malloc0(sizeof(BlockDirtyInfoList));
 
-    if (bs->dirty_bitmap &&
-        (sector << BDRV_SECTOR_BITS) < bdrv_getlength(bs)) {
-        return !!(bs->dirty_bitmap[chunk / BITS_PER_LONG] &
-            (1UL << (chunk % BITS_PER_LONG)));
+        info->count = bdrv_get_dirty_count(bs, bitmap) << BDRV_SECTOR_BITS;
+        info->granularity = bdrv_dirty_bitmap_granularity(bitmap);
+        info->has_name = !!bitmap->name;
+        info->name = g_strdup(bitmap->name);
+        info->persistent = bitmap->persistent;
+        info->frozen = bitmap->frozen;
+        entry->value = info;
+        *plist = entry;
+        plist = &entry->next;
+    }
+
+    return list;
+}
+
+int bdrv_get_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                   int64_t sector)
+{
+    int64_t chunk = sector / bitmap->granularity;
+
+    if (sector >= 0 && chunk < bitmap->size) {
+        return test_bit(chunk, bitmap->bitmap);
     } else {
         return 0;
     }
 }
 
-int64_t bdrv_get_next_dirty(BlockDriverState *bs, int64_t sector)
+/*
+ * Returns the first sector of the next dirty chunk after the one that
+ * contains @sector, wrapping around at the end of the device.  Pass -1 to
+ * start from the beginning.
+ */
+int64_t bdrv_get_next_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                            int64_t sector)
 {
-    int64_t chunk;
-    int bit, elem;
+    unsigned long nb_chunks = bitmap->size;
+    unsigned long chunk;
 
     /* Avoid an infinite loop.  */
-    assert(bs->dirty_count > 0);
-
-    sector = (sector | (BDRV_SECTORS_PER_DIRTY_CHUNK - 1)) + 1;
-    chunk = sector / (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    QEMU_BUILD_BUG_ON(sizeof(bs->dirty_bitmap[0]) * 8 != BITS_PER_LONG);
-    elem = chunk / BITS_PER_LONG;
-    bit = chunk % BITS_PER_LONG;
-    for (;;) {
-        if (sector >= bs->total_sectors) {
-            sector = 0;
-            bit = elem = 0;
-        }
-        if (bit == 0 && bs->dirty_bitmap[elem] == 0) {
-            sector += BDRV_SECTORS_PER_DIRTY_CHUNK * BITS_PER_LONG;
-            elem++;
-        } else {
-            if (bs->dirty_bitmap[elem] & (1UL << bit)) {
-                return sector;
+    assert(bitmap->count > 0);
+
+    chunk = sector < 0 ? 0 : sector / bitmap->granularity + 1;
+    if (chunk < nb_chunks) {
+        chunk = find_next_bit(bitmap->bitmap, nb_chunks, chunk);
+    }
+    if (chunk >= nb_chunks) {
+        chunk = find_first_bit(bitmap->bitmap, nb_chunks);
+    }
+    assert(chunk < nb_chunks);
+    return (int64_t)chunk * bitmap->granularity;
+}
+
+static void dirty_bitmap_update(BdrvDirtyBitmap *bitmap, int64_t sector_num,
+                                int nb_sectors, bool dirty)
+{
+    int64_t start, end;
+    unsigned long val, idx, bit;
+
+    if (nb_sectors <= 0) {
+        return;
+    }
+
+    start = sector_num / bitmap->granularity;
+    end = MIN((sector_num + nb_sectors - 1) / bitmap->granularity,
+              bitmap->size - 1);
+
+    for (; start <= end; start++) {
+        idx = start / BITS_PER_LONG;
+        bit = start % BITS_PER_LONG;
+        val = bitmap->bitmap[idx];
+        if (dirty) {
+            if (!(val & (1UL << bit))) {
+                bitmap->count++;
+                val |= 1UL << bit;
             }
-            sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-            if (++bit == BITS_PER_LONG) {
-                bit = 0;
-                elem++;
+        } else {
+            if (val & (1UL << bit)) {
+                bitmap->count--;
+                val &= ~(1UL << bit);
             }
         }
+        bitmap->bitmap[idx] = val;
+    }
+}
+
+/* Marks a range dirty in all the bitmaps of @bs */
+static void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
+                           int nr_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        dirty_bitmap_update(bitmap, cur_sector, nr_sectors, true);
+    }
+}
+
+void bdrv_set_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                           int64_t cur_sector, int nr_sectors)
+{
+    dirty_bitmap_update(bitmap, cur_sector, nr_sectors, true);
+}
+
+void bdrv_reset_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             int64_t cur_sector, int nr_sectors)
+{
+    dirty_bitmap_update(bitmap, cur_sector, nr_sectors, false);
+}
+
+void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap)
+{
+    memset(bitmap->bitmap, 0,
+           BITS_TO_LONGS(bitmap->size) * sizeof(unsigned long));
+    bitmap->count = 0;
+}
+
+/* Returns the number of dirty sectors, counting whole chunks */
+int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->count * bitmap->granularity;
+}
+
+/*
+ * Hands the contents of @bitmap over to the caller, typically a block job
+ * that copies the dirty data: @bitmap is cleared and keeps tracking new
+ * writes, while the returned copy is not attached to @bs and does not change
+ * anymore.  The copy must be passed to bdrv_thaw_dirty_bitmap() when the
+ * caller is done with it; until then @bitmap cannot be released.
+ */
+BdrvDirtyBitmap *bdrv_freeze_dirty_bitmap(BlockDriverState *bs,
+                                          BdrvDirtyBitmap *bitmap)
+{
+    BdrvDirtyBitmap *frozen;
+
+    assert(!bitmap->frozen);
+
+    frozen = g_new0(BdrvDirtyBitmap, 1);
+    *frozen = *bitmap;
+    frozen->name = NULL;
+    frozen->persistent = false;
+    frozen->bitmap = g_memdup(bitmap->bitmap,
+                              BITS_TO_LONGS(bitmap->size) *
+                              sizeof(unsigned long));
+
+    bdrv_clear_dirty_bitmap(bitmap);
+    bitmap->frozen = true;
+    return frozen;
+}
+
+/*
+ * Frees a copy returned by bdrv_freeze_dirty_bitmap().  If @merge is true,
+ * for example because the job failed, the chunks that were dirty in the copy
+ * are marked dirty again in @bitmap.
+ */
+void bdrv_thaw_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                            BdrvDirtyBitmap *frozen, bool merge)
+{
+    int64_t i;
+
+    assert(bitmap->frozen);
+    assert(bitmap->size == frozen->size &&
+           bitmap->granularity == frozen->granularity);
+
+    if (merge) {
+        for (i = 0; i < BITS_TO_LONGS(bitmap->size); i++) {
+            bitmap->bitmap[i] |= frozen->bitmap[i];
+        }
+        bitmap->count = dirty_bitmap_count(bitmap);
     }
+    bitmap->frozen = false;
+    dirty_bitmap_free(frozen);
 }
 
-void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
-                    int nr_sectors)
+/*
+ * Bitmaps are serialized as a little endian array of bits, one per chunk,
+ * padded to a whole byte.
+ */
+uint64_t bdrv_dirty_bitmap_serialization_size(BdrvDirtyBitmap *bitmap)
 {
-    set_dirty_bitmap(bs, cur_sector, nr_sectors, 1);
+    return DIV_ROUND_UP(bitmap->size, 8);
 }
 
-void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
-                      int nr_sectors)
+void bdrv_dirty_bitmap_serialize(BdrvDirtyBitmap *bitmap, uint8_t *buf)
 {
-    set_dirty_bitmap(bs, cur_sector, nr_sectors, 0);
+    uint64_t i, len = bdrv_dirty_bitmap_serialization_size(bitmap);
+
+    for (i = 0; i < len; i++) {
+        unsigned long word = bitmap->bitmap[i / sizeof(unsigned long)];
+        buf[i] = word >> (8 * (i % sizeof(unsigned long)));
+    }
 }
 
-int64_t bdrv_get_dirty_count(BlockDriverState *bs)
+void bdrv_dirty_bitmap_deserialize(BdrvDirtyBitmap *bitmap,
+                                   const uint8_t *buf)
 {
-    return bs->dirty_count;
+    uint64_t i, len = bdrv_dirty_bitmap_serialization_size(bitmap);
+
+    bdrv_clear_dirty_bitmap(bitmap);
+    for (i = 0; i < len; i++) {
+        bitmap->bitmap[i / sizeof(unsigned long)] |=
+            (unsigned long)buf[i] << (8 * (i % sizeof(unsigned long)));
+    }
+
+    /* Ignore the padding bits */
+    if (bitmap->size % BITS_PER_LONG) {
+        bitmap->bitmap[bitmap->size / BITS_PER_LONG] &=
+            BITMAP_LAST_WORD_MASK(bitmap->size);
+    }
+    bitmap->count = dirty_bitmap_count(bitmap);
 }
 
 void bdrv_set_in_use(BlockDriverState *bs, int in_use)
@@ -4400,11 +4771,42 @@ bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
+    int64_t latency_ns = get_clock() - cookie->start_time_ns;
+
     assert(cookie->type < BDRV_MAX_IOTYPE);
 
     bs->nr_bytes[cookie->type] += cookie->bytes;
     bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    bs->total_time_ns[cookie->type] += latency_ns;
+    block_latency_histogram_account(&bs->latency_histogram[cookie->type],
+                                    latency_ns);
+
+    trace_bdrv_acct_done(bs, cookie->type, cookie->bytes, latency_ns);
+}
+
+/*
+ * Sets up the latency histograms of @bs with log-scale bins; see
+ * block_latency_histogram_set().  The counts start over from zero.
+ */
+int bdrv_set_latency_histogram(BlockDriverState *bs, int64_t start,
+                               int64_t factor, int count)
+{
+    BlockLatencyHistogram hist = { 0 };
+    int i, ret;
+
+    /* Check the parameters before changing anything */
+    ret = block_latency_histogram_set(&hist, start, factor, count);
+    block_latency_histogram_clear(&hist);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        ret = block_latency_histogram_set(&bs->latency_histogram[i],
+                                          start, factor, count);
+        assert(ret == 0);
+    }
+    return 0;
 }
 
 int bdrv_img_create(const char *filename, const char *fmt,
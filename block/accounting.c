@@ -0,0 +1,86 @@
+/*
+ * Block I/O latency histograms
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "block/accounting.h"
+
+/*
+ * Replaces the bins of @hist by @count + 1 empty ones, whose boundaries
+ * start at @start ns and grow by @factor each.  A @count of 0 disables the
+ * histogram.
+ */
+int block_latency_histogram_set(BlockLatencyHistogram *hist, int64_t start,
+                                int64_t factor, int count)
+{
+    int64_t *boundaries;
+    int i;
+
+    if (count < 0 || count > BLOCK_LATENCY_HISTOGRAM_MAX_COUNT) {
+        return -EINVAL;
+    }
+
+    if (count == 0) {
+        block_latency_histogram_clear(hist);
+        return 0;
+    }
+
+    if (start <= 0 || factor < 2) {
+        return -EINVAL;
+    }
+
+    boundaries = g_new(int64_t, count);
+    boundaries[0] = start;
+    for (i = 1; i < count; i++) {
+        if (boundaries[i - 1] > INT64_MAX / factor) {
+            g_free(boundaries);
+            return -ERANGE;
+        }
+        boundaries[i] = boundaries[i - 1] * factor;
+    }
+
+    block_latency_histogram_clear(hist);
+    hist->nbins = count + 1;
+    hist->boundaries = boundaries;
+    hist->bins = g_new0(uint64_t, hist->nbins);
+    return 0;
+}
+
+void block_latency_histogram_clear(BlockLatencyHistogram *hist)
+{
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    hist->nbins = 0;
+    hist->boundaries = NULL;
+    hist->bins = NULL;
+}
+
+void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                     int64_t latency_ns)
+{
+    int low = 0, high;
+
+    if (!hist->nbins) {
+        return;
+    }
+
+    /* Find the first boundary above latency_ns; the last bin has none */
+    high = hist->nbins - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+
+        if (latency_ns < hist->boundaries[mid]) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    hist->bins[low]++;
+}
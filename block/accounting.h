@@ -0,0 +1,39 @@
+/*
+ * Block I/O latency histograms
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef BLOCK_ACCOUNTING_H
+#define BLOCK_ACCOUNTING_H 1
+
+#include <stdint.h>
+
+/*
+ * Bin i counts the requests that took at least boundaries[i - 1] and less
+ * than boundaries[i] nanoseconds; the first and last bins are open-ended.
+ */
+typedef struct BlockLatencyHistogram {
+    int nbins;              /* 0 if the histogram is disabled */
+    int64_t *boundaries;    /* nbins - 1 ascending latencies in ns */
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
+/* 10 us, 20 us, 40 us, ... 5.24 s */
+#define BLOCK_LATENCY_HISTOGRAM_START   10000
+#define BLOCK_LATENCY_HISTOGRAM_FACTOR  2
+#define BLOCK_LATENCY_HISTOGRAM_COUNT   20
+
+#define BLOCK_LATENCY_HISTOGRAM_MAX_COUNT 64
+
+int block_latency_histogram_set(BlockLatencyHistogram *hist, int64_t start,
+                                int64_t factor, int count);
+void block_latency_histogram_clear(BlockLatencyHistogram *hist);
+void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                     int64_t latency_ns);
+
+#endif
@@ -12,34 +12,61 @@
 #include "qemu-queue.h"
 #include "block/raw-aio.h"
 #include "event_notifier.h"
+#include "main-loop.h"
 
 #include <libaio.h>
 
 /*
  * Queue size (per-device).
  *
- * XXX: eventually we need to communicate this to the guest and/or make it
- *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ * The io_context starts with room for LAIO_MIN_EVENTS requests.  When more
+ * requests are outstanding, they wait in a software queue and the context is
+ * replaced by one twice as large, up to LAIO_MAX_EVENTS.  The old context is
+ * destroyed once the requests it holds have completed.
  */
-#define MAX_EVENTS 128
+#define LAIO_MIN_EVENTS 128
+#define LAIO_MAX_EVENTS 4096
+
+/* Events reaped per io_getevents() call */
+#define LAIO_REAP_BATCH 256
 
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
+    io_context_t io_ctx;
     struct iocb iocb;
     ssize_t ret;
     size_t nbytes;
     QEMUIOVector *qiov;
     bool is_read;
-    QLIST_ENTRY(qemu_laiocb) node;
+    bool queued;
+    bool failed;
+    QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
 struct qemu_laio_state {
     io_context_t ctx;
+    int ctx_size;       /* capacity of ctx */
+    int ctx_count;      /* requests submitted to ctx */
+
+    /* context being retired after a resize, until it drains */
+    io_context_t old_ctx;
+    int old_count;
+
     EventNotifier e;
-    int count;
+    int count;          /* requests not completed yet, queued or submitted */
+
+    /* requests not submitted yet, either because the queue is plugged or
+     * because the ring was full */
+    QSIMPLEQ_HEAD(, qemu_laiocb) pending;
+    int num_pending;
+    int plugged;
+    struct iocb **iocbs;
+
+    /* requests that failed to submit, completed from a bottom half so that
+     * callbacks never run before laio_submit() returns */
+    QSIMPLEQ_HEAD(, qemu_laiocb) failed;
+    QEMUBH *failed_bh;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -77,17 +104,114 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
-static void qemu_laio_completion_cb(EventNotifier *e)
+/*
+ * Replace the io_context with a larger one.  Only one resize can be in
+ * progress at a time.
+ */
+static void laio_grow(struct qemu_laio_state *s)
 {
-    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+    io_context_t ctx = 0;
+    int size = s->ctx_size * 2;
 
-    while (event_notifier_test_and_clear(&s->e)) {
-        struct io_event events[MAX_EVENTS];
-        struct timespec ts = { 0 };
-        int nevents, i;
+    if (s->old_ctx || size > LAIO_MAX_EVENTS) {
+        return;
+    }
+    if (io_setup(size, &ctx) != 0) {
+        return;
+    }
+
+    s->old_ctx = s->ctx;
+    s->old_count = s->ctx_count;
+    s->ctx = ctx;
+    s->ctx_size = size;
+    s->ctx_count = 0;
+    s->iocbs = g_renew(struct iocb *, s->iocbs, size);
+}
+
+static void laio_failed_bh(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+    struct qemu_laiocb *laiocb;
+
+    while ((laiocb = QSIMPLEQ_FIRST(&s->failed))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->failed, next);
+        qemu_laio_process_completion(s, laiocb);
+    }
+}
+
+static void laio_fail_pending(struct qemu_laio_state *s, int ret)
+{
+    struct qemu_laiocb *laiocb = QSIMPLEQ_FIRST(&s->pending);
+
+    QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+    s->num_pending--;
+    laiocb->queued = false;
+    laiocb->ret = ret;
+    laiocb->failed = true;
+    QSIMPLEQ_INSERT_TAIL(&s->failed, laiocb, next);
+    qemu_bh_schedule(s->failed_bh);
+}
+
+/*
+ * Submit queued requests, as many per io_submit() call as fit in the ring.
+ */
+static void laio_submit_pending(struct qemu_laio_state *s)
+{
+    while (s->num_pending) {
+        struct qemu_laiocb *laiocb;
+        int room, n, ret, i;
+
+        room = s->ctx_size - s->ctx_count;
+        if (room < s->num_pending) {
+            laio_grow(s);
+            room = s->ctx_size - s->ctx_count;
+        }
+        if (room == 0) {
+            /* resubmitted when requests complete */
+            return;
+        }
+
+        n = MIN(room, s->num_pending);
+        laiocb = QSIMPLEQ_FIRST(&s->pending);
+        for (i = 0; i < n; i++) {
+            s->iocbs[i] = &laiocb->iocb;
+            laiocb = QSIMPLEQ_NEXT(laiocb, next);
+        }
 
         do {
-            nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
+            ret = io_submit(s->ctx, n, s->iocbs);
+        } while (ret == -EINTR);
+
+        if (ret == -EAGAIN && s->ctx_count + s->old_count > 0) {
+            /* out of kernel resources, retry as requests complete */
+            return;
+        }
+        if (ret < 0) {
+            /* io_submit() only fails if the first request is bad */
+            laio_fail_pending(s, ret);
+            continue;
+        }
+
+        for (i = 0; i < ret; i++) {
+            laiocb = QSIMPLEQ_FIRST(&s->pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+            laiocb->queued = false;
+            laiocb->io_ctx = s->ctx;
+        }
+        s->num_pending -= ret;
+        s->ctx_count += ret;
+    }
+}
+
+static void qemu_laio_reap(struct qemu_laio_state *s, io_context_t ctx)
+{
+    struct io_event events[LAIO_REAP_BATCH];
+    struct timespec ts = { 0 };
+    int nevents, i;
+
+    do {
+        do {
+            nevents = io_getevents(ctx, 0, LAIO_REAP_BATCH, events, &ts);
         } while (nevents == -EINTR);
 
         for (i = 0; i < nevents; i++) {
@@ -95,9 +219,35 @@ static void qemu_laio_completion_cb(EventNotifier *e)
             struct qemu_laiocb *laiocb =
                     container_of(iocb, struct qemu_laiocb, iocb);
 
+            /* a callback may have resized the ring in the meantime */
+            if (laiocb->io_ctx == s->old_ctx) {
+                s->old_count--;
+            } else {
+                s->ctx_count--;
+            }
             laiocb->ret = io_event_ret(&events[i]);
             qemu_laio_process_completion(s, laiocb);
         }
+    } while (nevents == LAIO_REAP_BATCH);
+}
+
+static void qemu_laio_completion_cb(EventNotifier *e)
+{
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+
+    while (event_notifier_test_and_clear(&s->e)) {
+        if (s->old_ctx) {
+            qemu_laio_reap(s, s->old_ctx);
+            if (s->old_count == 0) {
+                io_destroy(s->old_ctx);
+                s->old_ctx = 0;
+            }
+        }
+        qemu_laio_reap(s, s->ctx);
+
+        if (!s->plugged) {
+            laio_submit_pending(s);
+        }
     }
 }
 
@@ -111,9 +261,25 @@ static int qemu_laio_flush_cb(EventNotifier *e)
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
     int ret;
 
+    /* Not submitted, just drop it */
+    if (laiocb->failed) {
+        QSIMPLEQ_REMOVE(&s->failed, laiocb, qemu_laiocb, next);
+        s->count--;
+        qemu_aio_release(laiocb);
+        return;
+    }
+    if (laiocb->queued) {
+        QSIMPLEQ_REMOVE(&s->pending, laiocb, qemu_laiocb, next);
+        s->num_pending--;
+        s->count--;
+        qemu_aio_release(laiocb);
+        return;
+    }
+
     if (laiocb->ret != -EINPROGRESS)
         return;
 
@@ -122,7 +288,7 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
      * filesystem implements cancellation of AIO request.
      * Thus the polling loop below is the normal code path.
      */
-    ret = io_cancel(laiocb->ctx->ctx, &laiocb->iocb, &event);
+    ret = io_cancel(laiocb->io_ctx, &laiocb->iocb, &event);
     if (ret == 0) {
         laiocb->ret = -ECANCELED;
         return;
@@ -160,6 +326,8 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     laiocb->ret = -EINPROGRESS;
     laiocb->is_read = (type == QEMU_AIO_READ);
     laiocb->qiov = qiov;
+    laiocb->queued = false;
+    laiocb->failed = false;
 
     iocbs = &laiocb->iocb;
 
@@ -177,14 +345,29 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         goto out_free_aiocb;
     }
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
+
+    /* Fast path: nothing to batch with and room in the ring */
+    if (!s->plugged && !s->num_pending && s->ctx_count < s->ctx_size) {
+        if (io_submit(s->ctx, 1, &iocbs) < 0) {
+            goto out_free_aiocb;
+        }
+        laiocb->io_ctx = s->ctx;
+        s->ctx_count++;
+        s->count++;
+        return &laiocb->common;
+    }
+
+    laiocb->queued = true;
+    QSIMPLEQ_INSERT_TAIL(&s->pending, laiocb, next);
+    s->num_pending++;
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_dec_count;
+    /* Do not hold back a batch that already fills the ring */
+    if (!s->plugged || s->num_pending >= s->ctx_size - s->ctx_count) {
+        laio_submit_pending(s);
+    }
     return &laiocb->common;
 
-out_dec_count:
-    s->count--;
 out_free_aiocb:
     qemu_aio_release(laiocb);
     return NULL;
@@ -199,9 +382,14 @@ void *laio_init(void)
         goto out_free_state;
     }
 
-    if (io_setup(MAX_EVENTS, &s->ctx) != 0) {
+    if (io_setup(LAIO_MIN_EVENTS, &s->ctx) != 0) {
         goto out_close_efd;
     }
+    s->ctx_size = LAIO_MIN_EVENTS;
+    s->iocbs = g_new(struct iocb *, s->ctx_size);
+    QSIMPLEQ_INIT(&s->pending);
+    QSIMPLEQ_INIT(&s->failed);
+    s->failed_bh = qemu_bh_new(laio_failed_bh, s);
 
     qemu_aio_set_event_notifier(&s->e, qemu_laio_completion_cb,
                                 qemu_laio_flush_cb);
@@ -214,3 +402,24 @@ out_free_state:
     g_free(s);
     return NULL;
 }
+
+/*
+ * While the queue is plugged, requests are only queued.  They are submitted
+ * together when the last user unplugs it.
+ */
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0) {
+        laio_submit_pending(s);
+    }
+}
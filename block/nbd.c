@@ -32,6 +32,8 @@
 #include "block_int.h"
 #include "module.h"
 #include "qemu_socket.h"
+#include "qemu-timer.h"
+#include "thread-pool.h"
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -48,34 +50,115 @@
 #endif
 
 #define MAX_NBD_REQUESTS	16
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define MAX_NBD_CONNECTIONS	16
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ ((uint64_t)(intptr_t)conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ ((uint64_t)(intptr_t)conn))
 
-typedef struct BDRVNBDState {
+/* How often a request is sent again when its connection is lost */
+#define NBD_MAX_RETRIES		3
+
+/* Lost connections are restored after this delay, unless all are lost.
+ * A failed attempt is not repeated before the delay in any case.  */
+#define NBD_RECONNECT_DELAY_NS	1000000000LL
+
+typedef struct BDRVNBDState BDRVNBDState;
+
+/*
+ * One socket connected to the export.  Each connection has its own
+ * requests in flight, identified by the handle, so that a slow request
+ * only holds up the requests queued behind it on the same socket.
+ */
+typedef struct NBDConnection {
+    BDRVNBDState *s;
     int sock;
-    uint32_t nbdflags;
-    off_t size;
-    size_t blocksize;
+    bool broken;
+    bool connecting;
+    bool connect_failed;
+    int64_t broken_time;
 
     CoMutex send_mutex;
-    CoMutex free_sema;
+    CoQueue free_sema;
     Coroutine *send_coroutine;
     int in_flight;
 
-    Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    Coroutine **recv_coroutine;
+    bool *receiving;
     struct nbd_reply reply;
+} NBDConnection;
+
+struct BDRVNBDState {
+    uint32_t nbdflags;
+    off_t size;
+    size_t blocksize;
+    bool negotiated;
+
+    NBDConnection conns[MAX_NBD_CONNECTIONS];
+    int num_conns;
+    int max_requests;   /* per connection */
+    int next_conn;
+    CoQueue reconnect_queue;
 
     int is_unix;
     char *host_spec;
     char *export_name; /* An NBD server may export several devices */
-} BDRVNBDState;
+    QemuOpts *socket_opts;
+};
+
+/* Only read while connecting, so that this can happen in a worker thread */
+static QemuOptsList nbd_socket_opts = {
+    .name = "nbd-socket",
+    .head = QTAILQ_HEAD_INITIALIZER(nbd_socket_opts.head),
+    .desc = {
+        {
+            .name = "path",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "host",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "port",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "ipv4",
+            .type = QEMU_OPT_BOOL,
+        },{
+            .name = "ipv6",
+            .type = QEMU_OPT_BOOL,
+        },
+        { /* end of list */ }
+    },
+};
+
+/* A connection attempt, which blocks and runs in the thread pool when a
+ * lost connection is restored */
+typedef struct NBDConnectRequest {
+    BDRVNBDState *s;
+    int sock;
+    uint32_t nbdflags;
+    off_t size;
+    size_t blocksize;
+    Error *err;
+} NBDConnectRequest;
+
+static int nbd_parse_count(const char *value, int max, int *result)
+{
+    char *end;
+    long n;
+
+    n = strtol(value, &end, 10);
+    if (!*value || *end || n < 1 || n > max) {
+        return -EINVAL;
+    }
+    *result = n;
+    return 0;
+}
 
 static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
 {
     URI *uri;
     const char *p;
     QueryParams *qp = NULL;
-    int ret = 0;
+    int i, ret = 0;
 
     uri = uri_parse(filename);
     if (!uri) {
@@ -100,19 +183,33 @@ static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
         s->export_name = g_strdup(p);
     }
 
+    /* ?socket=path (unix only), ?connections=N and ?requests=N */
     qp = query_params_parse(uri->query);
-    if (qp->n > 1 || (s->is_unix && !qp->n) || (!s->is_unix && qp->n)) {
-        ret = -EINVAL;
-        goto out;
+    for (i = 0; i < qp->n; i++) {
+        const char *name = qp->p[i].name;
+        const char *value = qp->p[i].value;
+
+        if (s->is_unix && !s->host_spec && !strcmp(name, "socket")) {
+            s->host_spec = g_strdup(value);
+        } else if (!strcmp(name, "connections")) {
+            ret = nbd_parse_count(value, MAX_NBD_CONNECTIONS, &s->num_conns);
+        } else if (!strcmp(name, "requests")) {
+            ret = nbd_parse_count(value, NBD_MAX_REQUESTS_LIMIT,
+                                  &s->max_requests);
+        } else {
+            ret = -EINVAL;
+        }
+        if (ret < 0) {
+            goto out;
+        }
     }
 
     if (s->is_unix) {
         /* nbd+unix:///export?socket=path */
-        if (uri->server || uri->port || strcmp(qp->p[0].name, "socket")) {
+        if (uri->server || uri->port || !s->host_spec) {
             ret = -EINVAL;
             goto out;
         }
-        s->host_spec = g_strdup(qp->p[0].value);
     } else {
         /* nbd[+tcp]://host:port/export */
         if (!uri->server) {
@@ -126,6 +223,12 @@ static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
     }
 
 out:
+    if (ret < 0) {
+        g_free(s->export_name);
+        g_free(s->host_spec);
+        s->export_name = NULL;
+        s->host_spec = NULL;
+    }
     if (qp) {
         query_params_free(qp);
     }
@@ -133,6 +236,38 @@ out:
     return ret;
 }
 
+static int nbd_config_socket(BDRVNBDState *s)
+{
+    SocketAddress *addr;
+    Error *local_err = NULL;
+
+    s->socket_opts = qemu_opts_create(&nbd_socket_opts, NULL, 0, NULL);
+    if (s->is_unix) {
+        qemu_opt_set(s->socket_opts, "path", s->host_spec);
+        return 0;
+    }
+
+    addr = socket_parse(s->host_spec, &local_err);
+    if (!addr || addr->kind != SOCKET_ADDRESS_KIND_INET) {
+        if (local_err) {
+            qerror_report_err(local_err);
+            error_free(local_err);
+        }
+        qapi_free_SocketAddress(addr);
+        return -EINVAL;
+    }
+    qemu_opt_set(s->socket_opts, "host", addr->inet->host);
+    qemu_opt_set(s->socket_opts, "port", addr->inet->port);
+    if (addr->inet->has_ipv4 && addr->inet->ipv4) {
+        qemu_opt_set(s->socket_opts, "ipv4", "on");
+    }
+    if (addr->inet->has_ipv6 && addr->inet->ipv6) {
+        qemu_opt_set(s->socket_opts, "ipv6", "on");
+    }
+    qapi_free_SocketAddress(addr);
+    return 0;
+}
+
 static int nbd_config(BDRVNBDState *s, const char *filename)
 {
     char *file;
@@ -182,53 +317,92 @@ out:
     return err;
 }
 
-static void nbd_coroutine_start(BDRVNBDState *s, struct nbd_request *request)
+static void nbd_coroutine_start(NBDConnection *conn,
+                                struct nbd_request *request)
 {
+    BDRVNBDState *s = conn->s;
     int i;
 
-    /* Poor man semaphore.  The free_sema is locked when no other request
-     * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    while (conn->in_flight >= s->max_requests) {
+        qemu_co_queue_wait(&conn->free_sema);
     }
-    s->in_flight++;
+    conn->in_flight++;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+    for (i = 0; i < s->max_requests; i++) {
+        if (conn->recv_coroutine[i] == NULL) {
+            conn->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
-    assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
+    assert(i < s->max_requests);
+    request->handle = INDEX_TO_HANDLE(conn, i);
 }
 
 static int nbd_have_request(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
+
+    return conn->in_flight > 0;
+}
 
-    return s->in_flight > 0;
+/*
+ * Closes a connection that failed, and fails the requests that are waiting
+ * for it.  They are sent again on another connection, or on this one once
+ * it is back.
+ */
+static void nbd_conn_fail(NBDConnection *conn)
+{
+    BDRVNBDState *s = conn->s;
+    Coroutine *self = qemu_in_coroutine() ? qemu_coroutine_self() : NULL;
+    Coroutine **waiting;
+    int i, n = 0;
+
+    if (conn->broken) {
+        return;
+    }
+
+    logout("Lost connection to NBD server\n");
+    conn->broken = true;
+    conn->broken_time = qemu_get_clock_ns(rt_clock);
+    qemu_aio_set_fd_handler(conn->sock, NULL, NULL, NULL, NULL);
+    closesocket(conn->sock);
+    conn->sock = -1;
+    conn->reply.handle = 0;
+
+    /* Entering a coroutine can start new requests, so collect them first */
+    waiting = g_new(Coroutine *, s->max_requests + 1);
+    if (conn->send_coroutine && conn->send_coroutine != self) {
+        waiting[n++] = conn->send_coroutine;
+    }
+    for (i = 0; i < s->max_requests; i++) {
+        if (conn->receiving[i] && conn->recv_coroutine[i] != self) {
+            waiting[n++] = conn->recv_coroutine[i];
+        }
+    }
+    for (i = 0; i < n; i++) {
+        qemu_coroutine_enter(waiting[i], NULL);
+    }
+    g_free(waiting);
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
     uint64_t i;
     int ret;
 
-    if (s->reply.handle == 0) {
+    if (conn->reply.handle == 0) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
          * the socket is not readable anymore.
          */
-        ret = nbd_receive_reply(s->sock, &s->reply);
+        ret = nbd_receive_reply(conn->sock, &conn->reply);
         if (ret == -EAGAIN) {
             return;
         }
         if (ret < 0) {
-            s->reply.handle = 0;
+            conn->reply.handle = 0;
             goto fail;
         }
     }
@@ -236,165 +410,388 @@ static void nbd_reply_ready(void *opaque)
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
-    if (i >= MAX_NBD_REQUESTS) {
+    i = HANDLE_TO_INDEX(conn, conn->reply.handle);
+    if (i >= conn->s->max_requests) {
         goto fail;
     }
 
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    if (conn->receiving[i]) {
+        qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
         return;
     }
 
 fail:
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
-        }
-    }
+    nbd_conn_fail(conn);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BDRVNBDState *s = opaque;
-    qemu_coroutine_enter(s->send_coroutine, NULL);
+    NBDConnection *conn = opaque;
+    qemu_coroutine_enter(conn->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
+static int nbd_co_send_request(NBDConnection *conn,
+                               struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
     int rc, ret;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->send_coroutine = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, nbd_restart_write,
-                            nbd_have_request, s);
-    rc = nbd_send_request(s->sock, request);
+    qemu_co_mutex_lock(&conn->send_mutex);
+    if (conn->broken) {
+        qemu_co_mutex_unlock(&conn->send_mutex);
+        return -EIO;
+    }
+
+    conn->send_coroutine = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(conn->sock, nbd_reply_ready, nbd_restart_write,
+                            nbd_have_request, conn);
+    rc = nbd_send_request(conn->sock, request);
     if (rc >= 0 && qiov) {
-        ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
+        ret = qemu_co_sendv(conn->sock, qiov->iov, qiov->niov,
                             offset, request->len);
         if (ret != request->len) {
-            return -EIO;
+            rc = -EIO;
         }
     }
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    if (!conn->broken) {
+        qemu_aio_set_fd_handler(conn->sock, nbd_reply_ready, NULL,
+                                nbd_have_request, conn);
+    }
+    conn->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&conn->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
-                                 struct nbd_reply *reply,
-                                 QEMUIOVector *qiov, int offset)
+/*
+ * Waits for the reply to @request.  Returns 0 when a reply arrived, with
+ * the error reported by the server in @reply, or -EIO if the connection
+ * was lost.
+ */
+static int nbd_co_receive_reply(NBDConnection *conn,
+                                struct nbd_request *request,
+                                struct nbd_reply *reply,
+                                QEMUIOVector *qiov, int offset)
 {
-    int ret;
+    int i = HANDLE_TO_INDEX(conn, request->handle);
+    int ret = -EIO;
+
+    if (conn->broken) {
+        return -EIO;
+    }
 
     /* Wait until we're woken up by the read handler.  TODO: perhaps
      * peek at the next reply and avoid yielding if it's ours?  */
+    conn->receiving[i] = true;
     qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
-                reply->error = EIO;
-            }
-        }
+    if (conn->broken || conn->reply.handle != request->handle) {
+        goto out;
+    }
 
-        /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
+    *reply = conn->reply;
+    if (qiov && reply->error == 0) {
+        if (qemu_co_recvv(conn->sock, qiov->iov, qiov->niov,
+                          offset, request->len) != request->len) {
+            goto out;
+        }
     }
+
+    /* Tell the read handler to read another header.  */
+    conn->reply.handle = 0;
+    ret = 0;
+
+out:
+    conn->receiving[i] = false;
+    return ret;
 }
 
-static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
+static void nbd_coroutine_end(NBDConnection *conn,
+                              struct nbd_request *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
+    int i = HANDLE_TO_INDEX(conn, request->handle);
+
+    conn->recv_coroutine[i] = NULL;
+    conn->in_flight--;
+    qemu_co_queue_next(&conn->free_sema);
+
+    /* A lost connection can be restored once all its requests are gone */
+    if (conn->broken && conn->in_flight == 0) {
+        qemu_co_queue_restart_all(&conn->s->reconnect_queue);
     }
 }
 
-static int nbd_establish_connection(BlockDriverState *bs)
+/* Connects a blocking socket and runs the NBD handshake on it */
+static int nbd_connect_func(void *opaque)
 {
-    BDRVNBDState *s = bs->opaque;
-    int sock;
+    NBDConnectRequest *req = opaque;
+    BDRVNBDState *s = req->s;
     int ret;
-    off_t size;
-    size_t blocksize;
 
+    errno = 0;
     if (s->is_unix) {
-        sock = unix_socket_outgoing(s->host_spec);
+        req->sock = unix_connect_opts(s->socket_opts, &req->err, NULL, NULL);
     } else {
-        sock = tcp_socket_outgoing_spec(s->host_spec);
+        req->sock = inet_connect_opts(s->socket_opts, &req->err, NULL, NULL);
     }
 
     /* Failed to establish connection */
-    if (sock < 0) {
+    if (req->sock < 0) {
         logout("Failed to establish connection to NBD server\n");
-        return -errno;
+        return errno ? -errno : -EIO;
     }
 
     /* NBD handshake */
-    ret = nbd_receive_negotiate(sock, s->export_name, &s->nbdflags, &size,
-                                &blocksize);
+    ret = nbd_receive_negotiate(req->sock, s->export_name, &req->nbdflags,
+                                &req->size, &req->blocksize);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
-        closesocket(sock);
+        closesocket(req->sock);
         return ret;
     }
+    return 0;
+}
+
+static int nbd_connect_finish(BDRVNBDState *s, NBDConnection *conn,
+                              NBDConnectRequest *req)
+{
+    int sock = req->sock;
+
+    /* All connections must see the same export */
+    if (s->negotiated && req->size != s->size) {
+        logout("NBD export changed size\n");
+        closesocket(sock);
+        return -EIO;
+    }
 
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     socket_set_nonblock(sock);
     qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
+                            nbd_have_request, conn);
 
-    s->sock = sock;
-    s->size = size;
-    s->blocksize = blocksize;
+    conn->sock = sock;
+    conn->broken = false;
+    conn->connect_failed = false;
+    if (!s->negotiated) {
+        s->nbdflags = req->nbdflags;
+        s->size = req->size;
+        s->blocksize = req->blocksize;
+        s->negotiated = true;
+    }
 
     logout("Established connection with NBD server\n");
     return 0;
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static int nbd_connect(BDRVNBDState *s, NBDConnection *conn)
+{
+    NBDConnectRequest req = { .s = s };
+    int ret;
+
+    ret = nbd_connect_func(&req);
+    if (req.err) {
+        qerror_report_err(req.err);
+        error_free(req.err);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    return nbd_connect_finish(s, conn, &req);
+}
+
+/*
+ * Restores a lost connection.  Connecting and the handshake block, so they
+ * run in the thread pool and only this request waits for them.  Requests
+ * that find no usable connection meanwhile wait in reconnect_queue.
+ */
+static int coroutine_fn nbd_co_reconnect(BDRVNBDState *s,
+                                         NBDConnection *conn)
+{
+    NBDConnectRequest req = { .s = s };
+    int ret;
+
+    conn->connecting = true;
+    ret = thread_pool_submit_co(nbd_connect_func, &req);
+    conn->connecting = false;
+    error_free(req.err);
+
+    if (ret == 0) {
+        ret = nbd_connect_finish(s, conn, &req);
+    }
+    if (ret < 0) {
+        conn->connect_failed = true;
+        conn->broken_time = qemu_get_clock_ns(rt_clock);
+    }
+    qemu_co_queue_restart_all(&s->reconnect_queue);
+    return ret;
+}
+
+/*
+ * Picks the connection with the fewest requests in flight, starting the
+ * search at a different connection each time so that they share the load
+ * even when idle.  Returns NULL if the server can't be reached.
+ */
+static NBDConnection *nbd_co_get_connection(BDRVNBDState *s)
+{
+    NBDConnection *conn, *best, *idle_broken;
+    bool connecting;
+    bool retry_now;
+    int i;
+
+    for (;;) {
+        best = idle_broken = NULL;
+        connecting = false;
+        for (i = 0; i < s->num_conns; i++) {
+            conn = &s->conns[(s->next_conn + i) % s->num_conns];
+            if (conn->connecting) {
+                connecting = true;
+            } else if (!conn->broken) {
+                if (!best || conn->in_flight < best->in_flight) {
+                    best = conn;
+                }
+            } else if (conn->in_flight == 0 && !idle_broken) {
+                idle_broken = conn;
+            }
+        }
+        s->next_conn = (s->next_conn + 1) % s->num_conns;
+
+        /* Don't try a dead server for every request: while others work,
+         * wait before restoring a lost connection, and never repeat a
+         * failed attempt right away */
+        if (idle_broken) {
+            retry_now = !best && !idle_broken->connect_failed;
+            if (retry_now ||
+                qemu_get_clock_ns(rt_clock) - idle_broken->broken_time >=
+                NBD_RECONNECT_DELAY_NS) {
+                if (nbd_co_reconnect(s, idle_broken) == 0) {
+                    return idle_broken;
+                }
+                continue;
+            }
+        }
+
+        if (best) {
+            return best;
+        }
+        if (idle_broken && !connecting) {
+            return NULL;
+        }
+
+        /* Wait for a connection attempt to finish, or for the requests on
+         * the lost connections to go away */
+        qemu_co_queue_wait(&s->reconnect_queue);
+    }
+}
+
+/*
+ * Sends @request and waits for its reply.  If the connection is lost on
+ * the way, the request is sent again; all NBD requests can be repeated
+ * safely.  @conn is the connection to use, or NULL to pick one.
+ */
+static int nbd_co_request(BDRVNBDState *s, NBDConnection *conn,
+                          struct nbd_request *request,
+                          QEMUIOVector *write_qiov,
+                          QEMUIOVector *read_qiov, int offset)
+{
+    struct nbd_reply reply = { .error = 0 };
+    int retries;
+    int ret;
+
+    for (retries = 0; retries <= NBD_MAX_RETRIES; retries++) {
+        if (!conn || conn->broken) {
+            conn = nbd_co_get_connection(s);
+            if (!conn) {
+                return -EIO;
+            }
+        }
+
+        nbd_coroutine_start(conn, request);
+        ret = nbd_co_send_request(conn, request, write_qiov, offset);
+        if (ret >= 0) {
+            ret = nbd_co_receive_reply(conn, request, &reply,
+                                       read_qiov, offset);
+        }
+        if (ret < 0) {
+            nbd_conn_fail(conn);
+        }
+        nbd_coroutine_end(conn, request);
+
+        if (ret >= 0) {
+            return -reply.error;
+        }
+    }
+    return -EIO;
+}
+
+static void nbd_conn_init(BDRVNBDState *s, NBDConnection *conn)
+{
+    conn->s = s;
+    conn->sock = -1;
+    conn->broken = true;
+    qemu_co_mutex_init(&conn->send_mutex);
+    qemu_co_queue_init(&conn->free_sema);
+    conn->recv_coroutine = g_new0(Coroutine *, s->max_requests);
+    conn->receiving = g_new0(bool, s->max_requests);
+}
+
+static void nbd_teardown_connection(NBDConnection *conn)
 {
-    BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
 
-    request.type = NBD_CMD_DISC;
-    request.from = 0;
-    request.len = 0;
-    nbd_send_request(s->sock, &request);
+    if (!conn->broken) {
+        request.type = NBD_CMD_DISC;
+        request.from = 0;
+        request.len = 0;
+        nbd_send_request(conn->sock, &request);
 
-    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL);
-    closesocket(s->sock);
+        qemu_aio_set_fd_handler(conn->sock, NULL, NULL, NULL, NULL);
+        closesocket(conn->sock);
+    }
+    g_free(conn->recv_coroutine);
+    g_free(conn->receiving);
 }
 
 static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
 {
     BDRVNBDState *s = bs->opaque;
     int result;
+    int i;
 
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_mutex_init(&s->free_sema);
+    s->num_conns = 1;
+    s->max_requests = MAX_NBD_REQUESTS;
+    qemu_co_queue_init(&s->reconnect_queue);
 
     /* Pop the config into our state object. Exit if invalid. */
     result = nbd_config(s, filename);
     if (result != 0) {
         return result;
     }
+    result = nbd_config_socket(s);
+    if (result != 0) {
+        qemu_opts_del(s->socket_opts);
+        g_free(s->export_name);
+        g_free(s->host_spec);
+        return result;
+    }
 
-    /* establish TCP connection, return error if it fails
+    /* establish TCP connections, return error if one fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
-    result = nbd_establish_connection(bs);
+    for (i = 0; i < s->num_conns; i++) {
+        nbd_conn_init(s, &s->conns[i]);
+        result = nbd_connect(s, &s->conns[i]);
+        if (result < 0) {
+            break;
+        }
+    }
 
+    if (result < 0) {
+        while (i >= 0) {
+            nbd_teardown_connection(&s->conns[i--]);
+        }
+        qemu_opts_del(s->socket_opts);
+        g_free(s->export_name);
+        g_free(s->host_spec);
+    }
     return result;
 }
 
@@ -404,23 +801,12 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     request.type = NBD_CMD_READ;
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, qiov, offset);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
-
+    return nbd_co_request(s, NULL, &request, NULL, qiov, offset);
 }
 
 static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
@@ -429,8 +815,6 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     request.type = NBD_CMD_WRITE;
     if (!bdrv_enable_write_cache(bs) && (s->nbdflags & NBD_FLAG_SEND_FUA)) {
@@ -440,15 +824,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, qiov, offset);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return nbd_co_request(s, NULL, &request, qiov, NULL, offset);
 }
 
 /* qemu-nbd has a limit of slightly less than 1M per request.  Try to
@@ -493,8 +869,7 @@ static int nbd_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
+    int i, ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
@@ -508,15 +883,22 @@ static int nbd_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+    /* Unless the server promises otherwise, a flush only covers the writes
+     * completed on the same connection.  */
+    if (s->num_conns == 1 || (s->nbdflags & NBD_FLAG_CAN_MULTI_CONN)) {
+        return nbd_co_request(s, NULL, &request, NULL, NULL, 0);
     }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+
+    for (i = 0; i < s->num_conns; i++) {
+        if (s->conns[i].broken) {
+            continue;
+        }
+        ret = nbd_co_request(s, &s->conns[i], &request, NULL, NULL, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
 }
 
 static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -524,34 +906,29 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
     }
     request.type = NBD_CMD_TRIM;
-    request.from = sector_num * 512;;
+    request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return nbd_co_request(s, NULL, &request, NULL, NULL, 0);
 }
 
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+    int i;
+
     g_free(s->export_name);
     g_free(s->host_spec);
 
-    nbd_teardown_connection(bs);
+    for (i = 0; i < s->num_conns; i++) {
+        nbd_teardown_connection(&s->conns[i]);
+    }
+    qemu_opts_del(s->socket_opts);
 }
 
 static int64_t nbd_getlength(BlockDriverState *bs)
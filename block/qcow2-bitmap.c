@@ -0,0 +1,346 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+#include "qemu-error.h"
+#include "host-utils.h"
+
+/*
+ * The bitmaps are listed in a directory that the dirty bitmaps header
+ * extension points to.  Each entry is followed by the name of the bitmap
+ * and padded to a multiple of 8 bytes; the data of a bitmap is one bit per
+ * chunk of granularity bytes, least significant bit first.
+ *
+ * The on-disk bitmaps are only valid while QCOW2_AUTOCLEAR_DIRTY_BITMAPS is
+ * set.  qcow2_open() clears all autoclear bits when the image is opened
+ * read-write, so the bitmaps read at that point become out of date as soon
+ * as the guest writes, and are only valid again once qcow2_close() has
+ * stored the bitmaps from memory.
+ *
+ * During a migration with shared storage, the destination opens the image
+ * inactive and neither loads nor stores bitmaps.  The source stores them
+ * when it hands the image over and becomes inactive itself.  The
+ * destination loads them once bdrv_invalidate_cache() reopens the image.
+ */
+
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * 1024)
+
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    /* entry is 8 byte aligned */
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t granularity_bits;
+    uint16_t name_size;
+    uint16_t reserved;
+    /* name follows */
+} Qcow2BitmapDirEntry;
+
+void qcow2_free_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        g_free(s->bitmaps[i].name);
+    }
+    g_free(s->bitmaps);
+    s->bitmaps = NULL;
+    s->nb_bitmaps = 0;
+}
+
+static int qcow2_read_bitmap_directory(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapDirEntry *e;
+    Qcow2Bitmap *bm;
+    uint8_t *dir;
+    uint64_t offset;
+    int i, name_size;
+    int ret;
+
+    if (s->bitmap_directory_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE ||
+        s->nb_bitmaps > s->bitmap_directory_size / sizeof(*e)) {
+        error_report("Dirty bitmap directory too large");
+        return -EINVAL;
+    }
+
+    dir = g_malloc(s->bitmap_directory_size);
+    ret = bdrv_pread(bs->file, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->bitmaps = g_malloc0(s->nb_bitmaps * sizeof(Qcow2Bitmap));
+    offset = 0;
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        if (s->bitmap_directory_size - offset < sizeof(*e)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        e = (Qcow2BitmapDirEntry *)(dir + offset);
+        offset += sizeof(*e);
+
+        name_size = be16_to_cpu(e->name_size);
+        if (s->bitmap_directory_size - offset < name_size) {
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        bm = s->bitmaps + i;
+        bm->data_offset = be64_to_cpu(e->data_offset);
+        bm->data_size = be64_to_cpu(e->data_size);
+        bm->granularity_bits = be32_to_cpu(e->granularity_bits);
+        bm->name = g_strndup((char *)dir + offset, name_size);
+        offset = align_offset(offset + name_size, 8);
+    }
+
+    g_free(dir);
+    return 0;
+
+fail:
+    if (ret == -EINVAL) {
+        error_report("Invalid dirty bitmap directory");
+    }
+    g_free(dir);
+    qcow2_free_bitmaps(bs);
+    return ret;
+}
+
+/* Creates a dirty bitmap of @bs from an entry of the bitmap directory */
+static int qcow2_load_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    BdrvDirtyBitmap *bitmap;
+    Error *local_err = NULL;
+    uint8_t *buf;
+    int ret;
+
+    if (bm->granularity_bits < BDRV_SECTOR_BITS ||
+        bm->granularity_bits > 31) {
+        error_report("Dirty bitmap '%s' has invalid granularity, ignoring it",
+                     bm->name);
+        return 0;
+    }
+
+    /* Bitmaps of the same name may already be there if the image is being
+     * reopened by bdrv_invalidate_cache() */
+    if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+        return 0;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, 1 << bm->granularity_bits,
+                                      bm->name, &local_err);
+    if (!bitmap) {
+        error_report("Cannot load dirty bitmap '%s': %s", bm->name,
+                     error_get_pretty(local_err));
+        error_free(local_err);
+        return 0;
+    }
+
+    if (bdrv_dirty_bitmap_serialization_size(bitmap) != bm->data_size) {
+        error_report("Dirty bitmap '%s' does not match the image size, "
+                     "ignoring it", bm->name);
+        bdrv_release_dirty_bitmap(bs, bitmap);
+        return 0;
+    }
+
+    buf = g_malloc(bm->data_size);
+    ret = bdrv_pread(bs->file, bm->data_offset, buf, bm->data_size);
+    if (ret < 0) {
+        g_free(buf);
+        bdrv_release_dirty_bitmap(bs, bitmap);
+        return ret;
+    }
+    bdrv_dirty_bitmap_deserialize(bitmap, buf);
+    bdrv_dirty_bitmap_set_persistent(bs, bitmap, true, NULL);
+    g_free(buf);
+    return 0;
+}
+
+/*
+ * Reads the bitmap directory and, when the image is opened read-write,
+ * creates the persistent dirty bitmaps of @bs from it.  Inactive images
+ * ignore the bitmaps, because the source of the migration still owns them.
+ */
+int qcow2_read_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, ret;
+
+    if (!s->nb_bitmaps) {
+        return 0;
+    }
+
+    if (s->inactive) {
+        /* The directory belongs to the source, which rewrites it when it
+         * hands the image over.  It is read again when the image is
+         * reopened after the migration, and must not be freed here. */
+        s->nb_bitmaps = 0;
+        s->bitmap_directory_offset = 0;
+        s->bitmap_directory_size = 0;
+        return 0;
+    }
+
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS)) {
+        /* Another program wrote to the image without updating the bitmaps;
+         * their clusters are leaked, but may have been reused already by
+         * 'qemu-img check -r leaks', so they can't be freed either */
+        error_report("Dirty bitmaps in the image are out of date, "
+                     "discarding them");
+        s->nb_bitmaps = 0;
+        s->bitmap_directory_offset = 0;
+        s->bitmap_directory_size = 0;
+        return bs->read_only ? 0 : qcow2_update_header(bs);
+    }
+
+    ret = qcow2_read_bitmap_directory(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (bs->read_only) {
+        return 0;
+    }
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        ret = qcow2_load_bitmap(bs, s->bitmaps + i);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Replaces the bitmaps stored in the image with the persistent dirty bitmaps
+ * of @bs, and marks them valid.  Called when the image is closed.
+ */
+int qcow2_store_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2BitmapDirEntry *e;
+    uint8_t *dir = NULL, *buf;
+    uint64_t dir_size = 0;
+    int64_t data_offset, dir_offset = 0;
+    int i, nb_bitmaps = 0, name_size;
+    int ret;
+
+    for (bitmap = bdrv_next_dirty_bitmap(bs, NULL); bitmap;
+         bitmap = bdrv_next_dirty_bitmap(bs, bitmap)) {
+        if (bdrv_dirty_bitmap_is_persistent(bitmap)) {
+            break;
+        }
+    }
+    if (!bitmap && !s->bitmap_directory_offset) {
+        return 0;
+    }
+
+    /* The on-disk bitmaps are out of date since the image was opened, so
+     * they can be dropped before the new ones are written */
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        qcow2_free_clusters(bs, s->bitmaps[i].data_offset,
+                            s->bitmaps[i].data_size);
+    }
+    if (s->bitmap_directory_offset) {
+        qcow2_free_clusters(bs, s->bitmap_directory_offset,
+                            s->bitmap_directory_size);
+    }
+    qcow2_free_bitmaps(bs);
+    s->bitmap_directory_offset = 0;
+    s->bitmap_directory_size = 0;
+
+    for (bitmap = bdrv_next_dirty_bitmap(bs, NULL); bitmap;
+         bitmap = bdrv_next_dirty_bitmap(bs, bitmap)) {
+        uint64_t size;
+
+        if (!bdrv_dirty_bitmap_is_persistent(bitmap)) {
+            continue;
+        }
+
+        size = bdrv_dirty_bitmap_serialization_size(bitmap);
+        data_offset = qcow2_alloc_clusters(bs, size);
+        if (data_offset < 0) {
+            ret = data_offset;
+            goto fail;
+        }
+
+        buf = g_malloc(size);
+        bdrv_dirty_bitmap_serialize(bitmap, buf);
+        ret = bdrv_pwrite(bs->file, data_offset, buf, size);
+        g_free(buf);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        name_size = strlen(bdrv_dirty_bitmap_name(bitmap));
+        dir = g_realloc(dir, dir_size + align_offset(sizeof(*e) + name_size,
+                                                     8));
+        e = (Qcow2BitmapDirEntry *)(dir + dir_size);
+        *e = (Qcow2BitmapDirEntry) {
+            .data_offset        = cpu_to_be64(data_offset),
+            .data_size          = cpu_to_be64(size),
+            .granularity_bits   =
+                cpu_to_be32(ctz32(bdrv_dirty_bitmap_granularity(bitmap))),
+            .name_size          = cpu_to_be16(name_size),
+        };
+        memcpy(e + 1, bdrv_dirty_bitmap_name(bitmap), name_size);
+        memset((uint8_t *)(e + 1) + name_size, 0,
+               align_offset(sizeof(*e) + name_size, 8) - sizeof(*e) -
+               name_size);
+        dir_size += align_offset(sizeof(*e) + name_size, 8);
+        nb_bitmaps++;
+    }
+
+    if (nb_bitmaps) {
+        dir_offset = qcow2_alloc_clusters(bs, dir_size);
+        if (dir_offset < 0) {
+            ret = dir_offset;
+            goto fail;
+        }
+        ret = bdrv_pwrite(bs->file, dir_offset, dir, dir_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The refcounts and the bitmaps must be on disk before the header
+     * declares the bitmaps valid */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->nb_bitmaps = nb_bitmaps;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    if (nb_bitmaps) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    }
+    ret = qcow2_update_header(bs);
+
+fail:
+    g_free(dir);
+    return ret;
+}
+
+bool qcow2_can_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    /* Older versions have no autoclear bits to tell stale bitmaps apart */
+    return s->qcow_version >= 3;
+}
@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "block/qcow2.h"
+#include "thread-pool.h"
 #include "trace.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
@@ -106,20 +107,24 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
 /*
  * l2_load
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * Loads the slice of the L2 table at l2_offset that contains the entry for
+ * the guest offset into memory. If the slice is in the cache, the cache is
+ * used; otherwise it is loaded from the image file.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Returns 0 and a pointer to the slice in *l2_slice on success, -errno if
+ * the read from the image file failed.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+    uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcowState *s = bs->opaque;
+    int start_of_slice = sizeof(uint64_t) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
     int ret;
 
-    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
+                          (void**) l2_slice);
 
     return ret;
 }
@@ -159,14 +164,17 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * The new table goes through the L2 cache one slice at a time and is written
+ * out before the L1 entry is updated to point to it.
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t old_l2_offset;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     int64_t l2_offset;
+    int slice, n_slices, slice_size2;
     int ret;
 
     old_l2_offset = s->l1_table[l1_index];
@@ -185,44 +193,49 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    /* allocate a new entry in the l2 cache */
-
-    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        return ret;
-    }
+    /* fill the new table slice by slice through the l2 cache */
 
-    l2_table = *table;
+    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    n_slices = s->cluster_size / slice_size2;
 
-    if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
-        /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-    } else {
-        uint64_t* old_table;
-
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
+    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
+    for (slice = 0; slice < n_slices; slice++) {
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice * slice_size2,
+                                    (void**) &l2_slice);
         if (ret < 0) {
             goto fail;
         }
 
-        memcpy(l2_table, old_table, s->cluster_size);
+        if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
+            /* if there was no old l2 table, clear the new table */
+            memset(l2_slice, 0, slice_size2);
+        } else {
+            uint64_t *old_slice;
+
+            /* if there was an old l2 table, read it from the disk */
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache,
+                (old_l2_offset & L1E_OFFSET_MASK) + slice * slice_size2,
+                (void**) &old_slice);
+            if (ret < 0) {
+                qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
+                goto fail;
+            }
 
-        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_table);
-        if (ret < 0) {
-            goto fail;
+            memcpy(l2_slice, old_slice, slice_size2);
+
+            qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_slice);
         }
+
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
     }
 
     /* write the l2 table to the file */
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
     trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -236,13 +249,11 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
     s->l1_table[l1_index] = old_l2_offset;
     return ret;
 }
@@ -395,19 +406,20 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     uint64_t l2_offset, *l2_table;
     int l1_bits, c;
     unsigned int index_in_cluster, nb_clusters;
-    uint64_t nb_available, nb_needed;
+    uint64_t nb_available, nb_needed, bytes_per_slice;
     int ret;
 
     index_in_cluster = (offset >> 9) & (s->cluster_sectors - 1);
     nb_needed = *num + index_in_cluster;
 
     l1_bits = s->l2_bits + s->cluster_bits;
+    bytes_per_slice = (uint64_t)s->l2_slice_size << s->cluster_bits;
 
     /* compute how many bytes there are between the offset and
-     * the end of the l1 entry
+     * the end of the l2 slice that contains it
      */
 
-    nb_available = (1ULL << l1_bits) - (offset & ((1ULL << l1_bits) - 1));
+    nb_available = bytes_per_slice - (offset & (bytes_per_slice - 1));
 
     /* compute the number of available sectors */
 
@@ -435,14 +447,14 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* load the l2 table in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
     if (ret < 0) {
         return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
     *cluster_offset = be64_to_cpu(l2_table[l2_index]);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
@@ -492,10 +504,10 @@ out:
  * get_cluster_table
  *
  * for a given disk offset, load (and allocate if needed)
- * the l2 table.
+ * the slice of the l2 table that contains its entry.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the l2 slice and the cluster index in the slice are given to
+ * the caller.
  *
  * Returns 0 on success, -errno in failure case
  */
@@ -523,15 +535,9 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
     /* seek the l2 table of the given l2 offset */
 
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
-        if (ret < 0) {
-            return ret;
-        }
-    } else {
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index);
         if (ret < 0) {
             return ret;
         }
@@ -540,11 +546,19 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
         if (l2_offset) {
             qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t));
         }
+
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    }
+
+    /* load the l2 slice in memory */
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
+    if (ret < 0) {
+        return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
     *new_l2_table = l2_table;
     *new_l2_index = l2_index;
@@ -618,7 +632,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
-    int i, j = 0, l2_index, ret;
+    int i, j = 0, n, l2_index, ret;
     uint64_t *old_cluster, start_sect, *l2_table;
     uint64_t cluster_offset = m->alloc_offset;
     bool cow = false;
@@ -696,10 +710,25 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      * If this was a COW, we need to decrease the refcount of the old cluster.
      * Also flush bs->file to get the right order for L2 and refcount update.
      */
-    if (j != 0) {
-        for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1);
+    for (i = 0; i < j; i += n) {
+        uint64_t entry = be64_to_cpu(old_cluster[i]);
+
+        /* Free runs of clusters that are contiguous in the image file with
+         * a single refcount update */
+        n = 1;
+        if (qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_NORMAL) {
+            while (i + n < j) {
+                uint64_t next = be64_to_cpu(old_cluster[i + n]);
+                uint64_t expected = (entry & L2E_OFFSET_MASK) +
+                                    ((uint64_t)n << s->cluster_bits);
+                if (qcow2_get_cluster_type(next) != QCOW2_CLUSTER_NORMAL ||
+                    (next & L2E_OFFSET_MASK) != expected) {
+                    break;
+                }
+                n++;
+            }
         }
+        qcow2_free_any_clusters(bs, entry, n);
     }
 
     ret = 0;
@@ -782,7 +811,10 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = old_alloc->offset >> s->cluster_bits;
         uint64_t old_end = old_start + old_alloc->nb_clusters;
 
-        if (end < old_start || start > old_end) {
+        /* Both ranges are half-open, so allocations of adjacent clusters,
+         * like those of a sequential stream of writes, don't wait for each
+         * other */
+        if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
             if (start < old_start) {
@@ -866,11 +898,11 @@ again:
     }
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters = MIN(size_to_clusters(s, n_end << BDRV_SECTOR_BITS),
-                      s->l2_size - l2_index);
+                      s->l2_slice_size - l2_index);
 
     cluster_offset = be64_to_cpu(l2_table[l2_index]);
 
@@ -1021,34 +1053,168 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+typedef struct Qcow2DecompressData {
+    uint8_t *dest;
+    int dest_size;
+    const uint8_t *src;
+    int src_size;
+} Qcow2DecompressData;
+
+static int qcow2_decompress_func(void *opaque)
+{
+    Qcow2DecompressData *data = opaque;
+
+    return decompress_buffer(data->dest, data->dest_size,
+                             data->src, data->src_size);
+}
+
+void qcow2_decompressed_cache_init(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < DECOMPRESSED_CACHE_SIZE; i++) {
+        s->decompressed_cache[i].offset = -1;
+        qemu_co_queue_init(&s->decompressed_cache[i].waiters);
+    }
+}
+
+void qcow2_decompressed_cache_free(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < DECOMPRESSED_CACHE_SIZE; i++) {
+        assert(!s->decompressed_cache[i].in_flight);
+        g_free(s->decompressed_cache[i].data);
+        s->decompressed_cache[i].data = NULL;
+        s->decompressed_cache[i].offset = -1;
+    }
+}
+
+/*
+ * Forget all cached clusters.  Compressed clusters are never modified in
+ * place, but their space may be reused for other compressed data once they
+ * have been freed.  Clusters that are being decompressed right now may
+ * already contain the old data, so they are only handed to the request
+ * that reads them and dropped when it completes.
+ */
+void qcow2_decompressed_cache_invalidate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < DECOMPRESSED_CACHE_SIZE; i++) {
+        if (s->decompressed_cache[i].in_flight) {
+            s->decompressed_cache[i].stale = true;
+        } else {
+            s->decompressed_cache[i].offset = -1;
+        }
+    }
+}
+
+/*
+ * Decompresses the cluster described by the L2 entry cluster_offset, or
+ * finds it in the cache of decompressed clusters, and points *data to it.
+ *
+ * Must be called with s->lock held.  The lock is dropped while the
+ * compressed data is read and inflated in a worker thread, so that several
+ * clusters can be decompressed at the same time.  *data stays valid until
+ * the caller drops the lock again.
+ */
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          uint8_t **data)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DecompressedCluster *entry, *victim;
+    Qcow2DecompressData decompress;
     int ret, csize, nb_csectors, sector_offset;
     uint64_t coffset;
+    uint8_t *buf;
+    int i;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
+
+again:
+    victim = NULL;
+    for (i = 0; i < DECOMPRESSED_CACHE_SIZE; i++) {
+        entry = &s->decompressed_cache[i];
+        if (entry->offset == coffset && !entry->stale) {
+            if (entry->in_flight) {
+                /* Someone else is decompressing it, wait for them */
+                qemu_co_mutex_unlock(&s->lock);
+                qemu_co_queue_wait(&entry->waiters);
+                qemu_co_mutex_lock(&s->lock);
+                goto again;
+            }
+            entry->lru = ++s->decompressed_lru_counter;
+            *data = entry->data;
+            return 0;
+        }
+        if (!entry->in_flight && (!victim || entry->lru < victim->lru)) {
+            victim = entry;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
+    }
+
+    if (!victim) {
+        /* Every entry is being filled, wait for one of them */
+        entry = &s->decompressed_cache[0];
+        qemu_co_mutex_unlock(&s->lock);
+        qemu_co_queue_wait(&entry->waiters);
+        qemu_co_mutex_lock(&s->lock);
+        goto again;
+    }
+
+    entry = victim;
+    entry->offset = coffset;
+    entry->in_flight = true;
+    if (!entry->data) {
+        entry->data = g_malloc(s->cluster_size);
+    }
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+    buf = qemu_blockalign(bs, nb_csectors * 512);
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_read(bs->file, coffset >> 9, buf, nb_csectors);
+    if (ret >= 0) {
+        decompress = (Qcow2DecompressData) {
+            .dest       = entry->data,
+            .dest_size  = s->cluster_size,
+            .src        = buf + sector_offset,
+            .src_size   = csize,
+        };
+        if (thread_pool_submit_co(qcow2_decompress_func, &decompress) < 0) {
+            ret = -EIO;
         }
-        s->cluster_cache_offset = coffset;
     }
+
+    qemu_co_mutex_lock(&s->lock);
+    qemu_vfree(buf);
+
+    entry->in_flight = false;
+    qemu_co_queue_restart_all(&entry->waiters);
+    if (ret < 0 || entry->stale) {
+        entry->offset = -1;
+        entry->stale = false;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    entry->lru = ++s->decompressed_lru_counter;
+    *data = entry->data;
     return 0;
 }
 
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of discarded
+ * all clusters in the same L2 slice) and returns the number of discarded
  * clusters.
  */
 static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1065,8 +1231,8 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
@@ -1112,7 +1278,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
     nb_clusters = size_to_clusters(s, end_offset - offset);
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     while (nb_clusters > 0) {
         ret = discard_single_l2(bs, offset, nb_clusters);
         if (ret < 0) {
@@ -1128,7 +1294,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
 /*
  * This zeroes as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of zeroed
+ * all clusters in the same L2 slice) and returns the number of zeroed
  * clusters.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1145,8 +1311,8 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
@@ -1182,7 +1348,7 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         return -ENOTSUP;
     }
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
 
     while (nb_clusters > 0) {
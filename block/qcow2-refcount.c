@@ -726,7 +726,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     BDRVQcowState *s = bs->opaque;
     uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, l1_allocated;
     int64_t old_offset, old_l2_offset;
-    int i, j, l1_modified = 0, nb_csectors, refcount;
+    int i, j, slice, l1_modified = 0, nb_csectors, refcount;
+    int slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    int n_slices = s->cluster_size / slice_size2;
     int ret;
 
     l2_table = NULL;
@@ -764,69 +766,70 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             old_l2_offset = l2_offset;
             l2_offset &= L1E_OFFSET_MASK;
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                    l2_offset + slice * slice_size2, (void**) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for(j = 0; j < s->l2_size; j++) {
-                offset = be64_to_cpu(l2_table[j]);
-                if (offset != 0) {
-                    old_offset = offset;
-                    offset &= ~QCOW_OFLAG_COPIED;
-                    if (offset & QCOW_OFLAG_COMPRESSED) {
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            int ret;
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, addend);
-                            if (ret < 0) {
-                                goto fail;
+                for(j = 0; j < s->l2_slice_size; j++) {
+                    offset = be64_to_cpu(l2_table[j]);
+                    if (offset != 0) {
+                        old_offset = offset;
+                        offset &= ~QCOW_OFLAG_COPIED;
+                        if (offset & QCOW_OFLAG_COMPRESSED) {
+                            nb_csectors = ((offset >> s->csize_shift) &
+                                           s->csize_mask) + 1;
+                            if (addend != 0) {
+                                int ret;
+                                ret = update_refcount(bs,
+                                    (offset & s->cluster_offset_mask) & ~511,
+                                    nb_csectors * 512, addend);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+
+                                /* TODO Flushing once for the whole function
+                                 * should be enough */
+                                bdrv_flush(bs->file);
                             }
-
-                            /* TODO Flushing once for the whole function should
-                             * be enough */
-                            bdrv_flush(bs->file);
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                    } else {
-                        uint64_t cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (addend != 0) {
-                            refcount = update_cluster_refcount(bs, cluster_index, addend);
+                            /* compressed clusters are never modified */
+                            refcount = 2;
                         } else {
-                            refcount = get_refcount(bs, cluster_index);
-                        }
+                            uint64_t cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
+                            if (addend != 0) {
+                                refcount = update_cluster_refcount(bs, cluster_index, addend);
+                            } else {
+                                refcount = get_refcount(bs, cluster_index);
+                            }
 
-                        if (refcount < 0) {
-                            ret = -EIO;
-                            goto fail;
+                            if (refcount < 0) {
+                                ret = -EIO;
+                                goto fail;
+                            }
                         }
-                    }
 
-                    if (refcount == 1) {
-                        offset |= QCOW_OFLAG_COPIED;
-                    }
-                    if (offset != old_offset) {
-                        if (addend > 0) {
-                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                                s->refcount_block_cache);
+                        if (refcount == 1) {
+                            offset |= QCOW_OFLAG_COPIED;
+                        }
+                        if (offset != old_offset) {
+                            if (addend > 0) {
+                                qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                    s->refcount_block_cache);
+                            }
+                            l2_table[j] = cpu_to_be64(offset);
+                            qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                         }
-                        l2_table[j] = cpu_to_be64(offset);
-                        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                     }
                 }
-            }
 
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
+                ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
             }
 
-
             if (addend != 0) {
                 refcount = update_cluster_refcount(bs, l2_offset >> s->cluster_bits, addend);
             } else {
@@ -1149,6 +1152,14 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->snapshots_offset, s->snapshots_size);
 
+    /* dirty bitmaps */
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        inc_refcounts(bs, res, refcount_table, nb_clusters,
+            s->bitmaps[i].data_offset, s->bitmaps[i].data_size);
+    }
+    inc_refcounts(bs, res, refcount_table, nb_clusters,
+        s->bitmap_directory_offset, s->bitmap_directory_size);
+
     /* refcount data */
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->refcount_table_offset,
@@ -27,6 +27,7 @@
 #include <zlib.h>
 #include "aes.h"
 #include "block/qcow2.h"
+#include "thread-pool.h"
 #include "qemu-error.h"
 #include "qerror.h"
 #include "trace.h"
@@ -56,6 +57,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_DIRTY_BITMAPS 0x64697274
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -148,6 +150,30 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_DIRTY_BITMAPS:
+            {
+                Qcow2BitmapHeaderExt bitmaps_ext;
+
+                if (ext.len != sizeof(bitmaps_ext)) {
+                    error_report("Invalid dirty bitmaps header extension");
+                    return -EINVAL;
+                }
+                ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+                if (ret < 0) {
+                    return ret;
+                }
+                s->nb_bitmaps = be32_to_cpu(bitmaps_ext.nb_bitmaps);
+                s->bitmap_directory_size =
+                    be64_to_cpu(bitmaps_ext.bitmap_directory_size);
+                s->bitmap_directory_offset =
+                    be64_to_cpu(bitmaps_ext.bitmap_directory_offset);
+                if (s->nb_bitmaps < 0) {
+                    error_report("Too many dirty bitmaps");
+                    return -EINVAL;
+                }
+            }
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -285,12 +311,47 @@ static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
     return ret;
 }
 
+/*
+ * Works out the number and size of the L2 cache entries and the number of
+ * refcount cache entries from the drive options.  The refcount block cache
+ * grows with the L2 cache, at a quarter of its size.
+ */
+static int qcow2_cache_sizes(BlockDriverState *bs, int *l2_cache_entries,
+                             int *l2_cache_entry_size,
+                             int *refcount_cache_entries)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t entry_size, cache_size, max_cache_size;
+
+    entry_size = bs->l2_cache_entry_size ?: s->cluster_size;
+    if (entry_size < MIN_L2_CACHE_ENTRY_SIZE || entry_size > s->cluster_size ||
+        !is_power_of_2(entry_size)) {
+        error_report("L2 cache entry size must be a power of two between "
+                     "%d and the cluster size (%d)", MIN_L2_CACHE_ENTRY_SIZE,
+                     s->cluster_size);
+        return -EINVAL;
+    }
+
+    /* There is no point in caching more than all L2 tables of the image */
+    cache_size = bs->l2_cache_size ?: (uint64_t)L2_CACHE_SIZE * s->cluster_size;
+    max_cache_size = (uint64_t)MAX(s->l1_size, 1) * s->cluster_size;
+    cache_size = MIN(cache_size, max_cache_size);
+
+    /* Copying an L2 table on write needs two entries at a time */
+    *l2_cache_entries = MIN(MAX(cache_size / entry_size, 2), INT_MAX);
+    *l2_cache_entry_size = entry_size;
+    *refcount_cache_entries = MAX(cache_size / s->cluster_size / 4,
+                                  REFCOUNT_CACHE_SIZE);
+    return 0;
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
     QCowHeader header;
     uint64_t ext_end;
+    int l2_cache_entries, l2_cache_entry_size, refcount_cache_entries;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -430,15 +491,20 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
-
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_blockalign(bs, QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
-                                  + 512);
-    s->cluster_cache_offset = -1;
+    ret = qcow2_cache_sizes(bs, &l2_cache_entries, &l2_cache_entry_size,
+                            &refcount_cache_entries);
+    if (ret < 0) {
+        goto fail;
+    }
+    s->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_entries,
+                                           l2_cache_entry_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_entries,
+                                                 s->cluster_size);
+
+    qcow2_decompressed_cache_init(bs);
     s->flags = flags;
+    s->inactive = flags & BDRV_O_INCOMING;
 
     ret = qcow2_refcount_init(bs);
     if (ret != 0) {
@@ -472,8 +538,16 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         goto fail;
     }
 
-    /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && s->autoclear_features != 0) {
+    ret = qcow2_read_bitmaps(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* Clear autoclear feature bits.  Unknown ones are not maintained by this
+     * version, and the dirty bitmaps in the image become out of date as soon
+     * as the image is written; qcow2_close() sets the bit again.  The source
+     * of an incoming migration still uses the header. */
+    if (!bs->read_only && !s->inactive && s->autoclear_features != 0) {
         s->autoclear_features = 0;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
@@ -507,13 +581,16 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_bitmaps(bs);
     qcow2_refcount_close(bs);
     g_free(s->l1_table);
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+    }
+    qcow2_decompressed_cache_free(bs);
     return ret;
 }
 
@@ -564,6 +641,16 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
 static int qcow2_reopen_prepare(BDRVReopenState *state,
                                 BlockReopenQueue *queue, Error **errp)
 {
+    BDRVQcowState *s = state->bs->opaque;
+
+    /* The autoclear bit can't be cleared from here, so writes would leave
+     * the stored bitmaps looking valid */
+    if (state->bs->read_only && (state->flags & BDRV_O_RDWR) &&
+        s->nb_bitmaps) {
+        error_setg(errp, "Cannot reopen an image with persistent dirty "
+                   "bitmaps read-write");
+        return -ENOTSUP;
+    }
     return 0;
 }
 
@@ -615,6 +702,7 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     uint64_t bytes_done = 0;
     QEMUIOVector hd_qiov;
     uint8_t *cluster_data = NULL;
+    uint8_t *decompressed;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
@@ -673,14 +761,14 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_decompress_cluster(bs, cluster_offset,
+                                           &decompressed);
             if (ret < 0) {
                 goto fail;
             }
 
             qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
+                decompressed + index_in_cluster * 512,
                 512 * cur_nr_sectors);
             break;
 
@@ -745,19 +833,16 @@ fail:
     return ret;
 }
 
-static void run_dependent_requests(BDRVQcowState *s, QCowL2Meta *m)
+static void run_dependent_requests(QCowL2Meta *m)
 {
     /* Take the request off the list of running requests */
     if (m->nb_clusters != 0) {
         QLIST_REMOVE(m, next_in_flight);
     }
 
-    /* Restart all dependent requests */
-    if (!qemu_co_queue_empty(&m->dependent_requests)) {
-        qemu_co_mutex_unlock(&s->lock);
-        qemu_co_queue_restart_all(&m->dependent_requests);
-        qemu_co_mutex_lock(&s->lock);
-    }
+    /* Restart all dependent requests.  This only schedules them, so there
+     * is no need to drop the lock: they will queue up on it anyway */
+    qemu_co_queue_restart_all(&m->dependent_requests);
 }
 
 static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
@@ -785,8 +870,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
     while (remaining_sectors != 0) {
@@ -852,7 +935,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             goto fail;
         }
 
-        run_dependent_requests(s, &l2meta);
+        run_dependent_requests(&l2meta);
 
         remaining_sectors -= cur_nr_sectors;
         sector_num += cur_nr_sectors;
@@ -862,7 +945,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     ret = 0;
 
 fail:
-    run_dependent_requests(s, &l2meta);
+    run_dependent_requests(&l2meta);
 
     qemu_co_mutex_unlock(&s->lock);
 
@@ -876,6 +959,12 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    /* An inactive image leaves the bitmaps to the other side of the
+     * migration; it has stored them already or will load them */
+    if (!bs->read_only && !s->inactive) {
+        qcow2_store_bitmaps(bs);
+    }
     g_free(s->l1_table);
 
     qcow2_cache_flush(bs, s->l2_table_cache);
@@ -889,16 +978,17 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_decompressed_cache_free(bs);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_bitmaps(bs);
 }
 
 static void qcow2_invalidate_cache(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    int flags = s->flags;
+    /* The image is ours once the migration has completed */
+    int flags = s->flags & ~BDRV_O_INCOMING;
     AES_KEY aes_encrypt_key;
     AES_KEY aes_decrypt_key;
     uint32_t crypt_method = 0;
@@ -926,6 +1016,28 @@ static void qcow2_invalidate_cache(BlockDriverState *bs)
     }
 }
 
+/*
+ * Called on the source of a migration before the destination takes over the
+ * image: the bitmaps are stored for the destination to load, and the image
+ * is left alone until the cache is invalidated.
+ */
+static void qcow2_inactivate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->inactive) {
+        return;
+    }
+    if (!bs->read_only) {
+        qcow2_store_bitmaps(bs);
+    }
+    qcow2_cache_flush(bs, s->l2_table_cache);
+    qcow2_cache_flush(bs, s->refcount_block_cache);
+    qcow2_mark_clean(bs);
+    bdrv_flush(bs->file);
+    s->inactive = true;
+}
+
 static size_t header_ext_add(char *buf, uint32_t magic, const void *s,
     size_t len, size_t buflen)
 {
@@ -1057,6 +1169,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+            .name = "dirty bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1067,6 +1184,24 @@ int qcow2_update_header(BlockDriverState *bs)
     buf += ret;
     buflen -= ret;
 
+    /* Dirty bitmaps */
+    if (s->nb_bitmaps) {
+        Qcow2BitmapHeaderExt bitmaps_ext = {
+            .nb_bitmaps              = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size   = cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                cpu_to_be64(s->bitmap_directory_offset),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DIRTY_BITMAPS,
+                             &bitmaps_ext, sizeof(bitmaps_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -1152,7 +1287,7 @@ static int preallocate(BlockDriverState *bs)
 
         /* There are no dependent requests, but we need to remove our request
          * from the list of in-flight requests */
-        run_dependent_requests(bs->opaque, &meta);
+        run_dependent_requests(&meta);
 
         /* TODO Preallocate data if requested */
 
@@ -1475,12 +1610,66 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+typedef struct Qcow2CompressData {
+    uint8_t *dest;
+    int dest_size;
+    const uint8_t *src;
+    int src_size;
+} Qcow2CompressData;
+
+/*
+ * Compresses src into dest in a worker thread.  Returns the compressed
+ * size, -ENOSPC if the data does not get smaller than dest_size, or
+ * -EINVAL on zlib errors.
+ */
+static int qcow2_compress_func(void *opaque)
 {
-    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressData *data = opaque;
     z_stream strm;
     int ret, out_len;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = data->src_size;
+    strm.next_in = (uint8_t *)data->src;
+    strm.avail_out = data->dest_size;
+    strm.next_out = data->dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    out_len = strm.next_out - data->dest;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        return -EINVAL;
+    }
+    if (ret != Z_STREAM_END || out_len >= data->dest_size) {
+        return -ENOSPC;
+    }
+    return out_len;
+}
+
+/*
+ * Deflating runs in the thread pool without s->lock, so callers that keep
+ * several clusters in flight compress them on several host CPUs.  Only
+ * the allocation and the write of the compressed data are serialized:
+ * compressed clusters are packed into shared sectors, which bdrv_pwrite()
+ * updates with a read-modify-write.
+ */
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  const uint8_t *buf,
+                                                  int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressData compress;
+    int ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
@@ -1498,47 +1687,37 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
+    compress = (Qcow2CompressData) {
+        .dest       = out_buf,
+        .dest_size  = s->cluster_size,
+        .src        = buf,
+        .src_size   = s->cluster_size,
+    };
+    out_len = thread_pool_submit_co(qcow2_compress_func, &compress);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (out_len == -ENOSPC) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
+    } else if (out_len < 0) {
+        ret = out_len;
+        goto fail;
     } else {
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
         if (!cluster_offset) {
+            qemu_co_mutex_unlock(&s->lock);
             ret = -EIO;
             goto fail;
         }
+        qcow2_decompressed_cache_invalidate(bs);
         cluster_offset &= s->cluster_offset_mask;
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
         ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
@@ -1584,6 +1763,9 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     BDRVQcowState *s = bs->opaque;
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
+    bdi->has_l2_cache_stats = true;
+    qcow2_cache_get_stats(s->l2_table_cache, &bdi->l2_cache_hits,
+                          &bdi->l2_cache_misses);
     return 0;
 }
 
@@ -1702,7 +1884,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -1717,6 +1899,8 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_change_backing_file   = qcow2_change_backing_file,
 
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
+    .bdrv_inactivate            = qcow2_inactivate,
+    .bdrv_can_store_dirty_bitmaps = qcow2_can_store_dirty_bitmaps,
 
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
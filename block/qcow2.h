@@ -51,11 +51,18 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Default L2 cache size, in clusters */
 #define L2_CACHE_SIZE 16
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
+/* Smallest part of an L2 table that the L2 cache can hold in one entry */
+#define MIN_L2_CACHE_ENTRY_SIZE 512
+
+/* Number of decompressed clusters that are kept in memory */
+#define DECOMPRESSED_CACHE_SIZE 32
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
 typedef struct QCowHeader {
@@ -94,6 +101,15 @@ typedef struct QCowSnapshot {
     uint64_t vm_clock_nsec;
 } QCowSnapshot;
 
+typedef struct Qcow2DecompressedCluster {
+    uint64_t offset;    /* of the compressed data, -1 if the entry is free */
+    uint8_t *data;
+    uint64_t lru;
+    bool in_flight;     /* being read and decompressed */
+    bool stale;         /* invalidated while in flight, don't cache it */
+    CoQueue waiters;
+} Qcow2DecompressedCluster;
+
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
@@ -126,6 +142,30 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS       =
+        1 << QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_DIRTY_BITMAPS,
+};
+
+/* Contents of the dirty bitmaps header extension */
+typedef struct Qcow2BitmapHeaderExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} QEMU_PACKED Qcow2BitmapHeaderExt;
+
+typedef struct Qcow2Bitmap {
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t granularity_bits;
+    char *name;
+} Qcow2Bitmap;
+
 typedef struct Qcow2Feature {
     uint8_t type;
     uint8_t bit;
@@ -138,6 +178,7 @@ typedef struct BDRVQcowState {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size;
     int l1_size;
     int l1_vm_state_index;
     int csize_shift;
@@ -149,9 +190,8 @@ typedef struct BDRVQcowState {
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    Qcow2DecompressedCluster decompressed_cache[DECOMPRESSED_CACHE_SIZE];
+    uint64_t decompressed_lru_counter;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -171,6 +211,12 @@ typedef struct BDRVQcowState {
     int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    uint64_t bitmap_directory_offset;
+    uint64_t bitmap_directory_size;
+    int nb_bitmaps;
+    Qcow2Bitmap *bitmaps;
+    bool inactive;      /* image owned by the other side of a migration */
+
     int flags;
     int qcow_version;
 
@@ -234,6 +280,18 @@ static inline int size_to_l1(BDRVQcowState *s, int64_t size)
     return (size + (1ULL << shift) - 1) >> shift;
 }
 
+static inline int offset_to_l2_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_size - 1);
+}
+
+/* Index of the L2 entry for @offset in the slice of the L2 table that the
+ * cache holds it in */
+static inline int offset_to_l2_slice_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -288,7 +346,12 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+void qcow2_decompressed_cache_init(BlockDriverState *bs);
+void qcow2_decompressed_cache_free(BlockDriverState *bs);
+void qcow2_decompressed_cache_invalidate(BlockDriverState *bs);
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          uint8_t **data);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -317,9 +380,17 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs, const char *snapshot_name);
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+void qcow2_free_bitmaps(BlockDriverState *bs);
+int qcow2_read_bitmaps(BlockDriverState *bs);
+int qcow2_store_bitmaps(BlockDriverState *bs);
+bool qcow2_can_store_dirty_bitmaps(BlockDriverState *bs);
+
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
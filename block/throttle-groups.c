@@ -0,0 +1,289 @@
+/*
+ * I/O throttling groups
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "block/throttle-groups.h"
+#include "qemu-queue.h"
+#include "qemu-timer.h"
+#include "trace.h"
+
+/*
+ * All throttled BlockDriverStates belong to a group, which by default only
+ * contains the device itself.  The members of a group share one set of
+ * leaky buckets, so they are limited together.
+ *
+ * Only one request per direction is waiting for a timer in each group at a
+ * time.  When it is allowed to go, the next member that has a request
+ * queued gets its turn, so that members take turns in round-robin order and
+ * a busy member can't starve the others.  tokens[] remembers whose turn it
+ * is.
+ */
+typedef struct ThrottleGroup {
+    char *name;
+    ThrottleState ts;
+    QLIST_HEAD(, BlockDriverState) head;
+    BlockDriverState *tokens[2];
+    bool any_timer_armed[2];
+    unsigned refcount;
+    QTAILQ_ENTRY(ThrottleGroup) list;
+} ThrottleGroup;
+
+static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
+    QTAILQ_HEAD_INITIALIZER(throttle_groups);
+
+static ThrottleGroup *throttle_group_incref(const char *name)
+{
+    ThrottleGroup *tg;
+
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        if (!strcmp(name, tg->name)) {
+            tg->refcount++;
+            return tg;
+        }
+    }
+
+    tg = g_new0(ThrottleGroup, 1);
+    tg->name = g_strdup(name);
+    throttle_init(&tg->ts, qemu_get_clock_ns(vm_clock));
+    QLIST_INIT(&tg->head);
+    tg->refcount = 1;
+    QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
+    return tg;
+}
+
+static void throttle_group_unref(ThrottleGroup *tg)
+{
+    if (--tg->refcount == 0) {
+        QTAILQ_REMOVE(&throttle_groups, tg, list);
+        g_free(tg->name);
+        g_free(tg);
+    }
+}
+
+const char *throttle_group_get_name(BlockDriverState *bs)
+{
+    return bs->throttle_group->name;
+}
+
+/* The member after @bs, in round-robin order */
+static BlockDriverState *throttle_group_next_bs(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *next = QLIST_NEXT(bs, round_robin);
+
+    return next ? next : QLIST_FIRST(&tg->head);
+}
+
+/*
+ * Returns the member whose request should go next: the first one after the
+ * current token with queued requests, or @bs, which is about to queue one,
+ * if there is none.
+ */
+static BlockDriverState *next_throttle_token(BlockDriverState *bs,
+                                             bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token, *start;
+
+    start = token = tg->tokens[is_write];
+
+    token = throttle_group_next_bs(token);
+    while (token != start && !token->pending_reqs[is_write]) {
+        token = throttle_group_next_bs(token);
+    }
+
+    if (token == start && !token->pending_reqs[is_write]) {
+        token = bs;
+    }
+
+    return token;
+}
+
+/*
+ * Checks whether a request of @bs must wait, and arms the timer of @bs if
+ * so.  While a timer is armed, all requests of the group have to wait.
+ */
+static bool throttle_group_schedule_timer(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    int64_t now, wait;
+
+    if (tg->any_timer_armed[is_write]) {
+        return true;
+    }
+
+    now = qemu_get_clock_ns(vm_clock);
+    wait = throttle_wait_time(&tg->ts, is_write, now);
+    if (!wait) {
+        return false;
+    }
+
+    trace_throttle_group_schedule_timer(tg, bs, is_write, wait);
+    qemu_mod_timer(bs->throttle_timers[is_write], now + wait);
+    tg->tokens[is_write] = bs;
+    tg->any_timer_armed[is_write] = true;
+    return true;
+}
+
+/* Lets the next queued request of the group go, now or when it may */
+static void schedule_next_request(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token;
+
+    token = next_throttle_token(bs, is_write);
+    if (!token->pending_reqs[is_write]) {
+        return;
+    }
+
+    if (!throttle_group_schedule_timer(token, is_write)) {
+        /* Give preference to requests from the current device */
+        if (qemu_in_coroutine() &&
+            qemu_co_queue_next(&bs->throttled_reqs[is_write])) {
+            token = bs;
+        } else {
+            qemu_mod_timer(token->throttle_timers[is_write],
+                           qemu_get_clock_ns(vm_clock));
+            tg->any_timer_armed[is_write] = true;
+        }
+        tg->tokens[is_write] = token;
+    }
+}
+
+void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
+                                                        unsigned int bytes,
+                                                        bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token;
+    bool must_wait;
+
+    token = next_throttle_token(bs, is_write);
+    must_wait = throttle_group_schedule_timer(token, is_write);
+
+    /* Keep the order of requests: wait if others are queued already */
+    if (must_wait || bs->pending_reqs[is_write]) {
+        bs->pending_reqs[is_write]++;
+        qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
+        bs->pending_reqs[is_write]--;
+
+        /* Throttling may have been disabled in the meantime */
+        if (!bs->throttle_group) {
+            return;
+        }
+        tg = bs->throttle_group;
+    }
+
+    throttle_account(&tg->ts, is_write, bytes);
+    schedule_next_request(bs, is_write);
+}
+
+static void throttle_timer_cb(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+
+    tg->any_timer_armed[is_write] = false;
+
+    /* Run the request that waited for the timer, or pick the next one */
+    if (!qemu_co_queue_next(&bs->throttled_reqs[is_write])) {
+        schedule_next_request(bs, is_write);
+    }
+}
+
+static void throttle_read_timer_cb(void *opaque)
+{
+    throttle_timer_cb(opaque, false);
+}
+
+static void throttle_write_timer_cb(void *opaque)
+{
+    throttle_timer_cb(opaque, true);
+}
+
+/* Makes @bs a member of the group @groupname, creating it if needed */
+void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
+{
+    ThrottleGroup *tg = throttle_group_incref(groupname);
+    int i;
+
+    bs->throttle_group = tg;
+    for (i = 0; i < 2; i++) {
+        if (!tg->tokens[i]) {
+            tg->tokens[i] = bs;
+        }
+        qemu_co_queue_init(&bs->throttled_reqs[i]);
+    }
+    bs->throttle_timers[0] = qemu_new_timer_ns(vm_clock,
+                                               throttle_read_timer_cb, bs);
+    bs->throttle_timers[1] = qemu_new_timer_ns(vm_clock,
+                                               throttle_write_timer_cb, bs);
+    QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
+}
+
+/*
+ * Removes @bs from its group.  Requests that are still queued must have been
+ * restarted by the caller.
+ */
+void throttle_group_unregister_bs(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token;
+    bool was_armed[2];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        was_armed[i] = qemu_timer_pending(bs->throttle_timers[i]);
+        if (was_armed[i]) {
+            tg->any_timer_armed[i] = false;
+        }
+        if (tg->tokens[i] == bs) {
+            token = throttle_group_next_bs(bs);
+            tg->tokens[i] = token == bs ? NULL : token;
+        }
+        qemu_del_timer(bs->throttle_timers[i]);
+        qemu_free_timer(bs->throttle_timers[i]);
+        bs->throttle_timers[i] = NULL;
+    }
+
+    QLIST_REMOVE(bs, round_robin);
+    bs->throttle_group = NULL;
+
+    /* Someone else may have been waiting for the timer of @bs */
+    for (i = 0; i < 2; i++) {
+        if (was_armed[i] && tg->tokens[i]) {
+            schedule_next_request(tg->tokens[i], i);
+        }
+    }
+
+    throttle_group_unref(tg);
+}
+
+/*
+ * Changes the limits of the whole group of @bs.  The armed timer of @bs is
+ * cancelled; the caller restarts the requests of @bs, which are then checked
+ * against the new limits.
+ */
+void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (qemu_timer_pending(bs->throttle_timers[i])) {
+            qemu_del_timer(bs->throttle_timers[i]);
+            tg->any_timer_armed[i] = false;
+        }
+    }
+    throttle_config(&tg->ts, cfg, qemu_get_clock_ns(vm_clock));
+}
+
+void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    throttle_get_config(&bs->throttle_group->ts, cfg);
+}
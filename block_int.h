@@ -29,6 +29,8 @@
 #include "qemu-queue.h"
 #include "qemu-coroutine.h"
 #include "qemu-timer.h"
+#include "qemu/throttle.h"
+#include "block/accounting.h"
 #include "qapi-types.h"
 #include "qerror.h"
 #include "monitor.h"
@@ -37,13 +39,6 @@
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
 
-#define BLOCK_IO_LIMIT_READ     0
-#define BLOCK_IO_LIMIT_WRITE    1
-#define BLOCK_IO_LIMIT_TOTAL    2
-
-#define BLOCK_IO_SLICE_TIME     100000000
-#define NANOSECONDS_PER_SECOND  1000000000.0
-
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
 #define BLOCK_OPT_COMPAT6           "compat6"
@@ -56,17 +51,15 @@
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
 
-typedef struct BdrvTrackedRequest BdrvTrackedRequest;
-
-typedef struct BlockIOLimit {
-    int64_t bps[3];
-    int64_t iops[3];
-} BlockIOLimit;
-
-typedef struct BlockIOBaseValue {
-    uint64_t bytes[2];
-    uint64_t ios[2];
-} BlockIOBaseValue;
+typedef struct BdrvTrackedRequest {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    bool is_write;
+    QLIST_ENTRY(BdrvTrackedRequest) list;
+    Coroutine *co; /* owner, used for deadlock detection */
+    CoQueue wait_queue; /* coroutines blocked on this request */
+} BdrvTrackedRequest;
 
 struct BlockDriver {
     const char *format_name;
@@ -126,6 +119,12 @@ struct BlockDriver {
      */
     void (*bdrv_invalidate_cache)(BlockDriverState *bs);
 
+    /*
+     * Write back all metadata and stop updating the image, because another
+     * process takes it over.  bdrv_invalidate_cache() makes it usable again.
+     */
+    void (*bdrv_inactivate)(BlockDriverState *bs);
+
     /*
      * Flushes all data that was already written to the OS all the way down to
      * the disk (for example raw-posix calls fsync()).
@@ -145,6 +144,8 @@ struct BlockDriver {
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -165,6 +166,13 @@ struct BlockDriver {
     int (*bdrv_change_backing_file)(BlockDriverState *bs,
         const char *backing_file, const char *backing_fmt);
 
+    /*
+     * Returns whether the image can hold dirty bitmaps.  The driver saves
+     * the persistent bitmaps of @bs in bdrv_close and creates them again in
+     * bdrv_open.
+     */
+    bool (*bdrv_can_store_dirty_bitmaps)(BlockDriverState *bs);
+
     /* removable device specific */
     int (*bdrv_is_inserted)(BlockDriverState *bs);
     int (*bdrv_media_changed)(BlockDriverState *bs);
@@ -190,6 +198,13 @@ struct BlockDriver {
 
     void (*bdrv_debug_event)(BlockDriverState *bs, BlkDebugEvent event);
 
+    /*
+     * Requests issued between bdrv_io_plug() and bdrv_io_unplug() may be
+     * held back by the driver and submitted together on unplug.
+     */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
     /*
      * Returns 1 if newly created images are guaranteed to contain only
      * zeros, 0 otherwise.
@@ -235,24 +250,40 @@ struct BlockDriverState {
 
     NotifierList close_notifiers;
 
+    /* Callback before write request is processed */
+    NotifierWithReturnList before_write_notifiers;
+
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
-    /* the time for latest disk I/O */
-    int64_t slice_time;
-    int64_t slice_start;
-    int64_t slice_end;
-    BlockIOLimit io_limits;
-    BlockIOBaseValue  io_base;
-    CoQueue      throttled_reqs;
-    QEMUTimer    *block_timer;
+    /* I/O throttling; the limits belong to the throttle group, see
+     * block/throttle-groups.c.  Index 0 is for reads, 1 for writes. */
+    struct ThrottleGroup *throttle_group;
+    QLIST_ENTRY(BlockDriverState) round_robin;
+    CoQueue      throttled_reqs[2];
+    unsigned int pending_reqs[2];
+    QEMUTimer    *throttle_timers[2];
     bool         io_limits_enabled;
 
+    /* requested size of the L2 table cache and of its entries, in bytes,
+     * for formats that have one; 0 selects the driver default */
+    uint64_t l2_cache_size;
+    uint64_t l2_cache_entry_size;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    BlockLatencyHistogram latency_histogram[BDRV_MAX_IOTYPE];
+
+    /* read and write requests that the driver is processing, and the time
+     * in ns when their number last changed */
+    unsigned int in_flight;
+    int64_t in_flight_changed_ns;
+    /* time with requests in flight, and its integral over their number */
+    uint64_t busy_time_ns;
+    uint64_t queue_depth_time_ns;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -269,8 +300,7 @@ struct BlockDriverState {
     bool iostatus_enabled;
     BlockDeviceIoStatus iostatus;
     char device_name[32];
-    unsigned long *dirty_bitmap;
-    int64_t dirty_count;
+    QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
@@ -283,8 +313,12 @@ struct BlockDriverState {
 
 int get_tmp_filename(char *filename, int size);
 
-void bdrv_set_io_limits(BlockDriverState *bs,
-                        BlockIOLimit *io_limits);
+void bdrv_set_io_limits(BlockDriverState *bs, ThrottleConfig *cfg);
+void bdrv_get_io_limits(BlockDriverState *bs, ThrottleConfig *cfg);
+void bdrv_io_limits_update_group(BlockDriverState *bs, const char *group);
+const char *bdrv_io_limits_group(BlockDriverState *bs);
+void bdrv_set_l2_cache_size(BlockDriverState *bs, uint64_t cache_size,
+                            uint64_t entry_size);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
@@ -293,6 +327,17 @@ void bdrv_emit_qmp_error_event(const BlockDriverState *bdrv,
                                enum MonitorEvent ev,
                                BlockErrorAction action, bool is_read);
 
+/**
+ * bdrv_add_before_write_notifier:
+ *
+ * Register a callback that is invoked before write requests are processed but
+ * after any throttling or waiting for overlapping requests.  The callback
+ * receives the BdrvTrackedRequest of the write; a negative return value fails
+ * the write with that error.
+ */
+void bdrv_add_before_write_notifier(BlockDriverState *bs,
+                                    NotifierWithReturn *notifier);
+
 /**
  * stream_start:
  * @bs: Block device to operate on.
@@ -338,6 +383,10 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  * @bs: Block device to operate on.
  * @target: Block device to write to.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @granularity: The chunk size of the dirty bitmap, in bytes.  Must be a
+ * power of two and at least one sector.
+ * @buf_size: The amount of data that can be in flight at the same time, in
+ * bytes, or 0 for the default.
  * @mode: Whether to collapse all images in the chain to the target.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
@@ -351,10 +400,43 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  * @bs will be switched to read from @target.
  */
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
-                  int64_t speed, MirrorSyncMode mode,
-                  BlockdevOnError on_source_error,
+                  int64_t speed, int64_t granularity, int64_t buf_size,
+                  MirrorSyncMode mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+/*
+ * backup_start:
+ * @bs: Block device to operate on.
+ * @target: Block device to write to.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @sync_mode: What parts of the disk image should be copied to the
+ * destination.
+ * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
+ * @on_source_error: The action to take upon error reading from the source.
+ * @on_target_error: The action to take upon error writing to the target.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Start a backup operation on @bs.  Clusters in @bs are written to @target
+ * until the job is cancelled or all clusters have been copied.  Guest writes
+ * to a cluster that has not been copied yet first save the old contents to
+ * @target, so that @target ends up with a point-in-time copy of @bs taken
+ * when the job started.  The job takes ownership of @target.
+ *
+ * With MIRROR_SYNC_MODE_INCREMENTAL, only the clusters that are dirty in
+ * @sync_bitmap are copied.  The bitmap is cleared when the job starts; if
+ * the job does not complete successfully, the clusters are marked dirty
+ * again so that the next backup copies them.
+ */
+void backup_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
+                  BlockdevOnError on_source_error,
+                  BlockdevOnError on_target_error,
+                  BlockDriverCompletionFunc *cb, void *opaque,
+                  Error **errp);
+
 #endif /* BLOCK_INT_H */
@@ -76,6 +76,7 @@ static void nbd_server_put_ref(NBDExport *exp)
 }
 
 void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
+                        bool has_max_requests, int64_t max_requests,
                         Error **errp)
 {
     BlockDriverState *bs;
@@ -98,6 +99,13 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
         return;
     }
 
+    if (has_max_requests &&
+        (max_requests < 1 || max_requests > NBD_MAX_REQUESTS_LIMIT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "max-requests",
+                  "a value between 1 and 1024");
+        return;
+    }
+
     if (!has_writable) {
         writable = true;
     }
@@ -108,6 +116,9 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
     exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY,
                          nbd_server_put_ref);
 
+    if (has_max_requests) {
+        nbd_export_set_max_requests(exp, max_requests);
+    }
     nbd_export_set_name(exp, device);
     drive_get_ref(drive_get_by_blockdev(bs));
 
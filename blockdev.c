@@ -255,20 +255,19 @@ static int parse_block_error_action(const char *buf, bool is_read)
     }
 }
 
-static bool do_check_io_limits(BlockIOLimit *io_limits)
+static bool check_throttle_config(ThrottleConfig *cfg, Error **errp)
 {
-    bool bps_flag;
-    bool iops_flag;
-
-    assert(io_limits);
-
-    bps_flag  = (io_limits->bps[BLOCK_IO_LIMIT_TOTAL] != 0)
-                 && ((io_limits->bps[BLOCK_IO_LIMIT_READ] != 0)
-                 || (io_limits->bps[BLOCK_IO_LIMIT_WRITE] != 0));
-    iops_flag = (io_limits->iops[BLOCK_IO_LIMIT_TOTAL] != 0)
-                 && ((io_limits->iops[BLOCK_IO_LIMIT_READ] != 0)
-                 || (io_limits->iops[BLOCK_IO_LIMIT_WRITE] != 0));
-    if (bps_flag || iops_flag) {
+    if (throttle_conflicting(cfg)) {
+        error_setg(errp, "bps/bps_max (iops/iops_max) and "
+                   "bps_rd/bps_wr/bps_rd_max/bps_wr_max "
+                   "(iops_rd/iops_wr/iops_rd_max/iops_wr_max) "
+                   "cannot be used at the same time");
+        return false;
+    }
+
+    if (!throttle_is_valid(cfg)) {
+        error_setg(errp, "throttling limits must not be negative, and a "
+                   "burst size needs the matching rate limit");
         return false;
     }
 
@@ -293,7 +292,9 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     int on_read_error, on_write_error;
     const char *devaddr;
     DriveInfo *dinfo;
-    BlockIOLimit io_limits;
+    ThrottleConfig cfg;
+    const char *throttling_group;
+    Error *local_err = NULL;
     int snapshot = 0;
     bool copy_on_read;
     int ret;
@@ -414,22 +415,39 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     }
 
     /* disk I/O throttling */
-    io_limits.bps[BLOCK_IO_LIMIT_TOTAL]  =
-                           qemu_opt_get_number(opts, "bps", 0);
-    io_limits.bps[BLOCK_IO_LIMIT_READ]   =
-                           qemu_opt_get_number(opts, "bps_rd", 0);
-    io_limits.bps[BLOCK_IO_LIMIT_WRITE]  =
-                           qemu_opt_get_number(opts, "bps_wr", 0);
-    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] =
-                           qemu_opt_get_number(opts, "iops", 0);
-    io_limits.iops[BLOCK_IO_LIMIT_READ]  =
-                           qemu_opt_get_number(opts, "iops_rd", 0);
-    io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
-                           qemu_opt_get_number(opts, "iops_wr", 0);
-
-    if (!do_check_io_limits(&io_limits)) {
-        error_report("bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
-                     "cannot be used at the same time");
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg =
+        qemu_opt_get_number(opts, "bps", 0);
+    cfg.buckets[THROTTLE_BPS_READ].avg  =
+        qemu_opt_get_number(opts, "bps_rd", 0);
+    cfg.buckets[THROTTLE_BPS_WRITE].avg =
+        qemu_opt_get_number(opts, "bps_wr", 0);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg =
+        qemu_opt_get_number(opts, "iops", 0);
+    cfg.buckets[THROTTLE_OPS_READ].avg  =
+        qemu_opt_get_number(opts, "iops_rd", 0);
+    cfg.buckets[THROTTLE_OPS_WRITE].avg =
+        qemu_opt_get_number(opts, "iops_wr", 0);
+
+    cfg.buckets[THROTTLE_BPS_TOTAL].max =
+        qemu_opt_get_number(opts, "bps_max", 0);
+    cfg.buckets[THROTTLE_BPS_READ].max  =
+        qemu_opt_get_number(opts, "bps_rd_max", 0);
+    cfg.buckets[THROTTLE_BPS_WRITE].max =
+        qemu_opt_get_number(opts, "bps_wr_max", 0);
+    cfg.buckets[THROTTLE_OPS_TOTAL].max =
+        qemu_opt_get_number(opts, "iops_max", 0);
+    cfg.buckets[THROTTLE_OPS_READ].max  =
+        qemu_opt_get_number(opts, "iops_rd_max", 0);
+    cfg.buckets[THROTTLE_OPS_WRITE].max =
+        qemu_opt_get_number(opts, "iops_wr_max", 0);
+
+    cfg.op_size = qemu_opt_get_number(opts, "iops_size", 0);
+    throttling_group = qemu_opt_get(opts, "group");
+
+    if (!check_throttle_config(&cfg, &local_err)) {
+        error_report("%s", error_get_pretty(local_err));
+        error_free(local_err);
         return NULL;
     }
 
@@ -552,7 +570,15 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
 
     /* disk I/O throttling */
-    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+    if (throttle_enabled(&cfg)) {
+        bdrv_io_limits_enable(dinfo->bdrv,
+                              throttling_group ? throttling_group : dinfo->id);
+        bdrv_set_io_limits(dinfo->bdrv, &cfg);
+    }
+
+    bdrv_set_l2_cache_size(dinfo->bdrv,
+                           qemu_opt_get_size(opts, "l2-cache-size", 0),
+                           qemu_opt_get_size(opts, "l2-cache-entry-size", 0));
 
     switch(type) {
     case IF_IDE:
@@ -955,9 +981,18 @@ void qmp_change_blockdev(const char *device, const char *filename,
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                int64_t bps_wr, int64_t iops, int64_t iops_rd,
-                               int64_t iops_wr, Error **errp)
+                               int64_t iops_wr,
+                               bool has_bps_max, int64_t bps_max,
+                               bool has_bps_rd_max, int64_t bps_rd_max,
+                               bool has_bps_wr_max, int64_t bps_wr_max,
+                               bool has_iops_max, int64_t iops_max,
+                               bool has_iops_rd_max, int64_t iops_rd_max,
+                               bool has_iops_wr_max, int64_t iops_wr_max,
+                               bool has_iops_size, int64_t iops_size,
+                               bool has_group, const char *group,
+                               Error **errp)
 {
-    BlockIOLimit io_limits;
+    ThrottleConfig cfg;
     BlockDriverState *bs;
 
     bs = bdrv_find(device);
@@ -966,29 +1001,91 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         return;
     }
 
-    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = bps;
-    io_limits.bps[BLOCK_IO_LIMIT_READ]  = bps_rd;
-    io_limits.bps[BLOCK_IO_LIMIT_WRITE] = bps_wr;
-    io_limits.iops[BLOCK_IO_LIMIT_TOTAL]= iops;
-    io_limits.iops[BLOCK_IO_LIMIT_READ] = iops_rd;
-    io_limits.iops[BLOCK_IO_LIMIT_WRITE]= iops_wr;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = bps;
+    cfg.buckets[THROTTLE_BPS_READ].avg  = bps_rd;
+    cfg.buckets[THROTTLE_BPS_WRITE].avg = bps_wr;
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = iops;
+    cfg.buckets[THROTTLE_OPS_READ].avg  = iops_rd;
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = iops_wr;
+
+    cfg.buckets[THROTTLE_BPS_TOTAL].max = has_bps_max ? bps_max : 0;
+    cfg.buckets[THROTTLE_BPS_READ].max  = has_bps_rd_max ? bps_rd_max : 0;
+    cfg.buckets[THROTTLE_BPS_WRITE].max = has_bps_wr_max ? bps_wr_max : 0;
+    cfg.buckets[THROTTLE_OPS_TOTAL].max = has_iops_max ? iops_max : 0;
+    cfg.buckets[THROTTLE_OPS_READ].max  = has_iops_rd_max ? iops_rd_max : 0;
+    cfg.buckets[THROTTLE_OPS_WRITE].max = has_iops_wr_max ? iops_wr_max : 0;
+
+    cfg.op_size = has_iops_size ? iops_size : 0;
 
-    if (!do_check_io_limits(&io_limits)) {
-        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+    if (!check_throttle_config(&cfg, errp)) {
         return;
     }
 
-    bs->io_limits = io_limits;
-    bs->slice_time = BLOCK_IO_SLICE_TIME;
+    if (!throttle_enabled(&cfg)) {
+        if (bs->io_limits_enabled) {
+            bdrv_io_limits_disable(bs);
+        }
+        return;
+    }
 
-    if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_disable(bs);
+    if (!has_group) {
+        group = bs->io_limits_enabled ? bdrv_io_limits_group(bs) : device;
+    }
+
+    if (!bs->io_limits_enabled) {
+        bdrv_io_limits_enable(bs, group);
     } else {
-        if (bs->block_timer) {
-            qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
-        }
+        bdrv_io_limits_update_group(bs, group);
+    }
+
+    bdrv_set_io_limits(bs, &cfg);
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_start, int64_t start,
+                                     bool has_factor, int64_t factor,
+                                     bool has_count, int64_t count,
+                                     Error **errp)
+{
+    BlockDriverState *bs;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!has_start) {
+        start = BLOCK_LATENCY_HISTOGRAM_START;
+    }
+    if (!has_factor) {
+        factor = BLOCK_LATENCY_HISTOGRAM_FACTOR;
+    }
+    if (!has_count) {
+        count = BLOCK_LATENCY_HISTOGRAM_COUNT;
+    }
+
+    if (start <= 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "start",
+                  "a positive number");
+        return;
+    }
+    if (factor < 2) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "factor",
+                  "a number of at least 2");
+        return;
+    }
+    if (count < 0 || count > BLOCK_LATENCY_HISTOGRAM_MAX_COUNT) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "count",
+                  "a number between 0 and 64");
+        return;
+    }
+
+    ret = bdrv_set_latency_histogram(bs, start, factor, count);
+    if (ret < 0) {
+        error_setg(errp, "The limit of the last bin is too large");
     }
 }
 
@@ -1192,6 +1289,8 @@ void qmp_drive_mirror(const char *device, const char *target,
                       enum MirrorSyncMode sync,
                       bool has_mode, enum NewImageMode mode,
                       bool has_speed, int64_t speed,
+                      bool has_granularity, uint32_t granularity,
+                      bool has_buf_size, int64_t buf_size,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
                       Error **errp)
@@ -1218,6 +1317,25 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_mode) {
         mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
     }
+    if (!has_granularity) {
+        granularity = 0;
+    }
+    if (!has_buf_size) {
+        buf_size = 0;
+    }
+
+    if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "granularity");
+        return;
+    }
+    if (granularity & (granularity - 1)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "granularity");
+        return;
+    }
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        error_set(errp, QERR_INVALID_PARAMETER, "sync");
+        return;
+    }
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -1296,9 +1414,22 @@ void qmp_drive_mirror(const char *device, const char *target,
         return;
     }
 
+    if (bdrv_get_info(target_bs, &bdi) < 0) {
+        bdi.cluster_size = 0;
+    }
+    if (granularity == 0) {
+        /* Choose the default granularity based on the target file's cluster
+         * size, clamped between 4k and 64k.  */
+        if (bdi.cluster_size != 0) {
+            granularity = MAX(4096, bdi.cluster_size);
+            granularity = MIN(65536, granularity);
+        } else {
+            granularity = 65536;
+        }
+    }
+
     /* We need a backing file if we will copy parts of a cluster.  */
-    if (bdrv_get_info(target_bs, &bdi) >= 0 && bdi.cluster_size != 0 &&
-        bdi.cluster_size >= BDRV_SECTORS_PER_DIRTY_CHUNK * 512) {
+    if (bdi.cluster_size > granularity) {
         ret = bdrv_open_backing_file(target_bs);
         if (ret < 0) {
             bdrv_delete(target_bs);
@@ -1307,7 +1438,8 @@ void qmp_drive_mirror(const char *device, const char *target,
         }
     }
 
-    mirror_start(bs, target_bs, speed, sync, on_source_error, on_target_error,
+    mirror_start(bs, target_bs, speed, granularity, buf_size, sync,
+                 on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_delete(target_bs);
@@ -1321,6 +1453,266 @@ void qmp_drive_mirror(const char *device, const char *target,
     drive_get_ref(drive_get_by_blockdev(bs));
 }
 
+void qmp_drive_backup(const char *device, const char *target,
+                      bool has_format, const char *format,
+                      enum MirrorSyncMode sync,
+                      bool has_bitmap, const char *bitmap,
+                      bool has_mode, enum NewImageMode mode,
+                      bool has_speed, int64_t speed,
+                      bool has_on_source_error, BlockdevOnError on_source_error,
+                      bool has_on_target_error, BlockdevOnError on_target_error,
+                      Error **errp)
+{
+    BlockDriverState *bs;
+    BlockDriverState *source, *target_bs;
+    BdrvDirtyBitmap *sync_bitmap = NULL;
+    BlockDriver *proto_drv;
+    BlockDriver *drv = NULL;
+    Error *local_err = NULL;
+    int flags;
+    uint64_t size;
+    int ret;
+
+    if (!has_speed) {
+        speed = 0;
+    }
+    if (!has_on_source_error) {
+        on_source_error = BLOCKDEV_ON_ERROR_REPORT;
+    }
+    if (!has_on_target_error) {
+        on_target_error = BLOCKDEV_ON_ERROR_REPORT;
+    }
+    if (!has_mode) {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (!has_format) {
+        format = mode == NEW_IMAGE_MODE_EXISTING ? NULL : bs->drv->format_name;
+    }
+    if (format) {
+        drv = bdrv_find_format(format);
+        if (!drv) {
+            error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
+            return;
+        }
+    }
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        if (!has_bitmap) {
+            error_set(errp, QERR_MISSING_PARAMETER, "bitmap");
+            return;
+        }
+        sync_bitmap = bdrv_find_dirty_bitmap(bs, bitmap);
+        if (!sync_bitmap) {
+            error_setg(errp, "Dirty bitmap '%s' not found", bitmap);
+            return;
+        }
+        if (bdrv_dirty_bitmap_is_frozen(sync_bitmap)) {
+            error_setg(errp, "Dirty bitmap '%s' is in use", bitmap);
+            return;
+        }
+    } else if (has_bitmap) {
+        error_set(errp, QERR_INVALID_PARAMETER, "bitmap");
+        return;
+    }
+
+    flags = bs->open_flags | BDRV_O_RDWR;
+
+    /* The target only receives the data that the job copies; the rest is
+     * read from the backing file.  With sync=none that is the device itself,
+     * as it was when the job started.
+     */
+    source = NULL;
+    if (sync == MIRROR_SYNC_MODE_TOP) {
+        source = bs->backing_hd;
+        if (!source) {
+            sync = MIRROR_SYNC_MODE_FULL;
+        }
+    } else if (sync == MIRROR_SYNC_MODE_NONE) {
+        source = bs;
+    }
+
+    proto_drv = bdrv_find_protocol(target);
+    if (!proto_drv) {
+        error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
+        return;
+    }
+
+    size = bdrv_getlength(bs);
+    if ((int64_t)size < 0) {
+        error_set(errp, QERR_IO_ERROR);
+        return;
+    }
+
+    if (mode != NEW_IMAGE_MODE_EXISTING) {
+        assert(format && drv);
+        if (source) {
+            ret = bdrv_img_create(target, format, source->filename,
+                                  source->drv->format_name, NULL,
+                                  size, flags);
+        } else {
+            ret = bdrv_img_create(target, format, NULL, NULL, NULL,
+                                  size, flags);
+        }
+        if (ret) {
+            error_set(errp, QERR_OPEN_FILE_FAILED, target);
+            return;
+        }
+    }
+
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, flags, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        error_set(errp, QERR_OPEN_FILE_FAILED, target);
+        return;
+    }
+
+    backup_start(bs, target_bs, speed, sync, sync_bitmap,
+                 on_source_error, on_target_error,
+                 block_job_cb, bs, &local_err);
+    if (local_err != NULL) {
+        bdrv_delete(target_bs);
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* Grab a reference so hotplug does not delete the BlockDriverState from
+     * underneath us.
+     */
+    drive_get_ref(drive_get_by_blockdev(bs));
+}
+
+/* Looks up a named dirty bitmap, or sets @errp */
+static BdrvDirtyBitmap *find_dirty_bitmap(const char *device, const char *name,
+                                          BlockDriverState **pbs,
+                                          Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return NULL;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found", name);
+        return NULL;
+    }
+
+    *pbs = bs;
+    return bitmap;
+}
+
+void qmp_block_dirty_bitmap_add(const char *device, const char *name,
+                                bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    BlockDriverInfo bdi;
+    Error *local_err = NULL;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (has_granularity) {
+        if (granularity < 512 || granularity > 1048576 * 64 ||
+            (granularity & (granularity - 1))) {
+            error_set(errp, QERR_INVALID_PARAMETER, "granularity");
+            return;
+        }
+    } else {
+        /* Same default as drive-mirror, based on the image cluster size */
+        if (bdrv_get_info(bs, &bdi) >= 0 && bdi.cluster_size != 0) {
+            granularity = MAX(4096, bdi.cluster_size);
+            granularity = MIN(65536, granularity);
+        } else {
+            granularity = 65536;
+        }
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (has_persistent && persistent) {
+        bdrv_dirty_bitmap_set_persistent(bs, bitmap, true, &local_err);
+        if (local_err) {
+            bdrv_release_dirty_bitmap(bs, bitmap);
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+}
+
+void qmp_block_dirty_bitmap_remove(const char *device, const char *name,
+                                   Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = find_dirty_bitmap(device, name, &bs, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (bdrv_dirty_bitmap_is_frozen(bitmap)) {
+        error_setg(errp, "Dirty bitmap '%s' is in use", name);
+        return;
+    }
+
+    bdrv_release_dirty_bitmap(bs, bitmap);
+}
+
+void qmp_block_dirty_bitmap_clear(const char *device, const char *name,
+                                  Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = find_dirty_bitmap(device, name, &bs, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (bdrv_dirty_bitmap_is_frozen(bitmap)) {
+        error_setg(errp, "Dirty bitmap '%s' is in use", name);
+        return;
+    }
+
+    bdrv_clear_dirty_bitmap(bitmap);
+}
+
 static BlockJob *find_block_job(const char *device)
 {
     BlockDriverState *bs;
@@ -0,0 +1,434 @@
+/*
+ * Buffer scanning primitives with SIMD implementations
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "host-utils.h"
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+#define BUFFER_ACCEL_X86
+#include <cpuid.h>
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+#endif
+
+#ifdef __ALTIVEC__
+#include <altivec.h>
+#define VECTYPE        vector unsigned char
+#define SPLAT(p)       vec_splat(vec_ld(0, p), 0)
+#define ALL_EQ(v1, v2) vec_all_eq(v1, v2)
+/* altivec.h may redefine the bool macro as vector type.
+ * Reset it to POSIX semantics. */
+#undef bool
+#define bool _Bool
+#else
+#define VECTYPE        unsigned long
+#define SPLAT(p)       (*(p) * (~0UL / 255))
+#define ALL_EQ(v1, v2) ((v1) == (v2))
+#endif
+
+typedef struct BufferAccelOps {
+    const char *name;
+    bool (*is_zero)(const void *buf, size_t len);
+    bool (*is_dup)(const void *buf, size_t len);
+    size_t (*find_diff)(const uint8_t *a, const uint8_t *b, size_t len);
+    size_t (*find_same)(const uint8_t *a, const uint8_t *b, size_t len);
+} BufferAccelOps;
+
+static inline unsigned long load_long(const uint8_t *p)
+{
+    unsigned long v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static bool is_zero_generic(const void *buf, size_t len)
+{
+    /*
+     * Use long as the biggest available internal data type that fits into the
+     * CPU register and unroll the loop to smooth out the effect of memory
+     * latency.
+     */
+
+    size_t i;
+    long d0, d1, d2, d3;
+    const long * const data = buf;
+
+    len /= sizeof(long);
+
+    for (i = 0; i < len; i += 4) {
+        d0 = data[i + 0];
+        d1 = data[i + 1];
+        d2 = data[i + 2];
+        d3 = data[i + 3];
+
+        if (d0 || d1 || d2 || d3) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool is_dup_generic(const void *buf, size_t len)
+{
+    const VECTYPE *p = buf;
+    VECTYPE val = SPLAT((const uint8_t *)buf);
+    size_t i;
+
+    for (i = 0; i < len / sizeof(VECTYPE); i++) {
+        if (!ALL_EQ(val, p[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static size_t find_diff_generic(const uint8_t *a, const uint8_t *b,
+                                size_t len)
+{
+    size_t i = 0;
+
+    while (i + sizeof(long) <= len && load_long(a + i) == load_long(b + i)) {
+        i += sizeof(long);
+    }
+    while (i < len && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+static size_t find_same_generic(const uint8_t *a, const uint8_t *b,
+                                size_t len)
+{
+    /* truncation to 32-bit long okay */
+    const unsigned long mask = (unsigned long)0x0101010101010101ULL;
+    size_t i = 0;
+
+    while (i + sizeof(long) <= len) {
+        unsigned long xor = load_long(a + i) ^ load_long(b + i);
+
+        /* a zero byte in xor is a byte that did not change */
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            break;
+        }
+        i += sizeof(long);
+    }
+    while (i < len && a[i] != b[i]) {
+        i++;
+    }
+    return i;
+}
+
+static const BufferAccelOps buffer_accel_generic = {
+    .name = "generic",
+    .is_zero = is_zero_generic,
+    .is_dup = is_dup_generic,
+    .find_diff = find_diff_generic,
+    .find_same = find_same_generic,
+};
+
+#ifdef BUFFER_ACCEL_X86
+
+#ifdef CONFIG_AVX2_OPT
+#define SSE2_FN __attribute__((target("sse2")))
+#else
+#define SSE2_FN
+#endif
+
+static SSE2_FN bool is_zero_sse2(const void *buf, size_t len)
+{
+    const __m128i *p = buf;
+    __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    /* len is a multiple of 16, see buffer_is_zero() */
+    for (i = 0; i + 1 < len / 16; i += 2) {
+        __m128i v = _mm_or_si128(_mm_loadu_si128(p + i),
+                                 _mm_loadu_si128(p + i + 1));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+    if (i < len / 16) {
+        __m128i v = _mm_loadu_si128(p + i);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) == 0xFFFF;
+    }
+    return true;
+}
+
+static SSE2_FN bool is_dup_sse2(const void *buf, size_t len)
+{
+    const __m128i *p = buf;
+    __m128i val = _mm_set1_epi8(*(const uint8_t *)buf);
+    size_t i;
+
+    for (i = 0; i < len / 16; i++) {
+        __m128i v = _mm_cmpeq_epi8(val, _mm_load_si128(p + i));
+        if (_mm_movemask_epi8(v) != 0xFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static SSE2_FN size_t find_diff_sse2(const uint8_t *a, const uint8_t *b,
+                                     size_t len)
+{
+    size_t i = 0;
+
+    while (i + 16 <= len) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+
+        if (mask != 0xFFFF) {
+            return i + ctz32(~mask);
+        }
+        i += 16;
+    }
+    return i + find_diff_generic(a + i, b + i, len - i);
+}
+
+static SSE2_FN size_t find_same_sse2(const uint8_t *a, const uint8_t *b,
+                                     size_t len)
+{
+    size_t i = 0;
+
+    while (i + 16 <= len) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += 16;
+    }
+    return i + find_same_generic(a + i, b + i, len - i);
+}
+
+static const BufferAccelOps buffer_accel_sse2 = {
+    .name = "sse2",
+    .is_zero = is_zero_sse2,
+    .is_dup = is_dup_sse2,
+    .find_diff = find_diff_sse2,
+    .find_same = find_same_sse2,
+};
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static bool is_zero_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    size_t i;
+
+    /* len is a multiple of 16, see buffer_is_zero() */
+    for (i = 0; i + 1 < len / 32; i += 2) {
+        __m256i v = _mm256_or_si256(_mm256_loadu_si256(p + i),
+                                    _mm256_loadu_si256(p + i + 1));
+        if (!_mm256_testz_si256(v, v)) {
+            return false;
+        }
+    }
+    if (i < len / 32) {
+        __m256i v = _mm256_loadu_si256(p + i);
+        if (!_mm256_testz_si256(v, v)) {
+            return false;
+        }
+    }
+    if (len & 16) {
+        return is_zero_sse2((const uint8_t *)buf + (len & ~(size_t)31), 16);
+    }
+    return true;
+}
+
+static bool is_dup_avx2(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    __m256i val = _mm256_set1_epi8(*p);
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_cmpeq_epi8(val,
+                                      _mm256_loadu_si256((const __m256i *)
+                                                         (p + i)));
+        if ((uint32_t)_mm256_movemask_epi8(v) != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return i == len || (p[i] == p[0] && is_dup_sse2(p + i, len - i));
+}
+
+static size_t find_diff_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+
+    while (i + 32 <= len) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+
+        if (mask != 0xFFFFFFFF) {
+            return i + ctz32(~mask);
+        }
+        i += 32;
+    }
+    return i + find_diff_sse2(a + i, b + i, len - i);
+}
+
+static size_t find_same_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+
+    while (i + 32 <= len) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += 32;
+    }
+    return i + find_same_sse2(a + i, b + i, len - i);
+}
+
+#pragma GCC pop_options
+
+static const BufferAccelOps buffer_accel_avx2 = {
+    .name = "avx2",
+    .is_zero = is_zero_avx2,
+    .is_dup = is_dup_avx2,
+    .find_diff = find_diff_avx2,
+    .find_same = find_same_avx2,
+};
+#endif /* CONFIG_AVX2_OPT */
+
+static bool buffer_accel_supported(BufferAccel accel)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+
+    switch (accel) {
+    case BUFFER_ACCEL_SSE2:
+        return edx & bit_SSE2;
+#ifdef CONFIG_AVX2_OPT
+    case BUFFER_ACCEL_AVX2: {
+        uint32_t xcr0_lo, xcr0_hi;
+
+        /* the OS must save the ymm registers across context switches */
+        if ((ecx & (bit_OSXSAVE | bit_AVX)) != (bit_OSXSAVE | bit_AVX)) {
+            return false;
+        }
+        asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+        if ((xcr0_lo & 6) != 6 || __get_cpuid_max(0, NULL) < 7) {
+            return false;
+        }
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return ebx & bit_AVX2;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+#endif /* BUFFER_ACCEL_X86 */
+
+static const BufferAccelOps *buffer_accel_ops(BufferAccel accel)
+{
+    switch (accel) {
+    case BUFFER_ACCEL_GENERIC:
+        return &buffer_accel_generic;
+#ifdef BUFFER_ACCEL_X86
+    case BUFFER_ACCEL_SSE2:
+        return buffer_accel_supported(accel) ? &buffer_accel_sse2 : NULL;
+#ifdef CONFIG_AVX2_OPT
+    case BUFFER_ACCEL_AVX2:
+        return buffer_accel_supported(accel) ? &buffer_accel_avx2 : NULL;
+#endif
+#endif
+    default:
+        return NULL;
+    }
+}
+
+static const BufferAccelOps *buffer_ops = &buffer_accel_generic;
+static BufferAccel buffer_accel = BUFFER_ACCEL_GENERIC;
+
+bool buffer_accel_select(BufferAccel accel)
+{
+    const BufferAccelOps *ops = buffer_accel_ops(accel);
+
+    if (!ops) {
+        return false;
+    }
+    buffer_ops = ops;
+    buffer_accel = accel;
+    return true;
+}
+
+BufferAccel buffer_accel_current(void)
+{
+    return buffer_accel;
+}
+
+const char *buffer_accel_name(BufferAccel accel)
+{
+    const BufferAccelOps *ops = buffer_accel_ops(accel);
+
+    return ops ? ops->name : NULL;
+}
+
+static void __attribute__((constructor)) buffer_accel_init(void)
+{
+    int accel;
+
+    for (accel = BUFFER_ACCEL_MAX - 1; accel > BUFFER_ACCEL_GENERIC; accel--) {
+        if (buffer_accel_select(accel)) {
+            break;
+        }
+    }
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * Attention! The len must be a multiple of 4 * sizeof(long) due to
+ * restriction of optimizations in this function.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    assert(len % (4 * sizeof(long)) == 0);
+    return buffer_ops->is_zero(buf, len);
+}
+
+bool buffer_is_dup(const void *buf, size_t len)
+{
+    assert(((uintptr_t)buf | len) % 16 == 0);
+    return buffer_ops->is_dup(buf, len);
+}
+
+size_t buffer_find_diff(const void *a, const void *b, size_t len)
+{
+    return buffer_ops->find_diff(a, b, len);
+}
+
+size_t buffer_find_same(const void *a, const void *b, size_t len)
+{
+    return buffer_ops->find_same(a, b, len);
+}
@@ -194,6 +194,14 @@ CoroutineAction qemu_coroutine_switch(Coroutine *from_,
     return from->action;
 }
 
+/* The thread of a coroutine exits when it terminates, so there is nothing
+ * to recycle.
+ */
+CoroutinePool *qemu_coroutine_thread_pool(void)
+{
+    return NULL;
+}
+
 Coroutine *qemu_coroutine_self(void)
 {
     CoroutineGThread *co = get_coroutine_key();
@@ -33,15 +33,6 @@
 #include "qemu-common.h"
 #include "qemu-coroutine-int.h"
 
-enum {
-    /* Maximum free pool size prevents holding too many freed coroutines */
-    POOL_MAX_SIZE = 64,
-};
-
-/** Free list to speed up creation */
-static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int pool_size;
-
 typedef struct {
     Coroutine base;
     void *stack;
@@ -58,6 +49,9 @@ typedef struct {
     /** The default coroutine */
     CoroutineUContext leader;
 
+    /** Free list to speed up creation */
+    CoroutinePool pool;
+
     /** Information for the signal handler (trampoline) */
     jmp_buf tr_reenter;
     volatile sig_atomic_t tr_called;
@@ -82,20 +76,10 @@ static void qemu_coroutine_thread_cleanup(void *opaque)
 {
     CoroutineThreadState *s = opaque;
 
+    qemu_coroutine_pool_cleanup(&s->pool);
     g_free(s);
 }
 
-static void __attribute__((destructor)) coroutine_cleanup(void)
-{
-    Coroutine *co;
-    Coroutine *tmp;
-
-    QSLIST_FOREACH_SAFE(co, &pool, pool_next, tmp) {
-        g_free(DO_UPCAST(CoroutineUContext, base, co)->stack);
-        g_free(co);
-    }
-}
-
 static void __attribute__((constructor)) coroutine_init(void)
 {
     int ret;
@@ -274,29 +258,13 @@ static Coroutine *coroutine_new(void)
 
 Coroutine *qemu_coroutine_new(void)
 {
-    Coroutine *co;
-
-    co = QSLIST_FIRST(&pool);
-    if (co) {
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
-        pool_size--;
-    } else {
-        co = coroutine_new();
-    }
-    return co;
+    return coroutine_new();
 }
 
 void qemu_coroutine_delete(Coroutine *co_)
 {
     CoroutineUContext *co = DO_UPCAST(CoroutineUContext, base, co_);
 
-    if (pool_size < POOL_MAX_SIZE) {
-        QSLIST_INSERT_HEAD(&pool, &co->base, pool_next);
-        co->base.caller = NULL;
-        pool_size++;
-        return;
-    }
-
     g_free(co->stack);
     g_free(co);
 }
@@ -318,6 +286,13 @@ CoroutineAction qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
     return ret;
 }
 
+CoroutinePool *qemu_coroutine_thread_pool(void)
+{
+    CoroutineThreadState *s = coroutine_get_thread_state();
+
+    return &s->pool;
+}
+
 Coroutine *qemu_coroutine_self(void)
 {
     CoroutineThreadState *s = coroutine_get_thread_state();
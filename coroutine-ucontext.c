@@ -34,19 +34,22 @@
 #include <valgrind/valgrind.h>
 #endif
 
-enum {
-    /* Maximum free pool size prevents holding too many freed coroutines */
-    POOL_MAX_SIZE = 64,
-};
-
-/** Free list to speed up creation */
-static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int pool_size;
+/* On x86-64 a few lines of assembly switch stacks and save only the
+ * callee-saved registers, which is cheaper than setjmp()/longjmp().  MXCSR
+ * and the x87 control word are not switched; QEMU never changes them.
+ */
+#if defined(__x86_64__) && defined(__LP64__) && defined(__ELF__)
+#define COROUTINE_ASM_SWITCH
+#endif
 
 typedef struct {
     Coroutine base;
     void *stack;
+#ifdef COROUTINE_ASM_SWITCH
+    void *sp;
+#else
     jmp_buf env;
+#endif
 
 #ifdef CONFIG_VALGRIND_H
     unsigned int valgrind_stack_id;
@@ -63,6 +66,9 @@ typedef struct {
 
     /** The default coroutine */
     CoroutineUContext leader;
+
+    /** Free list to speed up creation */
+    CoroutinePool pool;
 } CoroutineThreadState;
 
 static pthread_key_t thread_state_key;
@@ -93,20 +99,10 @@ static void qemu_coroutine_thread_cleanup(void *opaque)
 {
     CoroutineThreadState *s = opaque;
 
+    qemu_coroutine_pool_cleanup(&s->pool);
     g_free(s);
 }
 
-static void __attribute__((destructor)) coroutine_cleanup(void)
-{
-    Coroutine *co;
-    Coroutine *tmp;
-
-    QSLIST_FOREACH_SAFE(co, &pool, pool_next, tmp) {
-        g_free(DO_UPCAST(CoroutineUContext, base, co)->stack);
-        g_free(co);
-    }
-}
-
 static void __attribute__((constructor)) coroutine_init(void)
 {
     int ret;
@@ -118,6 +114,80 @@ static void __attribute__((constructor)) coroutine_init(void)
     }
 }
 
+#ifdef COROUTINE_ASM_SWITCH
+/* Push the callee-saved registers, store the stack pointer in *from_sp and
+ * pop the registers saved on the stack at to_sp.  The coroutine that is
+ * switched to sees action as the return value.
+ */
+CoroutineAction coroutine_asm_switch(void **from_sp, void *to_sp,
+                                     CoroutineAction action)
+    __attribute__((visibility("hidden")));
+
+asm(".pushsection .text\n"
+    ".p2align 4\n"
+    ".globl coroutine_asm_switch\n"
+    ".hidden coroutine_asm_switch\n"
+    ".type coroutine_asm_switch, @function\n"
+    "coroutine_asm_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    movl %edx, %eax\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coroutine_asm_switch, .-coroutine_asm_switch\n"
+    ".popsection\n");
+
+/* Entered by the first switch to a new coroutine, which is already current */
+static void coroutine_asm_start(void)
+{
+    Coroutine *co = coroutine_get_thread_state()->current;
+
+    while (true) {
+        co->entry(co->entry_arg);
+        qemu_coroutine_switch(co, co->caller, COROUTINE_TERMINATE);
+    }
+}
+
+static Coroutine *coroutine_new(void)
+{
+    const size_t stack_size = 1 << 20;
+    CoroutineUContext *co;
+    void **sp;
+
+    co = g_malloc0(sizeof(*co));
+    co->stack = g_malloc(stack_size);
+
+    /* Lay out what coroutine_asm_switch() pops: zeroed registers and
+     * coroutine_asm_start() as the return address.  The NULL above it stands
+     * in for the return address of coroutine_asm_start(), so that the stack
+     * is aligned as if it had been called.
+     */
+    sp = (void **)(((uintptr_t)co->stack + stack_size) & ~(uintptr_t)15);
+    *--sp = NULL;
+    *--sp = (void *)coroutine_asm_start;
+    sp -= 6;
+    memset(sp, 0, 6 * sizeof(*sp));
+    co->sp = sp;
+
+#ifdef CONFIG_VALGRIND_H
+    co->valgrind_stack_id =
+        VALGRIND_STACK_REGISTER(co->stack, co->stack + stack_size);
+#endif
+
+    return &co->base;
+}
+#else
 static void coroutine_trampoline(int i0, int i1)
 {
     union cc_arg arg;
@@ -184,19 +254,11 @@ static Coroutine *coroutine_new(void)
     }
     return &co->base;
 }
+#endif
 
 Coroutine *qemu_coroutine_new(void)
 {
-    Coroutine *co;
-
-    co = QSLIST_FIRST(&pool);
-    if (co) {
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
-        pool_size--;
-    } else {
-        co = coroutine_new();
-    }
-    return co;
+    return coroutine_new();
 }
 
 #ifdef CONFIG_VALGRIND_H
@@ -217,13 +279,6 @@ void qemu_coroutine_delete(Coroutine *co_)
 {
     CoroutineUContext *co = DO_UPCAST(CoroutineUContext, base, co_);
 
-    if (pool_size < POOL_MAX_SIZE) {
-        QSLIST_INSERT_HEAD(&pool, &co->base, pool_next);
-        co->base.caller = NULL;
-        pool_size++;
-        return;
-    }
-
 #ifdef CONFIG_VALGRIND_H
     valgrind_stack_deregister(co);
 #endif
@@ -238,15 +293,28 @@ CoroutineAction qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
     CoroutineUContext *from = DO_UPCAST(CoroutineUContext, base, from_);
     CoroutineUContext *to = DO_UPCAST(CoroutineUContext, base, to_);
     CoroutineThreadState *s = coroutine_get_thread_state();
+#ifndef COROUTINE_ASM_SWITCH
     int ret;
+#endif
 
     s->current = to_;
 
+#ifdef COROUTINE_ASM_SWITCH
+    return coroutine_asm_switch(&from->sp, to->sp, action);
+#else
     ret = setjmp(from->env);
     if (ret == 0) {
         longjmp(to->env, action);
     }
     return ret;
+#endif
+}
+
+CoroutinePool *qemu_coroutine_thread_pool(void)
+{
+    CoroutineThreadState *s = coroutine_get_thread_state();
+
+    return &s->pool;
 }
 
 Coroutine *qemu_coroutine_self(void)
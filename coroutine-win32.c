@@ -77,6 +77,12 @@ void qemu_coroutine_delete(Coroutine *co_)
     g_free(co);
 }
 
+/* There is no hook to free a pool when its thread exits */
+CoroutinePool *qemu_coroutine_thread_pool(void)
+{
+    return NULL;
+}
+
 Coroutine *qemu_coroutine_self(void)
 {
     if (!current) {
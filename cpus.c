@@ -669,6 +669,31 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     }
 }
 
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_is_self(cpu)) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+
+    qemu_cpu_kick(cpu);
+}
+
 static void flush_queued_work(CPUState *cpu)
 {
     struct qemu_work_item *wi;
@@ -680,12 +705,102 @@ static void flush_queued_work(CPUState *cpu)
     while ((wi = cpu->queued_work_first)) {
         cpu->queued_work_first = wi->next;
         wi->func(wi->data);
-        wi->done = true;
+        if (wi->free) {
+            g_free(wi);
+        } else {
+            wi->done = true;
+        }
     }
     cpu->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
+/* vCPU throttling
+ *
+ * While throttling is active, every vCPU thread is made to sleep for
+ * percentage / (100 - percentage) of a CPU_THROTTLE_TIMESLICE_MS time slice,
+ * once per time slice it gets to run.  The sleep is queued as work for the
+ * vCPU, so it happens outside of guest mode and without the global mutex.
+ */
+
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_MS 10
+
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+
+static void cpu_throttle_thread(void *opaque)
+{
+    CPUState *cpu = opaque;
+    CPUArchState *self_env = cpu_single_env;
+    int pct = throttle_percentage;
+
+    if (pct) {
+        qemu_mutex_unlock(&qemu_global_mutex);
+        g_usleep(pct * CPU_THROTTLE_TIMESLICE_MS * 1000 / (100 - pct));
+        qemu_mutex_lock(&qemu_global_mutex);
+        cpu_single_env = self_env;
+    }
+    cpu->throttle_thread_scheduled = false;
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUArchState *env;
+    int pct = throttle_percentage;
+
+    if (!pct) {
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        if (!cpu->throttle_thread_scheduled) {
+            cpu->throttle_thread_scheduled = true;
+            async_run_on_cpu(cpu, cpu_throttle_thread, cpu);
+        }
+        /* a single thread runs all TCG vCPUs */
+        if (!kvm_enabled()) {
+            break;
+        }
+    }
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ms(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_MS * 100 / (100 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ms(rt_clock, cpu_throttle_timer_tick,
+                                           NULL);
+    }
+    throttle_percentage = new_throttle_pct;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ms(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_MS);
+}
+
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+    if (throttle_timer) {
+        qemu_del_timer(throttle_timer);
+    }
+}
+
+bool cpu_throttle_active(void)
+{
+    return throttle_percentage != 0;
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 static void qemu_wait_io_event_common(CPUState *cpu)
 {
     if (cpu->stop) {
@@ -13,6 +13,13 @@ void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+/* Throttling slows down the vCPUs by making them sleep for the given
+ * percentage of the time.  Must be called with the iothread lock held. */
+void cpu_throttle_set(int new_throttle_pct);
+void cpu_throttle_stop(void);
+bool cpu_throttle_active(void);
+int cpu_throttle_get_percentage(void);
+
 /* vl.c */
 extern int smp_cores;
 extern int smp_threads;
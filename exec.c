@@ -36,6 +36,7 @@
 #include "memory.h"
 #include "dma.h"
 #include "exec-memory.h"
+#include "bitmap.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -56,6 +57,7 @@
 #else /* !CONFIG_USER_ONLY */
 #include "xen-mapcache.h"
 #include "trace.h"
+#include "migration.h"
 #endif
 #include "cpu-all.h"
 
@@ -1881,6 +1883,34 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     }
 }
 
+/* Same as cpu_physical_memory_reset_dirty, but also sets the bit of each
+ * page that was dirty in @bitmap.  Returns the number of bits that were
+ * newly set.  Note: start and end must be within the same ram block.  */
+uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *bitmap,
+                                               ram_addr_t start,
+                                               ram_addr_t end,
+                                               int dirty_flag)
+{
+    uintptr_t length;
+    uint64_t num_dirty;
+
+    start &= TARGET_PAGE_MASK;
+    end = TARGET_PAGE_ALIGN(end);
+
+    length = end - start;
+    if (length == 0) {
+        return 0;
+    }
+    num_dirty = bitmap_sync_bytemap(bitmap, ram_list.phys_dirty,
+                                    start >> TARGET_PAGE_BITS,
+                                    length >> TARGET_PAGE_BITS, dirty_flag);
+
+    if (tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, end, length);
+    }
+    return num_dirty;
+}
+
 static int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -3661,6 +3691,9 @@ void *address_space_map(AddressSpace *as,
     }
     rlen = todo;
     ret = qemu_ram_ptr_length(raddr, &rlen);
+    /* callers pass the mapping to system calls, which cannot wait for
+     * pages that are still in flight from a post-copy migration */
+    ram_postcopy_fault_in(ret, rlen);
     *plen = rlen;
     return ret;
 }
@@ -1022,6 +1022,26 @@ STEXI
 @findex drive_mirror
 Start mirroring a block device's writes to a new destination,
 using the specified target.
+ETEXI
+
+    {
+        .name       = "drive_backup",
+        .args_type  = "reuse:-n,full:-f,device:B,target:s,format:s?",
+        .params     = "[-n] [-f] device target [format]",
+        .help       = "initiates a point-in-time\n\t\t\t"
+                      "copy for a device. The device's contents are\n\t\t\t"
+                      "copied to the new image file, excluding data that\n\t\t\t"
+                      "is written after the command is started.\n\t\t\t"
+                      "The -n flag requests QEMU to reuse the image found\n\t\t\t"
+                      "in new-image-file, instead of recreating it from scratch.\n\t\t\t"
+                      "The -f flag requests QEMU to copy the whole disk,\n\t\t\t"
+                      "so that the result does not need a backing file.\n\t\t\t",
+        .mhandler.cmd = hmp_drive_backup,
+    },
+STEXI
+@item drive_backup
+@findex drive_backup
+Start a point-in-time copy of a block device to a specified target.
 ETEXI
 
     {
@@ -1512,6 +1532,8 @@ show block device statistics
 show the cpu registers
 @item info cpus
 show infos for each CPU
+@item info iothreads
+show the iothreads and their host thread ids
 @item info history
 show the command line history
 @item info irq
@@ -1556,6 +1578,9 @@ show the current VM UUID
 show CPU statistics
 @item info usernet
 show user network stack connection states
+@item info iohandlers
+show the file descriptor handlers of the main loop, how often they ran and
+how long they took
 @item info migrate
 show migration status
 @item info migrate_capabilities
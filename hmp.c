@@ -161,6 +161,10 @@ void hmp_info_migrate(Monitor *mon)
             monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
                            info->downtime);
         }
+        if (info->has_cpu_throttle_percentage) {
+            monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                           info->cpu_throttle_percentage);
+        }
     }
 
     if (info->has_ram) {
@@ -180,6 +184,10 @@ void hmp_info_migrate(Monitor *mon)
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
         }
+        if (info->ram->has_postcopy_requests) {
+            monitor_printf(mon, "postcopy requests: %" PRIu64 "\n",
+                           info->ram->postcopy_requests);
+        }
     }
 
     if (info->has_disk) {
@@ -200,10 +208,25 @@ void hmp_info_migrate(Monitor *mon)
                        info->xbzrle_cache->pages);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache hit rate: %0.2f\n",
+                       info->xbzrle_cache->cache_hit_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_compression) {
+        monitor_printf(mon, "compression threads: %" PRIu64 "\n",
+                       info->compression->threads);
+        monitor_printf(mon, "compressed transferred: %" PRIu64 " kbytes\n",
+                       info->compression->bytes >> 10);
+        monitor_printf(mon, "compressed pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compression busy: %" PRIu64 "\n",
+                       info->compression->busy);
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -271,6 +294,19 @@ void hmp_info_cpus(Monitor *mon)
     qapi_free_CpuInfoList(cpu_list);
 }
 
+void hmp_info_iothreads(Monitor *mon)
+{
+    IOThreadInfoList *info_list, *info;
+
+    info_list = qmp_query_iothreads(NULL);
+    for (info = info_list; info; info = info->next) {
+        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
+                       info->value->id, info->value->thread_id);
+    }
+
+    qapi_free_IOThreadInfoList(info_list);
+}
+
 void hmp_info_block(Monitor *mon)
 {
     BlockInfoList *block_list, *info;
@@ -315,6 +351,10 @@ void hmp_info_block(Monitor *mon)
                             info->value->inserted->iops,
                             info->value->inserted->iops_rd,
                             info->value->inserted->iops_wr);
+            if (info->value->inserted->has_group) {
+                monitor_printf(mon, " throttle_group=%s",
+                               info->value->inserted->group);
+            }
         } else {
             monitor_printf(mon, " [not inserted]");
         }
@@ -325,6 +365,34 @@ void hmp_info_block(Monitor *mon)
     qapi_free_BlockInfoList(block_list);
 }
 
+/* Prints the non-empty bins as "[lower, upper) count", in nanoseconds */
+static void print_latency_histogram(Monitor *mon, const char *type,
+                                    BlockLatencyBinList *bins)
+{
+    int64_t lower = 0;
+
+    if (!bins) {
+        return;
+    }
+
+    monitor_printf(mon, "    %s_latency_histogram:", type);
+    for (; bins; bins = bins->next) {
+        BlockLatencyBin *bin = bins->value;
+
+        if (bin->count) {
+            if (bin->has_limit_ns) {
+                monitor_printf(mon, " [%" PRId64 ", %" PRId64 ")=%" PRId64,
+                               lower, bin->limit_ns, bin->count);
+            } else {
+                monitor_printf(mon, " [%" PRId64 ", inf)=%" PRId64,
+                               lower, bin->count);
+            }
+        }
+        lower = bin->limit_ns;
+    }
+    monitor_printf(mon, "\n");
+}
+
 void hmp_info_blockstats(Monitor *mon)
 {
     BlockStatsList *stats_list, *stats;
@@ -344,8 +412,7 @@ void hmp_info_blockstats(Monitor *mon)
                        " flush_operations=%" PRId64
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
-                       " flush_total_time_ns=%" PRId64
-                       "\n",
+                       " flush_total_time_ns=%" PRId64,
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
                        stats->value->stats->rd_operations,
@@ -354,6 +421,30 @@ void hmp_info_blockstats(Monitor *mon)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+        if (stats->value->stats->has_l2_cache_hits) {
+            monitor_printf(mon, " l2_cache_hits=%" PRId64
+                           " l2_cache_misses=%" PRId64,
+                           stats->value->stats->l2_cache_hits,
+                           stats->value->stats->l2_cache_misses);
+        }
+        monitor_printf(mon, " in_flight=%" PRId64
+                       " busy_time_ns=%" PRId64
+                       " queue_depth_time_ns=%" PRId64,
+                       stats->value->stats->in_flight,
+                       stats->value->stats->busy_time_ns,
+                       stats->value->stats->queue_depth_time_ns);
+        if (stats->value->stats->has_idle_time_ns) {
+            monitor_printf(mon, " idle_time_ns=%" PRId64,
+                           stats->value->stats->idle_time_ns);
+        }
+        monitor_printf(mon, "\n");
+
+        print_latency_histogram(mon, "rd",
+                                stats->value->stats->rd_latency_histogram);
+        print_latency_histogram(mon, "wr",
+                                stats->value->stats->wr_latency_histogram);
+        print_latency_histogram(mon, "flush",
+                                stats->value->stats->flush_latency_histogram);
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -795,11 +886,40 @@ void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
 
     qmp_drive_mirror(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
-                     true, mode, false, 0,
+                     true, mode, false, 0, false, 0, false, 0,
                      false, 0, false, 0, &errp);
     hmp_handle_error(mon, &errp);
 }
 
+void hmp_drive_backup(Monitor *mon, const QDict *qdict)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *filename = qdict_get_str(qdict, "target");
+    const char *format = qdict_get_try_str(qdict, "format");
+    int reuse = qdict_get_try_bool(qdict, "reuse", 0);
+    int full = qdict_get_try_bool(qdict, "full", 0);
+    enum NewImageMode mode;
+    Error *errp = NULL;
+
+    if (!filename) {
+        error_set(&errp, QERR_MISSING_PARAMETER, "target");
+        hmp_handle_error(mon, &errp);
+        return;
+    }
+
+    if (reuse) {
+        mode = NEW_IMAGE_MODE_EXISTING;
+    } else {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+
+    qmp_drive_backup(device, filename, !!format, format,
+                     full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
+                     false, NULL, true, mode, false, 0, false, 0, false, 0,
+                     &errp);
+    hmp_handle_error(mon, &errp);
+}
+
 void hmp_snapshot_blkdev(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_str(qdict, "device");
@@ -959,7 +1079,10 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               qdict_get_int(qdict, "bps_wr"),
                               qdict_get_int(qdict, "iops"),
                               qdict_get_int(qdict, "iops_rd"),
-                              qdict_get_int(qdict, "iops_wr"), &err);
+                              qdict_get_int(qdict, "iops_wr"),
+                              false, 0, false, 0, false, 0,
+                              false, 0, false, 0, false, 0,
+                              false, 0, false, NULL, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1301,7 +1424,8 @@ void hmp_nbd_server_start(Monitor *mon, const QDict *qdict)
             continue;
         }
 
-        qmp_nbd_server_add(info->value->device, true, writable, &local_err);
+        qmp_nbd_server_add(info->value->device, true, writable, false, 0,
+                           &local_err);
 
         if (local_err != NULL) {
             qmp_nbd_server_stop(NULL);
@@ -1321,7 +1445,7 @@ void hmp_nbd_server_add(Monitor *mon, const QDict *qdict)
     int writable = qdict_get_try_bool(qdict, "writable", 0);
     Error *local_err = NULL;
 
-    qmp_nbd_server_add(device, true, writable, &local_err);
+    qmp_nbd_server_add(device, true, writable, false, 0, &local_err);
 
     if (local_err != NULL) {
         hmp_handle_error(mon, &local_err);
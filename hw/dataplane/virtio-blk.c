@@ -0,0 +1,558 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * The data plane services the virtqueue of a virtio-blk device in an
+ * iothread, without taking the global mutex.  Devices can share an iothread
+ * created with -object iothread and named with the x-iothread property, or
+ * get one of their own.  Guest kicks arrive through the
+ * ioeventfd host notifier, requests are submitted with Linux AIO in batches
+ * of one io_submit() per kick, and completions are signalled through the
+ * guest notifier, which KVM injects directly when irqfd is available.
+ *
+ * Only raw images opened with aio=native are supported, since the block
+ * layer cannot be used outside the global mutex.
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "iov.h"
+#include "qemu-error.h"
+#include "qemu/iothread.h"
+#include "migration.h"
+#include "block.h"
+#include "hw/virtio-blk.h"
+#include "hw/dataplane/vring.h"
+#include "hw/dataplane/ioq.h"
+#include "hw/dataplane/virtio-blk.h"
+
+enum {
+    SEG_MAX = 126,                  /* maximum number of I/O segments */
+    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
+    REQ_MAX = VRING_MAX,            /* maximum number of requests in the vring,
+                                     * is also the number of AIO requests */
+};
+
+typedef struct {
+    struct iocb iocb;               /* Linux AIO control block */
+    struct virtio_blk_inhdr *inhdr; /* status byte in guest memory */
+    unsigned int head;              /* vring descriptor index */
+    size_t size;                    /* number of bytes transferred */
+    void *bounce_buf;               /* used if guest buffers are unaligned */
+    struct iovec *read_iov;         /* guest buffers to copy back on read
+                                     * completion, with a bounce buffer */
+    unsigned int read_iov_cnt;
+} VirtIOBlockRequest;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool stopping;
+
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor */
+
+    VirtIODevice *vdev;
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+
+    IOThread *iothread;             /* runs the handlers below */
+    AioContext *ctx;
+
+    /* A copy of the virtqueue's notifier, so that handle_notify can find
+     * the data plane.  Do not call event_notifier_cleanup on it, the
+     * descriptor belongs to the virtqueue.
+     */
+    EventNotifier host_notifier;    /* doorbell */
+
+    IOQueue ioqueue;                /* Linux AIO queue */
+    VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
+                                             queue */
+
+    unsigned int num_reqs;
+
+    Error *migration_blocker;
+};
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIOBlockDataPlane *s)
+{
+    if (!vring_should_notify(s->vdev, &s->vring)) {
+        return;
+    }
+
+    event_notifier_set(s->guest_notifier);
+}
+
+/* Complete a request that did not go through Linux AIO */
+static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
+                                   struct virtio_blk_inhdr *inhdr,
+                                   unsigned char status)
+{
+    stb_p(&inhdr->status, status);
+    vring_push(&s->vring, head, sizeof(*inhdr));
+    notify_guest(s);
+}
+
+static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
+    unsigned char status;
+
+    if (likely(ret == req->size)) {
+        status = VIRTIO_BLK_S_OK;
+    } else {
+        status = VIRTIO_BLK_S_IOERR;
+    }
+
+    trace_virtio_blk_data_plane_complete_request(s, req->head, ret);
+
+    if (req->read_iov) {
+        if (status == VIRTIO_BLK_S_OK) {
+            iov_from_buf(req->read_iov, req->read_iov_cnt, 0,
+                         req->bounce_buf, req->size);
+        }
+        g_free(req->read_iov);
+        req->read_iov = NULL;
+    }
+    if (req->bounce_buf) {
+        qemu_vfree(req->bounce_buf);
+        req->bounce_buf = NULL;
+    }
+
+    stb_p(&req->inhdr->status, status);
+
+    /* Like the emulated device, report the transfer size plus the status
+     * byte as the used length. */
+    vring_push(&s->vring, req->head, req->size + sizeof(*req->inhdr));
+
+    s->num_reqs--;
+}
+
+static bool iov_is_aligned(struct iovec *iov, unsigned int iov_cnt,
+                           size_t alignment)
+{
+    unsigned int i;
+
+    for (i = 0; i < iov_cnt; i++) {
+        if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) & (alignment - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
+                       struct iovec *iov, unsigned int iov_cnt,
+                       uint64_t sector, unsigned int head,
+                       struct virtio_blk_inhdr *inhdr)
+{
+    size_t block_size = s->blk->conf.logical_block_size;
+    VirtIOBlockRequest *req;
+    struct iovec bounce_iov;
+    struct iocb *iocb;
+    size_t size;
+
+    size = iov_size(iov, iov_cnt);
+    if ((sector * BDRV_SECTOR_SIZE) % block_size || size % block_size) {
+        complete_request_early(s, head, inhdr, VIRTIO_BLK_S_IOERR);
+        return 0;
+    }
+
+    /* O_DIRECT needs aligned buffers, the guest's may not be */
+    bounce_iov.iov_base = NULL;
+    if (!iov_is_aligned(iov, iov_cnt, block_size)) {
+        bounce_iov.iov_base = qemu_blockalign(s->blk->conf.bs, size);
+        bounce_iov.iov_len = size;
+        if (!read) {
+            iov_to_buf(iov, iov_cnt, 0, bounce_iov.iov_base, size);
+        }
+    }
+
+    iocb = ioq_rdwr(&s->ioqueue, read,
+                    bounce_iov.iov_base ? &bounce_iov : iov,
+                    bounce_iov.iov_base ? 1 : iov_cnt,
+                    sector * BDRV_SECTOR_SIZE);
+
+    req = container_of(iocb, VirtIOBlockRequest, iocb);
+    req->head = head;
+    req->inhdr = inhdr;
+    req->size = size;
+    req->bounce_buf = bounce_iov.iov_base;
+    req->read_iov = NULL;
+    if (read && bounce_iov.iov_base) {
+        /* the iovec array is reused once the batch is submitted */
+        req->read_iov = g_memdup(iov, sizeof(iov[0]) * iov_cnt);
+        req->read_iov_cnt = iov_cnt;
+    }
+    return 0;
+}
+
+static void do_get_id_cmd(VirtIOBlockDataPlane *s,
+                          struct iovec *iov, unsigned int iov_cnt,
+                          unsigned int head, struct virtio_blk_inhdr *inhdr)
+{
+    char id[VIRTIO_BLK_ID_BYTES];
+
+    /* Serial number not NUL-terminated when shorter than buffer */
+    strncpy(id, s->blk->serial ? s->blk->serial : "", sizeof(id));
+    iov_from_buf(iov, iov_cnt, 0, id, sizeof(id));
+    complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
+}
+
+static int process_request(VirtIOBlockDataPlane *s, struct iovec iov[],
+                           unsigned int out_num, unsigned int in_num,
+                           unsigned int head)
+{
+    struct iovec *in_iov = &iov[out_num];
+    struct virtio_blk_outhdr outhdr;
+    struct virtio_blk_inhdr *inhdr;
+    struct iovec *out_data;
+    unsigned int out_cnt, in_cnt;
+    uint32_t type;
+
+    /* Same layout requirements as the emulated device */
+    if (unlikely(out_num < 1 || in_num < 1 ||
+                 iov[0].iov_len < sizeof(outhdr) ||
+                 in_iov[in_num - 1].iov_len < sizeof(*inhdr))) {
+        error_report("virtio-blk request headers missing");
+        return -EFAULT;
+    }
+
+    memcpy(&outhdr, iov[0].iov_base, sizeof(outhdr));
+    iov[0].iov_base += sizeof(outhdr);
+    iov[0].iov_len -= sizeof(outhdr);
+    in_iov[in_num - 1].iov_len -= sizeof(*inhdr);
+    inhdr = in_iov[in_num - 1].iov_base + in_iov[in_num - 1].iov_len;
+
+    /* Drop the segments that only held headers, O_DIRECT rejects them
+     * if they are not aligned */
+    out_data = iov;
+    out_cnt = out_num;
+    if (out_data[0].iov_len == 0) {
+        out_data++;
+        out_cnt--;
+    }
+    in_cnt = in_num;
+    if (in_iov[in_num - 1].iov_len == 0) {
+        in_cnt--;
+    }
+
+    type = ldl_p(&outhdr.type);
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        /* Synchronous flush is okay as long as it's rare */
+        complete_request_early(s, head, inhdr,
+                               qemu_fdatasync(s->fd) == 0 ?
+                               VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+        return 0;
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        /* TODO support SCSI commands */
+        complete_request_early(s, head, inhdr, VIRTIO_BLK_S_UNSUPP);
+        return 0;
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        do_get_id_cmd(s, in_iov, in_cnt, head, inhdr);
+        return 0;
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        return do_rdwr_cmd(s, false, out_data, out_cnt,
+                           ldq_p(&outhdr.sector), head, inhdr);
+    } else {
+        return do_rdwr_cmd(s, true, in_iov, in_cnt,
+                           ldq_p(&outhdr.sector), head, inhdr);
+    }
+}
+
+static int flush_true(EventNotifier *e)
+{
+    return true;
+}
+
+static void handle_notify(EventNotifier *e)
+{
+    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
+                                           host_notifier);
+
+    /* There is one array of iovecs into which all new requests are extracted
+     * from the vring.  Requests are read from the vring and the translated
+     * descriptors are written to the iovecs array.  The iovecs do not have to
+     * persist across handle_notify() calls because the kernel copies the
+     * iovecs on io_submit().
+     *
+     * Handling io_submit() EAGAIN may require storing the requests across
+     * handle_notify() calls until the kernel has sufficient resources to
+     * accept more I/O.  This is not implemented yet.
+     */
+    struct iovec iovec[VRING_MAX];
+    struct iovec *end = &iovec[VRING_MAX];
+    struct iovec *iov = iovec;
+
+    /* When a request is read from the vring, the index of the first descriptor
+     * (aka head) is returned so that the completed request can be pushed onto
+     * the vring later.
+     *
+     * The number of hypervisor read-only iovecs is out_num.  The number of
+     * hypervisor write-only iovecs is in_num.
+     */
+    int head;
+    unsigned int out_num = 0, in_num = 0;
+    unsigned int num_queued;
+
+    event_notifier_test_and_clear(&s->host_notifier);
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(s->vdev, &s->vring);
+
+        for (;;) {
+            head = vring_pop(s->vdev, &s->vring, iov, end, &out_num, &in_num);
+            if (head < 0) {
+                break; /* no more requests */
+            }
+
+            trace_virtio_blk_data_plane_process_request(s, out_num, in_num,
+                                                        head);
+
+            if (process_request(s, iov, out_num, in_num, head) < 0) {
+                vring_set_broken(&s->vring);
+                break;
+            }
+            iov += out_num + in_num;
+        }
+
+        if (likely(head == -EAGAIN)) { /* vring emptied */
+            /* Re-enable guest->host notifies and stop processing the vring.
+             * But if the guest has snuck in more descriptors, keep processing.
+             */
+            if (vring_enable_notification(s->vdev, &s->vring)) {
+                break;
+            }
+        } else { /* head == -ENOBUFS or fatal error, iovecs[] is depleted */
+            /* Since there are no iovecs[] left, stop processing for now.  Do
+             * not re-enable guest->host notifies since the I/O completion
+             * handler knows to check for more vring descriptors anyway.
+             */
+            break;
+        }
+    }
+
+    num_queued = ioq_num_queued(&s->ioqueue);
+    if (num_queued > 0) {
+        s->num_reqs += num_queued;
+        ioq_submit(&s->ioqueue);
+        trace_virtio_blk_data_plane_submit(s, num_queued);
+    }
+}
+
+static int flush_io(EventNotifier *e)
+{
+    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
+                                           ioqueue.io_notifier);
+
+    return s->num_reqs > 0;
+}
+
+static void handle_io(EventNotifier *e)
+{
+    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
+                                           ioqueue.io_notifier);
+
+    event_notifier_test_and_clear(e);
+    if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
+        notify_guest(s);
+    }
+
+    /* If there were more requests than iovecs, the vring will not be empty yet
+     * so check again.  There should now be enough resources to process more
+     * requests.
+     */
+    if (unlikely(vring_more_avail(&s->vring))) {
+        handle_notify(&s->host_notifier);
+    }
+}
+
+/* Context: QEMU global mutex held */
+bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockDataPlane **dataplane)
+{
+    VirtIOBlockDataPlane *s;
+    IOThread *iothread = NULL;
+    int fd;
+
+    *dataplane = NULL;
+
+    if (!blk->data_plane) {
+        if (blk->iothread) {
+            error_report("x-iothread requires x-data-plane=on");
+            return false;
+        }
+        return true;
+    }
+
+    if (blk->scsi) {
+        error_report("device is incompatible with x-data-plane, use scsi=off");
+        return false;
+    }
+
+    if (blk->config_wce) {
+        error_report("device is incompatible with x-data-plane, "
+                     "use config-wce=off");
+        return false;
+    }
+
+    fd = raw_get_aio_fd(blk->conf.bs);
+    if (fd < 0) {
+        error_report("drive is incompatible with x-data-plane, "
+                     "use format=raw,cache=none,aio=native");
+        return false;
+    }
+
+    if (blk->iothread) {
+        iothread = iothread_find(blk->iothread);
+        if (!iothread) {
+            error_report("iothread '%s' not found", blk->iothread);
+            return false;
+        }
+        object_ref(OBJECT(iothread));
+    } else {
+        /* Without a shared iothread, the device gets one of its own */
+        iothread = iothread_new();
+    }
+
+    s = g_new0(VirtIOBlockDataPlane, 1);
+    s->vdev = vdev;
+    s->fd = fd;
+    s->blk = blk;
+    s->iothread = iothread;
+    s->ctx = iothread_get_aio_context(iothread);
+
+    /* Prevent block operations that conflict with data plane thread */
+    bdrv_set_in_use(blk->conf.bs, 1);
+
+    /* Writes to guest memory bypass dirty logging */
+    error_setg(&s->migration_blocker,
+               "x-data-plane does not support migration");
+    migrate_add_blocker(s->migration_blocker);
+
+    *dataplane = s;
+    return true;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_blk_data_plane_stop(s);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    bdrv_set_in_use(s->blk->conf.bs, 0);
+    object_unref(OBJECT(s->iothread));
+    g_free(s);
+}
+
+/* Context: QEMU global mutex held
+ *
+ * Returns false if the data plane could not be started, in which case the
+ * device should go on processing requests in the I/O thread.
+ */
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    VirtQueue *vq;
+    int i;
+
+    if (s->started) {
+        return true;
+    }
+
+    if (!vdev->binding->set_host_notifier ||
+        !vdev->binding->set_guest_notifiers) {
+        error_report("x-data-plane is not supported by this virtio transport");
+        return false;
+    }
+
+    vq = virtio_get_queue(vdev, 0);
+    if (virtio_queue_get_num(vdev, 0) > REQ_MAX ||
+        !vring_setup(&s->vring, vdev, 0)) {
+        return false;
+    }
+
+    /* Set up guest notifier (irq) */
+    if (vdev->binding->set_guest_notifiers(vdev->binding_opaque, true) != 0) {
+        error_report("virtio-blk failed to set guest notifier, "
+                     "ensure -enable-kvm is set");
+        vring_teardown(&s->vring, vdev, 0);
+        return false;
+    }
+    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+    /* Set up virtqueue notify */
+    if (vdev->binding->set_host_notifier(vdev->binding_opaque, 0, true) != 0) {
+        error_report("virtio-blk failed to set host notifier");
+        vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
+        vring_teardown(&s->vring, vdev, 0);
+        return false;
+    }
+
+    s->host_notifier = *virtio_queue_get_host_notifier(vq);
+
+    /* Set up ioqueue */
+    ioq_init(&s->ioqueue, s->fd, REQ_MAX);
+    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
+        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+    }
+
+    s->started = true;
+    trace_virtio_blk_data_plane_start(s);
+
+    /* From now on the iothread services the queue */
+    aio_context_acquire(s->ctx);
+    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify,
+                           flush_true);
+    aio_set_event_notifier(s->ctx, ioq_get_notifier(&s->ioqueue), handle_io,
+                           flush_io);
+    aio_context_release(s->ctx);
+
+    /* Kick right away to begin processing requests already in vring */
+    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    return true;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_blk_data_plane_stop(s);
+
+    /* Take the queue away from the iothread, completing in-flight requests
+     * first.  Other devices may go on using the iothread.
+     */
+    aio_context_acquire(s->ctx);
+    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL, NULL);
+    while (s->num_reqs > 0) {
+        aio_poll(s->ctx, true);
+    }
+    aio_set_event_notifier(s->ctx, ioq_get_notifier(&s->ioqueue), NULL, NULL);
+    aio_context_release(s->ctx);
+
+    ioq_cleanup(&s->ioqueue);
+
+    vdev->binding->set_host_notifier(vdev->binding_opaque, 0, false);
+
+    /* Clean up guest notifier (irq) */
+    vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
+
+    vring_teardown(&s->vring, vdev, 0);
+
+    s->started = false;
+    s->stopping = false;
+}
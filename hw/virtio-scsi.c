@@ -150,6 +150,7 @@ typedef struct VirtIOSCSIReq {
     VirtQueueElement elem;
     QEMUSGList qsgl;
     SCSIRequest *sreq;
+    QTAILQ_ENTRY(VirtIOSCSIReq) next;
     union {
         char                  *buf;
         VirtIOSCSICmdReq      *cmd;
@@ -469,8 +470,12 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
     VirtIOSCSIReq *req;
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
     int n;
 
+    /* Parse all requests first and plug the disks they go to, so that the
+     * I/O they start is submitted in batches when the disks are unplugged.
+     */
     while ((req = virtio_scsi_pop_req(s, vq))) {
         SCSIDevice *d;
         int out_size, in_size;
@@ -512,10 +517,23 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
             }
         }
 
+        if (d->conf.bs) {
+            bdrv_io_plug(d->conf.bs);
+        }
+        QTAILQ_INSERT_TAIL(&reqs, req, next);
+    }
+
+    while ((req = QTAILQ_FIRST(&reqs))) {
+        BlockDriverState *bs = req->sreq->dev->conf.bs;
+
+        QTAILQ_REMOVE(&reqs, req, next);
         n = scsi_req_enqueue(req->sreq);
         if (n) {
             scsi_req_continue(req->sreq);
         }
+        if (bs) {
+            bdrv_io_unplug(bs);
+        }
     }
 }
 
@@ -57,6 +57,7 @@ typedef struct CPUClass {
  * @created: Indicates whether the CPU thread has been successfully created.
  * @stop: Indicates a pending stop request.
  * @stopped: Indicates the CPU has been artificially stopped.
+ * @throttle_thread_scheduled: Indicates a throttling sleep is queued.
  *
  * State of one CPU core or thread.
  */
@@ -76,6 +77,7 @@ struct CPUState {
     bool created;
     bool stop;
     bool stopped;
+    bool throttle_thread_scheduled;
 
     /* TODO Move common fields from CPUArchState here. */
 };
@@ -136,5 +138,16 @@ bool cpu_is_stopped(CPUState *cpu);
  */
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu
+ * asynchronously.
+ */
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
+
 
 #endif
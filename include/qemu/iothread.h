@@ -0,0 +1,51 @@
+/*
+ * Event loop thread
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_IOTHREAD_H
+#define QEMU_IOTHREAD_H
+
+#include "qemu/object.h"
+#include "qemu-common.h"
+#include "qemu-aio.h"
+#include "qemu-thread.h"
+
+#define TYPE_IOTHREAD "iothread"
+
+#define IOTHREAD(obj) \
+    OBJECT_CHECK(IOThread, (obj), TYPE_IOTHREAD)
+
+typedef struct IOThread IOThread;
+
+/**
+ * iothread_find:
+ * @id: the id given with -object iothread,id=@id
+ *
+ * Returns: the iothread called @id, or NULL if there is none.
+ */
+IOThread *iothread_find(const char *id);
+
+/**
+ * iothread_new:
+ *
+ * Start an iothread that is not visible to the user, for devices that want
+ * a thread of their own.  Release it with object_unref().
+ */
+IOThread *iothread_new(void);
+
+/**
+ * iothread_get_aio_context:
+ * @iothread: the thread
+ *
+ * Returns: the AioContext that @iothread runs.  Other threads must hold it
+ * with aio_context_acquire() while they use it.
+ */
+AioContext *iothread_get_aio_context(IOThread *iothread);
+
+#endif /* QEMU_IOTHREAD_H */
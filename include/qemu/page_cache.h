@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, indexed by a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -37,14 +37,15 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size);
 void cache_fini(PageCache *cache);
 
 /**
- * cache_is_cached: Checks to see if the page is cached
+ * cache_is_cached: Checks to see if the page is cached, and if so count a
+ * use of it
  *
  * Returns %true if page is cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr);
+bool cache_is_cached(PageCache *cache, uint64_t addr);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -57,17 +58,30 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr);
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
- * cache_insert: insert the page into the cache. the previous value will be overwritten
+ * cache_insert: copy the page into the cache. the previous value will be
+ * overwritten.  If the set the page belongs to is full, the page is only
+ * admitted when it was missed more often recently than the least frequently
+ * used page of the set was hit.
+ *
+ * Returns 0 if the page is cached, -1 if it was not admitted
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
  * @pdata: pointer to the page
  */
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
+int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
+
+/**
+ * cache_age: halve the access frequency of all pages, so that pages which
+ * are not used anymore eventually get evicted
+ *
+ * @cache pointer to the PageCache struct
+ */
+void cache_age(PageCache *cache);
 
 /**
- * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * cache_resize: resize the page cache, keeping its contents.  In case of
+ * size reduction the least frequently used pages will be freed
  *
  * Returns -1 on error new cache size on success
  *
@@ -0,0 +1,63 @@
+/*
+ * I/O throttling with leaky buckets
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_THROTTLE_H
+#define QEMU_THROTTLE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    THROTTLE_BPS_TOTAL,
+    THROTTLE_BPS_READ,
+    THROTTLE_BPS_WRITE,
+    THROTTLE_OPS_TOTAL,
+    THROTTLE_OPS_READ,
+    THROTTLE_OPS_WRITE,
+    BUCKETS_COUNT,
+} BucketType;
+
+/*
+ * Accounted I/O fills the bucket, which leaks @avg units (bytes or
+ * operations) per second.  Requests only have to wait while the bucket holds
+ * more than @max units, so @max is the size of the bursts that are allowed
+ * on top of the average rate.
+ */
+typedef struct LeakyBucket {
+    double avg;     /* rate limit in units per second, 0 for no limit */
+    double max;     /* burst size in units, 0 for the default */
+    double level;   /* units in the bucket */
+} LeakyBucket;
+
+typedef struct ThrottleConfig {
+    LeakyBucket buckets[BUCKETS_COUNT];
+    uint64_t op_size;   /* requests are accounted as several operations if
+                           they are larger than this, 0 to disable */
+} ThrottleConfig;
+
+typedef struct ThrottleState {
+    ThrottleConfig cfg;
+    int64_t previous_leak;  /* time of the last leak, in ns */
+} ThrottleState;
+
+void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta_ns);
+int64_t throttle_compute_wait(LeakyBucket *bkt);
+
+void throttle_init(ThrottleState *ts, int64_t now);
+bool throttle_enabled(ThrottleConfig *cfg);
+bool throttle_conflicting(ThrottleConfig *cfg);
+bool throttle_is_valid(ThrottleConfig *cfg);
+void throttle_config(ThrottleState *ts, ThrottleConfig *cfg, int64_t now);
+void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg);
+
+int64_t throttle_wait_time(ThrottleState *ts, bool is_write, int64_t now);
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+
+#endif
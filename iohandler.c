@@ -27,11 +27,16 @@
 #include "qemu-char.h"
 #include "qemu-queue.h"
 #include "qemu-aio.h"
+#include "qemu-timer.h"
 #include "main-loop.h"
+#include "monitor.h"
 
 #ifndef _WIN32
 #include <sys/wait.h>
 #endif
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 
 typedef struct IOHandlerRecord {
     IOCanReadHandler *fd_read_poll;
@@ -41,11 +46,144 @@ typedef struct IOHandlerRecord {
     QLIST_ENTRY(IOHandlerRecord) next;
     int fd;
     bool deleted;
+
+    /* G_IO_IN and G_IO_OUT, as registered with epoll */
+    int events;
+    bool use_epoll;
+
+    /* Handlers that qemu_iohandler_fill has to look at in every iteration */
+    QLIST_ENTRY(IOHandlerRecord) polled;
+    bool on_polled_list;
+
+    uint64_t dispatch_count;
+    int64_t dispatch_ns;
+    int64_t dispatch_max_ns;
 } IOHandlerRecord;
 
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
 
+/*
+ * Most handlers only change when qemu_set_fd_handler2 is called, and live in
+ * an epoll set that the main loop waits for as a single descriptor.  The
+ * others are on this list: handlers with a fd_read_poll callback, which
+ * must be asked again before every wait, and descriptors that epoll does
+ * not support (such as regular files), which go into the fd_sets.
+ * Without epoll, all handlers are on the list.
+ */
+static QLIST_HEAD(, IOHandlerRecord) io_handlers_polled =
+    QLIST_HEAD_INITIALIZER(io_handlers_polled);
+
+static int io_handlers_deleted;
+
+#ifdef CONFIG_EPOLL
+#define IOHANDLER_EPOLL_EVENTS 128
+
+static int io_epollfd = -1;
+
+static bool iohandler_epoll_init(void)
+{
+    static bool initialized;
+
+    if (!initialized) {
+        initialized = true;
+        io_epollfd = qemu_epoll_create();
+    }
+    return io_epollfd >= 0;
+}
+
+/*
+ * Registers @events of @ioh with epoll, or changes them.  Returns false if
+ * the descriptor can't be used with epoll.
+ *
+ * @force makes sure that the registration is there even if @events did not
+ * change, because the descriptor may have been closed and reused without
+ * removing the handler first; closing it drops it from the epoll set.
+ */
+static bool iohandler_epoll_update(IOHandlerRecord *ioh, int events,
+                                   bool force)
+{
+    struct epoll_event event = {
+        .events = (events & G_IO_IN ? EPOLLIN : 0) |
+                  (events & G_IO_OUT ? EPOLLOUT : 0),
+        .data.ptr = ioh,
+    };
+    int ret;
+
+    if (events == ioh->events && !force) {
+        return true;
+    }
+
+    if (!events) {
+        /* The descriptor may already be closed, ignore errors */
+        epoll_ctl(io_epollfd, EPOLL_CTL_DEL, ioh->fd, &event);
+        ioh->events = 0;
+        return true;
+    }
+
+    ret = epoll_ctl(io_epollfd, ioh->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                    ioh->fd, &event);
+    if (ret < 0 && errno == ENOENT) {
+        ret = epoll_ctl(io_epollfd, EPOLL_CTL_ADD, ioh->fd, &event);
+    } else if (ret < 0 && errno == EEXIST) {
+        ret = epoll_ctl(io_epollfd, EPOLL_CTL_MOD, ioh->fd, &event);
+    }
+    if (ret < 0) {
+        return false;
+    }
+
+    ioh->events = events;
+    return true;
+}
+#endif
+
+static int iohandler_events(IOHandlerRecord *ioh)
+{
+    int events = 0;
+
+    if (ioh->fd_read &&
+        (!ioh->fd_read_poll || ioh->fd_read_poll(ioh->opaque) != 0)) {
+        events |= G_IO_IN;
+    }
+    if (ioh->fd_write) {
+        events |= G_IO_OUT;
+    }
+    return events;
+}
+
+static void iohandler_register(IOHandlerRecord *ioh)
+{
+#ifdef CONFIG_EPOLL
+    if (!ioh->events && !ioh->use_epoll) {
+        /* New handler, or one that wasn't in the epoll set */
+        ioh->use_epoll = iohandler_epoll_init();
+    }
+    if (ioh->use_epoll &&
+        !iohandler_epoll_update(ioh, iohandler_events(ioh), true)) {
+        ioh->use_epoll = false;
+    }
+#endif
+
+    /* Records leave the list in qemu_iohandler_fill, which is never called
+     * while the list is being walked */
+    if ((ioh->fd_read_poll || !ioh->use_epoll) && !ioh->on_polled_list) {
+        QLIST_INSERT_HEAD(&io_handlers_polled, ioh, polled);
+        ioh->on_polled_list = true;
+    }
+}
+
+static void iohandler_unregister(IOHandlerRecord *ioh)
+{
+#ifdef CONFIG_EPOLL
+    if (ioh->use_epoll) {
+        iohandler_epoll_update(ioh, 0, false);
+    }
+#endif
+    if (!ioh->deleted) {
+        ioh->deleted = true;
+        io_handlers_deleted++;
+    }
+}
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -62,7 +200,7 @@ int qemu_set_fd_handler2(int fd,
     if (!fd_read && !fd_write) {
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd) {
-                ioh->deleted = 1;
+                iohandler_unregister(ioh);
                 break;
             }
         }
@@ -79,7 +217,11 @@ int qemu_set_fd_handler2(int fd,
         ioh->fd_read = fd_read;
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
-        ioh->deleted = 0;
+        if (ioh->deleted) {
+            ioh->deleted = false;
+            io_handlers_deleted--;
+        }
+        iohandler_register(ioh);
         qemu_notify_event();
     }
     return 0;
@@ -95,45 +237,137 @@ int qemu_set_fd_handler(int fd,
 
 void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *xfds)
 {
-    IOHandlerRecord *ioh;
+    IOHandlerRecord *ioh, *pioh;
+    int events;
 
-    QLIST_FOREACH(ioh, &io_handlers, next) {
-        if (ioh->deleted)
+    QLIST_FOREACH_SAFE(ioh, &io_handlers_polled, polled, pioh) {
+        if (ioh->deleted || (ioh->use_epoll && !ioh->fd_read_poll)) {
+            QLIST_REMOVE(ioh, polled);
+            ioh->on_polled_list = false;
             continue;
-        if (ioh->fd_read &&
-            (!ioh->fd_read_poll ||
-             ioh->fd_read_poll(ioh->opaque) != 0)) {
+        }
+
+        events = iohandler_events(ioh);
+#ifdef CONFIG_EPOLL
+        if (ioh->use_epoll) {
+            if (iohandler_epoll_update(ioh, events, false)) {
+                continue;
+            }
+            ioh->use_epoll = false;
+        }
+#endif
+        if (events & G_IO_IN) {
             FD_SET(ioh->fd, readfds);
             if (ioh->fd > *pnfds)
                 *pnfds = ioh->fd;
         }
-        if (ioh->fd_write) {
+        if (events & G_IO_OUT) {
             FD_SET(ioh->fd, writefds);
             if (ioh->fd > *pnfds)
                 *pnfds = ioh->fd;
         }
     }
+
+#ifdef CONFIG_EPOLL
+    if (io_epollfd >= 0) {
+        FD_SET(io_epollfd, readfds);
+        *pnfds = MAX(*pnfds, io_epollfd);
+    }
+#endif
+}
+
+static void iohandler_dispatch(IOHandlerRecord *ioh, IOHandler *handler)
+{
+    int64_t start = get_clock();
+    int64_t elapsed;
+
+    handler(ioh->opaque);
+
+    /* @ioh may have been deleted, but is not freed yet */
+    elapsed = get_clock() - start;
+    ioh->dispatch_count++;
+    ioh->dispatch_ns += elapsed;
+    ioh->dispatch_max_ns = MAX(ioh->dispatch_max_ns, elapsed);
+}
+
+#ifdef CONFIG_EPOLL
+static void iohandler_epoll_dispatch(void)
+{
+    struct epoll_event events[IOHANDLER_EPOLL_EVENTS];
+    IOHandlerRecord *ioh;
+    int i, n;
+
+    /* Whatever does not fit is reported again in the next iteration */
+    n = epoll_wait(io_epollfd, events, ARRAY_SIZE(events), 0);
+    for (i = 0; i < n; i++) {
+        ioh = events[i].data.ptr;
+
+        /* Errors and hangups wake up both handlers, as with select() */
+        if (!ioh->deleted && ioh->fd_read && (ioh->events & G_IO_IN) &&
+            (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            iohandler_dispatch(ioh, ioh->fd_read);
+        }
+        if (!ioh->deleted && ioh->fd_write && (ioh->events & G_IO_OUT) &&
+            (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+            iohandler_dispatch(ioh, ioh->fd_write);
+        }
+    }
 }
+#endif
 
 void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int ret)
 {
+    IOHandlerRecord *pioh, *ioh;
+
     if (ret > 0) {
-        IOHandlerRecord *pioh, *ioh;
+#ifdef CONFIG_EPOLL
+        if (io_epollfd >= 0 && FD_ISSET(io_epollfd, readfds)) {
+            iohandler_epoll_dispatch();
+        }
+#endif
 
-        QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
+        QLIST_FOREACH_SAFE(ioh, &io_handlers_polled, polled, pioh) {
+            if (ioh->use_epoll) {
+                continue;
+            }
             if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, readfds)) {
-                ioh->fd_read(ioh->opaque);
+                iohandler_dispatch(ioh, ioh->fd_read);
             }
             if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, writefds)) {
-                ioh->fd_write(ioh->opaque);
+                iohandler_dispatch(ioh, ioh->fd_write);
             }
+        }
+    }
 
-            /* Do this last in case read/write handlers marked it for deletion */
+    /* Free the handlers that were deleted, now that nobody walks the lists */
+    if (io_handlers_deleted) {
+        QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
             if (ioh->deleted) {
                 QLIST_REMOVE(ioh, next);
+                if (ioh->on_polled_list) {
+                    QLIST_REMOVE(ioh, polled);
+                }
                 g_free(ioh);
             }
         }
+        io_handlers_deleted = 0;
+    }
+}
+
+void do_info_iohandlers(Monitor *mon)
+{
+    IOHandlerRecord *ioh;
+
+    QLIST_FOREACH(ioh, &io_handlers, next) {
+        if (ioh->deleted) {
+            continue;
+        }
+        monitor_printf(mon, "fd %d (%s%s, %s): %" PRIu64 " dispatches, "
+                       "%" PRId64 " us total, %" PRId64 " us max\n",
+                       ioh->fd, ioh->fd_read ? "r" : "", ioh->fd_write ? "w" : "",
+                       ioh->use_epoll ? "epoll" : "select",
+                       ioh->dispatch_count, ioh->dispatch_ns / 1000,
+                       ioh->dispatch_max_ns / 1000);
     }
 }
 
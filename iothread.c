@@ -0,0 +1,177 @@
+/*
+ * Event loop thread
+ *
+ * An iothread runs the event loop of its own AioContext.  Devices whose
+ * handlers and requests live in that context are serviced by the thread
+ * instead of the main loop, so that several busy devices do not compete for
+ * a single thread.  Users create iothreads with -object iothread,id=NAME and
+ * assign devices to them by name.
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/iothread.h"
+#include "qmp-commands.h"
+
+#define IOTHREADS_PATH "/objects"
+
+struct IOThread {
+    Object parent;
+
+    QemuThread thread;
+    AioContext *ctx;
+    int thread_id;
+    QemuSemaphore init_done_sem;
+
+    /* Makes aio_poll() block in the thread when no requests are in flight */
+    EventNotifier stop_notifier;
+    bool polling;
+    bool stopping;
+};
+
+static void iothread_stop_read(EventNotifier *e)
+{
+    event_notifier_test_and_clear(e);
+}
+
+/* aio_poll() only blocks while some handler has requests in flight.  The
+ * thread's own handler claims to have some while the thread polls, so that
+ * an idle iothread sleeps instead of spinning.  Other threads that acquire
+ * the context, for example to drain it, are not held up by it.
+ */
+static int iothread_stop_flush(EventNotifier *e)
+{
+    IOThread *iothread = container_of(e, IOThread, stop_notifier);
+
+    return iothread->polling;
+}
+
+static void *iothread_run(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    iothread->thread_id = qemu_get_thread_id();
+    qemu_sem_post(&iothread->init_done_sem);
+
+    /* Give up the context after every iteration, so that other threads
+     * that asked for it with aio_context_acquire() get their turn.
+     */
+    while (!iothread->stopping) {
+        aio_context_acquire(iothread->ctx);
+        iothread->polling = true;
+        aio_poll(iothread->ctx, true);
+        iothread->polling = false;
+        aio_context_release(iothread->ctx);
+    }
+    return NULL;
+}
+
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->ctx = aio_context_new();
+    event_notifier_init(&iothread->stop_notifier, false);
+    aio_set_event_notifier(iothread->ctx, &iothread->stop_notifier,
+                           iothread_stop_read, iothread_stop_flush);
+
+    /* Wait for the thread id, query-iothreads reports it */
+    qemu_sem_init(&iothread->init_done_sem, 0);
+    qemu_thread_create(&iothread->thread, iothread_run,
+                       iothread, QEMU_THREAD_JOINABLE);
+    qemu_sem_wait(&iothread->init_done_sem);
+}
+
+static void iothread_instance_finalize(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->stopping = true;
+    event_notifier_set(&iothread->stop_notifier);
+    qemu_thread_join(&iothread->thread);
+
+    aio_set_event_notifier(iothread->ctx, &iothread->stop_notifier,
+                           NULL, NULL);
+    event_notifier_cleanup(&iothread->stop_notifier);
+    qemu_sem_destroy(&iothread->init_done_sem);
+    aio_context_unref(iothread->ctx);
+}
+
+static TypeInfo iothread_info = {
+    .name = TYPE_IOTHREAD,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
+    .instance_finalize = iothread_instance_finalize,
+};
+
+static void iothread_register_types(void)
+{
+    type_register_static(&iothread_info);
+}
+
+type_init(iothread_register_types)
+
+IOThread *iothread_find(const char *id)
+{
+    Object *container = container_get(object_get_root(), IOTHREADS_PATH);
+    Object *child;
+
+    child = object_resolve_path_component(container, (gchar *)id);
+    if (!child || !object_dynamic_cast(child, TYPE_IOTHREAD)) {
+        return NULL;
+    }
+    return IOTHREAD(child);
+}
+
+IOThread *iothread_new(void)
+{
+    return IOTHREAD(object_new(TYPE_IOTHREAD));
+}
+
+AioContext *iothread_get_aio_context(IOThread *iothread)
+{
+    return iothread->ctx;
+}
+
+static int query_one_iothread(Object *object, void *opaque)
+{
+    IOThreadInfoList ***prev = opaque;
+    IOThreadInfoList *elem;
+    IOThreadInfo *info;
+    IOThread *iothread;
+    gchar *path;
+
+    if (!object_dynamic_cast(object, TYPE_IOTHREAD)) {
+        return 0;
+    }
+    iothread = IOTHREAD(object);
+
+    path = object_get_canonical_path(object);
+    info = g_new0(IOThreadInfo, 1);
+    info->id = g_strdup(strrchr(path, '/') + 1);
+    info->thread_id = iothread->thread_id;
+    g_free(path);
+
+    elem = g_new0(IOThreadInfoList, 1);
+    elem->value = info;
+    elem->next = NULL;
+
+    **prev = elem;
+    *prev = &elem->next;
+    return 0;
+}
+
+IOThreadInfoList *qmp_query_iothreads(Error **errp)
+{
+    IOThreadInfoList *head = NULL;
+    IOThreadInfoList **prev = &head;
+    Object *container = container_get(object_get_root(), IOTHREADS_PATH);
+
+    object_child_foreach(container, query_one_iothread, &prev);
+    return head;
+}
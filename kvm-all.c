@@ -372,7 +372,15 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
      * especially when most of the memory is not dirty.
      */
     for (i = 0; i < len; i++) {
-        if (bitmap[i] != 0) {
+        if (bitmap[i] == ~0UL) {
+            /* whole word dirty, mark it in one go */
+            page_number = i * HOST_LONG_BITS * hpratio;
+            addr = section->offset_within_region +
+                   page_number * TARGET_PAGE_SIZE;
+            memory_region_set_dirty(section->mr, addr,
+                                    TARGET_PAGE_SIZE * hpratio *
+                                    HOST_LONG_BITS);
+        } else if (bitmap[i] != 0) {
             c = leul_to_cpu(bitmap[i]);
             do {
                 j = ffsl(c) - 1;
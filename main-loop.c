@@ -109,6 +109,10 @@ static int qemu_signal_init(void)
 
 static AioContext *qemu_aio_context;
 
+#ifndef _WIN32
+static GArray *gpollfds;
+#endif
+
 void qemu_notify_event(void)
 {
     if (!qemu_aio_context) {
@@ -133,6 +137,10 @@ int qemu_init_main_loop(void)
         return ret;
     }
 
+#ifndef _WIN32
+    gpollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+#endif
+
     qemu_aio_context = aio_context_new();
     src = aio_get_g_source(qemu_aio_context);
     g_source_attach(src, NULL);
@@ -142,101 +150,130 @@ int qemu_init_main_loop(void)
 
 static fd_set rfds, wfds, xfds;
 static int nfds;
-static GPollFD poll_fds[1024 * 2]; /* this is probably overkill */
-static int n_poll_fds;
 static int max_priority;
 
 #ifndef _WIN32
-static void glib_select_fill(int *max_fd, fd_set *rfds, fd_set *wfds,
-                             fd_set *xfds, uint32_t *cur_timeout)
+static int glib_pollfds_idx;
+static int glib_n_poll_fds;
+
+/*
+ * Slirp and the handlers that are not in the epoll set of iohandler.c still
+ * describe what they wait for with fd_sets.  The main loop itself polls,
+ * so that the number of descriptors is not limited by FD_SETSIZE and the
+ * cost of a wait does not depend on the highest descriptor number.
+ */
+static void fd_sets_to_pollfds(void)
 {
-    GMainContext *context = g_main_context_default();
-    int i;
-    int timeout = 0;
+    GPollFD pfd;
+    int fd;
+
+    for (fd = 0; fd <= nfds; fd++) {
+        pfd.fd = fd;
+        pfd.events = 0;
+        pfd.revents = 0;
+        if (FD_ISSET(fd, &rfds)) {
+            pfd.events |= G_IO_IN;
+        }
+        if (FD_ISSET(fd, &wfds)) {
+            pfd.events |= G_IO_OUT;
+        }
+        if (FD_ISSET(fd, &xfds)) {
+            pfd.events |= G_IO_PRI;
+        }
+        if (pfd.events) {
+            g_array_append_val(gpollfds, pfd);
+        }
+    }
+}
 
-    g_main_context_prepare(context, &max_priority);
+static void pollfds_to_fd_sets(int n)
+{
+    int i;
 
-    n_poll_fds = g_main_context_query(context, max_priority, &timeout,
-                                      poll_fds, ARRAY_SIZE(poll_fds));
-    g_assert(n_poll_fds <= ARRAY_SIZE(poll_fds));
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&xfds);
 
-    for (i = 0; i < n_poll_fds; i++) {
-        GPollFD *p = &poll_fds[i];
+    for (i = 0; i < n; i++) {
+        GPollFD *pfd = &g_array_index(gpollfds, GPollFD, i);
 
-        if ((p->events & G_IO_IN)) {
-            FD_SET(p->fd, rfds);
-            *max_fd = MAX(*max_fd, p->fd);
+        /* Like select(), report errors and hangups as readiness */
+        if ((pfd->events & G_IO_IN) &&
+            (pfd->revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+            FD_SET(pfd->fd, &rfds);
         }
-        if ((p->events & G_IO_OUT)) {
-            FD_SET(p->fd, wfds);
-            *max_fd = MAX(*max_fd, p->fd);
+        if ((pfd->events & G_IO_OUT) &&
+            (pfd->revents & (G_IO_OUT | G_IO_HUP | G_IO_ERR))) {
+            FD_SET(pfd->fd, &wfds);
         }
-        if ((p->events & G_IO_ERR)) {
-            FD_SET(p->fd, xfds);
-            *max_fd = MAX(*max_fd, p->fd);
+        if (pfd->revents & G_IO_PRI) {
+            FD_SET(pfd->fd, &xfds);
         }
     }
-
-    if (timeout >= 0 && timeout < *cur_timeout) {
-        *cur_timeout = timeout;
-    }
 }
 
-static void glib_select_poll(fd_set *rfds, fd_set *wfds, fd_set *xfds,
-                             bool err)
+static void glib_pollfds_fill(uint32_t *cur_timeout)
 {
     GMainContext *context = g_main_context_default();
+    int timeout = 0;
+    int n;
 
-    if (!err) {
-        int i;
+    g_main_context_prepare(context, &max_priority);
 
-        for (i = 0; i < n_poll_fds; i++) {
-            GPollFD *p = &poll_fds[i];
+    glib_pollfds_idx = gpollfds->len;
+    n = glib_n_poll_fds;
+    do {
+        GPollFD *pfds;
+        glib_n_poll_fds = n;
+        g_array_set_size(gpollfds, glib_pollfds_idx + glib_n_poll_fds);
+        pfds = &g_array_index(gpollfds, GPollFD, glib_pollfds_idx);
+        n = g_main_context_query(context, max_priority, &timeout, pfds,
+                                 glib_n_poll_fds);
+    } while (n != glib_n_poll_fds);
 
-            if ((p->events & G_IO_IN) && FD_ISSET(p->fd, rfds)) {
-                p->revents |= G_IO_IN;
-            }
-            if ((p->events & G_IO_OUT) && FD_ISSET(p->fd, wfds)) {
-                p->revents |= G_IO_OUT;
-            }
-            if ((p->events & G_IO_ERR) && FD_ISSET(p->fd, xfds)) {
-                p->revents |= G_IO_ERR;
-            }
-        }
+    if (timeout >= 0 && timeout < *cur_timeout) {
+        *cur_timeout = timeout;
     }
+}
 
-    if (g_main_context_check(context, max_priority, poll_fds, n_poll_fds)) {
+static void glib_pollfds_poll(void)
+{
+    GMainContext *context = g_main_context_default();
+    GPollFD *pfds = &g_array_index(gpollfds, GPollFD, glib_pollfds_idx);
+
+    if (g_main_context_check(context, max_priority, pfds, glib_n_poll_fds)) {
         g_main_context_dispatch(context);
     }
 }
 
 static int os_host_main_loop_wait(uint32_t timeout)
 {
-    struct timeval tv, *tvarg = NULL;
-    int ret;
-
-    glib_select_fill(&nfds, &rfds, &wfds, &xfds, &timeout);
+    int ret, n_fd_set_fds;
 
-    if (timeout < UINT32_MAX) {
-        tvarg = &tv;
-        tv.tv_sec = timeout / 1000;
-        tv.tv_usec = (timeout % 1000) * 1000;
-    }
+    g_array_set_size(gpollfds, 0);
+    fd_sets_to_pollfds();
+    n_fd_set_fds = gpollfds->len;
+    glib_pollfds_fill(&timeout);
 
     if (timeout > 0) {
         qemu_mutex_unlock_iothread();
     }
 
-    ret = select(nfds + 1, &rfds, &wfds, &xfds, tvarg);
+    ret = g_poll((GPollFD *)gpollfds->data, gpollfds->len,
+                 timeout == UINT32_MAX ? -1 : (int)MIN(timeout, INT_MAX));
 
     if (timeout > 0) {
         qemu_mutex_lock_iothread();
     }
 
-    glib_select_poll(&rfds, &wfds, &xfds, (ret < 0));
+    glib_pollfds_poll();
+    pollfds_to_fd_sets(ret > 0 ? n_fd_set_fds : 0);
     return ret;
 }
 #else
+static GPollFD poll_fds[1024 * 2]; /* this is probably overkill */
+static int n_poll_fds;
+
 /***********************************************************/
 /* Polling handling */
 
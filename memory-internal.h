@@ -112,8 +112,14 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
 
     end = TARGET_PAGE_ALIGN(start + length);
     start &= TARGET_PAGE_MASK;
-    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        cpu_physical_memory_set_dirty_flags(addr, dirty_flags);
+    if ((dirty_flags & 0xff) == 0xff) {
+        memset(ram_list.phys_dirty + (start >> TARGET_PAGE_BITS), 0xff,
+               (end - start) >> TARGET_PAGE_BITS);
+        addr = end;
+    } else {
+        for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
+            cpu_physical_memory_set_dirty_flags(addr, dirty_flags);
+        }
     }
     xen_modified_memory(addr, length);
 }
@@ -133,6 +139,10 @@ static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *bitmap,
+                                               ram_addr_t start,
+                                               ram_addr_t end,
+                                               int dirty_flag);
 
 extern const IORangeOps memory_region_iorange_ops;
 
@@ -1096,6 +1096,18 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
     return ret;
 }
 
+uint64_t memory_region_test_and_clear_dirty_bitmap(MemoryRegion *mr,
+                                                   hwaddr addr,
+                                                   hwaddr size,
+                                                   unsigned client,
+                                                   unsigned long *bitmap)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_sync_dirty_bitmap(bitmap,
+                                                 mr->ram_addr + addr,
+                                                 mr->ram_addr + addr + size,
+                                                 1 << client);
+}
 
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
@@ -471,6 +471,30 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr,
                                         hwaddr addr,
                                         hwaddr size,
                                         unsigned client);
+
+/**
+ * memory_region_test_and_clear_dirty_bitmap: Move the dirty state of a range
+ *                                            into a bitmap, and clear it.
+ *
+ * Like memory_region_test_and_clear_dirty() for every page in the range,
+ * but much faster for large ranges.  The bit of each dirty page is set in
+ * @bitmap, which is indexed by ram_addr_t page number.  Dirty logging must
+ * be enabled.
+ *
+ * Returns the number of bits newly set in @bitmap.
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ * @bitmap: the bitmap being updated.
+ */
+uint64_t memory_region_test_and_clear_dirty_bitmap(MemoryRegion *mr,
+                                                   hwaddr addr,
+                                                   hwaddr size,
+                                                   unsigned client,
+                                                   unsigned long *bitmap);
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -47,6 +47,8 @@ static void tcp_wait_for_connect(int fd, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    s->open_channel = inet_connect;
+    s->channel_address = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
@@ -62,7 +64,8 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && socket_error() == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
+    /* closed when the migration ends, multifd accepts more channels */
+    migration_incoming_set_listener(s);
 
     DPRINTF("accepted migration\n");
 
@@ -81,6 +84,7 @@ static void tcp_accept_incoming_migration(void *opaque)
     return;
 
 out:
+    migration_incoming_close_listener();
     closesocket(c);
 }
 
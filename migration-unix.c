@@ -47,6 +47,8 @@ static void unix_wait_for_connect(int fd, void *opaque)
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp)
 {
+    s->open_channel = unix_connect;
+    s->channel_address = g_strdup(path);
     unix_nonblocking_connect(path, unix_wait_for_connect, s, errp);
 }
 
@@ -62,7 +64,8 @@ static void unix_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && errno == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    close(s);
+    /* closed when the migration ends, multifd accepts more channels */
+    migration_incoming_set_listener(s);
 
     DPRINTF("accepted migration\n");
 
@@ -81,6 +84,7 @@ static void unix_accept_incoming_migration(void *opaque)
     return;
 
 out:
+    migration_incoming_close_listener();
     close(c);
 }
 
@@ -25,6 +25,7 @@
 #include "hw/hw.h"
 #include "qemu-timer.h"
 #include "qemu-char.h"
+#include "cpus.h"
 
 //#define DEBUG_MIGRATION
 
@@ -54,6 +55,12 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Migration compression defaults */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 4
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -67,6 +74,10 @@ MigrationState *migrate_get_current(void)
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_thread_count = DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
+        .decompress_thread_count = DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
+        .multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
     };
 
     return &current_migration;
@@ -97,8 +108,17 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
+    ram_decompress_threads_cleanup();
+    ram_multifd_load_cleanup();
+    migration_incoming_close_listener();
     qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
-    qemu_fclose(f);
+    if (ret == 1) {
+        /* post-copy: the rest of RAM is received by a separate thread,
+         * which owns f from now on */
+        DPRINTF("switched to post-copy\n");
+    } else {
+        qemu_fclose(f);
+    }
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
@@ -178,10 +198,24 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->cache_hit_rate = xbzrle_mig_cache_hit_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
 
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compress()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->threads = migrate_compress_threads();
+        info->compression->bytes = compress_mig_bytes_transferred();
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->busy = compress_mig_busy();
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -193,12 +227,16 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->postcopy ? "postcopy-active" : "active");
         info->has_total_time = true;
         info->total_time = qemu_get_clock_ms(rt_clock)
             - s->total_time;
         info->has_expected_downtime = true;
         info->expected_downtime = s->expected_downtime;
+        if (cpu_throttle_active()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
 
         info->has_ram = true;
         info->ram = g_malloc0(sizeof(*info->ram));
@@ -209,6 +247,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
+        if (migrate_use_postcopy()) {
+            info->ram->has_postcopy_requests = true;
+            info->ram->postcopy_requests = postcopy_mig_requests();
+        }
 
 
         if (blk_mig_active()) {
@@ -220,9 +262,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -238,6 +282,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->duplicate = dup_mig_pages_transferred();
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
+        if (migrate_use_postcopy()) {
+            info->ram->has_postcopy_requests = true;
+            info->ram->postcopy_requests = postcopy_mig_requests();
+        }
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -281,12 +329,24 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_savevm_state_cancel(s->file);
     }
 
+    cpu_throttle_stop();
+
     if (s->file) {
         DPRINTF("closing file\n");
         qemu_mutex_unlock_iothread();
         qemu_thread_join(&s->thread);
+        if (s->return_path) {
+            /* wake up the return path thread if it is blocked reading */
+            shutdown(qemu_get_fd(s->return_path), SHUT_RD);
+            qemu_thread_join(&s->rp_thread);
+        }
         qemu_mutex_lock_iothread();
 
+        if (s->return_path) {
+            qemu_fclose(s->return_path);
+            s->return_path = NULL;
+        }
+
         qemu_fclose(s->file);
         s->file = NULL;
     }
@@ -339,6 +399,61 @@ bool migration_has_failed(MigrationState *s)
             s->state == MIG_STATE_ERROR);
 }
 
+/*
+ * Page requests from the destination, sent while in post-copy:
+ * byte idstr length, idstr, be64 offset in the block, be32 page count.
+ */
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    QEMUFile *rp = s->return_path;
+
+    while (true) {
+        char idstr[256];
+        uint64_t offset;
+        uint32_t npages;
+        uint8_t len;
+
+        len = qemu_get_byte(rp);
+        qemu_get_buffer(rp, (uint8_t *)idstr, len);
+        idstr[len] = 0;
+        offset = qemu_get_be64(rp);
+        npages = qemu_get_be32(rp);
+        if (qemu_file_get_error(rp)) {
+            break;
+        }
+
+        DPRINTF("page request %s offset %" PRIx64 " pages %u\n",
+                idstr, offset, npages);
+        ram_save_queue_pages(idstr, offset, npages);
+    }
+    return NULL;
+}
+
+/*
+ * Stop the guest, send the device state and the list of pages that are
+ * still missing, and let the destination start.  Called with the
+ * iothread lock held.
+ */
+static int postcopy_start(MigrationState *s)
+{
+    int ret;
+
+    ret = qemu_savevm_state_postcopy(s->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->return_path = qemu_file_get_return_path(s->file);
+    if (!s->return_path) {
+        return -EINVAL;
+    }
+    qemu_thread_create(&s->rp_thread, source_return_path_thread,
+                       s, QEMU_THREAD_JOINABLE);
+    s->postcopy = true;
+    return 0;
+}
+
 static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -348,6 +463,7 @@ static void *migration_thread(void *opaque)
     int64_t start_time = initial_time;
     bool old_vm_running = false;
     bool first_time = true;
+    bool inactive = false;
     uint64_t pending_size;
 
     while (s->state == MIG_STATE_ACTIVE) {
@@ -386,10 +502,51 @@ static void *migration_thread(void *opaque)
             qemu_mutex_unlock_iothread();
         }
 
+        if (s->postcopy) {
+            int ret = ram_save_postcopy_iterate(s->file);
+
+            if (ret < 0) {
+                s->state = MIG_STATE_ERROR;
+            } else if (ret > 0) {
+                qemu_mutex_lock_iothread();
+                ram_save_postcopy_complete();
+                s->state = MIG_STATE_COMPLETED;
+                qemu_mutex_unlock_iothread();
+            }
+            continue;
+        }
+
         DPRINTF("iterate\n");
         pending_size = qemu_savevm_state_pending(s->file, max_size);
         DPRINTF("pending size %lu max %lu\n", pending_size, max_size);
-        if (pending_size >= max_size) {
+        if (migrate_auto_converge() &&
+            s->throttle_percentage != cpu_throttle_get_percentage()) {
+            qemu_mutex_lock_iothread();
+            cpu_throttle_set(s->throttle_percentage);
+            qemu_mutex_unlock_iothread();
+        }
+        if (pending_size >= max_size && migrate_use_postcopy() &&
+            ram_dirty_sync_count() >= 2) {
+            /* one full pass plus one round of dirty pages is enough,
+             * fetch the rest on demand */
+            DPRINTF("switching to post-copy\n");
+            qemu_mutex_lock_iothread();
+            qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+            old_vm_running = runstate_is_running();
+            start_time = qemu_get_clock_ms(rt_clock);
+            vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+            qemu_file_set_rate_limit(s->file, 0);
+            bdrv_inactivate_all();
+            inactive = true;
+            if (postcopy_start(s) < 0) {
+                s->state = MIG_STATE_ERROR;
+            } else {
+                /* the guest runs on the destination from now on */
+                old_vm_running = false;
+                s->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+            }
+            qemu_mutex_unlock_iothread();
+        } else if (pending_size >= max_size) {
             qemu_savevm_state_iterate(s->file);
         } else {
             DPRINTF("done iterating\n");
@@ -399,6 +556,10 @@ static void *migration_thread(void *opaque)
             start_time = qemu_get_clock_ms(rt_clock);
             vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
             qemu_file_set_rate_limit(s->file, 0);
+            /* the destination may use the images as soon as it has the
+             * rest of the state */
+            bdrv_inactivate_all();
+            inactive = true;
             if (qemu_savevm_state_complete(s->file) < 0) {
                 s->state = MIG_STATE_ERROR;
             } else {
@@ -412,9 +573,15 @@ static void *migration_thread(void *opaque)
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_get_clock_ms(rt_clock);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (!s->postcopy) {
+            s->downtime = end_time - start_time;
+        }
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
+        /* the destination did not start, take the images back */
+        if (inactive && !s->postcopy) {
+            bdrv_invalidate_cache_all();
+        }
         if (old_vm_running) {
             vm_start();
         }
@@ -444,9 +611,14 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int compress_level = s->compress_level;
+    int compress_thread_count = s->compress_thread_count;
+    int decompress_thread_count = s->decompress_thread_count;
+    int multifd_channels = s->multifd_channels;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
+    g_free(s->channel_address);
 
     memset(s, 0, sizeof(*s));
     s->bandwidth_limit = bandwidth_limit;
@@ -454,6 +626,10 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->compress_level = compress_level;
+    s->compress_thread_count = compress_thread_count;
+    s->decompress_thread_count = decompress_thread_count;
+    s->multifd_channels = multifd_channels;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -500,6 +676,25 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_postcopy() && (params.blk || params.shared)) {
+        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+        return;
+    }
+    if (migrate_use_postcopy() &&
+        !strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
+                  "a tcp: or unix: URI when postcopy is enabled");
+        return;
+    }
+    /* multifd sends the live page, which need not match the copy in the
+     * XBZRLE cache that later deltas are encoded against */
+    if (migrate_use_multifd() &&
+        (migrate_use_postcopy() || migrate_use_compress() ||
+         migrate_use_xbzrle())) {
+        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -593,3 +788,127 @@ int64_t migrate_xbzrle_cache_size(void)
 
     return s->xbzrle_cache_size;
 }
+
+bool migrate_use_compress(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_thread_count;
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->decompress_thread_count;
+}
+
+bool migrate_use_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY];
+}
+
+bool migrate_auto_converge(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->multifd_channels;
+}
+
+/* Open one more connection to the destination, for multifd.  Only socket
+ * transports can do this; the others migrate over a single stream. */
+int migrate_open_channel(Error **errp)
+{
+    MigrationState *s;
+    int fd;
+
+    s = migrate_get_current();
+    if (!s->open_channel) {
+        error_setg(errp, "the migration transport has a single channel");
+        return -1;
+    }
+
+    fd = s->open_channel(s->channel_address, errp);
+    if (fd >= 0) {
+        socket_set_block(fd);
+    }
+    return fd;
+}
+
+/* The listening socket of an incoming migration is kept open until the
+ * migration ends, so that extra channels can be accepted on it. */
+static int incoming_listen_fd = -1;
+
+void migration_incoming_set_listener(int fd)
+{
+    incoming_listen_fd = fd;
+}
+
+int migration_incoming_accept_channel(void)
+{
+    int fd;
+
+    if (incoming_listen_fd < 0) {
+        return -1;
+    }
+
+    socket_set_block(incoming_listen_fd);
+    do {
+        fd = qemu_accept(incoming_listen_fd, NULL, NULL);
+    } while (fd < 0 && socket_error() == EINTR);
+    return fd;
+}
+
+void migration_incoming_close_listener(void)
+{
+    if (incoming_listen_fd >= 0) {
+        closesocket(incoming_listen_fd);
+        incoming_listen_fd = -1;
+    }
+}
@@ -44,8 +44,20 @@ struct MigrationState
     int64_t downtime;
     int64_t expected_downtime;
     int64_t dirty_pages_rate;
+    /* vCPU throttling that auto-converge asks for */
+    int throttle_percentage;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int compress_level;
+    int compress_thread_count;
+    int decompress_thread_count;
+    bool postcopy;
+    QEMUFile *return_path;
+    QemuThread rp_thread;
+    int multifd_channels;
+    /* opens one more connection to channel_address, for multifd */
+    int (*open_channel)(const char *address, Error **errp);
+    char *channel_address;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -101,6 +113,23 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+double xbzrle_mig_cache_hit_rate(void);
+uint64_t compress_mig_bytes_transferred(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_busy(void);
+
+uint64_t postcopy_mig_requests(void);
+
+void ram_decompress_threads_cleanup(void);
+void ram_multifd_load_cleanup(void);
+
+uint64_t ram_dirty_sync_count(void);
+void ram_save_queue_pages(const char *idstr, uint64_t offset,
+                          uint32_t npages);
+int ram_save_postcopy_iterate(QEMUFile *f);
+void ram_save_postcopy_complete(void);
+void ram_postcopy_fault_in(void *host, size_t len);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -125,4 +154,20 @@ int64_t migrate_xbzrle_cache_size(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
+bool migrate_use_compress(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+
+bool migrate_use_postcopy(void);
+
+bool migrate_use_multifd(void);
+bool migrate_auto_converge(void);
+int migrate_multifd_channels(void);
+int migrate_open_channel(Error **errp);
+
+void migration_incoming_set_listener(int fd);
+int migration_incoming_accept_channel(void);
+void migration_incoming_close_listener(void);
+
 #endif
@@ -2485,6 +2485,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show infos for each CPU",
         .mhandler.info = hmp_info_cpus,
     },
+    {
+        .name       = "iothreads",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show iothreads",
+        .mhandler.info = hmp_info_iothreads,
+    },
     {
         .name       = "history",
         .args_type  = "",
@@ -2679,6 +2686,13 @@ static mon_cmd_t info_cmds[] = {
         .mhandler.info = do_info_usernet,
     },
 #endif
+    {
+        .name       = "iohandlers",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the main loop file descriptor handlers",
+        .mhandler.info = do_info_iohandlers,
+    },
     {
         .name       = "migrate",
         .args_type  = "",
@@ -38,6 +38,7 @@
 
 #include "qemu_socket.h"
 #include "qemu-queue.h"
+#include "iov.h"
 
 //#define DEBUG_NBD
 
@@ -76,7 +77,41 @@
 #define NBD_SET_TIMEOUT         _IO(0xab, 9)
 #define NBD_SET_FLAGS           _IO(0xab, 10)
 
-#define NBD_OPT_EXPORT_NAME     (1 << 0)
+#define NBD_OPT_EXPORT_NAME     1
+#define NBD_OPT_ABORT           2
+#define NBD_OPT_STRUCTURED_REPLY 8
+#define NBD_OPT_LIST_META_CONTEXT 9
+#define NBD_OPT_SET_META_CONTEXT 10
+
+/* Option replies */
+#define NBD_REP_MAGIC           0x0003e889045565a9LL
+#define NBD_REP_ACK             1
+#define NBD_REP_META_CONTEXT    4
+#define NBD_REP_ERR_UNSUP       0x80000001
+#define NBD_REP_ERR_INVALID     0x80000003
+#define NBD_REP_ERR_UNKNOWN     0x80000006
+
+#define NBD_MAX_OPTION_SIZE     4096
+
+/* Structured replies */
+#define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
+#define NBD_STRUCTURED_REPLY_SIZE   (4 + 2 + 2 + 8 + 4)
+#define NBD_REPLY_FLAG_DONE         (1 << 0)
+
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR        0x8001
+
+/* Flags of the "base:allocation" metadata context */
+#define NBD_META_BASE_ALLOCATION    "base:allocation"
+#define NBD_META_ID_BASE_ALLOCATION 0
+#define NBD_STATE_HOLE              (1 << 0)
+#define NBD_STATE_ZERO              (1 << 1)
+
+/* Granularity of the zero detection in structured reads */
+#define NBD_SPARSE_BLOCK_SIZE   4096
 
 /* Definitions for opaque data types */
 
@@ -97,6 +132,7 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint32_t nbdflags;
+    int max_requests;
     QTAILQ_HEAD(, NBDClient) clients;
     QSIMPLEQ_HEAD(, NBDRequest) requests;
     QTAILQ_ENTRY(NBDExport) next;
@@ -119,6 +155,9 @@ struct NBDClient {
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
+
+    bool structured_reply;
+    bool base_allocation;
 };
 
 /* That's all folks */
@@ -288,59 +327,261 @@ int unix_socket_outgoing(const char *path)
 
 */
 
+/* Skips the @size bytes of data of an option that is not processed */
+static int nbd_drop(int csock, uint32_t size)
+{
+    char buf[1024];
+    uint32_t len;
+
+    while (size > 0) {
+        len = MIN(size, sizeof(buf));
+        if (read_sync(csock, buf, len) != len) {
+            LOG("read failed");
+            return -EIO;
+        }
+        size -= len;
+    }
+    return 0;
+}
+
+static int nbd_send_rep(int csock, uint32_t type, uint32_t opt,
+                        const void *data, uint32_t len)
+{
+    char buf[8 + 4 + 4 + 4];
+
+    /* Server replies to options of fixed new-style clients with:
+        [ 0 ..   7]   NBD_REP_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   reply type
+        [16 ..  19]   length
+        [20 ..  xx]   data (length bytes)
+     */
+    TRACE("Reply opt=%" PRIx32 " type=%" PRIx32, opt, type);
+    cpu_to_be64w((uint64_t *)buf, NBD_REP_MAGIC);
+    cpu_to_be32w((uint32_t *)(buf + 8), opt);
+    cpu_to_be32w((uint32_t *)(buf + 12), type);
+    cpu_to_be32w((uint32_t *)(buf + 16), len);
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (rep)");
+        return -EIO;
+    }
+    if (len && write_sync(csock, (void *)data, len) != len) {
+        LOG("write failed (rep data)");
+        return -EIO;
+    }
+    return 0;
+}
+
+static int nbd_send_meta_context(int csock, uint32_t opt, uint32_t id,
+                                 const char *name)
+{
+    size_t len = strlen(name);
+    char buf[4 + 64];
+
+    assert(len <= sizeof(buf) - 4);
+    cpu_to_be32w((uint32_t *)buf, id);
+    memcpy(buf + 4, name, len);
+    return nbd_send_rep(csock, NBD_REP_META_CONTEXT, opt, buf, 4 + len);
+}
+
+/* Reads a string of the form [length (4 bytes), data] out of @buf */
+static bool nbd_parse_string(char **buf, uint32_t *size, char **str,
+                             uint32_t *len)
+{
+    if (*size < 4) {
+        return false;
+    }
+    *len = be32_to_cpup((uint32_t *)*buf);
+    if (*len > *size - 4) {
+        return false;
+    }
+    *str = *buf + 4;
+    *buf += 4 + *len;
+    *size -= 4 + *len;
+    return true;
+}
+
+/*
+ * Processes NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.  The
+ * only context that is supported is "base:allocation", which reports
+ * which parts of the export are holes.
+ *
+ *   [ 0 ..   3]   export name length
+ *   [ 4 ..  xx]   export name
+ *   [xx .. +3 ]   number of queries
+ *   followed by the queries, each as [length (4 bytes), query]
+ */
+static int nbd_negotiate_meta_context(NBDClient *client, uint32_t opt,
+                                      uint32_t length)
+{
+    int csock = client->sock;
+    bool set = opt == NBD_OPT_SET_META_CONTEXT;
+    char data[NBD_MAX_OPTION_SIZE + 1];
+    char *p = data, *str;
+    uint32_t size = length, len, nr_queries;
+    bool base_allocation = false;
+    int i, rc;
+
+    if (!client->structured_reply || length > NBD_MAX_OPTION_SIZE) {
+        rc = nbd_drop(csock, length);
+        if (rc < 0) {
+            return rc;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID, opt, NULL, 0);
+    }
+
+    if (read_sync(csock, data, length) != length) {
+        LOG("read failed");
+        return -EIO;
+    }
+
+    if (!nbd_parse_string(&p, &size, &str, &len) || size < 4) {
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID, opt, NULL, 0);
+    }
+
+    /* The string is overwritten by the number of queries, save that first */
+    nr_queries = be32_to_cpup((uint32_t *)p);
+    p += 4;
+    size -= 4;
+    str[len] = '\0';
+    if (!nbd_export_find(str)) {
+        return nbd_send_rep(csock, NBD_REP_ERR_UNKNOWN, opt, NULL, 0);
+    }
+
+    if (nr_queries == 0) {
+        /* Listing without a query returns all contexts */
+        base_allocation = !set;
+    }
+    for (i = 0; i < nr_queries; i++) {
+        if (!nbd_parse_string(&p, &size, &str, &len)) {
+            return nbd_send_rep(csock, NBD_REP_ERR_INVALID, opt, NULL, 0);
+        }
+        if ((len == strlen(NBD_META_BASE_ALLOCATION) &&
+             !memcmp(str, NBD_META_BASE_ALLOCATION, len)) ||
+            (!set && len == 5 && !memcmp(str, "base:", 5))) {
+            base_allocation = true;
+        }
+    }
+
+    if (set) {
+        client->base_allocation = base_allocation;
+    }
+    if (base_allocation) {
+        rc = nbd_send_meta_context(csock, opt, NBD_META_ID_BASE_ALLOCATION,
+                                   NBD_META_BASE_ALLOCATION);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    return nbd_send_rep(csock, NBD_REP_ACK, opt, NULL, 0);
+}
+
 static int nbd_receive_options(NBDClient *client)
 {
     int csock = client->sock;
     char name[256];
-    uint32_t tmp, length;
+    uint32_t flags, opt, length;
     uint64_t magic;
     int rc;
 
     /* Client sends:
-        [ 0 ..   3]   reserved (0)
-        [ 4 ..  11]   NBD_OPTS_MAGIC
-        [12 ..  15]   NBD_OPT_EXPORT_NAME
-        [16 ..  19]   length
-        [20 ..  xx]   export name (length bytes)
+        [ 0 ..   3]   client flags
+
+       then any number of options:
+        [ 0 ..   7]   NBD_OPTS_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   length
+        [16 ..  xx]   option data (length bytes)
+
+       Negotiation ends with NBD_OPT_EXPORT_NAME, whose data is the name
+       of the export.  Clients that do not set NBD_FLAG_C_FIXED_NEWSTYLE
+       may send no other option.
      */
 
     rc = -EINVAL;
-    if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+    if (read_sync(csock, &flags, sizeof(flags)) != sizeof(flags)) {
         LOG("read failed");
         goto fail;
     }
-    TRACE("Checking reserved");
-    if (tmp != 0) {
-        LOG("Bad reserved received");
+    TRACE("Checking client flags");
+    flags = be32_to_cpu(flags);
+    if (flags & ~NBD_FLAG_C_FIXED_NEWSTYLE) {
+        LOG("Bad client flags received");
         goto fail;
     }
 
-    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
-        LOG("read failed");
-        goto fail;
-    }
-    TRACE("Checking reserved");
-    if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
-        LOG("Bad magic received");
-        goto fail;
-    }
+    for (;;) {
+        if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+            LOG("read failed");
+            goto fail;
+        }
+        TRACE("Checking opts magic");
+        if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
+            LOG("Bad magic received");
+            goto fail;
+        }
 
-    if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
-        LOG("read failed");
-        goto fail;
-    }
-    TRACE("Checking option");
-    if (tmp != be32_to_cpu(NBD_OPT_EXPORT_NAME)) {
-        LOG("Bad option received");
-        goto fail;
-    }
+        if (read_sync(csock, &opt, sizeof(opt)) != sizeof(opt)) {
+            LOG("read failed");
+            goto fail;
+        }
+        opt = be32_to_cpu(opt);
 
-    if (read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
-        LOG("read failed");
-        goto fail;
+        if (read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
+            LOG("read failed");
+            goto fail;
+        }
+        length = be32_to_cpu(length);
+
+        TRACE("Checking option %" PRIu32, opt);
+        if (opt == NBD_OPT_EXPORT_NAME) {
+            break;
+        }
+        if (!(flags & NBD_FLAG_C_FIXED_NEWSTYLE)) {
+            LOG("Bad option received");
+            goto fail;
+        }
+
+        switch (opt) {
+        case NBD_OPT_ABORT:
+            nbd_drop(csock, length);
+            nbd_send_rep(csock, NBD_REP_ACK, opt, NULL, 0);
+            LOG("client aborted negotiation");
+            goto fail;
+
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (length) {
+                rc = nbd_drop(csock, length);
+                if (rc == 0) {
+                    rc = nbd_send_rep(csock, NBD_REP_ERR_INVALID, opt,
+                                      NULL, 0);
+                }
+            } else {
+                client->structured_reply = true;
+                rc = nbd_send_rep(csock, NBD_REP_ACK, opt, NULL, 0);
+            }
+            break;
+
+        case NBD_OPT_LIST_META_CONTEXT:
+        case NBD_OPT_SET_META_CONTEXT:
+            rc = nbd_negotiate_meta_context(client, opt, length);
+            break;
+
+        default:
+            rc = nbd_drop(csock, length);
+            if (rc == 0) {
+                rc = nbd_send_rep(csock, NBD_REP_ERR_UNSUP, opt, NULL, 0);
+            }
+            break;
+        }
+
+        if (rc < 0) {
+            goto fail;
+        }
+        rc = -EINVAL;
     }
+
     TRACE("Checking length");
-    length = be32_to_cpu(length);
     if (length > 255) {
         LOG("Bad length received");
         goto fail;
@@ -372,7 +613,9 @@ static int nbd_send_negotiate(NBDClient *client)
     char buf[8 + 8 + 8 + 128];
     int rc;
     const int myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                         NBD_FLAG_SEND_WRITE_ZEROES |
+                         NBD_FLAG_CAN_MULTI_CONN);
 
     /* Negotiation header without options:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
@@ -385,7 +628,7 @@ static int nbd_send_negotiate(NBDClient *client)
        Negotiation header with options, part 1:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
         [ 8 ..  15]   magic        (NBD_OPTS_MAGIC)
-        [16 ..  17]   server flags (0)
+        [16 ..  17]   server flags (NBD_FLAG_FIXED_NEWSTYLE)
 
        part 2 (after options are sent):
         [18 ..  25]   size
@@ -398,6 +641,7 @@ static int nbd_send_negotiate(NBDClient *client)
 
     TRACE("Beginning negotiation.");
     memcpy(buf, "NBDMAGIC", 8);
+    memset(buf + 8, 0, sizeof(buf) - 8);
     if (client->exp) {
         assert ((client->exp->nbdflags & ~65535) == 0);
         cpu_to_be64w((uint64_t*)(buf + 8), NBD_CLIENT_MAGIC);
@@ -405,8 +649,8 @@ static int nbd_send_negotiate(NBDClient *client)
         cpu_to_be16w((uint16_t*)(buf + 26), client->exp->nbdflags | myflags);
     } else {
         cpu_to_be64w((uint64_t*)(buf + 8), NBD_OPTS_MAGIC);
+        cpu_to_be16w((uint16_t*)(buf + 16), NBD_FLAG_FIXED_NEWSTYLE);
     }
-    memset(buf + 28, 0, 124);
 
     if (client->exp) {
         if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
@@ -804,8 +1048,6 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
-
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -854,7 +1096,7 @@ static NBDRequest *nbd_request_get(NBDClient *client)
     NBDRequest *req;
     NBDExport *exp = client->exp;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests < exp->max_requests);
     client->nb_requests++;
 
     if (QSIMPLEQ_EMPTY(&exp->requests)) {
@@ -873,7 +1115,7 @@ static void nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
     QSIMPLEQ_INSERT_HEAD(&client->exp->requests, req, entry);
-    if (client->nb_requests-- == MAX_NBD_REQUESTS) {
+    if (client->nb_requests-- >= client->exp->max_requests) {
         qemu_notify_event();
     }
     nbd_client_put(client);
@@ -890,6 +1132,7 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
     exp->bs = bs;
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
+    exp->max_requests = NBD_DEFAULT_MAX_REQUESTS;
     exp->size = size == -1 ? bdrv_getlength(bs) : size;
     exp->close = close;
     return exp;
@@ -928,6 +1171,13 @@ void nbd_export_set_name(NBDExport *exp, const char *name)
     nbd_export_put(exp);
 }
 
+/* Limits the number of requests that each client may have in flight */
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests)
+{
+    assert(max_requests > 0 && max_requests <= NBD_MAX_REQUESTS_LIMIT);
+    exp->max_requests = max_requests;
+}
+
 void nbd_export_close(NBDExport *exp)
 {
     NBDClient *client, *next;
@@ -989,6 +1239,21 @@ static int nbd_can_read(void *opaque);
 static void nbd_read(void *opaque);
 static void nbd_restart_write(void *opaque);
 
+static void nbd_co_send_lock(NBDClient *client)
+{
+    qemu_co_mutex_lock(&client->send_lock);
+    qemu_set_fd_handler2(client->sock, nbd_can_read, nbd_read,
+                         nbd_restart_write, client);
+    client->send_coroutine = qemu_coroutine_self();
+}
+
+static void nbd_co_send_unlock(NBDClient *client)
+{
+    client->send_coroutine = NULL;
+    qemu_set_fd_handler2(client->sock, nbd_can_read, nbd_read, NULL, client);
+    qemu_co_mutex_unlock(&client->send_lock);
+}
+
 static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
@@ -996,10 +1261,7 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     int csock = client->sock;
     ssize_t rc, ret;
 
-    qemu_co_mutex_lock(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
-                         nbd_restart_write, client);
-    client->send_coroutine = qemu_coroutine_self();
+    nbd_co_send_lock(client);
 
     if (!len) {
         rc = nbd_send_reply(csock, reply);
@@ -1015,9 +1277,69 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
         socket_set_cork(csock, 0);
     }
 
-    client->send_coroutine = NULL;
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
-    qemu_co_mutex_unlock(&client->send_lock);
+    nbd_co_send_unlock(client);
+    return rc;
+}
+
+/*
+ * Sends one chunk of a structured reply, with the payload in @iov.  The
+ * caller holds the send lock, and corks the socket if it sends several
+ * chunks.
+ *
+ *   [ 0 ..   3]   magic   (NBD_STRUCTURED_REPLY_MAGIC)
+ *   [ 4 ..   5]   flags
+ *   [ 6 ..   7]   type
+ *   [ 8 ..  15]   handle
+ *   [16 ..  19]   length of the payload
+ */
+static ssize_t nbd_co_send_chunk(NBDClient *client, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 struct iovec *iov, unsigned int niov)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    struct iovec chunk_iov[3];
+    size_t len;
+
+    assert(niov < ARRAY_SIZE(chunk_iov));
+    len = iov_size(iov, niov);
+
+    TRACE("Sending chunk type %u, flags %u, length %zu", type, flags, len);
+    cpu_to_be32w((uint32_t *)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t *)(buf + 4), flags);
+    cpu_to_be16w((uint16_t *)(buf + 6), type);
+    cpu_to_be64w((uint64_t *)(buf + 8), handle);
+    cpu_to_be32w((uint32_t *)(buf + 16), len);
+
+    chunk_iov[0].iov_base = buf;
+    chunk_iov[0].iov_len = sizeof(buf);
+    if (niov) {
+        memcpy(&chunk_iov[1], iov, niov * sizeof(*iov));
+    }
+
+    if (qemu_co_sendv(client->sock, chunk_iov, niov + 1, 0,
+                      sizeof(buf) + len) != sizeof(buf) + len) {
+        LOG("writing to socket failed");
+        return -EIO;
+    }
+    return 0;
+}
+
+static ssize_t nbd_co_send_error_chunk(NBDRequest *req, uint64_t handle,
+                                       uint32_t error)
+{
+    NBDClient *client = req->client;
+    uint8_t payload[4 + 2];
+    struct iovec iov = { .iov_base = payload, .iov_len = sizeof(payload) };
+    ssize_t rc;
+
+    /* Error number and a message of length 0 */
+    cpu_to_be32w((uint32_t *)payload, error);
+    cpu_to_be16w((uint16_t *)(payload + 4), 0);
+
+    nbd_co_send_lock(client);
+    rc = nbd_co_send_chunk(client, handle, NBD_REPLY_FLAG_DONE,
+                           NBD_REPLY_TYPE_ERROR, &iov, 1);
+    nbd_co_send_unlock(client);
     return rc;
 }
 
@@ -1025,6 +1347,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 {
     NBDClient *client = req->client;
     int csock = client->sock;
+    uint32_t command;
     ssize_t rc;
 
     client->recv_coroutine = qemu_coroutine_self();
@@ -1036,7 +1359,10 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_BUFFER_SIZE) {
+    /* Other requests do not transfer data, they can be larger */
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if ((command == NBD_CMD_READ || command == NBD_CMD_WRITE) &&
+        request->len > NBD_BUFFER_SIZE) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_BUFFER_SIZE);
         rc = -EINVAL;
@@ -1052,7 +1378,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     TRACE("Decoding type");
 
-    if ((request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
+    if (command == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
 
         if (qemu_co_recv(csock, req->data, request->len) != request->len) {
@@ -1068,6 +1394,223 @@ out:
     return rc;
 }
 
+/*
+ * Like bdrv_co_is_allocated_above() for the whole backing chain, but at the
+ * end of a shorter backing file it still returns the extent that the top
+ * image knows about, so that callers make progress.
+ */
+static int coroutine_fn nbd_co_get_allocation(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors, int *pnum)
+{
+    int ret;
+
+    ret = bdrv_co_is_allocated_above(bs, NULL, sector_num, nb_sectors, pnum);
+    if (ret == 0 && *pnum == 0) {
+        ret = bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
+    }
+    return ret;
+}
+
+/*
+ * Sends the run [@start, @start + @len) of @req->data as a data or a hole
+ * chunk.
+ */
+static ssize_t nbd_co_send_read_chunk(NBDRequest *req,
+                                      struct nbd_request *request,
+                                      uint32_t start, uint32_t len,
+                                      bool hole, bool done)
+{
+    uint8_t payload[8 + 4];
+    struct iovec iov[2];
+
+    cpu_to_be64w((uint64_t *)payload, request->from + start);
+    iov[0].iov_base = payload;
+    if (hole) {
+        cpu_to_be32w((uint32_t *)(payload + 8), len);
+        iov[0].iov_len = 8 + 4;
+    } else {
+        iov[0].iov_len = 8;
+        iov[1].iov_base = req->data + start;
+        iov[1].iov_len = len;
+    }
+
+    return nbd_co_send_chunk(req->client, request->handle,
+                             done ? NBD_REPLY_FLAG_DONE : 0,
+                             hole ? NBD_REPLY_TYPE_OFFSET_HOLE
+                                  : NBD_REPLY_TYPE_OFFSET_DATA,
+                             iov, hole ? 1 : 2);
+}
+
+/*
+ * Reads @request into @req->data.  Unallocated parts of the image are not
+ * read at all but filled with zeroes.
+ */
+static int coroutine_fn nbd_co_read_sparse(NBDRequest *req,
+                                           struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    uint8_t *buf = req->data;
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        ret = nbd_co_get_allocation(exp->bs, sector_num, nb_sectors, &n);
+        if (ret < 0) {
+            return ret;
+        }
+        if (n == 0) {
+            /* Past the end of the image, which bdrv_read() would reject */
+            return -EIO;
+        }
+
+        if (ret) {
+            ret = bdrv_read(exp->bs, sector_num, buf, n);
+            if (ret < 0) {
+                return ret;
+            }
+        } else {
+            memset(buf, 0, n * 512);
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * 512;
+    }
+    return 0;
+}
+
+/*
+ * Replies to a read request of a client that negotiated structured
+ * replies.  Blocks of zeroes are sent as holes instead of data, so reading
+ * a sparse image does not have to send all of its zeroes over the wire.
+ */
+static ssize_t nbd_co_send_sparse_read(NBDRequest *req,
+                                       struct nbd_request *request)
+{
+    NBDClient *client = req->client;
+    uint32_t len = request->len;
+    uint32_t run_start = 0, pos, block;
+    bool run_hole = false, hole;
+    ssize_t rc = 0;
+
+    nbd_co_send_lock(client);
+    socket_set_cork(client->sock, 1);
+
+    if (len == 0) {
+        rc = nbd_co_send_chunk(client, request->handle, NBD_REPLY_FLAG_DONE,
+                               NBD_REPLY_TYPE_NONE, NULL, 0);
+        goto out;
+    }
+
+    if (request->type & NBD_CMD_FLAG_DF) {
+        rc = nbd_co_send_read_chunk(req, request, 0, len, false, true);
+        goto out;
+    }
+
+    for (pos = 0; pos < len; pos += block) {
+        block = MIN(NBD_SPARSE_BLOCK_SIZE, len - pos);
+        hole = block % 32 == 0 && buffer_is_zero(req->data + pos, block);
+        if (pos == 0) {
+            run_hole = hole;
+        } else if (hole != run_hole) {
+            rc = nbd_co_send_read_chunk(req, request, run_start,
+                                        pos - run_start, run_hole, false);
+            if (rc < 0) {
+                goto out;
+            }
+            run_start = pos;
+            run_hole = hole;
+        }
+    }
+    rc = nbd_co_send_read_chunk(req, request, run_start, len - run_start,
+                                run_hole, true);
+
+out:
+    socket_set_cork(client->sock, 0);
+    nbd_co_send_unlock(client);
+    return rc;
+}
+
+/*
+ * Builds the extent descriptors for NBD_CMD_BLOCK_STATUS in @req->data, in
+ * the form [length (4 bytes), flags (4 bytes)] of the "base:allocation"
+ * context.  Returns the number of descriptors or -errno.
+ */
+static int coroutine_fn nbd_co_get_block_status(NBDRequest *req,
+                                                struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    uint64_t pos = request->from + exp->dev_offset;
+    uint64_t end = pos + request->len;
+    uint32_t *desc = (uint32_t *)req->data;
+    int max_desc = NBD_BUFFER_SIZE / 8;
+    int nb_desc = 0;
+    uint32_t flags, prev_flags = 0;
+    int64_t sector_num;
+    int nb_sectors, n, ret;
+    uint64_t next;
+
+    while (pos < end) {
+        sector_num = pos / 512;
+        nb_sectors = MIN(DIV_ROUND_UP(end, 512) - sector_num,
+                         INT_MAX / 512);
+        ret = nbd_co_get_allocation(exp->bs, sector_num, nb_sectors, &n);
+        if (ret < 0) {
+            return ret;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        flags = ret ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO;
+        next = MIN((sector_num + n) * 512, end);
+
+        if (nb_desc > 0 && flags == prev_flags) {
+            desc[2 * nb_desc - 2] += next - pos;
+        } else {
+            if (nb_desc == max_desc ||
+                (nb_desc == 1 && (request->type & NBD_CMD_FLAG_REQ_ONE))) {
+                break;
+            }
+            desc[2 * nb_desc] = next - pos;
+            desc[2 * nb_desc + 1] = flags;
+            prev_flags = flags;
+            nb_desc++;
+        }
+        pos = next;
+    }
+
+    return nb_desc ? nb_desc : -EIO;
+}
+
+static ssize_t nbd_co_send_block_status(NBDRequest *req,
+                                        struct nbd_request *request,
+                                        int nb_desc)
+{
+    NBDClient *client = req->client;
+    uint32_t *desc = (uint32_t *)req->data;
+    uint32_t id = cpu_to_be32(NBD_META_ID_BASE_ALLOCATION);
+    struct iovec iov[2];
+    ssize_t rc;
+    int i;
+
+    for (i = 0; i < 2 * nb_desc; i++) {
+        cpu_to_be32s(&desc[i]);
+    }
+    iov[0].iov_base = &id;
+    iov[0].iov_len = sizeof(id);
+    iov[1].iov_base = desc;
+    iov[1].iov_len = nb_desc * 8;
+
+    nbd_co_send_lock(client);
+    rc = nbd_co_send_chunk(client, request->handle, NBD_REPLY_FLAG_DONE,
+                           NBD_REPLY_TYPE_BLOCK_STATUS, iov, 2);
+    nbd_co_send_unlock(client);
+    return rc;
+}
+
 static void nbd_trip(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1075,6 +1618,8 @@ static void nbd_trip(void *opaque)
     NBDRequest *req;
     struct nbd_request request;
     struct nbd_reply reply;
+    int64_t sector_num;
+    int nb_sectors, n;
     ssize_t ret;
 
     TRACE("Reading request.");
@@ -1121,8 +1666,12 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
-                        req->data, request.len / 512);
+        if (client->structured_reply) {
+            ret = nbd_co_read_sparse(req, &request);
+        } else {
+            ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
+                            req->data, request.len / 512);
+        }
         if (ret < 0) {
             LOG("reading from file failed");
             reply.error = -ret;
@@ -1130,8 +1679,14 @@ static void nbd_trip(void *opaque)
         }
 
         TRACE("Read %u byte(s)", request.len);
-        if (nbd_co_send_reply(req, &reply, request.len) < 0)
+        if (client->structured_reply) {
+            ret = nbd_co_send_sparse_read(req, &request);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, request.len);
+        }
+        if (ret < 0) {
             goto out;
+        }
         break;
     case NBD_CMD_WRITE:
         TRACE("Request type is WRITE");
@@ -1193,12 +1748,75 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_WRITE_ZEROES:
+        TRACE("Request type is WRITE_ZEROES");
+
+        if (exp->nbdflags & NBD_FLAG_READ_ONLY) {
+            TRACE("Server is read-only, return error");
+            reply.error = EROFS;
+            goto error_reply;
+        }
+
+        /* Split the request, bdrv_co_write_zeroes may allocate a buffer */
+        sector_num = (request.from + exp->dev_offset) / 512;
+        nb_sectors = request.len / 512;
+        while (nb_sectors > 0) {
+            n = MIN(nb_sectors, NBD_BUFFER_SIZE / 512);
+            ret = bdrv_co_write_zeroes(exp->bs, sector_num, n);
+            if (ret < 0) {
+                LOG("writing zeroes failed");
+                reply.error = -ret;
+                goto error_reply;
+            }
+            sector_num += n;
+            nb_sectors -= n;
+        }
+
+        if (request.type & NBD_CMD_FLAG_FUA) {
+            ret = bdrv_co_flush(exp->bs);
+            if (ret < 0) {
+                LOG("flush failed");
+                reply.error = -ret;
+                goto error_reply;
+            }
+        }
+
+        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+            goto out;
+        }
+        break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+
+        if (!client->base_allocation || request.len == 0) {
+            goto invalid_request;
+        }
+
+        ret = nbd_co_get_block_status(req, &request);
+        if (ret < 0) {
+            LOG("getting block status failed");
+            reply.error = -ret;
+            goto error_reply;
+        }
+
+        if (nbd_co_send_block_status(req, &request, ret) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
-        reply.error = -EINVAL;
+        reply.error = EINVAL;
     error_reply:
-        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+        /* Structured reads must not get a simple reply */
+        if (client->structured_reply &&
+            ((request.type & NBD_CMD_MASK_COMMAND) == NBD_CMD_READ ||
+             (request.type & NBD_CMD_MASK_COMMAND) == NBD_CMD_BLOCK_STATUS)) {
+            ret = nbd_co_send_error_chunk(req, request.handle, reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0) {
             goto out;
         }
         break;
@@ -1219,7 +1837,8 @@ static int nbd_can_read(void *opaque)
 {
     NBDClient *client = opaque;
 
-    return client->recv_coroutine || client->nb_requests < MAX_NBD_REQUESTS;
+    return client->recv_coroutine ||
+           client->nb_requests < client->exp->max_requests;
 }
 
 static void nbd_read(void *opaque)
@@ -43,22 +43,37 @@ struct nbd_reply {
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)     /* Send WRITE_ZEROES */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Flush covers all connections */
+
+/* Handshake flags of the server and of the client (new-style only) */
+#define NBD_FLAG_FIXED_NEWSTYLE     (1 << 0)    /* Option haggling */
+#define NBD_FLAG_C_FIXED_NEWSTYLE   (1 << 0)    /* Client does haggling */
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
+#define NBD_CMD_FLAG_NO_HOLE	(1 << 17)
+#define NBD_CMD_FLAG_DF		(1 << 18)
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 19)
 
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_WRITE_ZEROES = 6,
+    NBD_CMD_BLOCK_STATUS = 7,
 };
 
 #define NBD_DEFAULT_PORT	10809
 
 #define NBD_BUFFER_SIZE (1024*1024)
 
+/* Requests that a client may have in flight */
+#define NBD_DEFAULT_MAX_REQUESTS    16
+#define NBD_MAX_REQUESTS_LIMIT      1024
+
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int tcp_socket_outgoing(const char *address, uint16_t port);
 int tcp_socket_incoming(const char *address, uint16_t port);
@@ -89,6 +104,7 @@ BlockDriverState *nbd_export_get_blockdev(NBDExport *exp);
 
 NBDExport *nbd_export_find(const char *name);
 void nbd_export_set_name(NBDExport *exp, const char *name);
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests);
 void nbd_export_close_all(void);
 
 NBDClient *nbd_client_new(NBDExport *exp, int csock,
@@ -181,17 +181,13 @@ static char *assign_name(NetClientState *nc1, const char *model)
     return g_strdup(buf);
 }
 
-NetClientState *qemu_new_net_client(NetClientInfo *info,
-                                    NetClientState *peer,
-                                    const char *model,
-                                    const char *name)
+static void qemu_net_client_setup(NetClientState *nc,
+                                  NetClientInfo *info,
+                                  NetClientState *peer,
+                                  const char *model,
+                                  const char *name,
+                                  NetClientDestructor *destructor)
 {
-    NetClientState *nc;
-
-    assert(info->size >= sizeof(NetClientState));
-
-    nc = g_malloc0(info->size);
-
     nc->info = info;
     nc->model = g_strdup(model);
     if (name) {
@@ -208,6 +204,26 @@ NetClientState *qemu_new_net_client(NetClientInfo *info,
     QTAILQ_INSERT_TAIL(&net_clients, nc, next);
 
     nc->send_queue = qemu_new_net_queue(nc);
+    nc->destructor = destructor;
+}
+
+static void qemu_net_client_destructor(NetClientState *nc)
+{
+    g_free(nc);
+}
+
+NetClientState *qemu_new_net_client(NetClientInfo *info,
+                                    NetClientState *peer,
+                                    const char *model,
+                                    const char *name)
+{
+    NetClientState *nc;
+
+    assert(info->size >= sizeof(NetClientState));
+
+    nc = g_malloc0(info->size);
+    qemu_net_client_setup(nc, info, peer, model, name,
+                          qemu_net_client_destructor);
 
     return nc;
 }
@@ -218,21 +234,63 @@ NICState *qemu_new_nic(NetClientInfo *info,
                        const char *name,
                        void *opaque)
 {
-    NetClientState *nc;
+    NetClientState *peers[MAX_QUEUE_NUM];
     NICState *nic;
+    int i, queues = MAX(1, conf->queues);
 
     assert(info->type == NET_CLIENT_OPTIONS_KIND_NIC);
     assert(info->size >= sizeof(NICState));
+    /* the subqueues follow NICState itself */
+    assert(queues == 1 || info->size == sizeof(NICState));
+
+    peers[0] = conf->peer;
+    if (queues > 1) {
+        assert(conf->peer);
+        if (qemu_find_net_clients_except(conf->peer->name, peers,
+                                         NET_CLIENT_OPTIONS_KIND_NIC,
+                                         queues) != queues) {
+            return NULL;
+        }
+        assert(peers[0] == conf->peer);
+    }
 
-    nc = qemu_new_net_client(info, conf->peer, model, name);
-
-    nic = DO_UPCAST(NICState, nc, nc);
+    nic = g_malloc0(info->size + sizeof(NetClientState) * (queues - 1));
     nic->conf = conf;
     nic->opaque = opaque;
+    nic->queues = queues;
+
+    for (i = 0; i < queues; i++) {
+        NetClientState *nc = qemu_get_subqueue(nic, i);
+
+        /* all queues go by the name of the first one */
+        qemu_net_client_setup(nc, info, peers[i], model,
+                              i ? nic->nc.name : name, NULL);
+        nc->queue_index = i;
+    }
 
     return nic;
 }
 
+NetClientState *qemu_get_subqueue(NICState *nic, int queue_index)
+{
+    assert(queue_index < nic->queues);
+    return queue_index ? &nic->subqueues[queue_index - 1] : &nic->nc;
+}
+
+NICState *qemu_get_nic(NetClientState *nc)
+{
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC);
+    if (!nc->queue_index) {
+        return DO_UPCAST(NICState, nc, nc);
+    }
+    return container_of(nc - (nc->queue_index - 1), NICState, subqueues[0]);
+}
+
+void *qemu_get_nic_opaque(NetClientState *nc)
+{
+    return qemu_get_nic(nc)->opaque;
+}
+
 static void qemu_cleanup_net_client(NetClientState *nc)
 {
     QTAILQ_REMOVE(&net_clients, nc, next);
@@ -252,37 +310,81 @@ static void qemu_free_net_client(NetClientState *nc)
     }
     g_free(nc->name);
     g_free(nc->model);
-    g_free(nc);
+    if (nc->destructor) {
+        nc->destructor(nc);
+    }
 }
 
+/* Deleting any queue of a backend deletes all of them. */
 void qemu_del_net_client(NetClientState *nc)
 {
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    int queues, i;
+
+    if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+        qemu_del_nic(qemu_get_nic(nc));
+        return;
+    }
+
+    queues = qemu_find_net_clients_except(nc->name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    assert(queues != 0);
+
     /* If there is a peer NIC, delete and cleanup client, but do not free. */
     if (nc->peer && nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
-        NICState *nic = DO_UPCAST(NICState, nc, nc->peer);
+        NICState *nic = qemu_get_nic(nc->peer);
         if (nic->peer_deleted) {
             return;
         }
         nic->peer_deleted = true;
         /* Let NIC know peer is gone. */
-        nc->peer->link_down = true;
+        for (i = 0; i < queues; i++) {
+            if (ncs[i]->peer) {
+                ncs[i]->peer->link_down = true;
+            }
+        }
         if (nc->peer->info->link_status_changed) {
             nc->peer->info->link_status_changed(nc->peer);
         }
-        qemu_cleanup_net_client(nc);
+        for (i = 0; i < queues; i++) {
+            qemu_cleanup_net_client(ncs[i]);
+            /* queues the NIC does not use are not freed along with it */
+            if (!ncs[i]->peer) {
+                qemu_free_net_client(ncs[i]);
+            }
+        }
         return;
     }
 
+    for (i = 0; i < queues; i++) {
+        qemu_cleanup_net_client(ncs[i]);
+        qemu_free_net_client(ncs[i]);
+    }
+}
+
+void qemu_del_nic(NICState *nic)
+{
+    int i;
+
     /* If this is a peer NIC and peer has already been deleted, free it now. */
-    if (nc->peer && nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
-        NICState *nic = DO_UPCAST(NICState, nc, nc);
-        if (nic->peer_deleted) {
-            qemu_free_net_client(nc->peer);
+    if (nic->peer_deleted) {
+        for (i = 0; i < nic->queues; i++) {
+            NetClientState *nc = qemu_get_subqueue(nic, i);
+            if (nc->peer) {
+                qemu_free_net_client(nc->peer);
+            }
         }
     }
 
-    qemu_cleanup_net_client(nc);
-    qemu_free_net_client(nc);
+    for (i = nic->queues - 1; i >= 0; i--) {
+        NetClientState *nc = qemu_get_subqueue(nic, i);
+
+        qemu_cleanup_net_client(nc);
+        qemu_free_net_client(nc);
+    }
+
+    g_free(nic);
 }
 
 void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
@@ -290,8 +392,9 @@ void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
     NetClientState *nc;
 
     QTAILQ_FOREACH(nc, &net_clients, next) {
-        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
-            func(DO_UPCAST(NICState, nc, nc), opaque);
+        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC &&
+            nc->queue_index == 0) {
+            func(qemu_get_nic(nc), opaque);
         }
     }
 }
@@ -481,6 +584,31 @@ NetClientState *qemu_find_netdev(const char *id)
     return NULL;
 }
 
+/*
+ * Collect the clients named @id that are not of @type, in creation order.
+ * A multiqueue backend creates one client per queue, all with the same name.
+ */
+int qemu_find_net_clients_except(const char *id, NetClientState **ncs,
+                                 NetClientOptionsKind type, int max)
+{
+    NetClientState *nc;
+    int ret = 0;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        if (nc->info->type == type) {
+            continue;
+        }
+        if (!strcmp(nc->name, id)) {
+            if (ret < max) {
+                ncs[ret] = nc;
+            }
+            ret++;
+        }
+    }
+
+    return ret;
+}
+
 static int nic_get_free_idx(void)
 {
     int index;
@@ -879,20 +1007,22 @@ void do_info_network(Monitor *mon)
 
 void qmp_set_link(const char *name, bool up, Error **errp)
 {
-    NetClientState *nc = NULL;
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    NetClientState *nc;
+    int queues, i;
 
-    QTAILQ_FOREACH(nc, &net_clients, next) {
-        if (!strcmp(nc->name, name)) {
-            goto done;
-        }
-    }
-done:
-    if (!nc) {
+    queues = qemu_find_net_clients_except(name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_MAX,
+                                          MAX_QUEUE_NUM);
+    if (queues == 0) {
         error_set(errp, QERR_DEVICE_NOT_FOUND, name);
         return;
     }
+    nc = ncs[0];
 
-    nc->link_down = !up;
+    for (i = 0; i < queues; i++) {
+        ncs[i]->link_down = !up;
+    }
 
     if (nc->info->link_status_changed) {
         nc->info->link_status_changed(nc);
@@ -912,10 +1042,9 @@ done:
 
 void net_cleanup(void)
 {
-    NetClientState *nc, *next_vc;
-
-    QTAILQ_FOREACH_SAFE(nc, &net_clients, next, next_vc) {
-        qemu_del_net_client(nc);
+    /* deleting a client may delete the clients that follow it, too */
+    while (!QTAILQ_EMPTY(&net_clients)) {
+        qemu_del_net_client(QTAILQ_FIRST(&net_clients));
     }
 }
 
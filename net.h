@@ -15,10 +15,13 @@ struct MACAddr {
 
 /* qdev nic properties */
 
+#define MAX_QUEUE_NUM 1024
+
 typedef struct NICConf {
     MACAddr macaddr;
     NetClientState *peer;
     int32_t bootindex;
+    int32_t queues;
 } NICConf;
 
 #define DEFINE_NIC_PROPERTIES(_state, _conf)                            \
@@ -35,6 +38,7 @@ typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
+typedef void (NetClientDestructor)(NetClientState *);
 
 typedef struct NetClientInfo {
     NetClientOptionsKind type;
@@ -58,16 +62,28 @@ struct NetClientState {
     char *name;
     char info_str[256];
     unsigned receive_disabled : 1;
+    NetClientDestructor *destructor;
+    unsigned int queue_index;
 };
 
+/*
+ * A NIC has one NetClientState per queue.  Queue 0 is @nc, so that NICs
+ * with a single queue can keep using it directly; the others follow the
+ * structure.  Each queue is connected to its own peer: the backend created
+ * them all under the same name, see qemu_find_net_clients_except().
+ */
 typedef struct NICState {
     NetClientState nc;
     NICConf *conf;
     void *opaque;
     bool peer_deleted;
+    unsigned int queues;
+    NetClientState subqueues[0];
 } NICState;
 
 NetClientState *qemu_find_netdev(const char *id);
+int qemu_find_net_clients_except(const char *id, NetClientState **ncs,
+                                 NetClientOptionsKind type, int max);
 NetClientState *qemu_new_net_client(NetClientInfo *info,
                                     NetClientState *peer,
                                     const char *model,
@@ -78,6 +94,10 @@ NICState *qemu_new_nic(NetClientInfo *info,
                        const char *name,
                        void *opaque);
 void qemu_del_net_client(NetClientState *nc);
+void qemu_del_nic(NICState *nic);
+NetClientState *qemu_get_subqueue(NICState *nic, int queue_index);
+NICState *qemu_get_nic(NetClientState *nc);
+void *qemu_get_nic_opaque(NetClientState *nc);
 NetClientState *qemu_find_vlan_client_by_name(Monitor *mon, int vlan_id,
                                               const char *client_str);
 typedef void (*qemu_nic_foreach)(NICState *nic, void *opaque);
@@ -762,3 +762,13 @@ void tap_set_vnet_hdr_len(NetClientState *nc, int len)
 {
     assert(0);
 }
+
+int tap_enable(NetClientState *nc)
+{
+    return 0;
+}
+
+int tap_disable(NetClientState *nc)
+{
+    return 0;
+}
@@ -61,6 +61,9 @@ static int running_on_valgrind = -1;
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
 #endif
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 
 int qemu_get_thread_id(void)
 {
@@ -180,6 +183,30 @@ int qemu_pipe(int pipefd[2])
     return ret;
 }
 
+#ifdef CONFIG_EPOLL
+/*
+ * Creates an epoll file descriptor with FD_CLOEXEC set
+ */
+int qemu_epoll_create(void)
+{
+    int ret;
+
+#ifdef CONFIG_EPOLL_CREATE1
+    ret = epoll_create1(EPOLL_CLOEXEC);
+    if (ret != -1 || errno != ENOSYS) {
+        return ret;
+    }
+#endif
+    /* the size is only a hint, but it must be positive */
+    ret = epoll_create(1);
+    if (ret != -1) {
+        qemu_set_cloexec(ret);
+    }
+
+    return ret;
+}
+#endif
+
 int qemu_utimens(const char *path, const struct timespec *times)
 {
     struct timeval tv[2], tv_now;
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, indexed by a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -34,26 +34,78 @@
     do { } while (0)
 #endif
 
+/*
+ * Each address maps to one set of CACHE_WAYS items.  Items carry an access
+ * frequency that is halved at every cache_age() call, which the migration
+ * code does once per dirty bitmap sync.  Halving is done lazily, by
+ * remembering the epoch at which the frequency was last brought up to date.
+ *
+ * When a set is full, a new page only replaces the item with the lowest
+ * frequency if it was itself missed more often, recently, than that item
+ * was hit.  Misses are counted in a small per-set history of addresses that
+ * are not cached.  This keeps pages that are dirtied over and over, which
+ * are the ones XBZRLE helps with, from being pushed out by pages that are
+ * only sent once.
+ */
+
+#define CACHE_WAYS 8
+#define CACHE_FREQ_MAX 255
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint32_t it_freq;
+    uint32_t it_epoch;
     uint8_t *it_data;
 };
 
+typedef struct CacheGhost {
+    uint64_t addr;
+    uint32_t freq;
+    uint32_t epoch;
+} CacheGhost;
+
 struct PageCache {
     CacheItem *page_cache;
+    CacheGhost *ghosts;
     unsigned int page_size;
     int64_t max_num_items;
+    int64_t num_sets;
+    unsigned int num_ways;
     uint64_t max_item_age;
+    uint32_t epoch;
     int64_t num_items;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+static uint32_t cache_freq(const PageCache *cache, uint32_t freq,
+                           uint32_t epoch)
+{
+    uint32_t shift = cache->epoch - epoch;
+
+    return shift >= 32 ? 0 : freq >> shift;
+}
+
+static void cache_init_sets(PageCache *cache, int64_t num_pages)
 {
     int64_t i;
 
+    cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
+
+    cache->page_cache = g_new0(CacheItem, num_pages);
+    cache->ghosts = g_new0(CacheGhost, num_pages);
+    for (i = 0; i < num_pages; i++) {
+        cache->page_cache[i].it_addr = -1;
+        cache->ghosts[i].addr = -1;
+    }
+    cache->num_items = 0;
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
     PageCache *cache;
 
     if (num_pages <= 0) {
@@ -61,7 +113,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         return NULL;
     }
 
-    cache = g_malloc(sizeof(*cache));
+    cache = g_malloc0(sizeof(*cache));
 
     /* round down to the nearest power of 2 */
     if (!is_power_of_2(num_pages)) {
@@ -69,20 +121,12 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         DPRINTF("rounding down to %" PRId64 "\n", num_pages);
     }
     cache->page_size = page_size;
-    cache->num_items = 0;
     cache->max_item_age = 0;
-    cache->max_num_items = num_pages;
-
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
-
-    cache->page_cache = g_malloc((cache->max_num_items) *
-                                 sizeof(*cache->page_cache));
+    cache->epoch = 0;
+    cache_init_sets(cache, num_pages);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
-    }
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->num_sets, cache->num_ways);
 
     return cache;
 }
@@ -99,75 +143,176 @@ void cache_fini(PageCache *cache)
     }
 
     g_free(cache->page_cache);
+    g_free(cache->ghosts);
     cache->page_cache = NULL;
+    cache->ghosts = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* index of the first way of the set for @address */
+static size_t cache_get_set_pos(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    uint64_t page = address / cache->page_size;
 
     g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    /* mix in the high bits, so that strided accesses spread over sets */
+    page ^= page >> 17;
+    page *= 0x9e3779b97f4a7c15ULL;
+    return ((page >> 32) & (cache->num_sets - 1)) * cache->num_ways;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = &cache->page_cache[cache_get_set_pos(cache, addr)];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
 
-    return (cache->page_cache[pos].it_addr == addr);
+bool cache_is_cached(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it) {
+        return false;
+    }
+
+    it->it_freq = MIN(cache_freq(cache, it->it_freq, it->it_epoch) + 1,
+                      CACHE_FREQ_MAX);
+    it->it_epoch = cache->epoch;
+    it->it_age = ++cache->max_item_age;
+    return true;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    return it ? it->it_data : NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/* Count a miss for @addr in the history of its set, and return how many
+ * recent misses it had. */
+static uint32_t cache_ghost_miss(PageCache *cache, uint64_t addr)
+{
+    CacheGhost *set = &cache->ghosts[cache_get_set_pos(cache, addr)];
+    CacheGhost *victim = NULL;
+    uint32_t victim_freq = UINT32_MAX;
+    unsigned int i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        uint32_t freq = cache_freq(cache, set[i].freq, set[i].epoch);
+
+        if (set[i].addr == addr) {
+            set[i].freq = MIN(freq + 1, CACHE_FREQ_MAX);
+            set[i].epoch = cache->epoch;
+            return set[i].freq;
+        }
+        if (freq < victim_freq) {
+            victim = &set[i];
+            victim_freq = freq;
+        }
+    }
 
-    return &cache->page_cache[pos];
+    victim->addr = addr;
+    victim->freq = 1;
+    victim->epoch = cache->epoch;
+    return 1;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+static void cache_ghost_forget(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheGhost *set = &cache->ghosts[cache_get_set_pos(cache, addr)];
+    unsigned int i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].addr == addr) {
+            set[i].addr = -1;
+            set[i].freq = 0;
+        }
+    }
 }
 
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
+/* The item of the set for @addr to replace: a free one if any, otherwise
+ * the least frequently used one, the least recently used one on ties. */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr,
+                                   uint32_t *victim_freq)
 {
+    CacheItem *set = &cache->page_cache[cache_get_set_pos(cache, addr)];
+    CacheItem *victim = NULL;
+    unsigned int i;
 
-    CacheItem *it = NULL;
+    *victim_freq = 0;
+    for (i = 0; i < cache->num_ways; i++) {
+        uint32_t freq;
+
+        if (set[i].it_addr == -1) {
+            return &set[i];
+        }
+        freq = cache_freq(cache, set[i].it_freq, set[i].it_epoch);
+        if (!victim || freq < *victim_freq ||
+            (freq == *victim_freq && set[i].it_age < victim->it_age)) {
+            victim = &set[i];
+            *victim_freq = freq;
+        }
+    }
+    return victim;
+}
+
+int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
+{
+    CacheItem *it;
+    uint32_t freq, victim_freq;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        freq = cache_ghost_miss(cache, addr);
+        it = cache_get_victim(cache, addr, &victim_freq);
+        if (it->it_addr != -1 && freq <= victim_freq) {
+            DPRINTF("not admitting %" PRIx64 "\n", addr);
+            return -1;
+        }
 
-    if (!it->it_data) {
-        cache->num_items++;
+        if (it->it_addr == -1) {
+            cache->num_items++;
+        }
+        cache_ghost_forget(cache, addr);
+        it->it_addr = addr;
+        it->it_freq = freq;
+        it->it_epoch = cache->epoch;
     }
 
-    it->it_data = pdata;
+    if (!it->it_data) {
+        it->it_data = g_malloc(cache->page_size);
+    }
+    memcpy(it->it_data, pdata, cache->page_size);
     it->it_age = ++cache->max_item_age;
-    it->it_addr = addr;
+    return 0;
+}
+
+void cache_age(PageCache *cache)
+{
+    g_assert(cache);
+    cache->epoch++;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
-    PageCache *new_cache;
+    CacheItem *old_items;
+    int64_t old_num_items;
     int64_t i;
 
-    CacheItem *old_it, *new_it;
-
     g_assert(cache);
 
     /* cache was not inited */
@@ -175,44 +320,47 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
+    if (new_num_pages <= 0) {
+        DPRINTF("invalid number of pages\n");
+        return -1;
+    }
+
     /* same size */
     if (pow2floor(new_num_pages) == cache->max_num_items) {
         return cache->max_num_items;
     }
 
-    new_cache = cache_init(new_num_pages, cache->page_size);
-    if (!(new_cache)) {
-        DPRINTF("Error creating new cache\n");
-        return -1;
-    }
+    old_items = cache->page_cache;
+    old_num_items = cache->max_num_items;
+    g_free(cache->ghosts);
+    cache_init_sets(cache, pow2floor(new_num_pages));
+
+    /* move all data from the old cache; where a set overflows, keep the
+     * pages that are used the most */
+    for (i = 0; i < old_num_items; i++) {
+        CacheItem *old_it = &old_items[i];
+        CacheItem *new_it;
+        uint32_t old_freq, victim_freq;
+
+        if (old_it->it_addr == -1) {
+            g_free(old_it->it_data);
+            continue;
+        }
 
-    /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data) {
-                /* keep the MRU page */
-                if (new_it->it_age >= old_it->it_age) {
-                    g_free(old_it->it_data);
-                } else {
-                    g_free(new_it->it_data);
-                    new_it->it_data = old_it->it_data;
-                    new_it->it_age = old_it->it_age;
-                    new_it->it_addr = old_it->it_addr;
-                }
-            } else {
-                cache_insert(new_cache, old_it->it_addr, old_it->it_data);
-            }
+        old_freq = cache_freq(cache, old_it->it_freq, old_it->it_epoch);
+        new_it = cache_get_victim(cache, old_it->it_addr, &victim_freq);
+        if (new_it->it_addr == -1) {
+            cache->num_items++;
+        } else if (victim_freq > old_freq ||
+                   (victim_freq == old_freq &&
+                    new_it->it_age >= old_it->it_age)) {
+            g_free(old_it->it_data);
+            continue;
         }
+        g_free(new_it->it_data);
+        *new_it = *old_it;
     }
-
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
-
-    g_free(new_cache);
+    g_free(old_items);
 
     return cache->max_num_items;
 }
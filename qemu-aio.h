@@ -17,6 +17,8 @@
 #include "qemu-common.h"
 #include "qemu-queue.h"
 #include "event_notifier.h"
+#include "qemu-thread.h"
+#include "qemu/rfifolock.h"
 
 typedef struct BlockDriverAIOCB BlockDriverAIOCB;
 typedef void BlockDriverCompletionFunc(void *opaque, int ret);
@@ -56,6 +58,11 @@ typedef struct AioContext {
     /* Anchor of the list of Bottom Halves belonging to the context */
     struct QEMUBH *first_bh;
 
+    /* Protects first_bh against bottom halves that are created and
+     * deleted from different threads.
+     */
+    QemuMutex bh_lock;
+
     /* A simple lock used to protect the first_bh list, and ensure that
      * no callbacks are removed while we're walking and dispatching callbacks.
      */
@@ -63,6 +70,24 @@ typedef struct AioContext {
 
     /* Used for aio_notify.  */
     EventNotifier notifier;
+
+    /* Held by the thread that runs the event loop, see aio_context_acquire */
+    RFifoLock lock;
+
+#ifdef CONFIG_EPOLL
+    /* The handlers are in this epoll set, which is the only descriptor that
+     * the GSource polls.  -1 if epoll could not be used.
+     */
+    int epollfd;
+    GPollFD epoll_pfd;
+
+    /* Events that the GSource fetched and aio_poll has not dispatched yet */
+    struct epoll_event *epoll_events;
+    int epoll_nevents;
+
+    /* Number of handlers that were deleted while walking_handlers was set */
+    int deleted_handlers;
+#endif
 } AioContext;
 
 /* Returns 1 if there are still outstanding AIO requests; 0 otherwise */
@@ -77,6 +102,14 @@ typedef int (AioFlushEventNotifierHandler)(EventNotifier *e);
  */
 AioContext *aio_context_new(void);
 
+/* Set up and tear down the parts of an AioContext that depend on the host.
+ *
+ * These are internal functions used by aio_context_new and when the last
+ * reference to the AioContext goes away.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_destroy(AioContext *ctx);
+
 /**
  * aio_context_ref:
  * @ctx: The AioContext to operate on.
@@ -93,6 +126,28 @@ void aio_context_ref(AioContext *ctx);
  */
 void aio_context_unref(AioContext *ctx);
 
+/**
+ * aio_context_acquire:
+ * @ctx: The AioContext to operate on.
+ *
+ * Take ownership of an AioContext whose event loop runs in another thread,
+ * typically an iothread.  The owner can add and remove handlers, poll the
+ * context and submit requests that complete in it; other threads wait until
+ * it calls aio_context_release().  Waiting threads kick the owner out of a
+ * blocking aio_poll() with aio_notify(), and get the context in FIFO order.
+ *
+ * The lock is recursive.  The main loop runs qemu_aio_context without it.
+ */
+void aio_context_acquire(AioContext *ctx);
+
+/**
+ * aio_context_release:
+ * @ctx: The AioContext to operate on.
+ *
+ * Relinquish ownership of an AioContext taken with aio_context_acquire().
+ */
+void aio_context_release(AioContext *ctx);
+
 /**
  * aio_bh_new: Allocate a new bottom half structure.
  *
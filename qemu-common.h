@@ -228,6 +228,10 @@ ssize_t qemu_recv_full(int fd, void *buf, size_t count, int flags)
 int qemu_pipe(int pipefd[2]);
 #endif
 
+#ifdef CONFIG_EPOLL
+int qemu_epoll_create(void);
+#endif
+
 #ifdef _WIN32
 /* MinGW needs type casts for the 'buf' and 'optval' arguments. */
 #define qemu_getsockopt(sockfd, level, optname, optval, optlen) \
@@ -335,6 +339,7 @@ struct qemu_work_item {
     void (*func)(void *data);
     void *data;
     int done;
+    bool free;
 };
 
 #ifdef CONFIG_USER_ONLY
@@ -388,11 +393,32 @@ size_t qemu_iovec_from_buf(QEMUIOVector *qiov, size_t offset,
 size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
                          int fillc, size_t bytes);
 
+/* buffer-accel.c */
+typedef enum BufferAccel {
+    BUFFER_ACCEL_GENERIC,
+    BUFFER_ACCEL_SSE2,
+    BUFFER_ACCEL_AVX2,
+    BUFFER_ACCEL_MAX,
+} BufferAccel;
+
+/* The best implementation the host supports is picked at startup, this is
+ * only meant for testing them against each other. */
+bool buffer_accel_select(BufferAccel accel);
+BufferAccel buffer_accel_current(void);
+const char *buffer_accel_name(BufferAccel accel);
+
 bool buffer_is_zero(const void *buf, size_t len);
+/* true if all bytes are equal; buf and len must be aligned to 16 */
+bool buffer_is_dup(const void *buf, size_t len);
+/* offset of the first byte that differs between a and b, or len */
+size_t buffer_find_diff(const void *a, const void *b, size_t len);
+/* offset of the first byte that is equal in a and b, or len */
+size_t buffer_find_same(const void *a, const void *b, size_t len);
 
 void qemu_progress_init(int enabled, float min_skip);
 void qemu_progress_end(void);
 void qemu_progress_print(float delta, int max);
+void qemu_progress_add_bytes(uint64_t bytes);
 const char *qemu_get_vm_name(void);
 
 #define QEMU_FILE_TYPE_BIOS   0
@@ -110,10 +110,50 @@ static QemuOptsList qemu_drive_opts = {
             .name = "bps_wr",
             .type = QEMU_OPT_NUMBER,
             .help = "limit write bytes per second",
+        },{
+            .name = "iops_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total I/O operations burst",
+        },{
+            .name = "iops_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read operations burst",
+        },{
+            .name = "iops_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write operations burst",
+        },{
+            .name = "bps_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes burst",
+        },{
+            .name = "bps_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read bytes burst",
+        },{
+            .name = "bps_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write bytes burst",
+        },{
+            .name = "iops_size",
+            .type = QEMU_OPT_NUMBER,
+            .help = "size in bytes that counts as one I/O operation",
+        },{
+            .name = "group",
+            .type = QEMU_OPT_STRING,
+            .help = "name of the throttle group",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the L2 table cache of the image format",
+        },{
+            .name = "l2-cache-entry-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the L2 table slices held by each cache entry",
         },{
             .name = "boot",
             .type = QEMU_OPT_BOOL,
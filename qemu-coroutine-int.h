@@ -41,9 +41,28 @@ struct Coroutine {
     QTAILQ_ENTRY(Coroutine) co_queue_next;
 };
 
+enum {
+    /* Freed coroutines move between threads in batches of this size */
+    POOL_BATCH_SIZE = 64,
+};
+
+/* Freed coroutines that a thread keeps for its own use */
+typedef struct CoroutinePool {
+    QSLIST_HEAD(, Coroutine) list;
+    unsigned int size;
+} CoroutinePool;
+
 Coroutine *qemu_coroutine_new(void);
 void qemu_coroutine_delete(Coroutine *co);
 CoroutineAction qemu_coroutine_switch(Coroutine *from, Coroutine *to,
                                       CoroutineAction action);
 
+/**
+ * Return the calling thread's pool, or NULL if the backend cannot free it
+ * when the thread exits.  Backends that return a pool call
+ * qemu_coroutine_pool_cleanup() from their thread exit hook.
+ */
+CoroutinePool *qemu_coroutine_thread_pool(void);
+void qemu_coroutine_pool_cleanup(CoroutinePool *pool);
+
 #endif
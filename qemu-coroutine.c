@@ -17,13 +17,89 @@
 #include "qemu-coroutine.h"
 #include "qemu-coroutine-int.h"
 
+/* Coroutines freed by threads whose own pool is full.  Any thread pushes onto
+ * it without taking a lock, and a thread whose pool runs dry takes it over as
+ * a whole, so coroutines created in one thread and terminated in another are
+ * still recycled.
+ */
+static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(release_pool);
+static unsigned int release_pool_size;
+
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 {
-    Coroutine *co = qemu_coroutine_new();
+    CoroutinePool *pool = qemu_coroutine_thread_pool();
+    Coroutine *co = NULL;
+
+    if (pool) {
+        co = QSLIST_FIRST(&pool->list);
+        if (!co && release_pool_size > POOL_BATCH_SIZE) {
+            /* The size may lag behind pushes in other threads, it is only
+             * used to bound the pools.
+             */
+            pool->size = __sync_lock_test_and_set(&release_pool_size, 0);
+            QSLIST_MOVE_ATOMIC(&pool->list, &release_pool);
+            co = QSLIST_FIRST(&pool->list);
+        }
+        if (co) {
+            QSLIST_REMOVE_HEAD(&pool->list, pool_next);
+            pool->size--;
+        }
+    }
+
+    if (!co) {
+        co = qemu_coroutine_new();
+    }
     co->entry = entry;
     return co;
 }
 
+static void coroutine_delete(Coroutine *co)
+{
+    CoroutinePool *pool = qemu_coroutine_thread_pool();
+
+    co->caller = NULL;
+
+    if (pool) {
+        if (pool->size < POOL_BATCH_SIZE) {
+            QSLIST_INSERT_HEAD(&pool->list, co, pool_next);
+            pool->size++;
+            return;
+        }
+        if (release_pool_size < POOL_BATCH_SIZE * 2) {
+            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
+            __sync_fetch_and_add(&release_pool_size, 1);
+            return;
+        }
+    }
+
+    qemu_coroutine_delete(co);
+}
+
+void qemu_coroutine_pool_cleanup(CoroutinePool *pool)
+{
+    Coroutine *co;
+    Coroutine *tmp;
+
+    QSLIST_FOREACH_SAFE(co, &pool->list, pool_next, tmp) {
+        qemu_coroutine_delete(co);
+    }
+    QSLIST_INIT(&pool->list);
+    pool->size = 0;
+}
+
+/* The main thread does not run thread exit hooks */
+static void __attribute__((destructor)) coroutine_pool_cleanup(void)
+{
+    CoroutinePool *pool = qemu_coroutine_thread_pool();
+    CoroutinePool released;
+
+    if (pool) {
+        qemu_coroutine_pool_cleanup(pool);
+    }
+    QSLIST_MOVE_ATOMIC(&released.list, &release_pool);
+    qemu_coroutine_pool_cleanup(&released);
+}
+
 static void coroutine_swap(Coroutine *from, Coroutine *to)
 {
     CoroutineAction ret;
@@ -35,7 +111,7 @@ static void coroutine_swap(Coroutine *from, Coroutine *to)
         return;
     case COROUTINE_TERMINATE:
         trace_qemu_coroutine_terminate(to);
-        qemu_coroutine_delete(to);
+        coroutine_delete(to);
         return;
     default:
         abort();
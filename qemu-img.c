@@ -88,6 +88,9 @@ static void help(void)
            "  '-p' show progress of command (only certain commands)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel coroutines for the convert command (default 8,\n"
+           "       maximum 16)\n"
+           "  '-W' allows the convert command to write the output out of order\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
            "Parameters to check subcommand:\n"
@@ -96,6 +99,11 @@ static void help(void)
            "       kinds of errors, with a higher risk of choosing the wrong fix or\n"
            "       hiding corruption that has already occurred.\n"
            "\n"
+           "Parameters to compare subcommand:\n"
+           "  '-f' first image format\n"
+           "  '-F' second image format\n"
+           "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
            "  '-a' applies a snapshot (revert disk to saved state)\n"
@@ -642,13 +650,15 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
         return 0;
     }
 
-    res = !!memcmp(buf1, buf2, 512);
-    for(i = 1; i < n; i++) {
-        buf1 += 512;
-        buf2 += 512;
-
-        if (!!memcmp(buf1, buf2, 512) != res) {
-            break;
+    res = buffer_find_diff(buf1, buf2, 512) != 512;
+    if (!res) {
+        /* equal sectors end where the first byte differs */
+        i = buffer_find_diff(buf1, buf2, n * 512) / 512;
+    } else {
+        for (i = 1; i < n; i++) {
+            if (buffer_find_diff(buf1 + i * 512, buf2 + i * 512, 512) == 512) {
+                break;
+            }
         }
     }
 
@@ -658,24 +668,388 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+/* Requests that img_convert() may have in flight at the same time */
+#define CONVERT_MAX_COROUTINES 16
+#define CONVERT_DEFAULT_COROUTINES 8
+
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+};
+
+/*
+ * State of a conversion.  Each coroutine picks the next chunk of the
+ * input under @lock, reads it into its own buffer and writes it out.
+ * Reads are therefore always done ahead of the write position; unless
+ * @wr_in_order is false, writes still reach the target in order, which
+ * keeps its layout the same as with sequential copying.
+ */
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    int64_t sector_num;
+    int64_t sectors_done;
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool compressed;
+    bool target_has_backing;
+    int min_sparse;
+    int cluster_sectors;
+    int buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[CONVERT_MAX_COROUTINES];
+    int64_t wait_sector_num[CONVERT_MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+    bool wr_in_order;
+    int64_t wr_offs;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+/*
+ * Returns the number of sectors starting at @sector_num that can be
+ * handled as one request, and updates s->status for them.
+ */
+static int coroutine_fn convert_iteration_sectors(ImgConvertState *s,
+                                                  int64_t sector_num)
+{
+    BlockDriverState *bs;
+    int64_t src_cur_offset;
+    int ret, n, src_cur;
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+    bs = s->src[src_cur];
+
+    assert(s->total_sectors > sector_num);
+    n = MIN(s->total_sectors - sector_num, INT_MAX / BDRV_SECTOR_SIZE);
+    n = MIN(n, s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+    if (s->sector_next_status <= sector_num) {
+        int pnum;
+
+        /* If the output image is being created as a copy on write image,
+           assume that sectors which are unallocated in the input image
+           are present in both the output's and input's base images (no
+           need to copy them).  Otherwise sectors that are unallocated in
+           the whole backing chain of the input read as zeroes. */
+        if (s->target_has_backing && s->has_zero_init) {
+            ret = bdrv_co_is_allocated(bs, sector_num - src_cur_offset, n,
+                                       &pnum);
+        } else {
+            ret = bdrv_co_is_allocated_above(bs, NULL,
+                                             sector_num - src_cur_offset, n,
+                                             &pnum);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (pnum <= 0) {
+            /* unknown status, e.g. past the end of a backing file */
+            s->status = BLK_DATA;
+        } else if (ret) {
+            s->status = BLK_DATA;
+            n = pnum;
+        } else {
+            s->status = s->target_has_backing && s->has_zero_init ?
+                        BLK_BACKING_FILE : BLK_ZERO;
+            n = pnum;
+        }
+        s->sector_next_status = sector_num + n;
+    }
+
+    n = MIN(n, s->sector_next_status - sector_num);
+    if (s->status == BLK_DATA) {
+        n = MIN(n, s->buf_sectors);
+    }
+
+    /* Compressed clusters are written as a whole, so an unallocated area
+     * that does not cover a full cluster must be copied like data. */
+    if (s->compressed) {
+        if (n < s->cluster_sectors) {
+            n = MIN(s->cluster_sectors, s->total_sectors - sector_num);
+            s->status = BLK_DATA;
+        } else {
+            n = n - n % s->cluster_sectors;
+        }
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    assert(nb_sectors <= s->buf_sectors);
+    while (nb_sectors > 0) {
+        int64_t src_cur_offset;
+        int src_cur;
+
+        /* A compressed cluster may span two input images */
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors, s->src_sectors[src_cur] -
+                            (sector_num - src_cur_offset));
+
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                            n, &qiov);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    if (s->compressed) {
+        /* Data comes one cluster at a time; zero clusters read back as
+         * zeroes from the new image anyway */
+        if (status != BLK_DATA) {
+            return 0;
+        }
+        assert(nb_sectors <= s->cluster_sectors);
+        if (nb_sectors < s->cluster_sectors) {
+            memset(buf + nb_sectors * BDRV_SECTOR_SIZE, 0,
+                   (s->cluster_sectors - nb_sectors) * BDRV_SECTOR_SIZE);
+        }
+        if (buffer_is_zero(buf, s->cluster_sectors * BDRV_SECTOR_SIZE)) {
+            return 0;
+        }
+        return bdrv_co_write_compressed(s->target, sector_num, buf,
+                                        s->cluster_sectors);
+    }
+
+    while (nb_sectors > 0) {
+        int n = nb_sectors;
+
+        switch (status) {
+        case BLK_BACKING_FILE:
+            /* Leave the range unallocated, the backing file shows through */
+            break;
+
+        case BLK_DATA:
+            /* If the output image is being created as a copy on write image,
+               copy all sectors even the ones containing only NUL bytes,
+               because they may differ from the sectors in the base image.
+
+               If the output is to a host device, we also write out
+               sectors that are entirely 0, since whatever data was
+               already there is garbage, not 0s. */
+            if (!s->has_zero_init || s->target_has_backing ||
+                is_allocated_sectors_min(buf, n, &n, s->min_sparse)) {
+                iov.iov_base = buf;
+                iov.iov_len = n * BDRV_SECTOR_SIZE;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            break;
+
+        case BLK_ZERO:
+            if (!s->has_zero_init) {
+                ret = bdrv_co_write_zeroes(s->target, sector_num, n);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    for (;;) {
+        enum ImgConvertBlockStatus status;
+        int64_t sector_num;
+        int n;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", s->sector_num, strerror(-n));
+            s->ret = n;
+            break;
+        }
+        /* Claim the range, so that the other coroutines can already go
+         * on reading what follows it */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == -EINPROGRESS) {
+            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (status == BLK_DATA) {
+            qemu_progress_add_bytes((uint64_t)n * BDRV_SECTOR_SIZE);
+        }
+        s->sectors_done += n;
+        qemu_progress_print(100.0 * s->sectors_done / s->total_sectors, 0);
+
+        if (s->wr_in_order) {
+            /* Hand over to the coroutine that waits for this write.  It
+             * cannot enter us back, as our wait_sector_num is -1 now. */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    s->sector_num = 0;
+    s->sectors_done = 0;
+    s->sector_next_status = 0;
+    s->wr_offs = 0;
+    s->ret = -EINPROGRESS;
+    qemu_co_mutex_init(&s->lock);
+
+    /* Count all coroutines as running before any of them can finish */
+    s->running_coroutines = s->num_coroutines;
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    if (s->ret == 0 && s->compressed) {
+        /* signal EOF to align */
+        bdrv_write_compressed(s->target, 0, NULL, 0);
+    }
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size = 0;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    int64_t total_sectors;
+    int64_t *bs_sectors = NULL;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = CONVERT_DEFAULT_COROUTINES;
+    bool wr_in_order = true;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -683,7 +1057,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -737,6 +1111,22 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            long val = strtol(optarg, &end, 10);
+            if (*end || val < 1 || val > CONVERT_MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             CONVERT_MAX_COROUTINES);
+                return 1;
+            }
+            num_coroutines = val;
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -765,6 +1155,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    bs_sectors = g_malloc0(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -774,8 +1165,15 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bs_sectors[bs_i] = bdrv_getlength(bs[bs_i]);
+        if (bs_sectors[bs_i] < 0) {
+            error_report("Could not get size of %s: %s",
+                         argv[optind + bs_i], strerror(-bs_sectors[bs_i]));
+            ret = -1;
+            goto out;
+        }
+        bs_sectors[bs_i] /= BDRV_SECTOR_SIZE;
+        total_sectors += bs_sectors[bs_i];
     }
 
     if (snapshot_name != NULL) {
@@ -841,7 +1239,7 @@ static int img_convert(int argc, char **argv)
         QEMUOptionParameter *preallocation =
             get_option_parameter(param, BLOCK_OPT_PREALLOC);
 
-        if (!drv->bdrv_write_compressed) {
+        if (!drv->bdrv_write_compressed && !drv->bdrv_co_write_compressed) {
             error_report("Compression not supported for this file format");
             ret = -1;
             goto out;
@@ -893,11 +1291,6 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
-
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
         if (ret < 0) {
@@ -910,187 +1303,347 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
+    }
 
-        nb_sectors = total_sectors;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, cluster_sectors));
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .has_zero_init      = bdrv_has_zero_init(out_bs),
+        .compressed         = compress,
+        .target_has_backing = out_baseimg != NULL,
+        .min_sparse         = min_sparse,
+        .cluster_sectors    = compress ? cluster_size / BDRV_SECTOR_SIZE : 0,
+        .buf_sectors        = compress ? cluster_size / BDRV_SECTOR_SIZE
+                                       : IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+        .num_coroutines     = num_coroutines,
+        /* Drivers that compress in a coroutine append each cluster as it
+         * is done; let them work on several clusters at once. */
+        .wr_in_order        = wr_in_order &&
+                              !(compress &&
+                                out_bs->drv->bdrv_co_write_compressed),
+    };
+    ret = convert_do_copy(&state);
+out:
+    qemu_progress_end();
+    free_option_parameters(create_options);
+    free_option_parameters(param);
+    if (out_bs) {
+        bdrv_delete(out_bs);
+    }
+    g_free(bs_sectors);
+    if (bs) {
+        for (bs_i = 0; bs_i < bs_n; bs_i++) {
+            if (bs[bs_i]) {
+                bdrv_delete(bs[bs_i]);
+            }
         }
+        g_free(bs);
+    }
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
 
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
+typedef struct CompareReadData {
+    int ret;
+    int pending;
+} CompareReadData;
 
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
+static void compare_read_cb(void *opaque, int ret)
+{
+    CompareReadData *data = opaque;
 
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
+    if (ret < 0 && data->ret == 0) {
+        data->ret = ret;
+    }
+    data->pending--;
+}
 
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
+/*
+ * Reads the same sectors from both images, with both requests in flight at
+ * the same time.  @bs2 may be NULL to read only from @bs1.
+ */
+static int compare_read(BlockDriverState *bs1, uint8_t *buf1,
+                        BlockDriverState *bs2, uint8_t *buf2,
+                        int64_t sector_num, int nb_sectors)
+{
+    BlockDriverState *bs[2] = { bs1, bs2 };
+    uint8_t *buf[2] = { buf1, buf2 };
+    QEMUIOVector qiov[2];
+    struct iovec iov[2];
+    CompareReadData data = { .ret = 0, .pending = 0 };
+    int i;
 
-                buf2 += nlow * 512;
-                bs_num += nlow;
+    for (i = 0; i < 2 && bs[i]; i++) {
+        iov[i].iov_base = buf[i];
+        iov[i].iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov[i], &iov[i], 1);
 
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
+        data.pending++;
+        if (!bdrv_aio_readv(bs[i], sector_num, &qiov[i], nb_sectors,
+                            compare_read_cb, &data)) {
+            compare_read_cb(&data, -EIO);
+        }
+    }
 
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            }
-            if (!buffer_is_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
+    while (data.pending) {
+        qemu_aio_wait();
+    }
+    return data.ret;
+}
+
+/*
+ * Checks that the given sectors of an image that are allocated only in
+ * this image read as zeroes.  Returns 0 if they do, 1 if they don't and
+ * 2 on error.
+ */
+static int compare_check_empty(BlockDriverState *bs, uint8_t *buf,
+                               int64_t sector_num, int nb_sectors,
+                               const char *filename)
+{
+    int ret, pnum;
+
+    ret = compare_read(bs, buf, NULL, NULL, sector_num, nb_sectors);
+    if (ret < 0) {
+        error_report("Error while reading offset %" PRId64 " of %s: %s",
+                     sector_num << BDRV_SECTOR_BITS, filename, strerror(-ret));
+        return 2;
+    }
+
+    ret = is_allocated_sectors(buf, nb_sectors, &pnum);
+    if (ret || pnum != nb_sectors) {
+        printf("Content mismatch at offset %" PRId64 "!\n",
+               (sector_num + (ret ? 0 : pnum)) << BDRV_SECTOR_BITS);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Compares the guest visible content of two images.  Ranges that are
+ * unallocated in the whole backing chain of both images are not read.
+ *
+ * Exit status:
+ *   0 - the images are identical
+ *   1 - the images differ
+ *   2 - an error occurred
+ */
+static int img_compare(int argc, char **argv)
+{
+    const char *fmt1 = NULL, *fmt2 = NULL, *filename1, *filename2;
+    BlockDriverState *bs1 = NULL, *bs2 = NULL;
+    int64_t total_sectors1, total_sectors2, total_sectors, sector_num;
+    uint8_t *buf1 = NULL, *buf2 = NULL;
+    bool progress = false, strict = false;
+    int c, ret;
+
+    for (;;) {
+        c = getopt(argc, argv, "hpf:F:s");
+        if (c == -1) {
+            break;
         }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
+        switch (c) {
+        case '?':
+            return 2;
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt1 = optarg;
+            break;
+        case 'F':
+            fmt2 = optarg;
+            break;
+        case 'p':
+            progress = true;
+            break;
+        case 's':
+            strict = true;
+            break;
+        }
+    }
 
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
+    if (optind != argc - 2) {
+        error_report("Expecting two image file names");
+        return 2;
+    }
+    filename1 = argv[optind++];
+    filename2 = argv[optind++];
+
+    /* Initialize before goto out */
+    qemu_progress_init(progress, 2.0);
+
+    bs1 = bdrv_new_open(filename1, fmt1, BDRV_O_FLAGS, true);
+    if (!bs1) {
+        ret = 2;
+        goto out;
+    }
+
+    bs2 = bdrv_new_open(filename2, fmt2, BDRV_O_FLAGS, true);
+    if (!bs2) {
+        ret = 2;
+        goto out;
+    }
+
+    total_sectors1 = bdrv_getlength(bs1);
+    total_sectors2 = bdrv_getlength(bs2);
+    if (total_sectors1 < 0 || total_sectors2 < 0) {
+        error_report("Can't get size of %s: %s",
+                     total_sectors1 < 0 ? filename1 : filename2,
+                     strerror(-MIN(total_sectors1, total_sectors2)));
+        ret = 2;
+        goto out;
+    }
+    total_sectors1 /= BDRV_SECTOR_SIZE;
+    total_sectors2 /= BDRV_SECTOR_SIZE;
+    total_sectors = MIN(total_sectors1, total_sectors2);
+
+    buf1 = qemu_blockalign(bs1, IO_BUF_SIZE);
+    buf2 = qemu_blockalign(bs2, IO_BUF_SIZE);
+
+    qemu_progress_print(0, 100);
+
+    if (strict && total_sectors1 != total_sectors2) {
+        printf("Strict mode: Image size mismatch!\n");
+        ret = 1;
+        goto out;
+    }
+
+    for (sector_num = 0; sector_num < total_sectors; ) {
+        int nb_sectors = MIN(total_sectors - sector_num,
+                             IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+        int allocated1, allocated2, pnum1, pnum2, pnum;
+
+        allocated1 = bdrv_is_allocated_above(bs1, NULL, sector_num,
+                                             nb_sectors, &pnum1);
+        allocated2 = bdrv_is_allocated_above(bs2, NULL, sector_num,
+                                             nb_sectors, &pnum2);
+        if (allocated1 < 0 || allocated2 < 0) {
+            error_report("Sector allocation test failed for %s",
+                         allocated1 < 0 ? filename1 : filename2);
+            ret = 2;
+            goto out;
+        }
+        /* nothing is known past the end of a backing file, read it */
+        if (pnum1 <= 0) {
+            allocated1 = 1;
+            pnum1 = nb_sectors;
+        }
+        if (pnum2 <= 0) {
+            allocated2 = 1;
+            pnum2 = nb_sectors;
         }
+        nb_sectors = MIN(pnum1, pnum2);
 
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
+        if (allocated1 && allocated2) {
+            ret = compare_read(bs1, buf1, bs2, buf2, sector_num, nb_sectors);
+            if (ret < 0) {
+                error_report("Error while reading offset %" PRId64 ": %s",
+                             sector_num << BDRV_SECTOR_BITS, strerror(-ret));
+                ret = 2;
+                goto out;
             }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
+            ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
+            if (ret || pnum != nb_sectors) {
+                printf("Content mismatch at offset %" PRId64 "!\n",
+                       (sector_num + (ret ? 0 : pnum)) << BDRV_SECTOR_BITS);
+                ret = 1;
+                goto out;
+            }
+        } else if (allocated1 != allocated2) {
+            if (strict) {
+                printf("Strict mode: Offset %" PRId64
+                       " allocation mismatch!\n",
+                       sector_num << BDRV_SECTOR_BITS);
+                ret = 1;
+                goto out;
+            }
+            if (allocated1) {
+                ret = compare_check_empty(bs1, buf1, sector_num, nb_sectors,
+                                          filename1);
             } else {
-                n = nb_sectors;
+                ret = compare_check_empty(bs2, buf2, sector_num, nb_sectors,
+                                          filename2);
             }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
+            if (ret) {
+                goto out;
             }
+        }
+        /* else unallocated in both chains, so both read as zeroes */
 
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
+        sector_num += nb_sectors;
+        qemu_progress_print(100.0 * nb_sectors /
+                            MAX(total_sectors1, total_sectors2), 100);
+    }
 
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
+    if (total_sectors1 != total_sectors2) {
+        BlockDriverState *bs_over;
+        uint8_t *buf_over;
+        const char *filename_over;
+        int64_t total_sectors_over;
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
+        printf("Warning: Image size mismatch!\n");
+        if (total_sectors1 > total_sectors2) {
+            bs_over = bs1;
+            buf_over = buf1;
+            total_sectors_over = total_sectors1;
+            filename_over = filename1;
+        } else {
+            bs_over = bs2;
+            buf_over = buf2;
+            total_sectors_over = total_sectors2;
+            filename_over = filename2;
+        }
+
+        /* The rest of the larger image must read as zeroes */
+        for (; sector_num < total_sectors_over; ) {
+            int nb_sectors = MIN(total_sectors_over - sector_num,
+                                 IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+            int allocated;
+
+            allocated = bdrv_is_allocated_above(bs_over, NULL, sector_num,
+                                                nb_sectors, &nb_sectors);
+            if (allocated < 0) {
+                error_report("Sector allocation test failed for %s",
+                             filename_over);
+                ret = 2;
                 goto out;
             }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
+            if (nb_sectors <= 0) {
+                allocated = 1;
+                nb_sectors = MIN(total_sectors_over - sector_num,
+                                 IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+            }
+            if (allocated) {
+                ret = compare_check_empty(bs_over, buf_over, sector_num,
+                                          nb_sectors, filename_over);
+                if (ret) {
+                    goto out;
                 }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
             }
-            qemu_progress_print(local_progress, 100);
+            sector_num += nb_sectors;
+            qemu_progress_print(100.0 * nb_sectors / total_sectors_over, 100);
         }
     }
+
+    printf("Images are identical.\n");
+    ret = 0;
+
 out:
-    qemu_progress_end();
-    free_option_parameters(create_options);
-    free_option_parameters(param);
-    qemu_vfree(buf);
-    if (out_bs) {
-        bdrv_delete(out_bs);
-    }
-    if (bs) {
-        for (bs_i = 0; bs_i < bs_n; bs_i++) {
-            if (bs[bs_i]) {
-                bdrv_delete(bs[bs_i]);
-            }
-        }
-        g_free(bs);
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    if (bs2) {
+        bdrv_delete(bs2);
     }
-    if (ret) {
-        return 1;
+    if (bs1) {
+        bdrv_delete(bs1);
     }
-    return 0;
+    qemu_progress_end();
+    return ret;
 }
 
 
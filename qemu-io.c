@@ -24,10 +24,15 @@
 
 #define CMD_NOFILE_OK   0x01
 
+#define QEMU_IO_OPT_L2_CACHE_SIZE       256
+#define QEMU_IO_OPT_L2_CACHE_ENTRY_SIZE 257
+
 char *progname;
 static BlockDriverState *bs;
 
 static int misalign;
+static uint64_t l2_cache_size;
+static uint64_t l2_cache_entry_size;
 
 /*
  * Parse the pattern argument to various sub-commands.
@@ -265,6 +270,19 @@ static int do_co_write_zeroes(int64_t offset, int count, int *total)
     }
 }
 
+static int do_write_compressed(char *buf, int64_t offset, int count,
+                               int *total)
+{
+    int ret;
+
+    ret = bdrv_write_compressed(bs, offset >> 9, (uint8_t *)buf, count >> 9);
+    if (ret < 0) {
+        return ret;
+    }
+    *total = count;
+    return 1;
+}
+
 static int do_load_vmstate(char *buf, int64_t offset, int count, int *total)
 {
     *total = bdrv_load_vmstate(bs, (uint8_t *)buf, offset, count);
@@ -687,6 +705,7 @@ static void write_help(void)
 " Writes into a segment of the currently open file, using a buffer\n"
 " filled with a set pattern (0xcdcdcdcd).\n"
 " -b, -- write to the VM state rather than the virtual disk\n"
+" -c, -- write compressed data with bdrv_write_compressed\n"
 " -p, -- use bdrv_pwrite to write the file\n"
 " -P, -- use different pattern to fill file\n"
 " -C, -- report statistics in a machine parsable format\n"
@@ -703,7 +722,7 @@ static const cmdinfo_t write_cmd = {
     .cfunc      = write_f,
     .argmin     = 2,
     .argmax     = -1,
-    .args       = "[-bCpqz] [-P pattern ] off len",
+    .args       = "[-bcCpqz] [-P pattern ] off len",
     .oneline    = "writes a number of bytes at a specified offset",
     .help       = write_help,
 };
@@ -712,6 +731,7 @@ static int write_f(int argc, char **argv)
 {
     struct timeval t1, t2;
     int Cflag = 0, pflag = 0, qflag = 0, bflag = 0, Pflag = 0, zflag = 0;
+    int cflag = 0;
     int c, cnt;
     char *buf = NULL;
     int64_t offset;
@@ -720,11 +740,14 @@ static int write_f(int argc, char **argv)
     int total = 0;
     int pattern = 0xcd;
 
-    while ((c = getopt(argc, argv, "bCpP:qz")) != EOF) {
+    while ((c = getopt(argc, argv, "bcCpP:qz")) != EOF) {
         switch (c) {
         case 'b':
             bflag = 1;
             break;
+        case 'c':
+            cflag = 1;
+            break;
         case 'C':
             Cflag = 1;
             break;
@@ -753,8 +776,8 @@ static int write_f(int argc, char **argv)
         return command_usage(&write_cmd);
     }
 
-    if (bflag + pflag + zflag > 1) {
-        printf("-b, -p, or -z cannot be specified at the same time\n");
+    if (bflag + cflag + pflag + zflag > 1) {
+        printf("-b, -c, -p, or -z cannot be specified at the same time\n");
         return 0;
     }
 
@@ -801,6 +824,8 @@ static int write_f(int argc, char **argv)
         cnt = do_save_vmstate(buf, offset, count, &total);
     } else if (zflag) {
         cnt = do_co_write_zeroes(offset, count, &total);
+    } else if (cflag) {
+        cnt = do_write_compressed(buf, offset, count, &total);
     } else {
         cnt = do_write(buf, offset, count, &total);
     }
@@ -1464,6 +1489,11 @@ static int info_f(int argc, char **argv)
     printf("cluster size: %s\n", s1);
     printf("vm state offset: %s\n", s2);
 
+    if (bdi.has_l2_cache_stats) {
+        printf("l2 cache hits: %" PRIu64 "\n", bdi.l2_cache_hits);
+        printf("l2 cache misses: %" PRIu64 "\n", bdi.l2_cache_misses);
+    }
+
     return 0;
 }
 
@@ -1692,6 +1722,7 @@ static int openfile(char *name, int flags, int growable)
         }
     } else {
         bs = bdrv_new("hda");
+        bdrv_set_l2_cache_size(bs, l2_cache_size, l2_cache_entry_size);
 
         if (bdrv_open(bs, name, flags, NULL) < 0) {
             fprintf(stderr, "%s: can't open device %s\n", progname, name);
@@ -1808,6 +1839,10 @@ static void usage(const char *name)
 "  -k, --native-aio     use kernel AIO implementation (on Linux only)\n"
 "  -t, --cache=MODE     use the given cache mode for the image\n"
 "  -T, --trace FILE     enable trace events listed in the given file\n"
+"      --l2-cache-size=SIZE\n"
+"                       size of the qcow2 L2 table cache\n"
+"      --l2-cache-entry-size=SIZE\n"
+"                       size of a qcow2 L2 table cache entry\n"
 "  -h, --help           display this help and exit\n"
 "  -V, --version        output version information and exit\n"
 "\n",
@@ -1833,11 +1868,14 @@ int main(int argc, char **argv)
         { "native-aio", 0, NULL, 'k' },
         { "cache", 1, NULL, 't' },
         { "trace", 1, NULL, 'T' },
+        { "l2-cache-size", 1, NULL, QEMU_IO_OPT_L2_CACHE_SIZE },
+        { "l2-cache-entry-size", 1, NULL, QEMU_IO_OPT_L2_CACHE_ENTRY_SIZE },
         { NULL, 0, NULL, 0 }
     };
     int c;
     int opt_index = 0;
     int flags = 0;
+    long long size;
 
     progname = basename(argv[0]);
 
@@ -1875,6 +1913,22 @@ int main(int argc, char **argv)
                 exit(1); /* error message will have been printed */
             }
             break;
+        case QEMU_IO_OPT_L2_CACHE_SIZE:
+            size = cvtnum(optarg);
+            if (size < 0) {
+                error_report("Invalid L2 cache size: %s", optarg);
+                exit(1);
+            }
+            l2_cache_size = size;
+            break;
+        case QEMU_IO_OPT_L2_CACHE_ENTRY_SIZE:
+            size = cvtnum(optarg);
+            if (size < 0) {
+                error_report("Invalid L2 cache entry size: %s", optarg);
+                exit(1);
+            }
+            l2_cache_entry_size = size;
+            break;
         case 'V':
             printf("%s version %s\n", progname, VERSION);
             exit(0);
@@ -36,6 +36,7 @@
 #define SOCKET_PATH         "/var/lock/qemu-nbd-%s"
 #define QEMU_NBD_OPT_CACHE  1
 #define QEMU_NBD_OPT_AIO    2
+#define QEMU_NBD_OPT_MAX_REQUESTS 3
 
 static NBDExport *exp;
 static int verbose;
@@ -45,6 +46,7 @@ static int persistent = 0;
 static enum { RUNNING, TERMINATE, TERMINATING, TERMINATED } state;
 static int shared = 1;
 static int nb_fds;
+static const char *export_name;
 
 static void usage(const char *name)
 {
@@ -62,6 +64,10 @@ static void usage(const char *name)
 "                       (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent     don't exit on the last connection\n"
+"  -x, --export-name=NAME  name of the export; clients then use the\n"
+"                       new-style protocol, with structured replies\n"
+"      --max-requests=NUM  requests that each client may have in flight\n"
+"                       (default '%d')\n"
 "  -v, --verbose        display extra debugging information\n"
 "\n"
 "Exposing part of the image:\n"
@@ -85,7 +91,7 @@ static void usage(const char *name)
 #endif
 "\n"
 "Report bugs to <qemu-devel@nongnu.org>\n"
-    , name, NBD_DEFAULT_PORT, "DEVICE");
+    , name, NBD_DEFAULT_PORT, "DEVICE", NBD_DEFAULT_MAX_REQUESTS);
 }
 
 static void version(const char *name)
@@ -222,7 +228,7 @@ static void *nbd_client_thread(void *arg)
         goto out;
     }
 
-    ret = nbd_receive_negotiate(sock, NULL, &nbdflags,
+    ret = nbd_receive_negotiate(sock, export_name, &nbdflags,
                                 &size, &blocksize);
     if (ret < 0) {
         goto out;
@@ -297,7 +303,9 @@ static void nbd_accept(void *opaque)
         return;
     }
 
-    if (fd >= 0 && nbd_client_new(exp, fd, nbd_client_closed)) {
+    /* Named exports are looked up during the negotiation */
+    if (fd >= 0 && nbd_client_new(export_name ? NULL : exp, fd,
+                                  nbd_client_closed)) {
         nb_fds++;
     }
 }
@@ -312,7 +320,7 @@ int main(int argc, char **argv)
     char *device = NULL;
     int port = NBD_DEFAULT_PORT;
     off_t fd_size;
-    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:t";
+    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:tx:";
     struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -332,6 +340,8 @@ int main(int argc, char **argv)
 #endif
         { "shared", 1, NULL, 'e' },
         { "persistent", 0, NULL, 't' },
+        { "export-name", 1, NULL, 'x' },
+        { "max-requests", 1, NULL, QEMU_NBD_OPT_MAX_REQUESTS },
         { "verbose", 0, NULL, 'v' },
         { NULL, 0, NULL, 0 }
     };
@@ -341,6 +351,7 @@ int main(int argc, char **argv)
     char *end;
     int flags = BDRV_O_RDWR;
     int partition = -1;
+    int max_requests = NBD_DEFAULT_MAX_REQUESTS;
     int ret;
     int fd;
     bool seen_cache = false;
@@ -445,6 +456,19 @@ int main(int argc, char **argv)
 	case 't':
 	    persistent = 1;
 	    break;
+        case 'x':
+            export_name = optarg;
+            break;
+        case QEMU_NBD_OPT_MAX_REQUESTS:
+            max_requests = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid request number '%s'", optarg);
+            }
+            if (max_requests < 1 || max_requests > NBD_MAX_REQUESTS_LIMIT) {
+                errx(EXIT_FAILURE, "Request number must be between 1 and %d",
+                     NBD_MAX_REQUESTS_LIMIT);
+            }
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -561,6 +585,10 @@ int main(int argc, char **argv)
     }
 
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
+    nbd_export_set_max_requests(exp, max_requests);
+    if (export_name) {
+        nbd_export_set_name(exp, export_name);
+    }
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
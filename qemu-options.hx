@@ -150,7 +150,11 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,l2-cache-size=size][,l2-cache-entry-size=size]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
+    "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
+    "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
+    "       [,iops_size=is][,group=g]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -204,6 +208,31 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item l2-cache-size=@var{size}
+Size of the cache that qcow2 keeps its L2 tables in.  Each 8 bytes of cache
+map one cluster of the image, so a cache of 1 MB covers 8 GB of guest disk
+with the default 64 KB clusters.  The cache is never made larger than what
+is needed to cover the whole image.
+@item l2-cache-entry-size=@var{size}
+Size of the slices of L2 tables that are read into the cache at once.  It
+must be a power of two between 512 bytes and the cluster size, which is the
+default.  Smaller slices make random I/O over a large image cheaper.
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w}
+Limit the throughput of the drive, in total or separately for reads and
+writes, to the given number of bytes per second.
+@item iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+Limit the number of I/O operations per second of the drive, in total or
+separately for reads and writes.
+@item bps_max=@var{bm},bps_rd_max=@var{rm},bps_wr_max=@var{wm},iops_max=@var{im},iops_rd_max=@var{irm},iops_wr_max=@var{iwm}
+Allow bursts of up to the given number of bytes or operations on top of the
+matching limit above.  Without these, bursts of a tenth of the per-second
+limit are allowed.
+@item iops_size=@var{is}
+Count requests that are larger than @var{is} bytes as several I/O operations.
+@item group=@var{g}
+Put the drive into the throttle group @var{g}.  All drives of a group share
+the same limits, so that their I/O is limited together.  By default, each
+drive is in a group of its own.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -1330,7 +1359,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
     "                connect the host TAP network interface to VLAN 'n' \n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                to configure it and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1347,6 +1376,10 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'fds=x:y:...:z' to connect to already opened multiqueue capable TAP interfaces\n"
+    "                use 'vhostfds=x:y:...:z' to connect to multiple already opened vhost net devices\n"
+    "                use 'queues=n' to create a multiqueue TAP interface with n queues\n"
+    "                    (-netdev only, for use with a virtio-net device with mq=on)\n"
     "-net bridge[,vlan=n][,name=str][,br=bridge][,helper=helper]\n"
     "                connects a host TAP network interface to a host bridge device 'br'\n"
     "                (default=" DEFAULT_BRIDGE_INTERFACE ") using the program 'helper'\n"
@@ -1547,7 +1580,7 @@ processed and applied to -net user. Mixing them with the new configuration
 syntax gives undefined results. Their use for new applications is discouraged
 as they will be removed from future versions.
 
-@item -netdev tap,id=@var{id}[,fd=@var{h}][,ifname=@var{name}][,script=@var{file}][,downscript=@var{dfile}][,helper=@var{helper}]
+@item -netdev tap,id=@var{id}[,fd=@var{h}][,fds=@var{x:y:...:z}][,ifname=@var{name}][,script=@var{file}][,downscript=@var{dfile}][,helper=@var{helper}][,queues=@var{n}]
 @item -net tap[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}][,ifname=@var{name}][,script=@var{file}][,downscript=@var{dfile}][,helper=@var{helper}]
 Connect the host TAP network interface @var{name} to VLAN @var{n}.
 
@@ -1565,6 +1598,13 @@ helper executable is @file{/usr/local/libexec/qemu-bridge-helper}.
 @option{fd}=@var{h} can be used to specify the handle of an already
 opened host TAP interface.
 
+@option{queues}=@var{n} opens @var{n} queues of a multiqueue capable TAP
+interface, each with its own file descriptor and, with @option{vhost=on},
+its own vhost-net instance.  A virtio-net device with @option{mq=on} that
+uses the netdev gets @var{n} queue pairs.  Already opened queues can be
+passed with @option{fds}, and matching vhost-net devices with
+@option{vhostfds}.
+
 Examples:
 
 @example
@@ -1587,6 +1627,13 @@ qemu-system-i386 linux.img \
                  -net nic -net tap,"helper=/usr/local/libexec/qemu-bridge-helper"
 @end example
 
+@example
+#launch a QEMU instance with a four queue virtio-net NIC, with vhost
+qemu-system-x86_64 linux.img -smp 4 \
+                 -netdev tap,id=hn0,queues=4,vhost=on \
+                 -device virtio-net-pci,netdev=hn0,mq=on,vectors=10
+@end example
+
 @item -netdev bridge,id=@var{id}[,br=@var{bridge}][,helper=@var{helper}]
 @item -net bridge[,vlan=@var{n}][,name=@var{name}][,br=@var{bridge}][,helper=@var{helper}]
 Connect a host TAP network interface to a host bridge device.
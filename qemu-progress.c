@@ -25,12 +25,15 @@
 #include "qemu-common.h"
 #include "osdep.h"
 #include "sysemu.h"
+#include "qemu-timer.h"
 #include <stdio.h>
 
 struct progress_state {
     float current;
     float last_print;
     float min_skip;
+    uint64_t bytes;
+    int64_t start_time;
     void (*print)(void);
     void (*end)(void);
 };
@@ -38,6 +41,17 @@ struct progress_state {
 static struct progress_state state;
 static volatile sig_atomic_t print_pending;
 
+/* Average throughput in MiB/s since the start, or 0 if nothing was counted */
+static double progress_throughput(void)
+{
+    int64_t elapsed = get_clock() - state.start_time;
+
+    if (!state.bytes || elapsed <= 0) {
+        return 0;
+    }
+    return (double)state.bytes / (1024 * 1024) / elapsed * get_ticks_per_sec();
+}
+
 /*
  * Simple progress print function.
  * @percent relative percent of current operation
@@ -45,7 +59,12 @@ static volatile sig_atomic_t print_pending;
  */
 static void progress_simple_print(void)
 {
-    printf("    (%3.2f/100%%)\r", state.current);
+    if (state.bytes) {
+        printf("    (%3.2f/100%%, %.1f MiB/s)\r", state.current,
+               progress_throughput());
+    } else {
+        printf("    (%3.2f/100%%)\r", state.current);
+    }
     fflush(stdout);
 }
 
@@ -70,7 +89,12 @@ static void sigusr_print(int signal)
 static void progress_dummy_print(void)
 {
     if (print_pending) {
-        fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        if (state.bytes) {
+            fprintf(stderr, "    (%3.2f/100%%, %.1f MiB/s)\n", state.current,
+                    progress_throughput());
+        } else {
+            fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        }
         print_pending = 0;
     }
 }
@@ -105,6 +129,8 @@ static void progress_dummy_init(void)
 void qemu_progress_init(int enabled, float min_skip)
 {
     state.min_skip = min_skip;
+    state.bytes = 0;
+    state.start_time = get_clock();
     if (enabled) {
         progress_simple_init();
     } else {
@@ -117,6 +143,15 @@ void qemu_progress_end(void)
     state.end();
 }
 
+/*
+ * Account @bytes of data that were transferred.  Once this has been
+ * called, progress reports include the average throughput.
+ */
+void qemu_progress_add_bytes(uint64_t bytes)
+{
+    state.bytes += bytes;
+}
+
 /*
  * Report progress.
  * @delta is how much progress we made.
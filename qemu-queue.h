@@ -195,6 +195,20 @@ struct {                                                                \
         (head)->slh_first = (elm);                                      \
 } while (/*CONSTCOND*/0)
 
+#define QSLIST_INSERT_HEAD_ATOMIC(head, elm, field) do {                 \
+        typeof(elm) save_sle_next;                                        \
+        do {                                                              \
+            save_sle_next = (elm)->field.sle_next = (head)->slh_first;    \
+        } while (__sync_val_compare_and_swap(&(head)->slh_first,          \
+                                             save_sle_next, (elm)) !=     \
+                 save_sle_next);                                          \
+} while (/*CONSTCOND*/0)
+
+#define QSLIST_MOVE_ATOMIC(dest, src) do {                               \
+        (dest)->slh_first = __sync_lock_test_and_set(&(src)->slh_first,   \
+                                                     NULL);               \
+} while (/*CONSTCOND*/0)
+
 #define QSLIST_REMOVE_HEAD(head, field) do {                             \
         (head)->slh_first = (head)->slh_first->field.sle_next;          \
 } while (/*CONSTCOND*/0)
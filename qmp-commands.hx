@@ -938,7 +938,8 @@ EQMP
     {
         .name       = "drive-mirror",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "on-source-error:s?,on-target-error:s?,"
+                      "granularity:i?,buf-size:i?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -970,7 +971,15 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "granularity": granularity of the dirty bitmap, in bytes (json-int, optional)
+- "buf-size": maximum amount of data in flight from source to target, in bytes
+  (json-int, default 10M)
 
+The default value of the granularity is the image cluster size clamped
+between 4096 and 65536, if the image format defines one.  If the format
+does not define a cluster size, the default value of the granularity
+is 65536.  Adjacent dirty chunks are copied with a single request, and
+several requests are in flight at the same time, up to buf-size bytes.
 
 
 Example:
@@ -981,6 +990,149 @@ Example:
                                                "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "drive-backup",
+        .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
+                      "bitmap:s?,on-source-error:s?,on-target-error:s?",
+        .mhandler.cmd_new = qmp_marshal_input_drive_backup,
+    },
+
+SQMP
+drive-backup
+------------
+
+Start a point-in-time copy of a block device to a new destination.  The
+status of ongoing drive-backup operations can be checked with
+query-block-jobs where the BlockJobInfo.type field has the value 'backup'.
+The operation can be stopped before it has completed using the
+block-job-cancel command.
+
+Clusters are copied in the background; a guest write to a cluster that
+has not been copied yet first copies the old contents to the target.
+
+Arguments:
+
+- "device": the name of the device which should be copied.
+            (json-string)
+- "target": the target of the new image. If the file exists, or if it is a
+            device, the existing file/device will be used as the new
+            destination.  If it does not exist, a new file will be created.
+            (json-string)
+- "format": the format of the new destination, default is to probe if 'mode' is
+            'existing', else the format of the source
+            (json-string, optional)
+- "sync": what parts of the disk image should be copied to the destination;
+  possibilities include "full" for all the disk, "top" for only the sectors
+  allocated in the topmost image, "none" to only copy the data that
+  guest writes are about to overwrite, or "incremental" to copy the
+  sectors that are dirty in "bitmap" (MirrorSyncMode).
+- "bitmap": the dirty bitmap to use with "incremental"; it is cleared when
+            the job starts and the copied sectors are marked dirty again if
+            the job fails or is cancelled (json-string, optional)
+- "mode": whether and how QEMU should create a new image
+          (NewImageMode, optional, default 'absolute-paths')
+- "speed": the maximum speed, in bytes per second (json-int, optional)
+- "on-source-error": the action to take on an error on the source, default
+                     'report'.  'stop' and 'enospc' can only be used
+                     if the block device supports io-status.
+                     (BlockdevOnError, optional)
+- "on-target-error": the action to take on an error on the target, default
+                     'report' (no limitations, since this applies to
+                     a different block device than device).
+                     (BlockdevOnError, optional)
+
+Example:
+-> { "execute": "drive-backup", "arguments": { "device": "drive0",
+                                               "sync": "full",
+                                               "target": "backup.img" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,persistent:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Create a dirty bitmap on a block device.  From now on, the bitmap records
+the sectors that the guest writes to.
+
+Arguments:
+
+- "device": the name of the block device (json-string)
+- "name": name of the new dirty bitmap (json-string)
+- "granularity": bytes tracked by each bit, a power of 2 between 512 and 64M
+                 (json-int, optional, default is the image cluster size
+                 clamped between 4096 and 65536, or 65536)
+- "persistent": save the bitmap in the image file when the device is closed,
+                and create it again when the device is opened (json-bool,
+                optional, default false; qcow2 compat=1.1 images only)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "device": "drive0",
+                                                         "name": "nightly",
+                                                         "persistent": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Remove a dirty bitmap from a block device, and from the image file if it is
+persistent.
+
+Arguments:
+
+- "device": the name of the block device (json-string)
+- "name": name of the dirty bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "device": "drive0",
+                                                            "name": "nightly" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-clear",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_clear,
+    },
+
+SQMP
+block-dirty-bitmap-clear
+------------------------
+
+Mark all sectors clean in a dirty bitmap.
+
+Arguments:
+
+- "device": the name of the block device (json-string)
+- "name": name of the dirty bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-clear", "arguments": { "device": "drive0",
+                                                           "name": "nightly" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1237,7 +1389,10 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,"
+                      "bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,"
+                      "iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,"
+                      "iops_size:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1256,6 +1411,16 @@ Arguments:
 - "iops":  total I/O operations per second(json-int)
 - "iops_rd":  read I/O operations per second(json-int)
 - "iops_wr":  write I/O operations per second(json-int)
+- "bps_max":  total burst size in bytes (json-int, optional)
+- "bps_rd_max":  read burst size in bytes (json-int, optional)
+- "bps_wr_max":  write burst size in bytes (json-int, optional)
+- "iops_max":  total burst size in I/O operations (json-int, optional)
+- "iops_rd_max":  read burst size in I/O operations (json-int, optional)
+- "iops_wr_max":  write burst size in I/O operations (json-int, optional)
+- "iops_size":  I/O size in bytes; larger requests count as several
+                operations (json-int, optional)
+- "group":  throttle group name; devices in the same group share their
+            limits (json-string, optional)
 
 Example:
 
@@ -1265,7 +1430,42 @@ Example:
                                                "bps_wr": "0",
                                                "iops": "0",
                                                "iops_rd": "0",
-                                               "iops_wr": "0" } }
+                                               "iops_wr": "0",
+                                               "bps_max": "8000000",
+                                               "group": "group0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,start:l?,factor:l?,count:l?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set up the read, write and flush latency histograms of a block device.  The
+bins have log-scale limits: start, start * factor, start * factor^2 and so
+on.  Their counts start over from zero.
+
+Arguments:
+
+- "device": device name (json-string)
+- "start": limit of the first bin in nanoseconds, default 10000 (json-int,
+           optional)
+- "factor": ratio between the limits of consecutive bins, at least 2,
+            default 2 (json-int, optional)
+- "count": number of limits, at most 64, default 20; 0 disables the
+           histograms (json-int, optional)
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0", "start": 100000, "factor": 10,
+                    "count": 5 } }
 <- { "return": {} }
 
 EQMP
@@ -1606,11 +1806,31 @@ Each json-object contain the following:
          - "iops": limit total I/O operations per second (json-int)
          - "iops_rd": limit read operations per second (json-int)
          - "iops_wr": limit write operations per second (json-int)
+         - "bps_max": total burst size in bytes (json-int, optional)
+         - "bps_rd_max": read burst size in bytes (json-int, optional)
+         - "bps_wr_max": write burst size in bytes (json-int, optional)
+         - "iops_max": total burst size in operations (json-int, optional)
+         - "iops_rd_max": read burst size in operations (json-int, optional)
+         - "iops_wr_max": write burst size in operations (json-int, optional)
+         - "iops_size": I/O size in bytes (json-int, optional)
+         - "group": throttle group name, only present if the device is
+                    throttled (json-string, optional)
 
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
                to "ok" when the "cont" command is issued (json_string, optional)
              - Possible values: "ok", "failed", "nospace"
+- "dirty-bitmaps": list of dirty bitmaps, only present if the device has
+                   any (json-array of json-object, optional).  Each object
+                   has the following members:
+         - "name": bitmap name, absent for anonymous bitmaps (json-string,
+                   optional)
+         - "count": number of dirty bytes (json-int)
+         - "granularity": bytes tracked by each bit (json-int)
+         - "persistent": true if the bitmap is saved in the image
+                         (json-bool)
+         - "frozen": true if a backup job is copying the bitmap's contents
+                     (json-bool)
 
 Example:
 
@@ -1690,6 +1910,27 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "l2-cache-hits": number of L2 table lookups served from the
+                       metadata cache of the image format (json-int, optional)
+    - "l2-cache-misses": number of L2 table lookups that had to read the
+                         image file (json-int, optional)
+    - "in_flight": read and write requests in flight (json-int)
+    - "busy_time_ns": total time with requests in flight in nano-seconds
+                      (json-int)
+    - "queue_depth_time_ns": total time with requests in flight in
+                             nano-seconds, weighted by their number; its
+                             increase divided by the elapsed time is the
+                             average queue depth (json-int)
+    - "idle_time_ns": time since the last request completed in nano-seconds,
+                      absent while requests are in flight (json-int, optional)
+    - "rd_latency_histogram", "wr_latency_histogram",
+      "flush_latency_histogram": latency histograms, if enabled with
+                                 block-latency-histogram-set (json-array,
+                                 optional).  Each bin is a json-object with:
+        - "limit_ns": the requests in this bin took less than this, and at
+                      least the limit of the previous bin; absent for the
+                      last bin (json-int, optional)
+        - "count": number of requests in the bin (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1724,7 +1965,13 @@ Example:
                "flush_operations":51,
                "wr_total_times_ns":313253456
                "rd_total_times_ns":3465673657
-               "flush_total_times_ns":49653
+               "flush_total_times_ns":49653,
+               "l2-cache-hits":36255,
+               "l2-cache-misses":349,
+               "in_flight":0,
+               "busy_time_ns":3523487215,
+               "queue_depth_time_ns":3794216330,
+               "idle_time_ns":1284967
             }
          },
          {
@@ -1828,6 +2075,42 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_cpus,
     },
 
+SQMP
+query-iothreads
+---------------
+
+Show the iothreads that were created with -object iothread.
+
+Return a json-array. Each iothread is represented by a json-object, which
+contains:
+
+- "id": identifier of the iothread (json-string)
+- "thread-id": ID of the underlying host thread (json-int)
+
+Example:
+
+-> { "execute": "query-iothreads" }
+<- {
+      "return":[
+         {
+            "id":"iothread0",
+            "thread-id":3134
+         },
+         {
+            "id":"iothread1",
+            "thread-id":3135
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-iothreads",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_iothreads,
+    },
+
 SQMP
 query-pci
 ---------
@@ -2353,7 +2636,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+       "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
 		 time (json-int)
@@ -2362,6 +2646,9 @@ The main json-object contains the following:
 - "expected-downtime": only present while migration is active
                 total amount in ms for downtime that was calculated on
 		the last bitmap round (json-int)
+- "cpu-throttle-percentage": only present while auto-converge throttles
+                the guest, percentage of time the vCPUs are kept from
+                running (json-int)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information (in bytes):
          - "transferred": amount transferred (json-int)
@@ -2370,6 +2657,9 @@ The main json-object contains the following:
          - "duplicate": number of duplicated pages (json-int)
          - "normal" : number of normal pages transferred (json-int)
          - "normal-bytes" : number of normal bytes transferred (json-int)
+         - "postcopy-requests" : number of page requests served in
+           post-copy, only present if the postcopy capability is active
+           (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information (in bytes):
          - "transferred": amount transferred (json-int)
@@ -2381,7 +2671,15 @@ The main json-object contains the following:
          - "bytes": total XBZRLE bytes transferred
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of cache misses
+         - "cache-hit": number of cache hits
+         - "cache-hit-rate": rate of cache hits during the last iteration
          - "overflow": number of XBZRLE overflows
+- "compression": only present if the compress capability is active.
+  It is a json-object with the following compression information:
+         - "threads": number of compression threads
+         - "bytes": total compressed bytes transferred
+         - "pages": number of compressed pages
+         - "busy": number of times no compression thread was idle
 Examples:
 
 1. Before the first migration
@@ -2477,6 +2775,8 @@ Examples:
             "bytes":20971520,
             "pages":2444343,
             "cache-miss":2244,
+            "cache-hit":9876,
+            "cache-hit-rate":0.81,
             "overflow":34434
          }
       }
@@ -2497,6 +2797,10 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": xbzrle support
+- "compress": multithreaded page compression support
+- "postcopy": switch to post-copy when pre-copy does not converge
+- "multifd": send pages over several connections in parallel
+- "auto-converge": throttle the guest down if migration does not converge
 
 Arguments:
 
@@ -2521,6 +2825,10 @@ Query current migration capabilities
 
 - "capabilities": migration capabilities state
          - "xbzrle" : XBZRLE state (json-bool)
+         - "compress" : multithreaded compression state (json-bool)
+         - "postcopy" : post-copy state (json-bool)
+         - "multifd" : multiple connections state (json-bool)
+         - "auto-converge" : auto-converge state (json-bool)
 
 Arguments:
 
@@ -2611,7 +2919,7 @@ EQMP
     },
     {
         .name       = "nbd-server-add",
-        .args_type  = "device:B,writable:b?",
+        .args_type  = "device:B,writable:b?,max-requests:i?",
         .mhandler.cmd_new = qmp_marshal_input_nbd_server_add,
     },
     {
@@ -561,6 +561,24 @@ QEMUFile *qemu_fopen_socket(int fd, const char *mode)
     return s->file;
 }
 
+/* Open the opposite direction of a socket-backed migration stream, so that
+ * the destination can send requests back to the source.  Returns NULL if
+ * the transport is not a socket. */
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    int fd;
+
+    if (f->ops != &socket_read_ops && f->ops != &socket_write_ops) {
+        return NULL;
+    }
+
+    fd = dup(qemu_get_fd(f));
+    if (fd < 0) {
+        return NULL;
+    }
+    return qemu_fopen_socket(fd, f->ops == &socket_read_ops ? "wb" : "rb");
+}
+
 QEMUFile *qemu_fopen(const char *filename, const char *mode)
 {
     QEMUFileStdio *s;
@@ -589,6 +607,55 @@ fail:
     return NULL;
 }
 
+/* QEMUFile backed by a growable memory buffer.  The buffer belongs to the
+ * caller and survives qemu_fclose(). */
+typedef struct QEMUFileMem {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    size_t read_pos;
+} QEMUFileMem;
+
+static int mem_put_buffer(void *opaque, const uint8_t *buf, int64_t pos,
+                          int size)
+{
+    QEMUFileMem *s = opaque;
+
+    if (s->size + size > s->capacity) {
+        s->capacity = MAX(s->capacity * 2, s->size + size);
+        s->data = g_realloc(s->data, s->capacity);
+    }
+    memcpy(s->data + s->size, buf, size);
+    s->size += size;
+    return size;
+}
+
+static int mem_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileMem *s = opaque;
+
+    size = MIN(size, s->size - s->read_pos);
+    memcpy(buf, s->data + s->read_pos, size);
+    s->read_pos += size;
+    return size;
+}
+
+static const QEMUFileOps mem_read_ops = {
+    .get_buffer = mem_get_buffer,
+};
+
+static const QEMUFileOps mem_write_ops = {
+    .put_buffer = mem_put_buffer,
+};
+
+static QEMUFile *qemu_fopen_mem(QEMUFileMem *s, int is_writable)
+{
+    if (is_writable) {
+        return qemu_fopen_ops(s, &mem_write_ops);
+    }
+    return qemu_fopen_ops(s, &mem_read_ops);
+}
+
 static int block_put_buffer(void *opaque, const uint8_t *buf,
                            int64_t pos, int size)
 {
@@ -850,6 +917,14 @@ int qemu_get_byte(QEMUFile *f)
     return result;
 }
 
+/* Account for @len bytes that were sent on behalf of @f over another
+ * channel, so that rate limiting and bandwidth estimation see them. */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->pos += len;
+    f->bytes_xfer += len;
+}
+
 int64_t qemu_ftell(QEMUFile *f)
 {
     qemu_fflush(f);
@@ -1743,6 +1818,7 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY             0x06
 
 bool qemu_savevm_state_blocked(Error **errp)
 {
@@ -1982,6 +2058,61 @@ out:
     return ret;
 }
 
+static int qemu_save_device_state(QEMUFile *f);
+
+/*
+ * Switch to post-copy.  The device state is packaged as a length-prefixed
+ * blob, so that the destination can hand the rest of the stream over to the
+ * one live section that supports post-copy (RAM) before loading devices;
+ * devices may touch guest memory while loading and that memory has to be
+ * fetched on demand by then.
+ */
+int qemu_savevm_state_postcopy(QEMUFile *f)
+{
+    SaveStateEntry *se, *postcopy_se = NULL;
+    QEMUFileMem mem = { NULL };
+    QEMUFile *mem_file;
+    int ret;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (!se->ops || !se->ops->save_live_iterate) {
+            continue;
+        }
+        if (se->ops->is_active && !se->ops->is_active(se->opaque)) {
+            continue;
+        }
+        if (!se->ops->save_postcopy_begin || postcopy_se) {
+            return -ENOTSUP;
+        }
+        postcopy_se = se;
+    }
+    if (!postcopy_se) {
+        return -EINVAL;
+    }
+
+    mem_file = qemu_fopen_mem(&mem, 1);
+    ret = qemu_save_device_state(mem_file);
+    qemu_fclose(mem_file);
+    if (ret < 0) {
+        g_free(mem.data);
+        return ret;
+    }
+
+    qemu_put_byte(f, QEMU_VM_POSTCOPY);
+    qemu_put_be32(f, mem.size);
+    qemu_put_buffer(f, mem.data, mem.size);
+    g_free(mem.data);
+
+    qemu_put_be32(f, postcopy_se->section_id);
+    ret = postcopy_se->ops->save_postcopy_begin(f, postcopy_se->opaque);
+    if (ret < 0) {
+        return ret;
+    }
+    qemu_fflush(f);
+
+    return qemu_file_get_error(f);
+}
+
 static int qemu_save_device_state(QEMUFile *f)
 {
     SaveStateEntry *se;
@@ -2121,6 +2252,11 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
+/*
+ * Returns 1 if the stream switched to post-copy.  In that case the rest of
+ * @f is being consumed in the background and must not be closed by the
+ * caller.
+ */
 int qemu_loadvm_state(QEMUFile *f)
 {
     QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
@@ -2216,6 +2352,49 @@ int qemu_loadvm_state(QEMUFile *f)
                 goto out;
             }
             break;
+        case QEMU_VM_POSTCOPY: {
+            QEMUFileMem mem = { NULL };
+            QEMUFile *mem_file;
+
+            mem.size = qemu_get_be32(f);
+            mem.data = g_malloc(mem.size);
+            if (qemu_get_buffer(f, mem.data, mem.size) != mem.size) {
+                g_free(mem.data);
+                ret = -EIO;
+                goto out;
+            }
+
+            section_id = qemu_get_be32(f);
+            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+                if (le->section_id == section_id) {
+                    break;
+                }
+            }
+            if (le == NULL || !le->se->ops ||
+                !le->se->ops->load_postcopy_begin) {
+                fprintf(stderr, "Post-copy not supported by section %d\n",
+                        section_id);
+                g_free(mem.data);
+                ret = -EINVAL;
+                goto out;
+            }
+
+            /* From here on the section owns the rest of the stream */
+            ret = le->se->ops->load_postcopy_begin(f, le->se->opaque);
+            if (ret < 0) {
+                g_free(mem.data);
+                goto out;
+            }
+
+            mem_file = qemu_fopen_mem(&mem, 0);
+            ret = qemu_loadvm_state(mem_file);
+            qemu_fclose(mem_file);
+            g_free(mem.data);
+            if (ret == 0) {
+                ret = 1;
+            }
+            goto out;
+        }
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
             ret = -EINVAL;
@@ -2632,40 +2811,16 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
-    long res, xor;
     uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
     while (i < slen) {
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        zrun_len = buffer_find_diff(old_buf + i, new_buf + i, slen - i);
+        i += zrun_len;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -2679,40 +2834,18 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = (long)0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        /* no need to look further than what fits in dst, a run that is cut
+         * short by the limit overflows below anyway */
+        nzrun_len = buffer_find_same(old_buf + i, new_buf + i,
+                                     MIN(slen - i, dlen - d));
+        i += nzrun_len;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -2721,7 +2854,6 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
@@ -18,6 +18,7 @@
 
 import os
 import re
+import socket
 import subprocess
 import string
 import unittest
@@ -25,13 +26,14 @@ import sys; sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..',
 import qmp
 
 __all__ = ['imgfmt', 'imgproto', 'test_dir' 'qemu_img', 'qemu_io',
-           'VM', 'QMPTestCase', 'notrun', 'main']
+           'qemu_nbd', 'VM', 'QMPTestCase', 'notrun', 'main']
 
 # This will not work if arguments or path contain spaces but is necessary if we
 # want to support the override options that ./check supports.
 qemu_img_args = os.environ.get('QEMU_IMG', 'qemu-img').strip().split(' ')
 qemu_io_args = os.environ.get('QEMU_IO', 'qemu-io').strip().split(' ')
 qemu_args = os.environ.get('QEMU', 'qemu').strip().split(' ')
+qemu_nbd_args = os.environ.get('QEMU_NBD', 'qemu-nbd').strip().split(' ')
 
 imgfmt = os.environ.get('IMGFMT', 'raw')
 imgproto = os.environ.get('IMGPROTO', 'file')
@@ -51,19 +53,51 @@ def qemu_io(*args):
     args = qemu_io_args + list(args)
     return subprocess.Popen(args, stdout=subprocess.PIPE).communicate()[0]
 
+def qemu_nbd(*args):
+    '''Start qemu-nbd in the background and return its Popen object'''
+    devnull = open('/dev/null', 'r+')
+    return subprocess.Popen(qemu_nbd_args + list(args), stdin=devnull, stdout=devnull)
+
+class QEMUQtestProtocol(object):
+    '''A qtest connection, QEMU connects to the socket at path'''
+
+    def __init__(self, path):
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.bind(path)
+        self._sock.listen(0)
+
+    def accept(self):
+        self._sock, _ = self._sock.accept()
+        self._sockfile = self._sock.makefile('r')
+
+    def cmd(self, qtest_cmd):
+        '''Send a qtest command and return the reply line'''
+        self._sock.sendall(qtest_cmd + '\n')
+        return self._sockfile.readline()
+
+    def close(self):
+        self._sock.close()
+
 class VM(object):
     '''A QEMU VM'''
 
-    def __init__(self):
-        self._monitor_path = os.path.join(test_dir, 'qemu-mon.%d' % os.getpid())
-        self._qemu_log_path = os.path.join(test_dir, 'qemu-log.%d' % os.getpid())
+    def __init__(self, path_suffix=''):
+        self._monitor_path = os.path.join(test_dir, 'qemu-mon%s.%d' % (path_suffix, os.getpid()))
+        self._qemu_log_path = os.path.join(test_dir, 'qemu-log%s.%d' % (path_suffix, os.getpid()))
+        self._qtest_path = os.path.join(test_dir, 'qemu-qtest%s.%d' % (path_suffix, os.getpid()))
         self._args = qemu_args + ['-chardev',
                      'socket,id=mon,path=' + self._monitor_path,
                      '-mon', 'chardev=mon,mode=control',
-                     '-qtest', 'stdio', '-machine', 'accel=qtest',
+                     '-qtest', 'unix:' + self._qtest_path,
+                     '-machine', 'accel=qtest',
                      '-display', 'none', '-vga', 'none']
         self._num_drives = 0
 
+    def add_args(self, *args):
+        '''Append command-line arguments'''
+        self._args.extend(args)
+        return self
+
     def add_drive(self, path, opts=''):
         '''Add a virtio-blk drive to the VM'''
         options = ['if=virtio',
@@ -85,11 +119,15 @@ class VM(object):
         qemulog = open(self._qemu_log_path, 'wb')
         try:
             self._qmp = qmp.QEMUMonitorProtocol(self._monitor_path, server=True)
+            self._qtest = QEMUQtestProtocol(self._qtest_path)
             self._popen = subprocess.Popen(self._args, stdin=devnull, stdout=qemulog,
                                            stderr=subprocess.STDOUT)
             self._qmp.accept()
+            self._qtest.accept()
         except:
             os.remove(self._monitor_path)
+            if os.path.exists(self._qtest_path):
+                os.remove(self._qtest_path)
             raise
 
     def shutdown(self):
@@ -97,7 +135,9 @@ class VM(object):
         if not self._popen is None:
             self._qmp.cmd('quit')
             self._popen.wait()
+            self._qtest.close()
             os.remove(self._monitor_path)
+            os.remove(self._qtest_path)
             os.remove(self._qemu_log_path)
             self._popen = None
 
@@ -110,6 +150,10 @@ class VM(object):
 
         return self._qmp.cmd(cmd, args=qmp_args)
 
+    def qtest(self, cmd):
+        '''Send a qtest command and return the reply'''
+        return self._qtest.cmd(cmd)
+
     def get_qmp_event(self, wait=False):
         '''Poll for one queued QMP events and return it'''
         return self._qmp.pull_event(wait=wait)
@@ -0,0 +1,143 @@
+/*
+ * bitmap_sync_bytemap() tests and benchmark
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "bitmap.h"
+
+#define TEST_FLAG   0x08
+#define OTHER_FLAGS 0x03
+
+/* page at a time, like the migration code used to do */
+static long sync_reference(unsigned long *dst, uint8_t *bytemap,
+                           long start, long nr, uint8_t flag)
+{
+    long i, count = 0;
+
+    for (i = start; i < start + nr; i++) {
+        if (bytemap[i] & flag) {
+            bytemap[i] &= ~flag;
+            if (!test_and_set_bit(i, dst)) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+static void fill_random(uint8_t *bytemap, unsigned long *bitmap, long nr)
+{
+    long i;
+
+    for (i = 0; i < nr; i++) {
+        bytemap[i] = g_test_rand_int_range(0, 4) == 0 ? TEST_FLAG : 0;
+        bytemap[i] |= g_test_rand_int_range(0, 4) & OTHER_FLAGS;
+        if (g_test_rand_int_range(0, 8) == 0) {
+            set_bit(i, bitmap);
+        }
+    }
+}
+
+static void test_sync_random(void)
+{
+    const long nr = 4096 + 77;
+    uint8_t *map1 = g_malloc(nr), *map2 = g_malloc(nr);
+    unsigned long *bits1 = bitmap_new(nr), *bits2 = bitmap_new(nr);
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        long start = g_test_rand_int_range(0, nr);
+        long len = g_test_rand_int_range(0, nr - start + 1);
+        long count1, count2;
+
+        bitmap_zero(bits1, nr);
+        fill_random(map1, bits1, nr);
+        memcpy(map2, map1, nr);
+        bitmap_copy(bits2, bits1, nr);
+
+        count1 = bitmap_sync_bytemap(bits1, map1, start, len, TEST_FLAG);
+        count2 = sync_reference(bits2, map2, start, len, TEST_FLAG);
+
+        g_assert_cmpint(count1, ==, count2);
+        g_assert(memcmp(map1, map2, nr) == 0);
+        g_assert(bitmap_equal(bits1, bits2, nr));
+    }
+
+    g_free(map1);
+    g_free(map2);
+    g_free(bits1);
+    g_free(bits2);
+}
+
+static void test_sync_all_dirty(void)
+{
+    const long nr = 1024;
+    uint8_t *map = g_malloc(nr);
+    unsigned long *bits = bitmap_new(nr);
+
+    memset(map, 0xff, nr);
+    g_assert_cmpint(bitmap_sync_bytemap(bits, map, 0, nr, TEST_FLAG), ==, nr);
+    g_assert(bitmap_full(bits, nr));
+    g_assert_cmpint(map[0], ==, 0xff & ~TEST_FLAG);
+    g_assert_cmpint(map[nr - 1], ==, 0xff & ~TEST_FLAG);
+
+    /* nothing left to move, and nothing new in the bitmap */
+    g_assert_cmpint(bitmap_sync_bytemap(bits, map, 0, nr, TEST_FLAG), ==, 0);
+    memset(map, TEST_FLAG, nr);
+    g_assert_cmpint(bitmap_sync_bytemap(bits, map, 0, nr, TEST_FLAG), ==, 0);
+
+    g_free(map);
+    g_free(bits);
+}
+
+/*
+ * Sync time against guest RAM size, with 4 KiB pages and about 1% of the
+ * pages dirty, for the page-at-a-time loop and for bitmap_sync_bytemap().
+ */
+static void perf_sync(void)
+{
+    long gb;
+
+    for (gb = 1; gb <= 64; gb *= 4) {
+        long nr = gb << (30 - 12);
+        uint8_t *map = g_malloc0(nr);
+        unsigned long *bits = bitmap_new(nr);
+        double t_ref, t_word;
+        long i;
+
+        for (i = 0; i < nr; i += 97) {
+            map[i] = TEST_FLAG;
+        }
+        g_test_timer_start();
+        sync_reference(bits, map, 0, nr, TEST_FLAG);
+        t_ref = g_test_timer_elapsed();
+
+        for (i = 0; i < nr; i += 97) {
+            map[i] = TEST_FLAG;
+        }
+        bitmap_zero(bits, nr);
+        g_test_timer_start();
+        bitmap_sync_bytemap(bits, map, 0, nr, TEST_FLAG);
+        t_word = g_test_timer_elapsed();
+
+        g_test_message("%3ld GiB: page at a time %f s, "
+                       "word at a time %f s\n", gb, t_ref, t_word);
+        g_free(map);
+        g_free(bits);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/bitmap-sync/random", test_sync_random);
+    g_test_add_func("/bitmap-sync/all-dirty", test_sync_all_dirty);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/bitmap-sync", perf_sync);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,211 @@
+/*
+ * Buffer scanning primitives tests and benchmark
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+
+#define BUF_SIZE 8192
+
+static uint8_t *buf_a, *buf_b;
+
+static size_t find_diff_reference(const uint8_t *a, const uint8_t *b,
+                                  size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len && a[i] == b[i]; i++) {
+        /* nothing */
+    }
+    return i;
+}
+
+static size_t find_same_reference(const uint8_t *a, const uint8_t *b,
+                                  size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len && a[i] != b[i]; i++) {
+        /* nothing */
+    }
+    return i;
+}
+
+/* b is a copy of a where some runs of bytes changed */
+static void fill_random(void)
+{
+    int i;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        buf_a[i] = g_test_rand_int_range(0, 256);
+    }
+    memcpy(buf_b, buf_a, BUF_SIZE);
+    for (i = g_test_rand_int_range(0, 16); i > 0; i--) {
+        int start = g_test_rand_int_range(0, BUF_SIZE);
+        int len = g_test_rand_int_range(1, 200);
+        int j;
+
+        for (j = start; j < MIN(start + len, BUF_SIZE); j++) {
+            buf_b[j] = buf_a[j] + g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+static void test_find(gconstpointer opaque)
+{
+    BufferAccel accel = (BufferAccel)GPOINTER_TO_INT(opaque);
+    BufferAccel old = buffer_accel_current();
+    int i;
+
+    if (!buffer_accel_select(accel)) {
+        return;
+    }
+
+    for (i = 0; i < 2000; i++) {
+        size_t start = g_test_rand_int_range(0, BUF_SIZE);
+        size_t len = g_test_rand_int_range(0, BUF_SIZE - start + 1);
+
+        fill_random();
+        g_assert_cmpint(buffer_find_diff(buf_a + start, buf_b + start, len),
+                        ==,
+                        find_diff_reference(buf_a + start, buf_b + start,
+                                            len));
+        g_assert_cmpint(buffer_find_same(buf_a + start, buf_b + start, len),
+                        ==,
+                        find_same_reference(buf_a + start, buf_b + start,
+                                            len));
+    }
+
+    buffer_accel_select(old);
+}
+
+static void test_zero_dup(gconstpointer opaque)
+{
+    BufferAccel accel = (BufferAccel)GPOINTER_TO_INT(opaque);
+    BufferAccel old = buffer_accel_current();
+    size_t len, pos;
+
+    if (!buffer_accel_select(accel)) {
+        return;
+    }
+
+    /* buffer_is_zero() only needs a multiple of 4 * sizeof(long), which
+     * is 16 on 32-bit hosts; the bytes right after the buffer must not be
+     * looked at.
+     */
+    for (len = 4 * sizeof(long); len + 32 <= BUF_SIZE;
+         len += 4 * sizeof(long)) {
+        memset(buf_a, 0, len);
+        memset(buf_a + len, 1, 32);
+        memset(buf_b, 0x5a, len);
+        g_assert(buffer_is_zero(buf_a, len));
+        g_assert(buffer_is_dup(buf_a, len));
+        g_assert(!buffer_is_zero(buf_b, len));
+        g_assert(buffer_is_dup(buf_b, len));
+
+        /* the last vector may be a partial one for wider kernels */
+        buf_a[len - 1] = 1;
+        g_assert(!buffer_is_zero(buf_a, len));
+        buf_a[len - 1] = 0;
+
+        pos = g_test_rand_int_range(0, len);
+        buf_a[pos] = 1;
+        buf_b[pos] = 0x5b;
+        g_assert(!buffer_is_zero(buf_a, len));
+        g_assert(!buffer_is_dup(buf_a, len));
+        g_assert(!buffer_is_dup(buf_b, len));
+    }
+
+    buffer_accel_select(old);
+}
+
+/*
+ * Throughput of each kernel over a page sized buffer, for each
+ * implementation that the host supports.  Every call scans the whole
+ * buffer.
+ */
+static void perf_kernels(void)
+{
+    const size_t len = 4096;
+    const int iterations = 1 << 18;
+    const double gb = (double)len * iterations / (1 << 30);
+    BufferAccel old = buffer_accel_current();
+    BufferAccel accel;
+    volatile size_t sink = 0;
+    int i;
+
+    memset(buf_a, 0, len);
+    memset(buf_b, 0xff, len);
+
+    for (accel = BUFFER_ACCEL_GENERIC; accel < BUFFER_ACCEL_MAX; accel++) {
+        double t_zero, t_dup, t_diff, t_same;
+
+        if (!buffer_accel_select(accel)) {
+            continue;
+        }
+
+        g_test_timer_start();
+        for (i = 0; i < iterations; i++) {
+            sink += buffer_is_zero(buf_a, len);
+        }
+        t_zero = g_test_timer_elapsed();
+
+        g_test_timer_start();
+        for (i = 0; i < iterations; i++) {
+            sink += buffer_is_dup(buf_b, len);
+        }
+        t_dup = g_test_timer_elapsed();
+
+        g_test_timer_start();
+        for (i = 0; i < iterations; i++) {
+            sink += buffer_find_diff(buf_a, buf_a, len);
+        }
+        t_diff = g_test_timer_elapsed();
+
+        g_test_timer_start();
+        for (i = 0; i < iterations; i++) {
+            sink += buffer_find_same(buf_a, buf_b, len);
+        }
+        t_same = g_test_timer_elapsed();
+
+        g_test_message("%-8s is_zero %6.2f GB/s, is_dup %6.2f GB/s, "
+                       "find_diff %6.2f GB/s, find_same %6.2f GB/s\n",
+                       buffer_accel_name(accel), gb / t_zero, gb / t_dup,
+                       gb / t_diff, gb / t_same);
+    }
+
+    buffer_accel_select(old);
+}
+
+int main(int argc, char **argv)
+{
+    BufferAccel accel;
+
+    /* keep both buffers 16-byte aligned, as buffer_is_dup() requires */
+    buf_a = g_malloc(2 * BUF_SIZE + 16);
+    buf_a += -(uintptr_t)buf_a & 15;
+    buf_b = buf_a + BUF_SIZE;
+
+    g_test_init(&argc, &argv, NULL);
+    for (accel = BUFFER_ACCEL_GENERIC; accel < BUFFER_ACCEL_MAX; accel++) {
+        const char *name = buffer_accel_name(accel);
+        char *path;
+
+        if (!name) {
+            continue;
+        }
+        path = g_strdup_printf("/buffer-accel/%s/find", name);
+        g_test_add_data_func(path, GINT_TO_POINTER(accel), test_find);
+        g_free(path);
+        path = g_strdup_printf("/buffer-accel/%s/zero-dup", name);
+        g_test_add_data_func(path, GINT_TO_POINTER(accel), test_zero_dup);
+        g_free(path);
+    }
+    if (g_test_perf()) {
+        g_test_add_func("/perf/buffer-accel", perf_kernels);
+    }
+    return g_test_run();
+}
@@ -13,6 +13,8 @@
 
 #include <glib.h>
 #include "qemu-coroutine.h"
+#include "qemu-coroutine-int.h"
+#include "qemu-thread.h"
 
 /*
  * Check that qemu_in_coroutine() works
@@ -150,15 +152,226 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+static void coroutine_fn empty_coroutine(void *opaque)
+{
+    /* Do nothing */
+}
+
 /*
- * Lifecycle benchmark
+ * Check that a thread never keeps more than a batch of freed coroutines.
+ * The tests run in new threads, whose pools start out empty.
  */
 
-static void coroutine_fn empty_coroutine(void *opaque)
+static void *pool_bound_thread(void *opaque)
 {
-    /* Do nothing */
+    Coroutine *coroutines[POOL_BATCH_SIZE * 2];
+    CoroutinePool *pool = qemu_coroutine_thread_pool();
+    unsigned int i;
+
+    /* Emptied even if the released coroutines of other threads were taken
+     * over, because there are at most two batches of them */
+    for (i = 0; i < POOL_BATCH_SIZE * 2; i++) {
+        coroutines[i] = qemu_coroutine_create(empty_coroutine);
+    }
+    g_assert_cmpint(pool->size, ==, 0);
+
+    for (i = 0; i < POOL_BATCH_SIZE * 2; i++) {
+        qemu_coroutine_enter(coroutines[i], NULL);
+        g_assert_cmpint(pool->size, <=, POOL_BATCH_SIZE);
+    }
+    g_assert_cmpint(pool->size, ==, POOL_BATCH_SIZE);
+    return NULL;
+}
+
+static void test_pool_bound(void)
+{
+    QemuThread thread;
+
+    if (!qemu_coroutine_thread_pool()) {
+        return; /* this backend does not pool coroutines */
+    }
+
+    qemu_thread_create(&thread, pool_bound_thread, NULL, QEMU_THREAD_JOINABLE);
+    qemu_thread_join(&thread);
+}
+
+/*
+ * Check that coroutines created in one thread and terminated in another one
+ * come back to the creating thread through the release pool
+ */
+
+#define CROSS_THREAD_COROUTINES (POOL_BATCH_SIZE * 3)
+
+static void *terminate_thread(void *opaque)
+{
+    Coroutine **coroutines = opaque;
+    CoroutinePool *pool = qemu_coroutine_thread_pool();
+    unsigned int i;
+
+    for (i = 0; i < CROSS_THREAD_COROUTINES; i++) {
+        qemu_coroutine_enter(coroutines[i], NULL);
+    }
+
+    /* One batch stays here, the rest is released or deleted */
+    g_assert_cmpint(pool->size, ==, POOL_BATCH_SIZE);
+    return NULL;
+}
+
+static void *create_thread(void *opaque)
+{
+    Coroutine *coroutines[CROSS_THREAD_COROUTINES];
+    Coroutine *coroutine;
+    CoroutinePool *pool = qemu_coroutine_thread_pool();
+    QemuThread thread;
+    unsigned int i;
+
+    for (i = 0; i < CROSS_THREAD_COROUTINES; i++) {
+        coroutines[i] = qemu_coroutine_create(empty_coroutine);
+    }
+    g_assert_cmpint(pool->size, ==, 0);
+
+    qemu_thread_create(&thread, terminate_thread, coroutines,
+                       QEMU_THREAD_JOINABLE);
+    qemu_thread_join(&thread);
+
+    /* The empty pool takes over everything the other thread released, and
+     * the last coroutine released comes first */
+    coroutine = qemu_coroutine_create(empty_coroutine);
+    for (i = 0; i < CROSS_THREAD_COROUTINES; i++) {
+        if (coroutines[i] == coroutine) {
+            break;
+        }
+    }
+    g_assert_cmpint(i, <, CROSS_THREAD_COROUTINES);
+    g_assert_cmpint(pool->size, >, 0);
+    g_assert_cmpint(pool->size, <, POOL_BATCH_SIZE * 2);
+
+    qemu_coroutine_enter(coroutine, NULL);
+    return NULL;
+}
+
+static void test_pool_cross_thread(void)
+{
+    QemuThread thread;
+
+    if (!qemu_coroutine_thread_pool()) {
+        return; /* this backend does not pool coroutines */
+    }
+
+    qemu_thread_create(&thread, create_thread, NULL, QEMU_THREAD_JOINABLE);
+    qemu_thread_join(&thread);
+}
+
+#if defined(__x86_64__) && defined(__ELF__)
+/*
+ * Check that switching between coroutines preserves the callee-saved
+ * registers and keeps the stack aligned as the ABI requires
+ */
+
+/* Calls fn(opaque) with known values in rbx, rbp and r12-r15, and returns
+ * the number of these registers that changed across the call */
+int call_with_callee_saved(void (*fn)(void *), void *opaque);
+
+#define CHECK_REG(val, reg) \
+    "    movabsq $" val ", %rcx\n" \
+    "    cmpq %rcx, %" reg "\n" \
+    "    setne %dl\n" \
+    "    movzbl %dl, %edx\n" \
+    "    addl %edx, %eax\n"
+
+asm(".pushsection .text\n"
+    ".globl call_with_callee_saved\n"
+    ".type call_with_callee_saved, @function\n"
+    "call_with_callee_saved:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    movq %rdi, %rax\n"
+    "    movq %rsi, %rdi\n"
+    "    movabsq $0x0101010101010101, %rbx\n"
+    "    movabsq $0x0202020202020202, %rbp\n"
+    "    movabsq $0x0c0c0c0c0c0c0c0c, %r12\n"
+    "    movabsq $0x0d0d0d0d0d0d0d0d, %r13\n"
+    "    movabsq $0x0e0e0e0e0e0e0e0e, %r14\n"
+    "    movabsq $0x0f0f0f0f0f0f0f0f, %r15\n"
+    "    call *%rax\n"
+    "    xorl %eax, %eax\n"
+    CHECK_REG("0x0101010101010101", "rbx")
+    CHECK_REG("0x0202020202020202", "rbp")
+    CHECK_REG("0x0c0c0c0c0c0c0c0c", "r12")
+    CHECK_REG("0x0d0d0d0d0d0d0d0d", "r13")
+    CHECK_REG("0x0e0e0e0e0e0e0e0e", "r14")
+    CHECK_REG("0x0f0f0f0f0f0f0f0f", "r15")
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size call_with_callee_saved, .-call_with_callee_saved\n"
+    ".popsection\n");
+
+static unsigned int changed_regs;
+static unsigned int misaligned_frames;
+
+/* Calls must leave the stack 16-byte aligned, so the frame, which starts
+ * below the return address and the saved rbp, is aligned as well */
+static void __attribute__((noinline)) check_stack_alignment(void)
+{
+    if ((uintptr_t)__builtin_frame_address(0) & 15) {
+        misaligned_frames++;
+    }
+}
+
+static void yield_from_asm(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void enter_from_asm(void *opaque)
+{
+    qemu_coroutine_enter(opaque, NULL);
+}
+
+static void coroutine_fn callee_saved_coroutine(void *opaque)
+{
+    check_stack_alignment();
+    changed_regs += call_with_callee_saved(yield_from_asm, NULL);
+    check_stack_alignment();
 }
 
+static void test_callee_saved(void)
+{
+    /* More than the pools can hold, so that the last ones are new and
+     * start on a fresh stack */
+    Coroutine *coroutines[POOL_BATCH_SIZE * 3 + 1];
+    unsigned int i;
+
+    changed_regs = 0;
+    misaligned_frames = 0;
+    for (i = 0; i < G_N_ELEMENTS(coroutines); i++) {
+        coroutines[i] = qemu_coroutine_create(callee_saved_coroutine);
+    }
+    for (i = 0; i < G_N_ELEMENTS(coroutines); i++) {
+        /* Runs until the yield, then until the coroutine terminates */
+        changed_regs += call_with_callee_saved(enter_from_asm, coroutines[i]);
+        changed_regs += call_with_callee_saved(enter_from_asm, coroutines[i]);
+    }
+    g_assert_cmpint(changed_regs, ==, 0);
+    g_assert_cmpint(misaligned_frames, ==, 0);
+}
+#endif
+
+/*
+ * Lifecycle benchmark
+ */
+
 static void perf_lifecycle(void)
 {
     Coroutine *coroutine;
@@ -202,6 +415,130 @@ static void perf_nesting(void)
         maxcycles, maxnesting, duration);
 }
 
+/*
+ * Latency benchmarks, reported in nanoseconds per operation
+ */
+
+#define PERF_BATCH 128
+
+static void perf_create_enter(void)
+{
+    Coroutine *coroutines[PERF_BATCH];
+    unsigned int i, j, max;
+    double create = 0, enter = 0;
+
+    max = 10000;
+
+    for (i = 0; i < max; i++) {
+        g_test_timer_start();
+        for (j = 0; j < PERF_BATCH; j++) {
+            coroutines[j] = qemu_coroutine_create(empty_coroutine);
+        }
+        create += g_test_timer_elapsed();
+
+        g_test_timer_start();
+        for (j = 0; j < PERF_BATCH; j++) {
+            qemu_coroutine_enter(coroutines[j], NULL);
+        }
+        enter += g_test_timer_elapsed();
+    }
+
+    g_test_message("Create: %.1f ns, enter and terminate: %.1f ns\n",
+                   create * 1e9 / (max * PERF_BATCH),
+                   enter * 1e9 / (max * PERF_BATCH));
+}
+
+static void coroutine_fn yield_loop(void *opaque)
+{
+    unsigned int *counter = opaque;
+
+    while (*counter > 0) {
+        (*counter)--;
+        qemu_coroutine_yield();
+    }
+}
+
+static void perf_yield(void)
+{
+    Coroutine *coroutine;
+    unsigned int i, maxcycles;
+    double duration;
+
+    maxcycles = 10000000;
+    i = maxcycles;
+
+    coroutine = qemu_coroutine_create(yield_loop);
+    g_test_timer_start();
+    while (i > 0) {
+        qemu_coroutine_enter(coroutine, &i);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Yield %u iterations: %.1f ns per enter and yield\n",
+                   maxcycles, duration * 1e9 / maxcycles);
+}
+
+/* One thread creates coroutines and another one runs them to completion, so
+ * freed coroutines have to find their way back to the creating thread.
+ */
+typedef struct {
+    Coroutine *coroutines[PERF_BATCH];
+    QemuSemaphore run;
+    QemuSemaphore done;
+    bool stop;
+} CrossThreadData;
+
+static void *cross_thread_run(void *opaque)
+{
+    CrossThreadData *data = opaque;
+    unsigned int i;
+
+    for (;;) {
+        qemu_sem_wait(&data->run);
+        if (data->stop) {
+            break;
+        }
+        for (i = 0; i < PERF_BATCH; i++) {
+            qemu_coroutine_enter(data->coroutines[i], NULL);
+        }
+        qemu_sem_post(&data->done);
+    }
+    return NULL;
+}
+
+static void perf_cross_thread(void)
+{
+    CrossThreadData data = { .stop = false };
+    QemuThread thread;
+    unsigned int i, j, max;
+    double duration;
+
+    max = 10000;
+
+    qemu_sem_init(&data.run, 0);
+    qemu_sem_init(&data.done, 0);
+    qemu_thread_create(&thread, cross_thread_run, &data, QEMU_THREAD_JOINABLE);
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        for (j = 0; j < PERF_BATCH; j++) {
+            data.coroutines[j] = qemu_coroutine_create(empty_coroutine);
+        }
+        qemu_sem_post(&data.run);
+        qemu_sem_wait(&data.done);
+    }
+    duration = g_test_timer_elapsed();
+
+    data.stop = true;
+    qemu_sem_post(&data.run);
+    qemu_thread_join(&thread);
+    qemu_sem_destroy(&data.run);
+    qemu_sem_destroy(&data.done);
+
+    g_test_message("Cross-thread lifecycle: %.1f ns per coroutine\n",
+                   duration * 1e9 / (max * PERF_BATCH));
+}
+
 
 int main(int argc, char **argv)
 {
@@ -211,9 +548,17 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/nesting", test_nesting);
     g_test_add_func("/basic/self", test_self);
     g_test_add_func("/basic/in_coroutine", test_in_coroutine);
+    g_test_add_func("/basic/pool-bound", test_pool_bound);
+    g_test_add_func("/basic/pool-cross-thread", test_pool_cross_thread);
+#if defined(__x86_64__) && defined(__ELF__)
+    g_test_add_func("/basic/callee-saved", test_callee_saved);
+#endif
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
         g_test_add_func("/perf/nesting", perf_nesting);
+        g_test_add_func("/perf/create-enter", perf_create_enter);
+        g_test_add_func("/perf/yield", perf_yield);
+        g_test_add_func("/perf/cross-thread", perf_cross_thread);
     }
     return g_test_run();
 }
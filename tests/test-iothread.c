@@ -0,0 +1,291 @@
+/*
+ * Iothread and AioContext ownership tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu-aio.h"
+#include "qemu/iothread.h"
+#include "qemu/rfifolock.h"
+#include "qmp-commands.h"
+#include "module.h"
+
+typedef struct {
+    QemuSemaphore sem;
+    int thread_id;
+    int n;
+} Counter;
+
+static void counter_bh(void *opaque)
+{
+    Counter *c = opaque;
+
+    c->thread_id = qemu_get_thread_id();
+    c->n++;
+    qemu_sem_post(&c->sem);
+}
+
+static void test_rfifolock_nesting(void)
+{
+    RFifoLock r;
+
+    rfifolock_init(&r, NULL, NULL);
+    rfifolock_lock(&r);
+    rfifolock_lock(&r);
+    g_assert_cmpint(r.nesting, ==, 2);
+    rfifolock_unlock(&r);
+    g_assert_cmpint(r.nesting, ==, 1);
+    rfifolock_unlock(&r);
+    g_assert_cmpint(r.nesting, ==, 0);
+    rfifolock_destroy(&r);
+}
+
+static void test_iothread_bh(void)
+{
+    IOThread *iothread = iothread_new();
+    AioContext *ctx = iothread_get_aio_context(iothread);
+    Counter c = { .n = 0 };
+    QEMUBH *bh;
+    int i;
+
+    /* bottom halves run in the iothread, the scheduling thread is not
+     * involved */
+    qemu_sem_init(&c.sem, 0);
+    bh = aio_bh_new(ctx, counter_bh, &c);
+    for (i = 1; i <= 10; i++) {
+        qemu_bh_schedule(bh);
+        qemu_sem_wait(&c.sem);
+        g_assert_cmpint(c.n, ==, i);
+        g_assert_cmpint(c.thread_id, !=, qemu_get_thread_id());
+    }
+    qemu_bh_delete(bh);
+
+    qemu_sem_destroy(&c.sem);
+    object_unref(OBJECT(iothread));
+}
+
+typedef struct {
+    EventNotifier e;
+    Counter c;
+} NotifierCounter;
+
+static void notifier_counter_read(EventNotifier *e)
+{
+    NotifierCounter *nc = container_of(e, NotifierCounter, e);
+
+    event_notifier_test_and_clear(e);
+    counter_bh(&nc->c);
+}
+
+static int notifier_counter_flush(EventNotifier *e)
+{
+    return 1;
+}
+
+static void test_iothread_acquire(void)
+{
+    IOThread *iothread = iothread_new();
+    AioContext *ctx = iothread_get_aio_context(iothread);
+    NotifierCounter nc = { .c.n = 0 };
+
+    /* the iothread is blocked in aio_poll() and must let go of the
+     * context */
+    qemu_sem_init(&nc.c.sem, 0);
+    event_notifier_init(&nc.e, false);
+    aio_context_acquire(ctx);
+    aio_set_event_notifier(ctx, &nc.e, notifier_counter_read,
+                           notifier_counter_flush);
+    aio_context_release(ctx);
+
+    event_notifier_set(&nc.e);
+    qemu_sem_wait(&nc.c.sem);
+    g_assert_cmpint(nc.c.n, ==, 1);
+    g_assert_cmpint(nc.c.thread_id, !=, qemu_get_thread_id());
+
+    /* while we own the context, its handlers run in this thread */
+    aio_context_acquire(ctx);
+    event_notifier_set(&nc.e);
+    g_assert(aio_poll(ctx, true));
+    qemu_sem_wait(&nc.c.sem);
+    g_assert_cmpint(nc.c.n, ==, 2);
+    g_assert_cmpint(nc.c.thread_id, ==, qemu_get_thread_id());
+    aio_set_event_notifier(ctx, &nc.e, NULL, NULL);
+
+    /* the thread's own wakeup handler does not make us wait */
+    g_assert(!aio_poll(ctx, true));
+    aio_context_release(ctx);
+
+    event_notifier_cleanup(&nc.e);
+    qemu_sem_destroy(&nc.c.sem);
+    object_unref(OBJECT(iothread));
+}
+
+static void test_iothread_query(void)
+{
+    Object *container = container_get(object_get_root(), "/objects");
+    Object *obj = object_new(TYPE_IOTHREAD);
+    IOThreadInfoList *info_list;
+
+    object_property_add_child(container, "iothread0", obj, NULL);
+    g_assert(iothread_find("iothread0") == IOTHREAD(obj));
+    g_assert(iothread_find("iothread1") == NULL);
+
+    info_list = qmp_query_iothreads(NULL);
+    g_assert(info_list != NULL);
+    g_assert_cmpstr(info_list->value->id, ==, "iothread0");
+    g_assert_cmpint(info_list->value->thread_id, !=, qemu_get_thread_id());
+    g_assert(info_list->next == NULL);
+    qapi_free_IOThreadInfoList(info_list);
+
+    object_unparent(obj);
+    object_unref(obj);
+    g_assert(iothread_find("iothread0") == NULL);
+}
+
+/* Round trips of a bottom half that the iothread runs for this thread */
+static void perf_iothread_bh(void)
+{
+    const int iterations = 100000;
+    IOThread *iothread = iothread_new();
+    Counter c = { .n = 0 };
+    double duration;
+    QEMUBH *bh;
+    int i;
+
+    qemu_sem_init(&c.sem, 0);
+    bh = aio_bh_new(iothread_get_aio_context(iothread), counter_bh, &c);
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        qemu_bh_schedule(bh);
+        qemu_sem_wait(&c.sem);
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("bottom half round trips: %8.0f/s\n",
+                   iterations / duration);
+
+    qemu_bh_delete(bh);
+    qemu_sem_destroy(&c.sem);
+    object_unref(OBJECT(iothread));
+}
+
+/*
+ * Several "devices" whose handlers do a few microseconds of work per
+ * request, each driven by a thread of its own, like a guest vCPU that
+ * submits requests and waits for them.  The devices either share one
+ * iothread or each get their own.
+ */
+#define PERF_DEVICES_MAX 4
+
+typedef struct {
+    NotifierCounter nc;
+    QemuThread thread;
+    int iterations;
+} PerfDevice;
+
+static void perf_device_read(EventNotifier *e)
+{
+    volatile unsigned int acc = 0;
+    unsigned int i;
+
+    for (i = 0; i < 5000; i++) {
+        acc += i * i;
+    }
+    notifier_counter_read(e);
+}
+
+static void *perf_device_submit(void *opaque)
+{
+    PerfDevice *dev = opaque;
+    int i;
+
+    for (i = 0; i < dev->iterations; i++) {
+        event_notifier_set(&dev->nc.e);
+        qemu_sem_wait(&dev->nc.c.sem);
+    }
+    return NULL;
+}
+
+static void perf_iothread_devices(int ndevices, bool shared)
+{
+    const int iterations = 20000;
+    IOThread *iothreads[PERF_DEVICES_MAX];
+    PerfDevice devs[PERF_DEVICES_MAX];
+    double duration;
+    int i;
+
+    for (i = 0; i < ndevices; i++) {
+        iothreads[i] = i == 0 || !shared ? iothread_new() : iothreads[0];
+        memset(&devs[i], 0, sizeof(devs[i]));
+        devs[i].iterations = iterations;
+        qemu_sem_init(&devs[i].nc.c.sem, 0);
+        event_notifier_init(&devs[i].nc.e, false);
+
+        aio_context_acquire(iothread_get_aio_context(iothreads[i]));
+        aio_set_event_notifier(iothread_get_aio_context(iothreads[i]),
+                               &devs[i].nc.e, perf_device_read,
+                               notifier_counter_flush);
+        aio_context_release(iothread_get_aio_context(iothreads[i]));
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < ndevices; i++) {
+        qemu_thread_create(&devs[i].thread, perf_device_submit, &devs[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < ndevices; i++) {
+        qemu_thread_join(&devs[i].thread);
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("%d devices, %d iothread(s): %8.0f requests/s\n",
+                   ndevices, shared ? 1 : ndevices,
+                   ndevices * iterations / duration);
+
+    for (i = 0; i < ndevices; i++) {
+        AioContext *ctx = iothread_get_aio_context(iothreads[i]);
+
+        aio_context_acquire(ctx);
+        aio_set_event_notifier(ctx, &devs[i].nc.e, NULL, NULL);
+        aio_context_release(ctx);
+        event_notifier_cleanup(&devs[i].nc.e);
+        qemu_sem_destroy(&devs[i].nc.c.sem);
+    }
+    for (i = 0; i < ndevices; i++) {
+        if (i == 0 || !shared) {
+            object_unref(OBJECT(iothreads[i]));
+        }
+    }
+}
+
+static void perf_iothread_scaling(void)
+{
+    int ndevices;
+
+    for (ndevices = 1; ndevices <= PERF_DEVICES_MAX; ndevices *= 2) {
+        perf_iothread_devices(ndevices, true);
+        if (ndevices > 1) {
+            perf_iothread_devices(ndevices, false);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    module_call_init(MODULE_INIT_QOM);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/iothread/rfifolock/nesting", test_rfifolock_nesting);
+    g_test_add_func("/iothread/bh", test_iothread_bh);
+    g_test_add_func("/iothread/acquire", test_iothread_acquire);
+    g_test_add_func("/iothread/query", test_iothread_query);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/iothread/bh", perf_iothread_bh);
+        g_test_add_func("/perf/iothread/scaling", perf_iothread_scaling);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,126 @@
+/*
+ * Block I/O latency histogram tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "block/accounting.h"
+
+static void test_set(void)
+{
+    BlockLatencyHistogram hist = { 0 };
+    int i;
+
+    g_assert_cmpint(block_latency_histogram_set(&hist, 1000, 10, 4), ==, 0);
+    g_assert_cmpint(hist.nbins, ==, 5);
+    g_assert_cmpint(hist.boundaries[0], ==, 1000);
+    g_assert_cmpint(hist.boundaries[1], ==, 10000);
+    g_assert_cmpint(hist.boundaries[2], ==, 100000);
+    g_assert_cmpint(hist.boundaries[3], ==, 1000000);
+    for (i = 0; i < hist.nbins; i++) {
+        g_assert_cmpint(hist.bins[i], ==, 0);
+    }
+
+    /* the default covers 10 us to 5.24 s */
+    g_assert_cmpint(block_latency_histogram_set(&hist,
+                        BLOCK_LATENCY_HISTOGRAM_START,
+                        BLOCK_LATENCY_HISTOGRAM_FACTOR,
+                        BLOCK_LATENCY_HISTOGRAM_COUNT), ==, 0);
+    g_assert_cmpint(hist.nbins, ==, BLOCK_LATENCY_HISTOGRAM_COUNT + 1);
+    g_assert_cmpint(hist.boundaries[BLOCK_LATENCY_HISTOGRAM_COUNT - 1], ==,
+                    10000LL << 19);
+
+    /* invalid parameters leave the histogram alone */
+    g_assert_cmpint(block_latency_histogram_set(&hist, 0, 2, 4), ==, -EINVAL);
+    g_assert_cmpint(block_latency_histogram_set(&hist, 1, 1, 4), ==, -EINVAL);
+    g_assert_cmpint(block_latency_histogram_set(&hist, 1, 2, -1), ==,
+                    -EINVAL);
+    g_assert_cmpint(block_latency_histogram_set(&hist, 1, 2,
+                        BLOCK_LATENCY_HISTOGRAM_MAX_COUNT + 1), ==, -EINVAL);
+    g_assert_cmpint(block_latency_histogram_set(&hist, 1000, 1000, 10), ==,
+                    -ERANGE);
+    g_assert_cmpint(hist.nbins, ==, BLOCK_LATENCY_HISTOGRAM_COUNT + 1);
+
+    /* the largest limits that still fit */
+    g_assert_cmpint(block_latency_histogram_set(&hist, 1, 2, 63), ==, 0);
+    g_assert_cmpint(hist.boundaries[62], ==, 1LL << 62);
+    g_assert_cmpint(block_latency_histogram_set(&hist, 1, 2, 64), ==,
+                    -ERANGE);
+
+    /* a count of 0 disables the histogram */
+    g_assert_cmpint(block_latency_histogram_set(&hist, 1000, 10, 0), ==, 0);
+    g_assert_cmpint(hist.nbins, ==, 0);
+    g_assert(hist.boundaries == NULL);
+    g_assert(hist.bins == NULL);
+    block_latency_histogram_account(&hist, 1000);
+
+    block_latency_histogram_clear(&hist);
+}
+
+static void test_account(void)
+{
+    static const struct {
+        int64_t latency_ns;
+        int bin;
+    } tests[] = {
+        { 0,        0 },
+        { 999,      0 },
+        { 1000,     1 },
+        { 9999,     1 },
+        { 10000,    2 },
+        { 50000,    2 },
+        { 100000,   3 },
+        { 999999,   3 },
+        { 1000000,  4 },
+        { INT64_MAX, 4 },
+    };
+    BlockLatencyHistogram hist = { 0 };
+    uint64_t expected[5] = { 0 };
+    int i, j;
+
+    g_assert_cmpint(block_latency_histogram_set(&hist, 1000, 10, 4), ==, 0);
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+        block_latency_histogram_account(&hist, tests[i].latency_ns);
+        expected[tests[i].bin]++;
+        for (j = 0; j < hist.nbins; j++) {
+            g_assert_cmpint(hist.bins[j], ==, expected[j]);
+        }
+    }
+
+    /* setting up the bins again empties them */
+    g_assert_cmpint(block_latency_histogram_set(&hist, 1000, 10, 4), ==, 0);
+    for (j = 0; j < hist.nbins; j++) {
+        g_assert_cmpint(hist.bins[j], ==, 0);
+    }
+
+    block_latency_histogram_clear(&hist);
+}
+
+static void test_account_single_boundary(void)
+{
+    BlockLatencyHistogram hist = { 0 };
+
+    g_assert_cmpint(block_latency_histogram_set(&hist, 500, 2, 1), ==, 0);
+    g_assert_cmpint(hist.nbins, ==, 2);
+    block_latency_histogram_account(&hist, 499);
+    block_latency_histogram_account(&hist, 500);
+    block_latency_histogram_account(&hist, 501);
+    g_assert_cmpint(hist.bins[0], ==, 1);
+    g_assert_cmpint(hist.bins[1], ==, 2);
+    block_latency_histogram_clear(&hist);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/latency-histogram/set", test_set);
+    g_test_add_func("/latency-histogram/account", test_account);
+    g_test_add_func("/latency-histogram/account-single-boundary",
+                    test_account_single_boundary);
+    return g_test_run();
+}
@@ -0,0 +1,400 @@
+/*
+ * Main loop and AioContext dispatch tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <sys/resource.h>
+#include "qemu-common.h"
+#include "main-loop.h"
+#include "qemu-aio.h"
+#include "event_notifier.h"
+
+typedef struct {
+    EventNotifier e;
+    int n;
+    int active;
+    bool allow_read;
+    EventNotifier *other;
+} Notifier;
+
+static void notifier_init(Notifier *data)
+{
+    memset(data, 0, sizeof(*data));
+    g_assert(event_notifier_init(&data->e, false) == 0);
+}
+
+static void notifier_read(void *opaque)
+{
+    Notifier *data = opaque;
+
+    event_notifier_test_and_clear(&data->e);
+    data->n++;
+}
+
+static int notifier_can_read(void *opaque)
+{
+    Notifier *data = opaque;
+
+    return data->allow_read;
+}
+
+static void notifier_write(void *opaque)
+{
+    Notifier *data = opaque;
+
+    data->n++;
+}
+
+static void notifier_delete_both(void *opaque)
+{
+    Notifier *data = opaque;
+
+    data->n++;
+    qemu_set_fd_handler(event_notifier_get_fd(&data->e), NULL, NULL, NULL);
+    qemu_set_fd_handler(event_notifier_get_fd(data->other), NULL, NULL, NULL);
+}
+
+static void test_iohandler_read(void)
+{
+    Notifier data;
+
+    notifier_init(&data);
+    qemu_set_fd_handler(event_notifier_get_fd(&data.e), notifier_read, NULL,
+                        &data);
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 0);
+
+    event_notifier_set(&data.e);
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 1);
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 1);
+
+    qemu_set_fd_handler(event_notifier_get_fd(&data.e), NULL, NULL, NULL);
+    event_notifier_set(&data.e);
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 1);
+    event_notifier_cleanup(&data.e);
+}
+
+static void test_iohandler_read_poll(void)
+{
+    Notifier data;
+
+    notifier_init(&data);
+    qemu_set_fd_handler2(event_notifier_get_fd(&data.e), notifier_can_read,
+                         notifier_read, NULL, &data);
+    event_notifier_set(&data.e);
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 0);
+
+    data.allow_read = true;
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 1);
+
+    data.allow_read = false;
+    event_notifier_set(&data.e);
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 1);
+
+    qemu_set_fd_handler(event_notifier_get_fd(&data.e), NULL, NULL, NULL);
+    event_notifier_cleanup(&data.e);
+}
+
+static void test_iohandler_write(void)
+{
+    Notifier data;
+
+    notifier_init(&data);
+    qemu_set_fd_handler(event_notifier_get_fd(&data.e), NULL, notifier_write,
+                        &data);
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 1);
+
+    /* switch the same descriptor over to reading */
+    qemu_set_fd_handler(event_notifier_get_fd(&data.e), notifier_read, NULL,
+                        &data);
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 1);
+    event_notifier_set(&data.e);
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 2);
+
+    qemu_set_fd_handler(event_notifier_get_fd(&data.e), NULL, NULL, NULL);
+    event_notifier_cleanup(&data.e);
+}
+
+static void test_iohandler_delete(void)
+{
+    Notifier a, b;
+
+    /* whichever handler runs first removes both */
+    notifier_init(&a);
+    notifier_init(&b);
+    a.other = &b.e;
+    b.other = &a.e;
+    qemu_set_fd_handler(event_notifier_get_fd(&a.e), notifier_delete_both,
+                        NULL, &a);
+    qemu_set_fd_handler(event_notifier_get_fd(&b.e), notifier_delete_both,
+                        NULL, &b);
+    event_notifier_set(&a.e);
+    event_notifier_set(&b.e);
+    main_loop_wait(true);
+    g_assert_cmpint(a.n + b.n, ==, 1);
+    main_loop_wait(true);
+    g_assert_cmpint(a.n + b.n, ==, 1);
+
+    event_notifier_cleanup(&a.e);
+    event_notifier_cleanup(&b.e);
+}
+
+#ifdef CONFIG_EPOLL
+static void test_iohandler_high_fd(void)
+{
+    Notifier data;
+    struct rlimit rlim;
+    int fd = FD_SETSIZE + 16;
+
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    if (rlim.rlim_cur <= fd) {
+        g_test_message("RLIMIT_NOFILE too low, skipping\n");
+        return;
+    }
+
+    /* a descriptor that does not fit in an fd_set */
+    notifier_init(&data);
+    g_assert(dup2(event_notifier_get_fd(&data.e), fd) == fd);
+    qemu_set_fd_handler(fd, notifier_read, NULL, &data);
+    event_notifier_set(&data.e);
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 1);
+
+    qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    close(fd);
+    event_notifier_cleanup(&data.e);
+}
+#endif
+
+static void aio_notifier_read(EventNotifier *e)
+{
+    Notifier *data = container_of(e, Notifier, e);
+
+    event_notifier_test_and_clear(e);
+    data->n++;
+    if (data->active) {
+        data->active--;
+    }
+}
+
+static int aio_notifier_flush(EventNotifier *e)
+{
+    Notifier *data = container_of(e, Notifier, e);
+
+    return data->active > 0;
+}
+
+static void test_aio_notifier(void)
+{
+    AioContext *ctx = aio_context_new();
+    Notifier data;
+
+    notifier_init(&data);
+    aio_set_event_notifier(ctx, &data.e, aio_notifier_read,
+                           aio_notifier_flush);
+    while (aio_poll(ctx, false)) {
+        /* flush the notification from aio_set_event_notifier */
+    }
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    /* handlers without active requests are not waited for */
+    event_notifier_set(&data.e);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    data.active = 1;
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert(!aio_poll(ctx, false));
+
+    /* aio_flush() waits while requests are active */
+    data.active = 1;
+    event_notifier_set(&data.e);
+    aio_flush(ctx);
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert_cmpint(data.active, ==, 0);
+
+    aio_set_event_notifier(ctx, &data.e, NULL, NULL);
+    data.active = 1;
+    event_notifier_set(&data.e);
+    aio_poll(ctx, false);
+    g_assert_cmpint(data.n, ==, 2);
+
+    event_notifier_cleanup(&data.e);
+    aio_context_unref(ctx);
+}
+
+static void test_aio_main_loop(void)
+{
+    Notifier data;
+
+    /* handlers of the main AioContext run through its GSource */
+    notifier_init(&data);
+    qemu_aio_set_event_notifier(&data.e, aio_notifier_read, NULL);
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 0);
+
+    event_notifier_set(&data.e);
+    main_loop_wait(true);
+    g_assert_cmpint(data.n, ==, 1);
+
+    qemu_aio_set_event_notifier(&data.e, NULL, NULL);
+    event_notifier_cleanup(&data.e);
+}
+
+/*
+ * Wakeup rate with a growing number of idle descriptors, only one of which
+ * becomes ready at a time.
+ */
+static const int perf_fd_counts[] = { 1, 16, 256, 1000, 4000 };
+
+static Notifier *perf_notifiers_new(int count)
+{
+    struct rlimit rlim;
+    Notifier *notifiers;
+    int i;
+
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    if (rlim.rlim_cur < rlim.rlim_max) {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+#ifndef CONFIG_EPOLL
+    /* the main loop uses fd_sets for its handlers */
+    if (count + 16 > FD_SETSIZE) {
+        return NULL;
+    }
+#endif
+    if (rlim.rlim_cur < count + 16) {
+        return NULL;
+    }
+
+    notifiers = g_new(Notifier, count);
+    for (i = 0; i < count; i++) {
+        notifier_init(&notifiers[i]);
+    }
+    return notifiers;
+}
+
+static void perf_notifiers_free(Notifier *notifiers, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        event_notifier_cleanup(&notifiers[i].e);
+    }
+    g_free(notifiers);
+}
+
+static void perf_main_loop(void)
+{
+    const int iterations = 100000;
+    Notifier *notifiers;
+    double duration;
+    int i, j, count;
+
+    for (i = 0; i < ARRAY_SIZE(perf_fd_counts); i++) {
+        count = perf_fd_counts[i];
+        notifiers = perf_notifiers_new(count);
+        if (!notifiers) {
+            g_test_message("main loop %5d fds: skipped\n", count);
+            continue;
+        }
+        for (j = 0; j < count; j++) {
+            qemu_set_fd_handler(event_notifier_get_fd(&notifiers[j].e),
+                                notifier_read, NULL, &notifiers[j]);
+        }
+        main_loop_wait(true);
+
+        g_test_timer_start();
+        for (j = 0; j < iterations; j++) {
+            event_notifier_set(&notifiers[j % count].e);
+            main_loop_wait(false);
+        }
+        duration = g_test_timer_elapsed();
+
+        g_test_message("main loop %5d fds: %8.0f wakeups/s\n",
+                       count, iterations / duration);
+        for (j = 0; j < count; j++) {
+            qemu_set_fd_handler(event_notifier_get_fd(&notifiers[j].e),
+                                NULL, NULL, NULL);
+        }
+        main_loop_wait(true);
+        perf_notifiers_free(notifiers, count);
+    }
+}
+
+static void perf_aio(void)
+{
+    const int iterations = 100000;
+    AioContext *ctx = aio_context_new();
+    Notifier *notifiers;
+    double duration;
+    int i, j, count;
+
+    for (i = 0; i < ARRAY_SIZE(perf_fd_counts); i++) {
+        count = perf_fd_counts[i];
+        notifiers = perf_notifiers_new(count);
+        if (!notifiers) {
+            g_test_message("aio       %5d fds: skipped\n", count);
+            continue;
+        }
+        for (j = 0; j < count; j++) {
+            notifiers[j].active = 1;
+            aio_set_event_notifier(ctx, &notifiers[j].e, aio_notifier_read,
+                                   aio_notifier_flush);
+        }
+
+        g_test_timer_start();
+        for (j = 0; j < iterations; j++) {
+            notifiers[j % count].active = 1;
+            event_notifier_set(&notifiers[j % count].e);
+            aio_poll(ctx, true);
+        }
+        duration = g_test_timer_elapsed();
+
+        g_test_message("aio       %5d fds: %8.0f wakeups/s\n",
+                       count, iterations / duration);
+        for (j = 0; j < count; j++) {
+            aio_set_event_notifier(ctx, &notifiers[j].e, NULL, NULL);
+        }
+        perf_notifiers_free(notifiers, count);
+    }
+    aio_context_unref(ctx);
+}
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop();
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/main-loop/iohandler/read", test_iohandler_read);
+    g_test_add_func("/main-loop/iohandler/read_poll", test_iohandler_read_poll);
+    g_test_add_func("/main-loop/iohandler/write", test_iohandler_write);
+    g_test_add_func("/main-loop/iohandler/delete", test_iohandler_delete);
+#ifdef CONFIG_EPOLL
+    g_test_add_func("/main-loop/iohandler/high_fd", test_iohandler_high_fd);
+#endif
+    g_test_add_func("/main-loop/aio/notifier", test_aio_notifier);
+    g_test_add_func("/main-loop/aio/main_loop", test_aio_main_loop);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/main-loop", perf_main_loop);
+        g_test_add_func("/perf/aio", perf_aio);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,360 @@
+/*
+ * Throttling engine tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <math.h>
+#include "qemu-common.h"
+#include "qemu/throttle.h"
+
+#define NS_PER_SEC 1000000000LL
+
+static ThrottleState ts;
+static ThrottleConfig cfg;
+
+static bool double_cmp(double x, double y)
+{
+    return fabs(x - y) < 1e-6;
+}
+
+static void test_leak_bucket(void)
+{
+    LeakyBucket bkt = { .avg = 150, .max = 15, .level = 1.5 };
+
+    /* nothing leaks out of an empty bucket */
+    throttle_leak_bucket(&bkt, NS_PER_SEC / 150);
+    g_assert(double_cmp(bkt.level, 0.5));
+    throttle_leak_bucket(&bkt, NS_PER_SEC / 150);
+    g_assert(double_cmp(bkt.level, 0));
+    throttle_leak_bucket(&bkt, NS_PER_SEC / 150);
+    g_assert(double_cmp(bkt.level, 0));
+
+    bkt.level = 100;
+    throttle_leak_bucket(&bkt, NS_PER_SEC / 3);
+    g_assert(double_cmp(bkt.level, 50));
+}
+
+static void test_compute_wait(void)
+{
+    LeakyBucket bkt = { .avg = 10, .max = 0, .level = 0 };
+    int64_t wait;
+
+    /* no limit */
+    bkt.avg = 0;
+    bkt.level = 1000;
+    g_assert(!throttle_compute_wait(&bkt));
+
+    /* the default burst is a tenth of the rate */
+    bkt.avg = 10;
+    bkt.level = 1;
+    g_assert(!throttle_compute_wait(&bkt));
+    bkt.level = 2;
+    wait = throttle_compute_wait(&bkt);
+    g_assert_cmpint(wait, ==, NS_PER_SEC / 10);
+
+    /* an explicit burst size */
+    bkt.max = 20;
+    bkt.level = 20;
+    g_assert(!throttle_compute_wait(&bkt));
+    bkt.level = 25;
+    wait = throttle_compute_wait(&bkt);
+    g_assert_cmpint(wait, ==, NS_PER_SEC / 2);
+}
+
+static void test_init(void)
+{
+    int i;
+
+    throttle_init(&ts, 42);
+    g_assert_cmpint(ts.previous_leak, ==, 42);
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        g_assert(!ts.cfg.buckets[i].avg);
+        g_assert(!ts.cfg.buckets[i].max);
+        g_assert(!ts.cfg.buckets[i].level);
+    }
+    g_assert(!throttle_enabled(&ts.cfg));
+}
+
+static void set_cfg_value(bool is_max, int index, double value)
+{
+    if (is_max) {
+        cfg.buckets[index].max = value;
+        cfg.buckets[index].avg = value ? 1 : 0;
+    } else {
+        cfg.buckets[index].avg = value;
+    }
+}
+
+static void test_enabled(void)
+{
+    int i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    g_assert(!throttle_enabled(&cfg));
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.buckets[i].avg = 150;
+        g_assert(throttle_enabled(&cfg));
+    }
+
+    /* a burst size alone does not enable throttling */
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.buckets[i].max = 150;
+        g_assert(!throttle_enabled(&cfg));
+    }
+}
+
+static void test_conflicting_config(void)
+{
+    static const struct {
+        BucketType total, read, write;
+    } types[] = {
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ, THROTTLE_BPS_WRITE },
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ, THROTTLE_OPS_WRITE },
+    };
+    int i, is_max;
+
+    for (i = 0; i < ARRAY_SIZE(types); i++) {
+        for (is_max = 0; is_max < 2; is_max++) {
+            memset(&cfg, 0, sizeof(cfg));
+            set_cfg_value(is_max, types[i].read, 1);
+            set_cfg_value(is_max, types[i].write, 1);
+            g_assert(!throttle_conflicting(&cfg));
+
+            set_cfg_value(is_max, types[i].total, 1);
+            g_assert(throttle_conflicting(&cfg));
+
+            set_cfg_value(is_max, types[i].read, 0);
+            g_assert(throttle_conflicting(&cfg));
+
+            set_cfg_value(is_max, types[i].write, 0);
+            g_assert(!throttle_conflicting(&cfg));
+        }
+    }
+
+    /* bytes and operations limits can be combined freely */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1;
+    cfg.buckets[THROTTLE_OPS_READ].avg = 1;
+    g_assert(!throttle_conflicting(&cfg));
+}
+
+static void test_is_valid(void)
+{
+    int i;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        memset(&cfg, 0, sizeof(cfg));
+        g_assert(throttle_is_valid(&cfg));
+
+        cfg.buckets[i].avg = 100;
+        g_assert(throttle_is_valid(&cfg));
+        cfg.buckets[i].max = 1000;
+        g_assert(throttle_is_valid(&cfg));
+
+        cfg.buckets[i].avg = 0;
+        g_assert(!throttle_is_valid(&cfg));
+
+        cfg.buckets[i].avg = -1;
+        cfg.buckets[i].max = 0;
+        g_assert(!throttle_is_valid(&cfg));
+
+        cfg.buckets[i].avg = 100;
+        cfg.buckets[i].max = -1;
+        g_assert(!throttle_is_valid(&cfg));
+    }
+}
+
+static void test_config_functions(void)
+{
+    ThrottleConfig orig_cfg, final_cfg;
+    int i;
+
+    memset(&orig_cfg, 0, sizeof(orig_cfg));
+    orig_cfg.buckets[THROTTLE_BPS_TOTAL].avg = 153;
+    orig_cfg.buckets[THROTTLE_BPS_READ].avg  = 56;
+    orig_cfg.buckets[THROTTLE_BPS_WRITE].avg = 1;
+    orig_cfg.buckets[THROTTLE_OPS_TOTAL].avg = 150;
+    orig_cfg.buckets[THROTTLE_OPS_READ].avg  = 69;
+    orig_cfg.buckets[THROTTLE_OPS_WRITE].avg = 23;
+    orig_cfg.buckets[THROTTLE_BPS_TOTAL].max = 0;
+    orig_cfg.buckets[THROTTLE_BPS_READ].max  = 56.5;
+    orig_cfg.buckets[THROTTLE_BPS_WRITE].max = 120;
+    orig_cfg.buckets[THROTTLE_OPS_TOTAL].max = 150;
+    orig_cfg.buckets[THROTTLE_OPS_READ].max  = 400;
+    orig_cfg.buckets[THROTTLE_OPS_WRITE].max = 500;
+    orig_cfg.buckets[THROTTLE_BPS_TOTAL].level = 45;
+    orig_cfg.buckets[THROTTLE_OPS_WRITE].level = 65;
+    orig_cfg.op_size = 1;
+
+    throttle_init(&ts, 0);
+    throttle_config(&ts, &orig_cfg, 1000);
+    g_assert_cmpint(ts.previous_leak, ==, 1000);
+
+    throttle_get_config(&ts, &final_cfg);
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        g_assert(double_cmp(final_cfg.buckets[i].avg,
+                            orig_cfg.buckets[i].avg));
+        g_assert(double_cmp(final_cfg.buckets[i].max,
+                            orig_cfg.buckets[i].max));
+        /* new limits start with empty buckets */
+        g_assert(double_cmp(final_cfg.buckets[i].level, 0));
+    }
+    g_assert_cmpint(final_cfg.op_size, ==, orig_cfg.op_size);
+}
+
+static void test_accounting(void)
+{
+    static const struct {
+        bool is_write;
+        uint64_t size;
+        uint64_t op_size;
+        double bps_total, bps_read, bps_write;
+        double ops_total, ops_read, ops_write;
+    } tests[] = {
+        { false, 4096,  0,    4096,  4096, 0,     1,   1,   0   },
+        { true,  4096,  0,    4096,  0,    4096,  1,   0,   1   },
+        /* requests up to op_size count as one operation */
+        { false, 512,   4096, 512,   512,  0,     1,   1,   0   },
+        { false, 4096,  4096, 4096,  4096, 0,     1,   1,   0   },
+        { true,  65536, 4096, 65536, 0,    65536, 16,  0,   16  },
+        { false, 6144,  4096, 6144,  6144, 0,     1.5, 1.5, 0   },
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+        LeakyBucket *b = ts.cfg.buckets;
+
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.op_size = tests[i].op_size;
+        throttle_init(&ts, 0);
+        throttle_config(&ts, &cfg, 0);
+
+        throttle_account(&ts, tests[i].is_write, tests[i].size);
+        g_assert(double_cmp(b[THROTTLE_BPS_TOTAL].level, tests[i].bps_total));
+        g_assert(double_cmp(b[THROTTLE_BPS_READ].level, tests[i].bps_read));
+        g_assert(double_cmp(b[THROTTLE_BPS_WRITE].level, tests[i].bps_write));
+        g_assert(double_cmp(b[THROTTLE_OPS_TOTAL].level, tests[i].ops_total));
+        g_assert(double_cmp(b[THROTTLE_OPS_READ].level, tests[i].ops_read));
+        g_assert(double_cmp(b[THROTTLE_OPS_WRITE].level, tests[i].ops_write));
+    }
+}
+
+static void test_wait_time(void)
+{
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = 10;
+    throttle_init(&ts, 0);
+    throttle_config(&ts, &cfg, 0);
+
+    /* reads are not limited */
+    throttle_account(&ts, false, 512);
+    throttle_account(&ts, false, 512);
+    g_assert(!throttle_wait_time(&ts, false, 0));
+
+    /* the default burst of one operation fits, the second one waits */
+    throttle_account(&ts, true, 512);
+    g_assert(!throttle_wait_time(&ts, true, 0));
+    throttle_account(&ts, true, 512);
+    g_assert_cmpint(throttle_wait_time(&ts, true, 0), ==, NS_PER_SEC / 10);
+
+    /* time leaks the bucket */
+    g_assert_cmpint(throttle_wait_time(&ts, true, NS_PER_SEC / 20), ==,
+                    NS_PER_SEC / 20);
+    g_assert(!throttle_wait_time(&ts, true, NS_PER_SEC / 10));
+
+    /* the clock going backwards does not refill it */
+    throttle_account(&ts, true, 512);
+    g_assert_cmpint(throttle_wait_time(&ts, true, 0), ==, NS_PER_SEC / 10);
+}
+
+/*
+ * Submits requests of @size bytes as fast as the limits allow for @duration
+ * ns of virtual time, and returns the number of requests that got through.
+ */
+static int64_t run_workload(ThrottleConfig *config, bool is_write,
+                            uint64_t size, int64_t duration)
+{
+    int64_t now = 0, wait, count = 0;
+
+    throttle_init(&ts, 0);
+    throttle_config(&ts, config, 0);
+
+    while (now < duration) {
+        wait = throttle_wait_time(&ts, is_write, now);
+        if (wait) {
+            now += wait;
+            continue;
+        }
+        throttle_account(&ts, is_write, size);
+        count++;
+    }
+    return count;
+}
+
+static void test_rate(void)
+{
+    int64_t count;
+
+    /* 100 IOPS over 10 seconds, plus the default burst of 10 */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 100;
+    count = run_workload(&cfg, false, 4096, 10 * NS_PER_SEC);
+    g_assert_cmpint(count, >=, 1000);
+    g_assert_cmpint(count, <=, 1000 + 10 + 1);
+
+    /* 1 MB/s of 64 KB writes */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_WRITE].avg = 1024 * 1024;
+    count = run_workload(&cfg, true, 65536, 10 * NS_PER_SEC);
+    g_assert_cmpint(count, >=, 160);
+    g_assert_cmpint(count, <=, 160 + 2 + 1);
+
+    /* with iops_size, large requests use up the IOPS limit faster */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 100;
+    cfg.op_size = 4096;
+    count = run_workload(&cfg, false, 65536, 10 * NS_PER_SEC);
+    g_assert_cmpint(count, >=, 1000 / 16);
+    g_assert_cmpint(count, <=, 1000 / 16 + 1 + 1);
+}
+
+static void test_burst(void)
+{
+    int64_t count;
+
+    /* the whole burst goes through at once, then the rate applies */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 10;
+    cfg.buckets[THROTTLE_OPS_TOTAL].max = 100;
+    count = run_workload(&cfg, false, 4096, 1);
+    g_assert_cmpint(count, ==, 101);
+
+    count = run_workload(&cfg, false, 4096, 10 * NS_PER_SEC);
+    g_assert_cmpint(count, >=, 100 + 100);
+    g_assert_cmpint(count, <=, 100 + 100 + 1);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/throttle/leak_bucket", test_leak_bucket);
+    g_test_add_func("/throttle/compute_wait", test_compute_wait);
+    g_test_add_func("/throttle/init", test_init);
+    g_test_add_func("/throttle/config/enabled", test_enabled);
+    g_test_add_func("/throttle/config/conflicting", test_conflicting_config);
+    g_test_add_func("/throttle/config/is_valid", test_is_valid);
+    g_test_add_func("/throttle/config/functions", test_config_functions);
+    g_test_add_func("/throttle/accounting", test_accounting);
+    g_test_add_func("/throttle/wait_time", test_wait_time);
+    g_test_add_func("/throttle/rate", test_rate);
+    g_test_add_func("/throttle/burst", test_burst);
+    return g_test_run();
+}
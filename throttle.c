@@ -0,0 +1,183 @@
+/*
+ * I/O throttling with leaky buckets
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/throttle.h"
+
+#define NANOSECONDS_PER_SECOND  1000000000.0
+
+/*
+ * Without an explicit burst size, let 100 ms worth of I/O through at full
+ * speed.  Guests tend to submit requests in batches (the Linux CFQ scheduler,
+ * for example, alternates between reads and writes every 100 ms), and a
+ * bucket that only holds a single request would turn every batch into
+ * a sawtooth of short waits.
+ */
+static double throttle_bucket_max(LeakyBucket *bkt)
+{
+    return bkt->max ? bkt->max : bkt->avg / 10;
+}
+
+/* Empties @bkt by what leaked out of it in @delta_ns nanoseconds */
+void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta_ns)
+{
+    double leak;
+
+    leak = bkt->avg * (double)delta_ns / NANOSECONDS_PER_SECOND;
+    bkt->level = MAX(bkt->level - leak, 0);
+}
+
+static void throttle_do_leak(ThrottleState *ts, int64_t now)
+{
+    int64_t delta_ns = now - ts->previous_leak;
+    int i;
+
+    if (delta_ns <= 0) {
+        return;
+    }
+
+    ts->previous_leak = now;
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        throttle_leak_bucket(&ts->cfg.buckets[i], delta_ns);
+    }
+}
+
+/* Returns the time in ns until @bkt is back to its burst size, 0 if it is
+ * not over it */
+int64_t throttle_compute_wait(LeakyBucket *bkt)
+{
+    double extra;
+
+    if (!bkt->avg) {
+        return 0;
+    }
+
+    extra = bkt->level - throttle_bucket_max(bkt);
+    if (extra <= 0) {
+        return 0;
+    }
+
+    return extra * NANOSECONDS_PER_SECOND / bkt->avg;
+}
+
+void throttle_init(ThrottleState *ts, int64_t now)
+{
+    memset(ts, 0, sizeof(*ts));
+    ts->previous_leak = now;
+}
+
+bool throttle_enabled(ThrottleConfig *cfg)
+{
+    int i;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        if (cfg->buckets[i].avg > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool throttle_conflicting_type(ThrottleConfig *cfg, BucketType total,
+                                      BucketType read, BucketType write)
+{
+    bool has_total = cfg->buckets[total].avg || cfg->buckets[total].max;
+    bool has_rw = cfg->buckets[read].avg || cfg->buckets[read].max ||
+                  cfg->buckets[write].avg || cfg->buckets[write].max;
+
+    return has_total && has_rw;
+}
+
+/* Total limits can't be combined with read or write limits */
+bool throttle_conflicting(ThrottleConfig *cfg)
+{
+    return throttle_conflicting_type(cfg, THROTTLE_BPS_TOTAL,
+                                     THROTTLE_BPS_READ, THROTTLE_BPS_WRITE) ||
+           throttle_conflicting_type(cfg, THROTTLE_OPS_TOTAL,
+                                     THROTTLE_OPS_READ, THROTTLE_OPS_WRITE);
+}
+
+/* Limits must not be negative, and a burst size needs a rate */
+bool throttle_is_valid(ThrottleConfig *cfg)
+{
+    int i;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        if (cfg->buckets[i].avg < 0 || cfg->buckets[i].max < 0) {
+            return false;
+        }
+        if (cfg->buckets[i].max && !cfg->buckets[i].avg) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Applies a new configuration; the buckets start out empty */
+void throttle_config(ThrottleState *ts, ThrottleConfig *cfg, int64_t now)
+{
+    int i;
+
+    ts->cfg = *cfg;
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        ts->cfg.buckets[i].level = 0;
+    }
+    ts->previous_leak = now;
+}
+
+void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg)
+{
+    *cfg = ts->cfg;
+}
+
+/*
+ * Returns how long in ns a read or write request has to wait at time @now
+ * before it may be submitted, or 0 if it may be submitted right away.
+ */
+int64_t throttle_wait_time(ThrottleState *ts, bool is_write, int64_t now)
+{
+    static const BucketType to_check[2][4] = {
+        { THROTTLE_BPS_TOTAL, THROTTLE_OPS_TOTAL,
+          THROTTLE_BPS_READ, THROTTLE_OPS_READ },
+        { THROTTLE_BPS_TOTAL, THROTTLE_OPS_TOTAL,
+          THROTTLE_BPS_WRITE, THROTTLE_OPS_WRITE },
+    };
+    int64_t wait, max_wait = 0;
+    int i;
+
+    throttle_do_leak(ts, now);
+
+    for (i = 0; i < ARRAY_SIZE(to_check[is_write]); i++) {
+        wait = throttle_compute_wait(&ts->cfg.buckets[to_check[is_write][i]]);
+        max_wait = MAX(max_wait, wait);
+    }
+    return max_wait;
+}
+
+/* Accounts a request of @size bytes that is being submitted */
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+{
+    double units = 1.0;
+
+    if (ts->cfg.op_size && size > ts->cfg.op_size) {
+        units = (double)size / ts->cfg.op_size;
+    }
+
+    ts->cfg.buckets[THROTTLE_BPS_TOTAL].level += size;
+    ts->cfg.buckets[THROTTLE_OPS_TOTAL].level += units;
+
+    if (is_write) {
+        ts->cfg.buckets[THROTTLE_BPS_WRITE].level += size;
+        ts->cfg.buckets[THROTTLE_OPS_WRITE].level += units;
+    } else {
+        ts->cfg.buckets[THROTTLE_BPS_READ].level += size;
+        ts->cfg.buckets[THROTTLE_OPS_READ].level += units;
+    }
+}
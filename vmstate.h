@@ -39,6 +39,11 @@ typedef struct SaveVMHandlers {
     void (*cancel)(void *opaque);
     LoadStateHandler *load_state;
     bool (*is_active)(void *opaque);
+    /* Post-copy: the source sends whatever the destination needs to track
+     * the state that is still missing; the destination takes over the rest
+     * of the stream and returns before it has been consumed. */
+    int (*save_postcopy_begin)(QEMUFile *f, void *opaque);
+    int (*load_postcopy_begin)(QEMUFile *f, void *opaque);
 } SaveVMHandlers;
 
 int register_savevm(DeviceState *dev,